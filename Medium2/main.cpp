@@ -13,6 +13,26 @@
 #include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <stdexcept>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * Поиск кратчайшей цепочки знакомых, связывающей двух людей.
@@ -70,6 +90,2434 @@ std::vector<std::string> searchAcquaintancesChain(const std::map<std::string, st
     return result;
 }
 
+/**
+ * Выполнить функцию в нескольких потоках: function(номер потока). Поток с номером 0 - вызывающий.
+ */
+template<typename Function>
+void run_in_threads(size_t thread_count, Function function) {
+    std::vector<std::thread> threads;
+    for (size_t thread_no = 1; thread_no < thread_count; ++thread_no) {
+        threads.emplace_back(function, thread_no);
+    }
+    function(0);
+    for (auto& thread: threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Выполнить function(i) для всех i из [0, count) в нескольких потоках; потоки берут следующий номер по мере
+ * освобождения.
+ */
+template<typename Function>
+void parallel_for(size_t thread_count, size_t count, Function function) {
+    std::atomic<size_t> next{0};
+    run_in_threads(std::max<size_t>(std::min(thread_count, count), 1), [&](size_t) {
+        for (size_t i = next++; i < count; i = next++) {
+            function(i);
+        }
+    });
+}
+
+/**
+ * Файл, целиком отображённый в память только для чтения.
+ */
+class MappedFile {
+public:
+    /**
+     * @param path Путь к файлу.
+     * @param sequential Файл будет прочитан целиком: ядро начинает читать его заранее.
+     */
+    MappedFile(const std::string& path, bool sequential) {
+        int file = open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            throw std::runtime_error("Cannot open file: " + path);
+        }
+        struct stat file_stat{};
+        if (fstat(file, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            close(file);
+            throw std::runtime_error("Not a regular file: " + path);
+        }
+        size_ = file_stat.st_size;
+        if (size_ > 0) {
+            void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+            if (mapping == MAP_FAILED) {
+                close(file);
+                throw std::runtime_error("Cannot map file: " + path);
+            }
+            if (sequential) {
+                madvise(mapping, size_, MADV_SEQUENTIAL);
+                madvise(mapping, size_, MADV_WILLNEED);
+            }
+            data_ = static_cast<const char*>(mapping);
+        }
+        close(file);  // Отображение остаётся действительным.
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    /**
+     * Содержимое файла.
+     */
+    const char* data() const {
+        return data_;
+    }
+
+    /**
+     * Размер файла.
+     */
+    size_t size() const {
+        return size_;
+    }
+private:
+    const char* data_ = nullptr;  // Отображение файла (nullptr для пустого файла).
+    size_t size_ = 0;  // Размер файла.
+};
+
+/**
+ * Граф знакомств с числовыми идентификаторами людей.
+ * Имена один раз заменяются номерами (uint32_t), а списки знакомых хранятся в формате CSR:
+ * знакомые человека v - это neighbours_[offsets_[v]..offsets_[v + 1]) в том же порядке, что и в исходном отображении.
+ * Поиск в ширину работает с плоскими массивами пометок и родителей, а имена восстанавливает только для ответа.
+ * Знакомства направленные, поэтому для двустороннего поиска хранятся и обратные списки (кто знаком с человеком),
+ * тоже в формате CSR. Это удваивает память под рёбра.
+ * Все массивы графа лежат в одном непрерывном образе: заголовок, списки знакомых, обратные списки, имена подряд
+ * и хеш-таблица номеров по именам. Образ записывается в файл как есть (кэш графа), а загрузка кэша только
+ * отображает файл в память, так что запросы можно выполнять сразу, без разбора и построения.
+ */
+class AcquaintanceGraph {
+public:
+    using Id = uint32_t;  // Номер человека.
+    static const Id no_id = UINT32_MAX;  // Номер, не соответствующий ни одному человеку.
+
+    /**
+     * Рабочие массивы поиска. Их можно переиспользовать между поисками, чтобы не выделять и не очищать память
+     * размером с граф на каждый запрос: вершина посещена, если её пометка равна номеру текущего поиска.
+     */
+    struct SearchWorkspace {
+        std::vector<uint32_t> visited;  // Номер поиска, в котором вершина была посещена.
+        std::vector<Id> parents;  // Родительские вершины.
+        std::vector<Id> queue;  // Очередь посещения вершин.
+        std::vector<uint32_t> backward_visited;  // Пометки обратного поиска (от конца цепочки).
+        std::vector<Id> children;  // Следующие вершины цепочки для вершин обратного поиска.
+        std::vector<Id> backward_queue;  // Очередь обратного поиска.
+        uint32_t epoch = 0;  // Номер текущего поиска.
+
+        /**
+         * Подготовить массивы к новому поиску в графе из vertex_count людей.
+         * @return Номер поиска.
+         */
+        uint32_t prepare(size_t vertex_count) {
+            if (visited.size() != vertex_count) {
+                visited.assign(vertex_count, 0);
+                parents.resize(vertex_count);
+                queue.reserve(vertex_count);
+                backward_visited.assign(vertex_count, 0);
+                children.resize(vertex_count);
+                epoch = 0;
+            }
+            if (++epoch == 0) {  // Номера поисков закончились - очищаем пометки.
+                std::fill(visited.begin(), visited.end(), 0);
+                std::fill(backward_visited.begin(), backward_visited.end(), 0);
+                epoch = 1;
+            }
+            return epoch;
+        }
+    };
+
+    /**
+     * Построение графа.
+     * @param peoples Граф знакомств. Люди, встречающиеся только среди знакомых, тоже получают номера.
+     */
+    explicit AcquaintanceGraph(const std::map<std::string, std::vector<std::string>>& peoples) {
+        std::unordered_map<std::string, Id> ids;  // Номера людей по именам.
+        std::vector<const std::string*> names;  // Имена людей по номерам (указывают на ключи ids).
+        auto intern = [&ids, &names](const std::string& name) {
+            auto inserted = ids.emplace(name, static_cast<Id>(names.size()));
+            if (inserted.second) {
+                if (names.size() == no_id) {
+                    throw std::length_error("Too many people.");
+                }
+                names.push_back(&inserted.first->first);  // Ключи unordered_map не перемещаются.
+            }
+            return inserted.first->second;
+        };
+        size_t edge_count = 0;
+        for (auto& people: peoples) {
+            intern(people.first);  // Номера людей из ключей идут подряд в порядке ключей.
+            edge_count += people.second.size();
+        }
+        if (edge_count > UINT32_MAX) {
+            throw std::length_error("Too many acquaintances.");
+        }
+        std::vector<std::pair<Id, Id>> edges;
+        edges.reserve(edge_count);
+        Id person = 0;
+        for (auto& people: peoples) {
+            for (auto& acquaintance: people.second) {
+                edges.emplace_back(person, intern(acquaintance));
+            }
+            ++person;
+        }
+
+        std::vector<uint64_t> hashes(names.size());
+        std::vector<uint64_t> shard_counts(name_shard_count_);
+        size_t name_bytes = 0;
+        for (size_t id = 0; id < names.size(); ++id) {
+            hashes[id] = name_hash(names[id]->data(), names[id]->size());
+            ++shard_counts[name_shard(hashes[id])];
+            name_bytes += names[id]->size();
+        }
+        allocate(names.size(), edges.size(), name_bytes, &shard_counts);
+        name_offsets_[0] = 0;
+        for (size_t id = 0; id < names.size(); ++id) {
+            std::memcpy(name_data_ + name_offsets_[id], names[id]->data(), names[id]->size());
+            name_offsets_[id + 1] = name_offsets_[id] + names[id]->size();
+            insert_name(static_cast<Id>(id), hashes[id]);
+        }
+        build_adjacency(1, [&edges](size_t, auto&& function) {
+            for (auto& edge: edges) {
+                function(edge.first, edge.second);
+            }
+        }, 1);
+    }
+
+    /**
+     * Построение графа без имён по списку знакомств: люди известны только по номерам.
+     * Знакомые каждого человека идут в порядке списка.
+     * @param vertex_count Количество людей.
+     * @param edges Пары (человек, его знакомый).
+     * @param thread_count Количество потоков.
+     */
+    AcquaintanceGraph(Id vertex_count, const std::vector<std::pair<Id, Id>>& edges,
+                      size_t thread_count = std::thread::hardware_concurrency()) {
+        if (edges.size() > UINT32_MAX || vertex_count == no_id) {
+            throw std::length_error("Too many acquaintances.");
+        }
+        for (auto& edge: edges) {
+            if (edge.first >= vertex_count || edge.second >= vertex_count) {
+                throw std::out_of_range("Unknown person in acquaintances.");
+            }
+        }
+        allocate(vertex_count, edges.size(), 0, nullptr);
+        size_t part_count = std::max<size_t>(thread_count, 1) * 4;
+        build_adjacency(part_count, [&edges, part_count](size_t part, auto&& function) {
+            for (size_t i = edges.size() * part / part_count; i < edges.size() * (part + 1) / part_count; ++i) {
+                function(edges[i].first, edges[i].second);
+            }
+        }, thread_count);
+    }
+
+    AcquaintanceGraph(AcquaintanceGraph&&) = default;
+    AcquaintanceGraph& operator=(AcquaintanceGraph&&) = default;
+    AcquaintanceGraph(const AcquaintanceGraph&) = delete;
+    AcquaintanceGraph& operator=(const AcquaintanceGraph&) = delete;
+
+    /**
+     * Загрузить граф из текстового списка знакомств.
+     * Каждая строка - человек и его знакомые через табуляцию (у человека может быть несколько строк, знакомых
+     * может не быть); пустые строки и пустые поля пропускаются, "\r" в конце строки отбрасывается.
+     * Файл отображается в память и делится на куски по границам строк. Потоки разбирают свои куски и назначают
+     * именам номера внутри куска; затем имена распределяются по шардам по хешу, и каждый шард объединяет имена
+     * всех кусков. Номера идут по шардам, внутри шарда - в порядке первого появления в файле,
+     * поэтому не зависят от количества потоков. Списки знакомых строятся параллельной сортировкой подсчётом,
+     * знакомые идут в порядке файла.
+     * @param path Путь к файлу.
+     * @param thread_count Количество потоков.
+     */
+    static AcquaintanceGraph load_edge_list(const std::string& path,
+                                            size_t thread_count = std::thread::hardware_concurrency()) {
+        thread_count = std::max<size_t>(thread_count, 1);
+        MappedFile file(path, true);
+        std::vector<size_t> boundaries{0};  // Границы кусков - начала строк.
+        for (size_t chunk = 1; chunk < thread_count; ++chunk) {
+            size_t position = std::max(boundaries.back(), file.size() * chunk / thread_count);
+            auto newline = position == 0 ? nullptr : static_cast<const char*>(
+                    std::memchr(file.data() + position - 1, '\n', file.size() - position + 1));
+            boundaries.push_back(position == 0 ? 0 : newline == nullptr ? file.size() : newline - file.data() + 1);
+        }
+        boundaries.push_back(file.size());
+
+        std::vector<NameInterner> chunk_names(thread_count);  // Имена кусков.
+        std::vector<std::vector<std::pair<Id, Id>>> edges(thread_count);  // Знакомства кусков.
+        std::vector<std::vector<uint32_t>> shard_orders(thread_count);  // Имена кусков, упорядоченные по шардам.
+        std::vector<std::vector<uint32_t>> shard_starts(thread_count);  // Начала шардов в shard_orders.
+        std::atomic<bool> too_long_name{false};
+        run_in_threads(thread_count, [&](size_t chunk) {
+            auto& names = chunk_names[chunk];
+            const char* position = file.data() + boundaries[chunk];
+            const char* end = file.data() + boundaries[chunk + 1];
+            while (position < end) {
+                auto line_end = static_cast<const char*>(std::memchr(position, '\n', end - position));
+                line_end = line_end == nullptr ? end : line_end;
+                const char* fields_end = line_end > position && line_end[-1] == '\r' ? line_end - 1 : line_end;
+                Id person = no_id;
+                for (const char* field = position; field <= fields_end;) {
+                    auto tab = static_cast<const char*>(std::memchr(field, '\t', fields_end - field));
+                    tab = tab == nullptr ? fields_end : tab;
+                    if (tab - field > UINT32_MAX) {
+                        too_long_name = true;
+                    } else if (tab != field) {
+                        auto size = static_cast<uint32_t>(tab - field);
+                        Id id = names.intern(field, size, name_hash(field, size));
+                        if (person == no_id) {
+                            person = id;
+                        } else {
+                            edges[chunk].emplace_back(person, id);
+                        }
+                    }
+                    field = tab + 1;
+                }
+                position = line_end + 1;
+            }
+            auto& order = shard_orders[chunk];
+            auto& starts = shard_starts[chunk];
+            starts.assign(name_shard_count_ + 1, 0);
+            for (auto& name: names.names()) {
+                ++starts[name_shard(name.hash) + 1];
+            }
+            for (size_t shard = 0; shard < name_shard_count_; ++shard) {
+                starts[shard + 1] += starts[shard];
+            }
+            order.resize(names.names().size());
+            std::vector<uint32_t> positions(starts.begin(), starts.end() - 1);
+            for (uint32_t i = 0; i < names.names().size(); ++i) {
+                order[positions[name_shard(names.names()[i].hash)]++] = i;
+            }
+        });
+        if (too_long_name) {
+            throw std::length_error("Too long name in " + path);
+        }
+
+        std::vector<NameInterner> shard_names(name_shard_count_);  // Имена шардов.
+        std::vector<std::vector<Id>> chunk_ids(thread_count);  // Номера имён кусков внутри шардов.
+        for (size_t chunk = 0; chunk < thread_count; ++chunk) {
+            chunk_ids[chunk].resize(chunk_names[chunk].names().size());
+        }
+        parallel_for(thread_count, name_shard_count_, [&](size_t shard) {
+            NameInterner names;
+            for (size_t chunk = 0; chunk < thread_count; ++chunk) {  // Куски идут в порядке файла.
+                auto& chunk_shard_names = chunk_names[chunk].names();
+                for (auto i = shard_starts[chunk][shard]; i < shard_starts[chunk][shard + 1]; ++i) {
+                    auto& name = chunk_shard_names[shard_orders[chunk][i]];
+                    chunk_ids[chunk][shard_orders[chunk][i]] = names.intern(chunk_names[chunk].data(name), name.size,
+                                                                            name.hash);
+                }
+            }
+            shard_names[shard] = std::move(names);
+        });
+
+        std::vector<uint64_t> shard_counts(name_shard_count_);
+        std::vector<Id> shard_ids(name_shard_count_ + 1, 0);  // Первые номера шардов.
+        std::vector<uint64_t> shard_bytes(name_shard_count_ + 1, 0);  // Начала имён шардов.
+        size_t edge_count = 0;
+        for (size_t shard = 0; shard < name_shard_count_; ++shard) {
+            shard_counts[shard] = shard_names[shard].names().size();
+            if (shard_ids[shard] + shard_counts[shard] >= no_id) {
+                throw std::length_error("Too many people.");
+            }
+            shard_ids[shard + 1] = static_cast<Id>(shard_ids[shard] + shard_counts[shard]);
+            shard_bytes[shard + 1] = shard_bytes[shard];
+            for (auto& name: shard_names[shard].names()) {
+                shard_bytes[shard + 1] += name.size;
+            }
+        }
+        for (auto& chunk_edges: edges) {
+            edge_count += chunk_edges.size();
+        }
+        if (edge_count > UINT32_MAX) {
+            throw std::length_error("Too many acquaintances.");
+        }
+        AcquaintanceGraph graph;
+        graph.allocate(shard_ids.back(), edge_count, shard_bytes.back(), &shard_counts);
+        graph.name_offsets_[graph.vertex_count()] = shard_bytes.back();
+        parallel_for(thread_count, name_shard_count_, [&](size_t shard) {
+            uint64_t offset = shard_bytes[shard];
+            Id id = shard_ids[shard];
+            for (auto& name: shard_names[shard].names()) {
+                graph.name_offsets_[id] = offset;
+                std::memcpy(graph.name_data_ + offset, shard_names[shard].data(name), name.size);
+                graph.insert_name(id, name.hash);
+                offset += name.size;
+                ++id;
+            }
+        });
+        run_in_threads(thread_count, [&](size_t chunk) {
+            auto& ids = chunk_ids[chunk];
+            auto& names = chunk_names[chunk].names();
+            for (size_t i = 0; i < ids.size(); ++i) {
+                ids[i] += shard_ids[name_shard(names[i].hash)];
+            }
+            for (auto& edge: edges[chunk]) {
+                edge = {ids[edge.first], ids[edge.second]};
+            }
+        });
+        graph.build_adjacency(thread_count, [&edges](size_t chunk, auto&& function) {
+            for (auto& edge: edges[chunk]) {
+                function(edge.first, edge.second);
+            }
+        }, thread_count);
+        return graph;
+    }
+
+    /**
+     * Загрузить граф из кэша, записанного save. Файл отображается в память и один раз прочитывается целиком:
+     * проверяются заголовок, размер файла и содержимое массивов (начала списков не убывают, номера знакомых
+     * и номера в хеш-таблице имён меньше количества людей, у каждого шарда таблицы есть пустая ячейка),
+     * чтобы повреждённый кэш не приводил к чтению за пределами образа.
+     * @param path Путь к файлу.
+     */
+    static AcquaintanceGraph load(const std::string& path) {
+        AcquaintanceGraph graph;
+        graph.mapping_.reset(new MappedFile(path, false));
+        ImageHeader header{};
+        if (graph.mapping_->size() < sizeof(header)) {
+            throw std::runtime_error("Not an acquaintance graph cache: " + path);
+        }
+        std::memcpy(&header, graph.mapping_->data(), sizeof(header));
+        uint64_t size = 0;
+        if (std::memcmp(header.magic, image_magic_, sizeof(header.magic)) != 0 || header.version != image_version_ ||
+            header.vertex_count == no_id || header.edge_count > UINT32_MAX || !image_size(header, size) ||
+            size != graph.mapping_->size()) {
+            throw std::runtime_error("Not an acquaintance graph cache: " + path);
+        }
+        graph.attach(const_cast<char*>(graph.mapping_->data()), graph.mapping_->size());
+        if (!graph.is_image_valid(header)) {
+            throw std::runtime_error("Corrupted acquaintance graph cache: " + path);
+        }
+        return graph;
+    }
+
+    /**
+     * Загрузить граф из кэша, а если кэша нет или он повреждён - из текстового списка знакомств,
+     * после чего перезаписать кэш.
+     * @param cache_path Путь к файлу кэша.
+     * @param edge_list_path Путь к текстовому списку знакомств (см. load_edge_list).
+     * @param thread_count Количество потоков для разбора текстового списка.
+     */
+    static AcquaintanceGraph load_or_build(const std::string& cache_path, const std::string& edge_list_path,
+                                           size_t thread_count = std::thread::hardware_concurrency()) {
+        try {
+            return load(cache_path);
+        } catch (const std::runtime_error&) {
+        }
+        auto graph = load_edge_list(edge_list_path, thread_count);
+        try {
+            graph.save(cache_path);
+        } catch (const std::runtime_error&) {
+            // Без кэша граф всё равно построен: в следующий раз он снова будет прочитан из текста.
+        }
+        return graph;
+    }
+
+    /**
+     * Записать кэш графа: образ как есть (числа в порядке байтов машины).
+     * @param path Путь к файлу.
+     */
+    void save(const std::string& path) const {
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        output.write(image_data_, image_size_);
+        output.flush();
+        if (!output) {
+            throw std::runtime_error("Can't write acquaintance graph cache: " + path);
+        }
+    }
+
+    /**
+     * Количество людей.
+     */
+    size_t vertex_count() const {
+        return vertex_count_;
+    }
+
+    /**
+     * Количество знакомств (рёбер).
+     */
+    size_t edge_count() const {
+        return edge_count_;
+    }
+
+    /**
+     * Размер образа графа (и файла кэша) в байтах.
+     */
+    size_t image_size() const {
+        return image_size_;
+    }
+
+    /**
+     * Номер человека по имени.
+     * @return Номер или no_id, если такого человека нет.
+     */
+    Id find(const std::string& name) const {
+        if (name_table_offsets_ == nullptr) {
+            return no_id;
+        }
+        uint64_t hash = name_hash(name.data(), name.size());
+        uint32_t shard = name_shard(hash);
+        const Id* table = name_table_ + name_table_offsets_[shard];
+        uint64_t mask = name_table_offsets_[shard + 1] - name_table_offsets_[shard] - 1;
+        if (mask + 1 == 0) {
+            return no_id;
+        }
+        for (uint64_t slot = hash & mask; table[slot] != no_id; slot = (slot + 1) & mask) {
+            Id id = table[slot];
+            if (name_offsets_[id + 1] - name_offsets_[id] == name.size() &&
+                std::memcmp(name_data_ + name_offsets_[id], name.data(), name.size()) == 0) {
+                return id;
+            }
+        }
+        return no_id;
+    }
+
+    /**
+     * Имя человека по номеру. У графа без имён бросает исключение.
+     */
+    std::string name(Id id) const {
+        if (name_offsets_ == nullptr || id >= vertex_count()) {
+            throw std::out_of_range("Unknown person.");
+        }
+        return std::string(name_data_ + name_offsets_[id], name_offsets_[id + 1] - name_offsets_[id]);
+    }
+
+    /**
+     * Начало списка знакомых человека.
+     */
+    const Id* neighbours_begin(Id id) const {
+        return neighbours_ + offsets_[id];
+    }
+
+    /**
+     * Конец списка знакомых человека.
+     */
+    const Id* neighbours_end(Id id) const {
+        return neighbours_ + offsets_[id + 1];
+    }
+
+    /**
+     * Начало списка тех, у кого человек в знакомых.
+     */
+    const Id* reverse_neighbours_begin(Id id) const {
+        return reverse_neighbours_ + reverse_offsets_[id];
+    }
+
+    /**
+     * Конец списка тех, у кого человек в знакомых.
+     */
+    const Id* reverse_neighbours_end(Id id) const {
+        return reverse_neighbours_ + reverse_offsets_[id + 1];
+    }
+
+    /**
+     * Вызвать function(знакомый) для всех знакомых человека.
+     */
+    template<typename Function>
+    void for_each_neighbour(Id id, Function function) const {
+        for (auto it = neighbours_begin(id), end = neighbours_end(id); it != end; ++it) {
+            function(*it);
+        }
+    }
+
+    /**
+     * Поиск кратчайшей цепочки знакомых по номерам.
+     * Результат совпадает с searchAcquaintancesChain: знакомые рассматриваются в исходном порядке.
+     * @param first Начало цепочки.
+     * @param second Конец цепочки.
+     * @param workspace Рабочие массивы поиска.
+     * @return Цепочка номеров или пустой вектор, если цепочки нет.
+     */
+    std::vector<Id> search_chain(Id first, Id second, SearchWorkspace& workspace) const {
+        if (first >= vertex_count() || second >= vertex_count()) {
+            return {};
+        }
+        uint32_t epoch = workspace.prepare(vertex_count());
+        auto& visited = workspace.visited;
+        auto& parents = workspace.parents;
+        auto& queue = workspace.queue;
+        size_t head = 0;
+        queue.clear();
+        queue.push_back(first);
+        visited[first] = epoch;
+        parents[first] = first;
+        while (head < queue.size()) {
+            Id v = queue[head++];
+            for (auto it = neighbours_begin(v), end = neighbours_end(v); it != end; ++it) {
+                Id to = *it;
+                if (visited[to] == epoch) {
+                    continue;
+                }
+                visited[to] = epoch;
+                parents[to] = v;
+                if (to == second) {
+                    std::vector<Id> chain{second};
+                    while (parents[chain.back()] != chain.back()) {
+                        chain.push_back(parents[chain.back()]);
+                    }
+                    std::reverse(chain.begin(), chain.end());
+                    return chain;
+                }
+                queue.push_back(to);
+            }
+        }
+        return {};
+    }
+
+    /**
+     * Поиск кратчайшей цепочки знакомых по именам.
+     * @param first Начало цепочки.
+     * @param second Конец цепочки.
+     * @param workspace Рабочие массивы поиска.
+     * @return Цепочка знакомых или пустой вектор, если цепочки нет (в том числе если человека нет в графе).
+     */
+    std::vector<std::string> search_chain(const std::string& first, const std::string& second,
+                                          SearchWorkspace& workspace) const {
+        return names_of(search_chain(find(first), find(second), workspace));
+    }
+
+    /**
+     * Поиск кратчайшей цепочки знакомых по именам с временными рабочими массивами.
+     */
+    std::vector<std::string> search_chain(const std::string& first, const std::string& second) const {
+        SearchWorkspace workspace;
+        return search_chain(first, second, workspace);
+    }
+
+    /**
+     * Двусторонний поиск кратчайшей цепочки знакомых по номерам.
+     * Поиск в ширину растёт одновременно от начала цепочки по спискам знакомых и от конца по обратным спискам,
+     * каждый раз на один уровень с той стороны, где фронт меньше. Цепочка находится, когда сторона доходит
+     * до вершины, уже посещённой другой стороной; первая такая встреча даёт кратчайшую цепочку.
+     * Длина цепочки совпадает с search_chain, но при нескольких кратчайших цепочках может быть выбрана другая.
+     * @param first Начало цепочки.
+     * @param second Конец цепочки.
+     * @param workspace Рабочие массивы поиска.
+     * @return Цепочка номеров или пустой вектор, если цепочки нет.
+     */
+    std::vector<Id> search_chain_bidirectional(Id first, Id second, SearchWorkspace& workspace) const {
+        if (first >= vertex_count() || second >= vertex_count() || first == second) {
+            return {};  // Как и в search_chain, цепочки от человека к самому себе нет.
+        }
+        uint32_t epoch = workspace.prepare(vertex_count());
+        workspace.queue.assign(1, first);
+        workspace.visited[first] = epoch;
+        workspace.parents[first] = first;
+        workspace.backward_queue.assign(1, second);
+        workspace.backward_visited[second] = epoch;
+        workspace.children[second] = second;
+        size_t forward_begin = 0;
+        size_t backward_begin = 0;
+        while (forward_begin < workspace.queue.size() && backward_begin < workspace.backward_queue.size()) {
+            Id meeting = no_id;
+            if (workspace.queue.size() - forward_begin <= workspace.backward_queue.size() - backward_begin) {
+                meeting = expand_level(offsets_, neighbours_, workspace.queue, forward_begin, workspace.visited,
+                                       workspace.parents, workspace.backward_visited, epoch);
+            } else {
+                meeting = expand_level(reverse_offsets_, reverse_neighbours_, workspace.backward_queue, backward_begin,
+                                       workspace.backward_visited, workspace.children, workspace.visited, epoch);
+            }
+            if (meeting != no_id) {
+                std::vector<Id> chain{meeting};
+                while (workspace.parents[chain.back()] != chain.back()) {
+                    chain.push_back(workspace.parents[chain.back()]);
+                }
+                std::reverse(chain.begin(), chain.end());
+                while (workspace.children[chain.back()] != chain.back()) {
+                    chain.push_back(workspace.children[chain.back()]);
+                }
+                return chain;
+            }
+        }
+        return {};
+    }
+
+    /**
+     * Двусторонний поиск кратчайшей цепочки знакомых по именам.
+     */
+    std::vector<std::string> search_chain_bidirectional(const std::string& first, const std::string& second,
+                                                        SearchWorkspace& workspace) const {
+        return names_of(search_chain_bidirectional(find(first), find(second), workspace));
+    }
+
+    /**
+     * Преобразовать цепочку номеров в цепочку имён.
+     */
+    std::vector<std::string> names_of(const std::vector<Id>& chain) const {
+        std::vector<std::string> result;
+        result.reserve(chain.size());
+        for (auto id: chain) {
+            result.push_back(name(id));
+        }
+        return result;
+    }
+private:
+    /**
+     * Заголовок образа графа. За ним идут массивы, каждый с границы 8 байтов: начала списков знакомых,
+     * списки знакомых, начала обратных списков, обратные списки; у графа с именами - начала имён,
+     * начала шардов хеш-таблицы имён, хеш-таблица и имена подряд.
+     */
+    struct ImageHeader {
+        char magic[8];  // Начало файла кэша.
+        uint32_t version;  // Версия формата.
+        uint32_t vertex_count;  // Количество людей.
+        uint64_t edge_count;  // Количество знакомств.
+        uint64_t name_bytes;  // Суммарная длина имён.
+        uint64_t name_table_size;  // Количество ячеек хеш-таблицы имён.
+        uint64_t named;  // Есть ли у графа имена.
+    };
+
+    /**
+     * Имена, которым назначаются номера по порядку первого появления.
+     * Новые имена копируются подряд в собственный буфер: частые имена появляются раньше и лежат рядом,
+     * а сравнение с уже известным именем не обращается к случайному месту большого файла.
+     */
+    class NameInterner {
+    public:
+        /**
+         * Имя: хеш, начало в буфере имён и длина.
+         */
+        struct Name {
+            uint64_t hash;
+            uint64_t offset;
+            uint32_t size;
+        };
+
+        /**
+         * Получить номер имени, при необходимости назначив новый.
+         */
+        Id intern(const char* data, uint32_t size, uint64_t hash) {
+            if ((names_.size() + 1) * 2 > slots_.size()) {
+                grow();
+            }
+            size_t mask = slots_.size() - 1;
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                Id id = slots_[slot];
+                if (id == no_id) {
+                    slots_[slot] = static_cast<Id>(names_.size());
+                    names_.push_back({hash, characters_.size(), size});
+                    characters_.insert(characters_.end(), data, data + size);
+                    return slots_[slot];
+                }
+                if (names_[id].hash == hash && names_[id].size == size &&
+                    std::memcmp(characters_.data() + names_[id].offset, data, size) == 0) {
+                    return id;
+                }
+            }
+        }
+
+        /**
+         * Имена по номерам.
+         */
+        const std::vector<Name>& names() const {
+            return names_;
+        }
+
+        /**
+         * Строка имени.
+         */
+        const char* data(const Name& name) const {
+            return characters_.data() + name.offset;
+        }
+    private:
+        /**
+         * Удвоить хеш-таблицу.
+         */
+        void grow() {
+            slots_.assign(std::max<size_t>(slots_.size() * 2, 16), no_id);
+            size_t mask = slots_.size() - 1;
+            for (Id id = 0; id < names_.size(); ++id) {
+                size_t slot = names_[id].hash & mask;
+                while (slots_[slot] != no_id) {
+                    slot = (slot + 1) & mask;
+                }
+                slots_[slot] = id;
+            }
+        }
+
+        std::vector<Name> names_;  // Имена по номерам.
+        std::vector<char> characters_;  // Имена подряд.
+        std::vector<Id> slots_;  // Хеш-таблица с открытой адресацией: номера имён, no_id - пустая ячейка.
+    };
+
+    AcquaintanceGraph() = default;
+
+    /**
+     * Хеш имени (FNV-1a). Старшие биты выбирают шард хеш-таблицы имён, младшие - ячейку в шарде.
+     */
+    static uint64_t name_hash(const char* data, size_t size) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /**
+     * Шард хеш-таблицы имён по хешу.
+     */
+    static uint32_t name_shard(uint64_t hash) {
+        return static_cast<uint32_t>(hash >> (64 - name_shard_bits_));
+    }
+
+    /**
+     * Количество ячеек шарда хеш-таблицы имён: степень двойки, не меньше удвоенного количества имён.
+     */
+    static uint64_t name_table_slots(uint64_t name_count) {
+        uint64_t slots = name_count == 0 ? 0 : 2;
+        while (slots < name_count * 2) {
+            slots *= 2;
+        }
+        return slots;
+    }
+
+    /**
+     * Выровнять размер на 8 байтов.
+     */
+    static uint64_t align(uint64_t size) {
+        return (size + 7) / 8 * 8;
+    }
+
+    /**
+     * Размер образа графа с заданным заголовком.
+     * Заголовок может быть прочитан из повреждённого файла, поэтому каждое действие проверяется на переполнение.
+     * @param size Размер образа.
+     * @return false, если размер не помещается в 64 бита.
+     */
+    static bool image_size(const ImageHeader& header, uint64_t& size) {
+        size = align(sizeof(ImageHeader));
+        auto add = [&size](uint64_t count, uint64_t item_size) {
+            uint64_t bytes = 0;
+            return !__builtin_mul_overflow(count, item_size, &bytes) && bytes <= UINT64_MAX - 7 &&
+                   !__builtin_add_overflow(size, align(bytes), &size);
+        };
+        uint64_t offsets_count = uint64_t{header.vertex_count} + 1;
+        bool fits = add(offsets_count, sizeof(uint32_t)) && add(header.edge_count, sizeof(Id)) &&
+                    add(offsets_count, sizeof(uint32_t)) && add(header.edge_count, sizeof(Id));
+        if (header.named != 0) {
+            fits = fits && add(offsets_count, sizeof(uint64_t)) && add(name_shard_count_ + 1, sizeof(uint64_t)) &&
+                   add(header.name_table_size, sizeof(Id)) && add(header.name_bytes, 1);
+        }
+        return fits;
+    }
+
+    /**
+     * Проверить массивы образа, прочитанного из файла, за O(V + E) плюс размер хеш-таблицы имён.
+     * Образ уже размечен attach, а его размер совпадает с заголовком.
+     */
+    bool is_image_valid(const ImageHeader& header) const {
+        auto is_adjacency_valid = [this](const uint32_t* offsets, const Id* neighbours) {
+            if (offsets[0] != 0 || offsets[vertex_count()] != edge_count()) {
+                return false;
+            }
+            for (size_t v = 0; v < vertex_count(); ++v) {
+                if (offsets[v] > offsets[v + 1]) {
+                    return false;
+                }
+            }
+            return std::all_of(neighbours, neighbours + edge_count(), [this](Id id) { return id < vertex_count(); });
+        };
+        if (!is_adjacency_valid(offsets_, neighbours_) || !is_adjacency_valid(reverse_offsets_, reverse_neighbours_)) {
+            return false;
+        }
+        if (header.named == 0) {
+            return true;
+        }
+        if (name_offsets_[0] != 0 || name_offsets_[vertex_count()] != header.name_bytes ||
+            name_table_offsets_[0] != 0 || name_table_offsets_[name_shard_count_] != header.name_table_size) {
+            return false;
+        }
+        for (size_t v = 0; v < vertex_count(); ++v) {
+            if (name_offsets_[v] > name_offsets_[v + 1]) {
+                return false;
+            }
+        }
+        for (size_t shard = 0; shard < name_shard_count_; ++shard) {
+            uint64_t begin = name_table_offsets_[shard];
+            uint64_t end = name_table_offsets_[shard + 1];
+            if (begin > end || end > header.name_table_size) {
+                return false;
+            }
+            uint64_t slots = end - begin;
+            if ((slots & (slots - 1)) != 0) {
+                return false;  // Поиск по шарду берёт номер ячейки по маске.
+            }
+            bool has_empty_slot = slots == 0;  // Иначе поиск отсутствующего имени не остановится.
+            for (uint64_t slot = begin; slot < end; ++slot) {
+                if (name_table_[slot] == no_id) {
+                    has_empty_slot = true;
+                } else if (name_table_[slot] >= vertex_count()) {
+                    return false;
+                }
+            }
+            if (!has_empty_slot) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Выделить образ графа и разметить его массивы. Хеш-таблица имён заполняется пустыми ячейками.
+     * @param shard_counts Количества имён по шардам; nullptr - граф без имён.
+     */
+    void allocate(size_t vertex_count, size_t edge_count, uint64_t name_bytes,
+                  const std::vector<uint64_t>* shard_counts) {
+        ImageHeader header{};
+        std::memcpy(header.magic, image_magic_, sizeof(header.magic));
+        header.version = image_version_;
+        header.vertex_count = static_cast<uint32_t>(vertex_count);
+        header.edge_count = edge_count;
+        header.name_bytes = name_bytes;
+        header.named = shard_counts != nullptr;
+        if (shard_counts != nullptr) {
+            for (auto count: *shard_counts) {
+                header.name_table_size += name_table_slots(count);
+            }
+        }
+        uint64_t size = 0;
+        if (!image_size(header, size)) {
+            throw std::length_error("Acquaintance graph is too large.");
+        }
+        image_.resize(size / sizeof(uint64_t));
+        std::memcpy(image_.data(), &header, sizeof(header));
+        attach(reinterpret_cast<char*>(image_.data()), size);
+        if (shard_counts != nullptr) {
+            name_table_offsets_[0] = 0;
+            for (size_t shard = 0; shard < name_shard_count_; ++shard) {
+                name_table_offsets_[shard + 1] = name_table_offsets_[shard] + name_table_slots((*shard_counts)[shard]);
+            }
+            std::fill(name_table_, name_table_ + header.name_table_size, no_id);
+        }
+    }
+
+    /**
+     * Указать массивы графа в образе.
+     * @param image Образ, начинающийся с заголовка. Образ из файла кэша не изменяется.
+     * @param size Размер образа.
+     */
+    void attach(char* image, size_t size) {
+        ImageHeader header{};
+        std::memcpy(&header, image, sizeof(header));
+        image_data_ = image;
+        image_size_ = size;
+        vertex_count_ = header.vertex_count;
+        edge_count_ = header.edge_count;
+        char* position = image + align(sizeof(ImageHeader));
+        auto take = [&position](uint64_t bytes) {
+            char* section = position;
+            position += align(bytes);
+            return section;
+        };
+        offsets_ = reinterpret_cast<uint32_t*>(take((vertex_count_ + 1) * sizeof(uint32_t)));
+        neighbours_ = reinterpret_cast<Id*>(take(edge_count_ * sizeof(Id)));
+        reverse_offsets_ = reinterpret_cast<uint32_t*>(take((vertex_count_ + 1) * sizeof(uint32_t)));
+        reverse_neighbours_ = reinterpret_cast<Id*>(take(edge_count_ * sizeof(Id)));
+        if (header.named != 0) {
+            name_offsets_ = reinterpret_cast<uint64_t*>(take((vertex_count_ + 1) * sizeof(uint64_t)));
+            name_table_offsets_ = reinterpret_cast<uint64_t*>(take((name_shard_count_ + 1) * sizeof(uint64_t)));
+            name_table_ = reinterpret_cast<Id*>(take(header.name_table_size * sizeof(Id)));
+            name_data_ = take(header.name_bytes);
+        }
+    }
+
+    /**
+     * Добавить номер в хеш-таблицу имён.
+     */
+    void insert_name(Id id, uint64_t hash) {
+        uint32_t shard = name_shard(hash);
+        Id* table = name_table_ + name_table_offsets_[shard];
+        uint64_t mask = name_table_offsets_[shard + 1] - name_table_offsets_[shard] - 1;
+        uint64_t slot = hash & mask;
+        while (table[slot] != no_id) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = id;
+    }
+
+    /**
+     * Построить прямые и обратные списки знакомых.
+     * @param part_count Количество частей знакомств.
+     * @param for_each_edge for_each_edge(часть, function) вызывает function(человек, знакомый) для знакомств части
+     * в порядке, в котором знакомые должны идти в списках.
+     * @param thread_count Количество потоков.
+     */
+    template<typename ForEachEdge>
+    void build_adjacency(size_t part_count, ForEachEdge for_each_edge, size_t thread_count) {
+        counting_sort(part_count, for_each_edge, thread_count, offsets_, neighbours_);
+        size_t reverse_part_count = std::min(vertex_count(), std::max<size_t>(thread_count, 1) * 4);
+        counting_sort(reverse_part_count, [this, reverse_part_count](size_t part, auto&& function) {
+            for (size_t v = vertex_count() * part / reverse_part_count;
+                 v < vertex_count() * (part + 1) / reverse_part_count; ++v) {
+                for (auto it = neighbours_begin(static_cast<Id>(v)), end = neighbours_end(static_cast<Id>(v));
+                     it != end; ++it) {
+                    function(*it, static_cast<Id>(v));
+                }
+            }
+        }, thread_count, reverse_offsets_, reverse_neighbours_);
+    }
+
+    /**
+     * Устойчивая параллельная сортировка подсчётом пар (ключ, значение) по ключу в формат CSR.
+     * Номера людей делятся на диапазоны-корзины. Сначала каждая часть считает свои пары по корзинам и раскладывает
+     * их в промежуточный массив, затем каждая корзина раскладывает свои пары по ключам. Пары с одинаковым ключом
+     * остаются в порядке частей и порядке перебора внутри части.
+     * @param part_count Количество частей пар.
+     * @param for_each_pair for_each_pair(часть, function) вызывает function(ключ, значение) для пар части.
+     * @param thread_count Количество потоков.
+     * @param offsets Начала значений по ключам, плюс общий конец (vertex_count() + 1 элементов).
+     * @param values Значения (edge_count() элементов).
+     */
+    template<typename ForEachPair>
+    void counting_sort(size_t part_count, ForEachPair for_each_pair, size_t thread_count, uint32_t* offsets,
+                       Id* values) const {
+        size_t key_count = vertex_count();
+        offsets[key_count] = static_cast<uint32_t>(edge_count());
+        if (key_count == 0) {
+            return;
+        }
+        size_t bucket_width = (key_count + std::max<size_t>(thread_count, 1) * 16 - 1) /
+                              (std::max<size_t>(thread_count, 1) * 16);
+        size_t bucket_count = (key_count + bucket_width - 1) / bucket_width;
+        std::vector<uint64_t> starts(part_count * bucket_count);  // Сначала количества пар частей по корзинам.
+        parallel_for(thread_count, part_count, [&](size_t part) {
+            uint64_t* counts = starts.data() + part * bucket_count;
+            for_each_pair(part, [counts, bucket_width](Id key, Id) {
+                ++counts[key / bucket_width];
+            });
+        });
+        std::vector<uint64_t> bucket_starts(bucket_count + 1);
+        uint64_t position = 0;
+        for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+            bucket_starts[bucket] = position;
+            for (size_t part = 0; part < part_count; ++part) {
+                uint64_t count = starts[part * bucket_count + bucket];
+                starts[part * bucket_count + bucket] = position;
+                position += count;
+            }
+        }
+        bucket_starts[bucket_count] = position;
+        std::vector<std::pair<Id, Id>> pairs(edge_count());
+        parallel_for(thread_count, part_count, [&](size_t part) {
+            uint64_t* positions = starts.data() + part * bucket_count;
+            for_each_pair(part, [&pairs, positions, bucket_width](Id key, Id value) {
+                pairs[positions[key / bucket_width]++] = {key, value};
+            });
+        });
+        parallel_for(thread_count, bucket_count, [&](size_t bucket) {
+            size_t first_key = bucket * bucket_width;
+            size_t last_key = std::min(key_count, first_key + bucket_width);
+            std::fill(offsets + first_key, offsets + last_key, 0);
+            for (auto i = bucket_starts[bucket]; i < bucket_starts[bucket + 1]; ++i) {
+                ++offsets[pairs[i].first];
+            }
+            auto start = static_cast<uint32_t>(bucket_starts[bucket]);
+            for (size_t key = first_key; key < last_key; ++key) {
+                uint32_t count = offsets[key];
+                offsets[key] = start;
+                start += count;
+            }
+            for (auto i = bucket_starts[bucket]; i < bucket_starts[bucket + 1]; ++i) {
+                values[offsets[pairs[i].first]++] = pairs[i].second;
+            }
+            for (size_t key = last_key - 1; key > first_key; --key) {  // offsets[key] сдвинулись на начало следующего.
+                offsets[key] = offsets[key - 1];
+            }
+            offsets[first_key] = static_cast<uint32_t>(bucket_starts[bucket]);
+        });
+    }
+
+    /**
+     * Продвинуть одну сторону двустороннего поиска на уровень.
+     * @param offsets Начала списков смежности стороны.
+     * @param neighbours Списки смежности стороны.
+     * @param queue Очередь стороны; её конец с позиции begin - текущий уровень.
+     * @param begin Начало текущего уровня. После вызова - начало следующего.
+     * @param visited Пометки стороны.
+     * @param links Для каждой вершины стороны - соседняя вершина на пути к началу стороны.
+     * @param other_visited Пометки другой стороны.
+     * @param epoch Номер поиска.
+     * @return Вершина встречи сторон или no_id.
+     */
+    static Id expand_level(const uint32_t* offsets, const Id* neighbours,
+                           std::vector<Id>& queue, size_t& begin, std::vector<uint32_t>& visited,
+                           std::vector<Id>& links, const std::vector<uint32_t>& other_visited, uint32_t epoch) {
+        size_t end = queue.size();
+        for (size_t i = begin; i < end; ++i) {
+            Id v = queue[i];
+            for (auto j = offsets[v]; j < offsets[v + 1]; ++j) {
+                Id to = neighbours[j];
+                if (visited[to] == epoch) {
+                    continue;
+                }
+                visited[to] = epoch;
+                links[to] = v;
+                if (other_visited[to] == epoch) {
+                    return to;
+                }
+                queue.push_back(to);
+            }
+        }
+        begin = end;
+        return no_id;
+    }
+
+    static const uint32_t name_shard_bits_ = 8;  // Шардов хеш-таблицы имён 2^name_shard_bits_.
+    static const size_t name_shard_count_ = size_t{1} << name_shard_bits_;  // Количество шардов.
+    static constexpr const char image_magic_[8] = {'A', 'C', 'Q', 'G', 'R', 'A', 'P', 'H'};  // Начало файла кэша.
+    static const uint32_t image_version_ = 1;  // Версия формата образа.
+
+    std::vector<uint64_t> image_;  // Образ графа, построенного в памяти.
+    std::unique_ptr<MappedFile> mapping_;  // Файл кэша, если граф загружен из него.
+    const char* image_data_ = nullptr;  // Образ графа (в image_ или в отображении файла).
+    size_t image_size_ = 0;  // Размер образа.
+    size_t vertex_count_ = 0;  // Количество людей.
+    size_t edge_count_ = 0;  // Количество знакомств.
+    // Массивы в образе. Массивы отображённого кэша только читаются.
+    uint32_t* offsets_ = nullptr;  // Начала списков знакомых в neighbours_, плюс общий конец.
+    Id* neighbours_ = nullptr;  // Списки знакомых всех людей подряд.
+    uint32_t* reverse_offsets_ = nullptr;  // Начала обратных списков в reverse_neighbours_, плюс общий конец.
+    Id* reverse_neighbours_ = nullptr;  // Обратные списки: для каждого человека - те, у кого он в знакомых.
+    uint64_t* name_offsets_ = nullptr;  // Начала имён в name_data_, плюс общий конец; nullptr у графа без имён.
+    uint64_t* name_table_offsets_ = nullptr;  // Начала шардов хеш-таблицы имён, плюс общий конец.
+    Id* name_table_ = nullptr;  // Хеш-таблица номеров по именам, no_id - пустая ячейка.
+    char* name_data_ = nullptr;  // Имена подряд.
+};
+
+const AcquaintanceGraph::Id AcquaintanceGraph::no_id;
+const uint32_t AcquaintanceGraph::name_shard_bits_;
+const size_t AcquaintanceGraph::name_shard_count_;
+constexpr const char AcquaintanceGraph::image_magic_[8];
+const uint32_t AcquaintanceGraph::image_version_;
+
+/**
+ * Сжатые списки знакомых: каждый список упорядочен и хранится разностями соседних номеров в коде переменной
+ * длины (varint: по 7 бит в байте, старший бит - есть ли продолжение). Первый номер списка хранится разностью
+ * с номером самого человека (со знаком, zigzag), остальные - разностью с предыдущим. Чем ближе номера знакомых,
+ * тем меньше байтов на знакомство; при случайных номерах выходит около 2-3 байтов вместо 4.
+ * Начала списков хранятся 32-битными смещениями от начала блока из block_vertices_ людей и 64-битными
+ * началами блоков, то есть чуть больше 4 байтов на человека.
+ * Списки распаковываются на лету при обходе, поэтому поиск в ширину медленнее, чем по несжатому графу.
+ * Для двустороннего поиска цепочек нужны два объекта: сжатые прямые и обратные списки одного графа.
+ * Порядок знакомых в списках меняется, поэтому при нескольких кратчайших цепочках может быть выбрана другая,
+ * чем у AcquaintanceGraph::search_chain.
+ */
+class CompressedAdjacency {
+public:
+    using Id = AcquaintanceGraph::Id;
+
+    /**
+     * Сжать списки знакомых графа.
+     * @param graph Граф.
+     * @param reverse Сжать обратные списки (кто знаком с человеком) вместо прямых.
+     * @param thread_count Количество потоков.
+     */
+    explicit CompressedAdjacency(const AcquaintanceGraph& graph, bool reverse = false,
+                                 size_t thread_count = std::thread::hardware_concurrency()):
+            reverse_(reverse), edge_count_(graph.edge_count()), offsets_(graph.vertex_count() + 1),
+            block_starts_(graph.vertex_count() / block_vertices_ + 1) {
+        size_t vertex_count = graph.vertex_count();
+        std::vector<uint64_t> starts(vertex_count + 1, 0);  // Начала списков.
+        size_t part_count = std::min(vertex_count, std::max<size_t>(thread_count, 1) * 4);
+        std::vector<std::vector<uint8_t>> parts(part_count);  // Сжатые списки частей.
+        parallel_for(thread_count, part_count, [&](size_t part) {
+            std::vector<Id> list;
+            auto& bytes = parts[part];
+            for (size_t v = vertex_count * part / part_count; v < vertex_count * (part + 1) / part_count; ++v) {
+                auto id = static_cast<Id>(v);
+                if (reverse) {
+                    list.assign(graph.reverse_neighbours_begin(id), graph.reverse_neighbours_end(id));
+                } else {
+                    list.assign(graph.neighbours_begin(id), graph.neighbours_end(id));
+                }
+                std::sort(list.begin(), list.end());
+                Id previous = id;
+                for (size_t i = 0; i < list.size(); ++i) {
+                    if (i == 0) {
+                        int64_t difference = int64_t{list[0]} - int64_t{id};
+                        uint64_t zigzag = (static_cast<uint64_t>(difference) << 1) ^ (difference < 0 ? ~uint64_t{0} : 0);
+                        write_varint(bytes, zigzag);
+                    } else {
+                        write_varint(bytes, list[i] - previous);
+                    }
+                    previous = list[i];
+                }
+                starts[v + 1] = bytes.size();  // Пока - конец списка внутри части.
+            }
+        });
+        std::vector<uint64_t> part_starts(part_count + 1, 0);
+        for (size_t part = 0; part < part_count; ++part) {
+            part_starts[part + 1] = part_starts[part] + parts[part].size();
+        }
+        bytes_.resize(part_starts.back());
+        parallel_for(thread_count, part_count, [&](size_t part) {
+            std::copy(parts[part].begin(), parts[part].end(), bytes_.begin() + part_starts[part]);
+            std::vector<uint8_t>().swap(parts[part]);
+            for (size_t v = vertex_count * part / part_count; v < vertex_count * (part + 1) / part_count; ++v) {
+                starts[v + 1] += part_starts[part];
+            }
+        });
+        for (size_t v = 0; v <= vertex_count; ++v) {
+            if (v % block_vertices_ == 0) {
+                block_starts_[v / block_vertices_] = starts[v];
+            }
+            uint64_t offset = starts[v] - block_starts_[v / block_vertices_];
+            if (offset > UINT32_MAX) {
+                throw std::length_error("Too long acquaintance lists.");
+            }
+            offsets_[v] = static_cast<uint32_t>(offset);
+        }
+    }
+
+    /**
+     * Количество людей.
+     */
+    size_t vertex_count() const {
+        return offsets_.size() - 1;
+    }
+
+    /**
+     * Количество знакомств.
+     */
+    size_t edge_count() const {
+        return edge_count_;
+    }
+
+    /**
+     * Размер сжатых списков в байтах.
+     */
+    size_t list_bytes() const {
+        return bytes_.size();
+    }
+
+    /**
+     * Память под списки и их начала в байтах.
+     */
+    size_t memory_usage() const {
+        return bytes_.size() + offsets_.size() * sizeof(uint32_t) + block_starts_.size() * sizeof(uint64_t);
+    }
+
+    /**
+     * Вызвать function(знакомый) для всех знакомых человека в порядке возрастания номеров.
+     */
+    template<typename Function>
+    void for_each_neighbour(Id id, Function function) const {
+        const uint8_t* position = bytes_.data() + block_starts_[id / block_vertices_] + offsets_[id];
+        const uint8_t* end = bytes_.data() + block_starts_[(id + 1) / block_vertices_] + offsets_[id + 1];
+        if (position == end) {
+            return;
+        }
+        uint64_t zigzag = read_varint(position);
+        auto neighbour = static_cast<Id>(int64_t{id} + static_cast<int64_t>((zigzag >> 1) ^ (0 - (zigzag & 1))));
+        function(neighbour);
+        while (position != end) {
+            neighbour += static_cast<Id>(read_varint(position));
+            function(neighbour);
+        }
+    }
+
+    /**
+     * Сжаты ли обратные списки.
+     */
+    bool is_reverse() const {
+        return reverse_;
+    }
+
+    /**
+     * Односторонний поиск кратчайшей цепочки знакомых по номерам.
+     * Доступен только для прямых списков: по обратным спискам поиск шёл бы по перевёрнутому графу.
+     * @param first Начало цепочки.
+     * @param second Конец цепочки.
+     * @param workspace Рабочие массивы поиска.
+     * @return Цепочка номеров или пустой вектор, если цепочки нет (в том числе от человека к самому себе).
+     */
+    std::vector<Id> search_chain(Id first, Id second, AcquaintanceGraph::SearchWorkspace& workspace) const {
+        if (reverse_) {
+            throw std::invalid_argument("Chains are searched along forward acquaintance lists.");
+        }
+        if (first >= vertex_count() || second >= vertex_count() || first == second) {
+            return {};
+        }
+        uint32_t epoch = workspace.prepare(vertex_count());
+        auto& visited = workspace.visited;
+        auto& parents = workspace.parents;
+        auto& queue = workspace.queue;
+        queue.assign(1, first);
+        visited[first] = epoch;
+        parents[first] = first;
+        for (size_t head = 0; head < queue.size() && visited[second] != epoch; ++head) {
+            Id v = queue[head];
+            for_each_neighbour(v, [&](Id to) {
+                if (visited[to] != epoch) {
+                    visited[to] = epoch;
+                    parents[to] = v;
+                    queue.push_back(to);
+                }
+            });
+        }
+        if (visited[second] != epoch) {
+            return {};
+        }
+        std::vector<Id> chain{second};
+        while (parents[chain.back()] != chain.back()) {
+            chain.push_back(parents[chain.back()]);
+        }
+        std::reverse(chain.begin(), chain.end());
+        return chain;
+    }
+
+    /**
+     * Двусторонний поиск кратчайшей цепочки знакомых по сжатым прямым и обратным спискам одного графа.
+     * Устроен так же, как AcquaintanceGraph::search_chain_bidirectional: на каждом шаге на уровень растёт сторона
+     * с меньшим фронтом.
+     * @param forward Сжатые прямые списки.
+     * @param backward Сжатые обратные списки того же графа.
+     * @param first Начало цепочки.
+     * @param second Конец цепочки.
+     * @param workspace Рабочие массивы поиска.
+     * @return Цепочка номеров или пустой вектор, если цепочки нет (в том числе от человека к самому себе).
+     */
+    static std::vector<Id> search_chain_bidirectional(const CompressedAdjacency& forward,
+                                                      const CompressedAdjacency& backward, Id first, Id second,
+                                                      AcquaintanceGraph::SearchWorkspace& workspace) {
+        if (forward.reverse_ || !backward.reverse_ || forward.vertex_count() != backward.vertex_count()) {
+            throw std::invalid_argument("Bidirectional search needs forward and reverse lists of one graph.");
+        }
+        if (first >= forward.vertex_count() || second >= forward.vertex_count() || first == second) {
+            return {};
+        }
+        uint32_t epoch = workspace.prepare(forward.vertex_count());
+        workspace.queue.assign(1, first);
+        workspace.visited[first] = epoch;
+        workspace.parents[first] = first;
+        workspace.backward_queue.assign(1, second);
+        workspace.backward_visited[second] = epoch;
+        workspace.children[second] = second;
+        size_t forward_begin = 0;
+        size_t backward_begin = 0;
+        while (forward_begin < workspace.queue.size() && backward_begin < workspace.backward_queue.size()) {
+            Id meeting = AcquaintanceGraph::no_id;
+            if (workspace.queue.size() - forward_begin <= workspace.backward_queue.size() - backward_begin) {
+                meeting = forward.expand_level(workspace.queue, forward_begin, workspace.visited, workspace.parents,
+                                               workspace.backward_visited, epoch);
+            } else {
+                meeting = backward.expand_level(workspace.backward_queue, backward_begin, workspace.backward_visited,
+                                                workspace.children, workspace.visited, epoch);
+            }
+            if (meeting != AcquaintanceGraph::no_id) {
+                std::vector<Id> chain{meeting};
+                while (workspace.parents[chain.back()] != chain.back()) {
+                    chain.push_back(workspace.parents[chain.back()]);
+                }
+                std::reverse(chain.begin(), chain.end());
+                while (workspace.children[chain.back()] != chain.back()) {
+                    chain.push_back(workspace.children[chain.back()]);
+                }
+                return chain;
+            }
+        }
+        return {};
+    }
+private:
+    /**
+     * Продвинуть одну сторону двустороннего поиска на уровень (см. AcquaintanceGraph::expand_level).
+     * Список, в котором стороны встретились, дочитывается без обработки.
+     * @return Вершина встречи сторон или no_id.
+     */
+    Id expand_level(std::vector<Id>& queue, size_t& begin, std::vector<uint32_t>& visited, std::vector<Id>& links,
+                    const std::vector<uint32_t>& other_visited, uint32_t epoch) const {
+        size_t end = queue.size();
+        for (size_t i = begin; i < end; ++i) {
+            Id v = queue[i];
+            Id meeting = AcquaintanceGraph::no_id;
+            for_each_neighbour(v, [&](Id to) {
+                if (meeting != AcquaintanceGraph::no_id || visited[to] == epoch) {
+                    return;
+                }
+                visited[to] = epoch;
+                links[to] = v;
+                if (other_visited[to] == epoch) {
+                    meeting = to;
+                    return;
+                }
+                queue.push_back(to);
+            });
+            if (meeting != AcquaintanceGraph::no_id) {
+                return meeting;
+            }
+        }
+        begin = end;
+        return AcquaintanceGraph::no_id;
+    }
+
+    /**
+     * Дописать число в коде переменной длины.
+     */
+    static void write_varint(std::vector<uint8_t>& bytes, uint64_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(value));
+    }
+
+    /**
+     * Прочитать число в коде переменной длины. Короткие числа (большинство разностей) читаются без цикла.
+     */
+    static uint64_t read_varint(const uint8_t*& position) {
+        uint64_t value = position[0];
+        if (value < 0x80) {
+            position += 1;
+            return value;
+        }
+        value = (value & 0x7F) | uint64_t{position[1]} << 7;
+        if (position[1] < 0x80) {
+            position += 2;
+            return value;
+        }
+        value = (value & 0x3FFF) | uint64_t{position[2]} << 14;
+        if (position[2] < 0x80) {
+            position += 3;
+            return value;
+        }
+        value &= 0x1FFFFF;
+        position += 3;
+        for (unsigned shift = 21;; shift += 7) {
+            uint8_t byte = *position++;
+            value |= uint64_t{byte & 0x7Fu} << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    static const size_t block_vertices_ = 64;  // Людей в блоке, начало которого хранится полностью.
+
+    bool reverse_;  // Сжаты ли обратные списки.
+    size_t edge_count_;  // Количество знакомств.
+    std::vector<uint32_t> offsets_;  // Начала сжатых списков относительно начала блока, плюс общий конец.
+    std::vector<uint64_t> block_starts_;  // Начала блоков в bytes_: блок v / block_vertices_ начинается со списка v.
+    std::vector<uint8_t> bytes_;  // Сжатые списки подряд.
+};
+
+const size_t CompressedAdjacency::block_vertices_;
+
+/**
+ * Барьер для фиксированного количества потоков: wait возвращается, когда его вызвали все потоки.
+ */
+class ThreadBarrier {
+public:
+    explicit ThreadBarrier(size_t thread_count): thread_count_(thread_count) {
+    }
+
+    /**
+     * Дождаться остальных потоков.
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t generation = generation_;
+        if (++waiting_ == thread_count_) {
+            waiting_ = 0;
+            ++generation_;
+            condition_.notify_all();
+            return;
+        }
+        condition_.wait(lock, [&]() { return generation != generation_; });
+    }
+private:
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    size_t thread_count_;  // Количество потоков.
+    size_t waiting_ = 0;  // Сколько потоков уже ждут.
+    size_t generation_ = 0;  // Сколько раз барьер был пройден.
+};
+
+/**
+ * Постоянные потоки: run(function) работает как run_in_threads, но потоки создаются один раз в конструкторе,
+ * а не при каждом запуске. Вызывающий поток участвует в работе с номером 0.
+ * function не должна бросать исключений.
+ */
+class WorkerThreads {
+public:
+    explicit WorkerThreads(size_t thread_count):
+            thread_count_(std::max<size_t>(thread_count, 1)), start_(thread_count_), finish_(thread_count_) {
+        for (size_t thread_no = 1; thread_no < thread_count_; ++thread_no) {
+            threads_.emplace_back([this, thread_no]() { work(thread_no); });
+        }
+    }
+
+    WorkerThreads(const WorkerThreads&) = delete;
+    WorkerThreads& operator=(const WorkerThreads&) = delete;
+
+    ~WorkerThreads() {
+        task_ = nullptr;  // Пустая задача - сигнал завершения.
+        start_.wait();
+        for (auto& thread: threads_) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Количество потоков вместе с вызывающим.
+     */
+    size_t size() const {
+        return thread_count_;
+    }
+
+    /**
+     * Выполнить function(номер потока) во всех потоках и дождаться завершения.
+     */
+    void run(const std::function<void(size_t)>& function) {
+        task_ = &function;
+        start_.wait();
+        function(0);
+        finish_.wait();
+    }
+private:
+    void work(size_t thread_no) {
+        while (true) {
+            start_.wait();
+            if (task_ == nullptr) {
+                return;
+            }
+            (*task_)(thread_no);
+            finish_.wait();
+        }
+    }
+
+    size_t thread_count_;  // Количество потоков.
+    ThreadBarrier start_;  // Барьер начала задачи.
+    ThreadBarrier finish_;  // Барьер окончания задачи.
+    const std::function<void(size_t)>* task_ = nullptr;  // Текущая задача (записывается до барьера начала).
+    std::vector<std::thread> threads_;  // Потоки с номерами 1, 2, ...
+};
+
+/**
+ * Многопоточный поиск в ширину с выбором направления (direction-optimizing BFS).
+ * Поиск идёт по уровням, все потоки обрабатывают уровень вместе. Фронт и следующий фронт - битовые карты.
+ * Уровень обрабатывается одним из двух способов:
+ *  * сверху вниз: вершины фронта перебирают знакомых и захватывают непосещённых атомарной записью родителя;
+ *  * снизу вверх: непосещённые вершины перебирают тех, у кого они в знакомых, и ищут среди них вершину фронта.
+ * Пока фронт маленький, выгоднее первый способ; когда рёбер фронта становится больше, чем непросмотренных рёбер
+ * делённых на alpha, - второй (первая найденная вершина фронта обрывает перебор, так что большинство рёбер
+ * не просматривается); когда фронт снова сужается меньше количества вершин делённого на beta, - снова первый.
+ * Работа раздаётся потокам кусками по chunk_words_ слов битовой карты. Потоки создаются один раз в конструкторе
+ * и синхронизируются между уровнями барьером, поэтому короткие поиски не тратят время на запуск потоков.
+ * Цепочка той же длины, что и у последовательного поиска, но родители выбираются гонкой, поэтому сама цепочка
+ * может быть другой.
+ */
+class ParallelBfs {
+public:
+    using Id = AcquaintanceGraph::Id;
+
+    /**
+     * Статистика последнего поиска.
+     */
+    struct Stats {
+        uint64_t reached_vertices = 0;  // Количество посещённых вершин.
+        uint64_t traversed_edges = 0;  // Сумма исходящих степеней посещённых вершин (как в Graph500).
+        uint64_t examined_edges = 0;  // Количество фактически просмотренных рёбер.
+        uint32_t levels = 0;  // Количество уровней.
+        uint32_t bottom_up_levels = 0;  // Из них обработано снизу вверх.
+        double seconds = 0;  // Время поиска.
+
+        /**
+         * Пройденных рёбер в секунду (traversed edges per second).
+         */
+        double teps() const {
+            return seconds > 0 ? traversed_edges / seconds : 0;
+        }
+    };
+
+    /**
+     * @param graph Граф. Должен жить дольше объекта.
+     * @param thread_count Количество потоков.
+     * @param direction_optimizing Переключаться ли на обработку снизу вверх (false - только сверху вниз).
+     */
+    explicit ParallelBfs(const AcquaintanceGraph& graph, size_t thread_count = std::thread::hardware_concurrency(),
+                         bool direction_optimizing = true):
+            graph_(graph), direction_optimizing_(direction_optimizing), workers_(thread_count),
+            level_barrier_(workers_.size()),
+            parents_(new std::atomic<Id>[graph.vertex_count()]),
+            words_((graph.vertex_count() + 63) / 64),
+            frontier_(new std::atomic<uint64_t>[words_]),
+            next_(new std::atomic<uint64_t>[words_]) {
+    }
+
+    /**
+     * Поиск кратчайшей цепочки знакомых.
+     * Поиск останавливается после уровня, на котором найден конец цепочки.
+     * @return Цепочка номеров или пустой вектор, если цепочки нет (как и у последовательного поиска,
+     * цепочки от человека к самому себе нет).
+     */
+    std::vector<Id> search_chain(Id first, Id second) {
+        if (first >= graph_.vertex_count() || second >= graph_.vertex_count() || first == second) {
+            return {};
+        }
+        run(first, second);
+        if (parents_[second].load(std::memory_order_relaxed) == AcquaintanceGraph::no_id) {
+            return {};
+        }
+        std::vector<Id> chain{second};
+        while (chain.back() != first) {
+            chain.push_back(parents_[chain.back()].load(std::memory_order_relaxed));
+        }
+        std::reverse(chain.begin(), chain.end());
+        return chain;
+    }
+
+    /**
+     * Обойти все вершины, достижимые из заданной.
+     * @return Статистика обхода.
+     */
+    const Stats& traverse(Id source) {
+        if (source >= graph_.vertex_count()) {
+            throw std::out_of_range("Unknown person.");
+        }
+        run(source, AcquaintanceGraph::no_id);
+        return stats_;
+    }
+
+    /**
+     * Статистика последнего поиска.
+     */
+    const Stats& last_stats() const {
+        return stats_;
+    }
+private:
+    /**
+     * Поиск в ширину от source до окончания уровня, на котором посещён target (no_id - до конца).
+     * Все уровни проходят в одном запуске постоянных потоков. После каждого уровня потоки встречаются на барьере,
+     * поток 0 подводит итоги уровня, и на втором барьере все получают решение о следующем уровне.
+     */
+    void run(Id source, Id target) {
+        auto start = std::chrono::steady_clock::now();
+        stats_ = Stats();
+        size_t vertex_count = graph_.vertex_count();
+        uint64_t frontier_vertices = 1;
+        uint64_t frontier_edges = graph_.neighbours_end(source) - graph_.neighbours_begin(source);
+        uint64_t unexplored_edges = graph_.edge_count() - frontier_edges;
+        stats_.reached_vertices = 1;
+        stats_.traversed_edges = frontier_edges;
+        bool bottom_up = false;
+        bool finished = false;
+        auto choose_direction = [&]() {
+            if (!bottom_up && direction_optimizing_ && frontier_edges > unexplored_edges / alpha_) {
+                bottom_up = true;
+            } else if (bottom_up && frontier_vertices < vertex_count / beta_) {
+                bottom_up = false;
+            }
+        };
+        choose_direction();
+        std::atomic<size_t> next_chunk{0};
+        std::atomic<uint64_t> next_vertices{0};
+        std::atomic<uint64_t> next_edges{0};
+        std::atomic<uint64_t> examined_edges{0};
+        workers_.run([&](size_t thread_no) {
+            size_t thread_count = workers_.size();
+            size_t first_word = words_ * thread_no / thread_count;
+            size_t last_word = words_ * (thread_no + 1) / thread_count;
+            for (size_t v = vertex_count * thread_no / thread_count; v < vertex_count * (thread_no + 1) / thread_count;
+                 ++v) {
+                parents_[v].store(v == source ? source : AcquaintanceGraph::no_id, std::memory_order_relaxed);
+            }
+            for (size_t word = first_word; word < last_word; ++word) {
+                frontier_[word].store(word == source / 64 ? uint64_t{1} << (source % 64) : 0,
+                                      std::memory_order_relaxed);
+                next_[word].store(0, std::memory_order_relaxed);
+            }
+            level_barrier_.wait();
+            while (!finished) {
+                uint64_t vertices = 0;
+                uint64_t edges = 0;
+                uint64_t examined = 0;
+                for (size_t chunk = next_chunk++; chunk * chunk_words_ < words_; chunk = next_chunk++) {
+                    size_t chunk_begin = chunk * chunk_words_;
+                    size_t chunk_end = std::min(words_, chunk_begin + chunk_words_);
+                    if (bottom_up) {
+                        expand_bottom_up(chunk_begin, chunk_end, vertices, edges, examined);
+                    } else {
+                        expand_top_down(chunk_begin, chunk_end, vertices, edges, examined);
+                    }
+                }
+                next_vertices += vertices;
+                next_edges += edges;
+                examined_edges += examined;
+                auto old_frontier = frontier_.get();
+                level_barrier_.wait();
+                for (size_t word = first_word; word < last_word; ++word) {  // Старый фронт станет следующим.
+                    old_frontier[word].store(0, std::memory_order_relaxed);
+                }
+                if (thread_no == 0) {
+                    std::swap(frontier_, next_);
+                    frontier_vertices = next_vertices.exchange(0);
+                    frontier_edges = next_edges.exchange(0);
+                    unexplored_edges -= std::min(unexplored_edges, frontier_edges);
+                    stats_.reached_vertices += frontier_vertices;
+                    stats_.traversed_edges += frontier_edges;
+                    stats_.examined_edges += examined_edges.exchange(0);
+                    ++stats_.levels;
+                    stats_.bottom_up_levels += bottom_up;
+                    next_chunk = 0;
+                    finished = frontier_vertices == 0 || (target != AcquaintanceGraph::no_id &&
+                            parents_[target].load(std::memory_order_relaxed) != AcquaintanceGraph::no_id);
+                    choose_direction();
+                }
+                level_barrier_.wait();
+            }
+        });
+        stats_.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /**
+     * Обработать сверху вниз вершины фронта из слов [first_word, last_word) битовой карты.
+     */
+    void expand_top_down(size_t first_word, size_t last_word, uint64_t& vertices, uint64_t& edges,
+                         uint64_t& examined) {
+        for (size_t word = first_word; word < last_word; ++word) {
+            for (uint64_t bits = frontier_[word].load(std::memory_order_relaxed); bits != 0; bits &= bits - 1) {
+                auto u = static_cast<Id>(word * 64 + __builtin_ctzll(bits));
+                for (auto it = graph_.neighbours_begin(u), end = graph_.neighbours_end(u); it != end; ++it) {
+                    ++examined;
+                    Id to = *it;
+                    Id expected = AcquaintanceGraph::no_id;
+                    if (parents_[to].load(std::memory_order_relaxed) == expected &&
+                        parents_[to].compare_exchange_strong(expected, u, std::memory_order_relaxed)) {
+                        next_[to / 64].fetch_or(uint64_t{1} << (to % 64), std::memory_order_relaxed);
+                        ++vertices;
+                        edges += graph_.neighbours_end(to) - graph_.neighbours_begin(to);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Обработать снизу вверх непосещённые вершины из слов [first_word, last_word) битовой карты.
+     * Слова следующего фронта в этом диапазоне записывает только этот поток.
+     */
+    void expand_bottom_up(size_t first_word, size_t last_word, uint64_t& vertices, uint64_t& edges,
+                          uint64_t& examined) {
+        size_t vertex_count = graph_.vertex_count();
+        for (size_t word = first_word; word < last_word; ++word) {
+            uint64_t next_bits = 0;
+            for (size_t v = word * 64; v < std::min(vertex_count, word * 64 + 64); ++v) {
+                if (parents_[v].load(std::memory_order_relaxed) != AcquaintanceGraph::no_id) {
+                    continue;
+                }
+                auto vertex = static_cast<Id>(v);
+                for (auto it = graph_.reverse_neighbours_begin(vertex), end = graph_.reverse_neighbours_end(vertex);
+                     it != end; ++it) {
+                    ++examined;
+                    Id u = *it;
+                    if ((frontier_[u / 64].load(std::memory_order_relaxed) >> (u % 64)) & 1) {
+                        parents_[v].store(u, std::memory_order_relaxed);
+                        next_bits |= uint64_t{1} << (v % 64);
+                        ++vertices;
+                        edges += graph_.neighbours_end(vertex) - graph_.neighbours_begin(vertex);
+                        break;
+                    }
+                }
+            }
+            next_[word].store(next_bits, std::memory_order_relaxed);
+        }
+    }
+
+    static const uint64_t alpha_ = 14;  // Порог перехода снизу вверх (из статьи Beamer et al.).
+    static const uint64_t beta_ = 24;  // Порог возврата сверху вниз.
+    static const size_t chunk_words_ = 64;  // Слов битовой карты (по 64 вершины) в куске работы.
+
+    const AcquaintanceGraph& graph_;  // Граф.
+    bool direction_optimizing_;  // Разрешена ли обработка снизу вверх.
+    WorkerThreads workers_;  // Потоки поиска: создаются один раз на объект.
+    ThreadBarrier level_barrier_;  // Барьер между уровнями.
+    std::unique_ptr<std::atomic<Id>[]> parents_;  // Родители посещённых вершин, no_id - не посещена.
+    size_t words_;  // Размер битовых карт в словах.
+    std::unique_ptr<std::atomic<uint64_t>[]> frontier_;  // Текущий фронт.
+    std::unique_ptr<std::atomic<uint64_t>[]> next_;  // Следующий фронт.
+    Stats stats_;  // Статистика последнего поиска.
+};
+
+/**
+ * Пакетный поиск цепочек знакомых: поиск в ширину сразу от многих людей (multi-source BFS, Then et al.).
+ * Запросы группируются по началу цепочки, и до batch_sources разных начал обрабатываются одним обходом:
+ * у каждой вершины пометки посещения и фронта - 64-битные слова, бит i которых относится к i-му началу.
+ * Уровень обхода - один проход по спискам знакомых, в котором слово фронта вершины целиком объединяется
+ * со словами её знакомых, так что граф читается из памяти один раз на пакет, а не на каждый запрос.
+ * Для восстановления цепочек слова фронта сохраняются для каждого уровня (8 байт на вершину на уровень):
+ * звено цепочки перед вершиной уровня k - любой из тех, у кого она в знакомых, с битом начала во фронте k - 1.
+ * Обход заканчивается, когда найдены концы всех цепочек пакета; начала, чьи цепочки все найдены,
+ * перестают распространяться. Чтобы память не росла с длиной цепочек, обход идёт не дальше level_limit
+ * уровней, а цепочки, не найденные к этому уровню, ищутся по одной двусторонним поиском. Сохранённые фронты
+ * освобождаются после каждого вызова search_chains.
+ * Цепочки той же длины, что и у последовательного поиска, но при нескольких кратчайших цепочках может быть
+ * выбрана другая.
+ */
+class BatchBfs {
+public:
+    using Id = AcquaintanceGraph::Id;
+    static const size_t batch_sources = 64;  // Разных начал цепочек в одном обходе (бит в слове).
+
+    static const size_t default_level_limit = 16;  // Длина цепочки, после которой пакетный обход прекращается.
+
+    /**
+     * @param graph Граф. Должен жить дольше объекта.
+     * @param level_limit Наибольшая длина цепочки в пакетном обходе (фронтов сохраняется на один больше).
+     * Более длинные цепочки ищутся по одной.
+     */
+    explicit BatchBfs(const AcquaintanceGraph& graph, size_t level_limit = default_level_limit):
+            graph_(graph), level_limit_(std::max<size_t>(level_limit, 1)), seen_(graph.vertex_count()) {
+    }
+
+    /**
+     * Поиск кратчайших цепочек знакомых для списка пар.
+     * @param pairs Пары (начало цепочки, конец цепочки).
+     * @return Цепочки номеров в порядке пар; пустая цепочка, если её нет (в том числе от человека к самому себе
+     * и для неизвестных номеров).
+     */
+    std::vector<std::vector<Id>> search_chains(const std::vector<std::pair<Id, Id>>& pairs) {
+        std::vector<std::vector<Id>> chains(pairs.size());
+        max_levels_ = 0;
+        fallback_count_ = 0;
+        std::vector<size_t> order;  // Номера пар, для которых нужен поиск, сгруппированные по началу.
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            if (pairs[i].first < graph_.vertex_count() && pairs[i].second < graph_.vertex_count() &&
+                pairs[i].first != pairs[i].second) {
+                order.push_back(i);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [&pairs](size_t lhs, size_t rhs) {
+            return pairs[lhs].first < pairs[rhs].first;
+        });
+        for (size_t begin = 0; begin < order.size();) {
+            size_t end = begin;
+            size_t sources = 0;
+            for (; end < order.size(); ++end) {
+                if (end == begin || pairs[order[end]].first != pairs[order[end - 1]].first) {
+                    if (sources == batch_sources) {
+                        break;
+                    }
+                    ++sources;
+                }
+            }
+            run_batch(pairs, order.data() + begin, order.data() + end, chains);
+            begin = end;
+        }
+        std::vector<std::vector<uint64_t>>().swap(levels_);
+        return chains;
+    }
+
+    /**
+     * Поиск кратчайших цепочек знакомых для списка пар имён.
+     */
+    std::vector<std::vector<std::string>> search_chains(const std::vector<std::pair<std::string, std::string>>& pairs) {
+        std::vector<std::pair<Id, Id>> ids;
+        ids.reserve(pairs.size());
+        for (auto& pair: pairs) {
+            ids.emplace_back(graph_.find(pair.first), graph_.find(pair.second));
+        }
+        auto chains = search_chains(ids);
+        std::vector<std::vector<std::string>> result;
+        result.reserve(chains.size());
+        for (auto& chain: chains) {
+            result.push_back(graph_.names_of(chain));
+        }
+        return result;
+    }
+
+    /**
+     * Количество уровней в самом глубоком обходе последнего вызова search_chains (столько слов на вершину
+     * было занято под сохранённые фронты). Не больше level_limit + 1.
+     */
+    size_t max_levels() const {
+        return max_levels_;
+    }
+
+    /**
+     * Сколько цепочек в последнем вызове search_chains искались по одной, потому что длиннее level_limit.
+     */
+    size_t fallback_count() const {
+        return fallback_count_;
+    }
+private:
+    /**
+     * Обработать пакет пар с не более чем batch_sources разными началами.
+     * @param first Начало номеров пар пакета; пары с одинаковым началом идут подряд.
+     * @param last Конец номеров пар пакета.
+     */
+    void run_batch(const std::vector<std::pair<Id, Id>>& pairs, const size_t* first, const size_t* last,
+                   std::vector<std::vector<Id>>& chains) {
+        size_t vertex_count = graph_.vertex_count();
+        size_t count = last - first;
+        std::vector<uint64_t> bits(count);  // Бит начала цепочки каждой пары.
+        std::vector<size_t> remaining;  // Количество ненайденных цепочек для каждого начала.
+        if (levels_.empty()) {
+            levels_.emplace_back(vertex_count);
+        }
+        max_levels_ = std::max<size_t>(max_levels_, 1);
+        std::fill(levels_[0].begin(), levels_[0].end(), 0);
+        std::fill(seen_.begin(), seen_.end(), 0);
+        for (size_t i = 0; i < count; ++i) {
+            Id source = pairs[first[i]].first;
+            if (i == 0 || source != pairs[first[i - 1]].first) {
+                remaining.push_back(0);
+            }
+            bits[i] = uint64_t{1} << (remaining.size() - 1);
+            ++remaining.back();
+            levels_[0][source] |= bits[i];
+            seen_[source] |= bits[i];
+        }
+        uint64_t active = remaining.size() == 64 ? ~uint64_t{0} : (uint64_t{1} << remaining.size()) - 1;
+        std::vector<uint32_t> distances(count, 0);  // Длины найденных цепочек в рёбрах, 0 - не найдена.
+        size_t unresolved = count;
+        bool limit_reached = false;
+        for (size_t level = 1; unresolved > 0 && active != 0; ++level) {
+            if (level > level_limit_) {
+                limit_reached = true;
+                break;
+            }
+            max_levels_ = std::max(max_levels_, level + 1);
+            if (levels_.size() == level) {
+                levels_.emplace_back(vertex_count);
+            }
+            const auto& frontier = levels_[level - 1];
+            auto& next = levels_[level];
+            std::fill(next.begin(), next.end(), 0);
+            for (Id u = 0; u < vertex_count; ++u) {
+                uint64_t word = frontier[u];
+                if (word == 0) {
+                    continue;
+                }
+                for (auto it = graph_.neighbours_begin(u), end = graph_.neighbours_end(u); it != end; ++it) {
+                    next[*it] |= word;
+                }
+            }
+            uint64_t reached = 0;
+            for (size_t v = 0; v < vertex_count; ++v) {
+                next[v] &= active & ~seen_[v];
+                seen_[v] |= next[v];
+                reached |= next[v];
+            }
+            if (reached == 0) {
+                break;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (distances[i] == 0 && (next[pairs[first[i]].second] & bits[i]) != 0) {
+                    distances[i] = static_cast<uint32_t>(level);
+                    --unresolved;
+                    size_t lane = __builtin_ctzll(bits[i]);
+                    if (--remaining[lane] == 0) {
+                        active &= ~bits[i];
+                    }
+                }
+            }
+        }
+        AcquaintanceGraph::SearchWorkspace workspace;
+        for (size_t i = 0; i < count; ++i) {
+            if (distances[i] == 0) {
+                if (limit_reached) {  // Цепочка длиннее level_limit_ или её нет.
+                    chains[first[i]] = graph_.search_chain_bidirectional(pairs[first[i]].first, pairs[first[i]].second,
+                                                                         workspace);
+                    ++fallback_count_;
+                }
+                continue;
+            }
+            auto& chain = chains[first[i]];
+            chain.resize(distances[i] + 1);
+            chain.back() = pairs[first[i]].second;
+            for (size_t level = distances[i]; level > 0; --level) {
+                Id v = chain[level];
+                auto it = graph_.reverse_neighbours_begin(v);
+                while ((levels_[level - 1][*it] & bits[i]) == 0) {
+                    ++it;
+                }
+                chain[level - 1] = *it;
+            }
+        }
+    }
+
+    const AcquaintanceGraph& graph_;  // Граф.
+    size_t level_limit_;  // Наибольшая длина цепочки в пакетном обходе.
+    std::vector<uint64_t> seen_;  // Пометки посещения: бит i - вершина достигнута от i-го начала пакета.
+    std::vector<std::vector<uint64_t>> levels_;  // Фронты по уровням: levels_[k] - вершины на расстоянии k.
+    size_t max_levels_ = 0;  // Уровней в самом глубоком обходе последнего вызова.
+    size_t fallback_count_ = 0;  // Цепочек, найденных по одной, в последнем вызове.
+};
+
+const size_t BatchBfs::batch_sources;
+const size_t BatchBfs::default_level_limit;
+
+/**
+ * Индекс расстояний между людьми: 2-hop метки (pruned landmark labeling, Akiba et al.).
+ * У каждого человека v две метки - списки пар (хаб, расстояние): исходящая - до каких хабов и за сколько шагов
+ * можно дойти от v, входящая - от каких хабов и за сколько шагов можно дойти до v. Метки покрывают граф так,
+ * что на каждой кратчайшей цепочке s -> t лежит хаб из исходящей метки s и входящей метки t, поэтому
+ * расстояние - минимум сумм по общим хабам, который находится слиянием двух списков, упорядоченных по хабам.
+ * Хабами по очереди становятся все люди в порядке убывания количества знакомств. От каждого хаба идут поиски
+ * в ширину по знакомствам и по обратным знакомствам; вершина, расстояние до которой уже дают прежние метки,
+ * не получает метку и не продолжает поиск. Поэтому первые хабы покрывают большую часть цепочек, а поиски от
+ * следующих быстро обрываются.
+ * В каждой записи метки хранится подсказка - соседняя вершина на кратчайшем пути к хабу (для исходящей метки)
+ * или от хаба (для входящей), у которой в метке есть тот же хаб. По подсказкам цепочка восстанавливается
+ * без поиска, за её длину умноженную на логарифм размера метки.
+ * Номера хабов, расстояния и подсказки хранятся отдельными массивами: слияние читает только номера хабов,
+ * а расстояние занимает байт, так что запись метки занимает 9 байтов.
+ */
+class DistanceIndex {
+public:
+    using Id = AcquaintanceGraph::Id;
+    static const uint32_t no_distance = UINT32_MAX;  // Расстояние до недостижимой вершины.
+    static const uint32_t max_distance = UINT8_MAX;  // Наибольшее расстояние до хаба в метке.
+
+    /**
+     * Построение индекса.
+     * Поиски от хабов независимы, если не учитывают метки друг друга, поэтому хабы обрабатываются пакетами
+     * по одному на поток, а метки пакета добавляются после его завершения. Метки получаются чуть больше,
+     * чем при последовательном построении, поэтому первые хабы, покрывающие больше всего, обрабатываются
+     * по одному, и размер пакета растёт до количества потоков постепенно.
+     * @param graph Граф. Если расстояние до хаба в метке оказывается больше max_distance (такое возможно
+     * только в графах с очень длинными кратчайшими цепочками), бросается исключение std::length_error.
+     * @param thread_count Количество потоков.
+     */
+    explicit DistanceIndex(const AcquaintanceGraph& graph,
+                           size_t thread_count = std::thread::hardware_concurrency()) {
+        size_t vertex_count = graph.vertex_count();
+        thread_count = std::max<size_t>(thread_count, 1);
+        order_.resize(vertex_count);
+        for (size_t v = 0; v < vertex_count; ++v) {
+            order_[v] = static_cast<Id>(v);
+        }
+        auto degree = [&graph](Id v) {
+            return (graph.neighbours_end(v) - graph.neighbours_begin(v)) +
+                   (graph.reverse_neighbours_end(v) - graph.reverse_neighbours_begin(v));
+        };
+        std::stable_sort(order_.begin(), order_.end(), [&degree](Id lhs, Id rhs) {
+            return degree(lhs) > degree(rhs);
+        });
+        std::vector<uint32_t> hubs(vertex_count);  // Номера хабов по вершинам.
+        for (size_t hub = 0; hub < vertex_count; ++hub) {
+            hubs[order_[hub]] = static_cast<uint32_t>(hub);
+        }
+
+        std::vector<std::vector<LabelEntry>> in_labels(vertex_count);
+        std::vector<std::vector<LabelEntry>> out_labels(vertex_count);
+        std::vector<std::vector<std::pair<Id, LabelEntry>>> new_in(thread_count);  // Метки пакета по потокам.
+        std::vector<std::vector<std::pair<Id, LabelEntry>>> new_out(thread_count);
+        std::atomic<bool> too_long{false};
+        ThreadBarrier barrier(thread_count);
+        run_in_threads(thread_count, [&](size_t thread_no) {
+            PrunedSearch search(graph, hubs);
+            size_t begin = 0;
+            while (begin < vertex_count) {
+                size_t end = std::min(vertex_count, begin + std::min(thread_count, 1 + begin / sequential_hubs_));
+                if (begin + thread_no < end) {
+                    auto hub = static_cast<uint32_t>(begin + thread_no);
+                    new_in[thread_no].clear();
+                    new_out[thread_no].clear();
+                    search.run(order_[hub], begin, false, out_labels, in_labels, new_in[thread_no]);
+                    search.run(order_[hub], begin, true, in_labels, out_labels, new_out[thread_no]);
+                }
+                barrier.wait();
+                if (thread_no == 0) {  // Метки упорядочены по хабам, если добавлять их в порядке хабов.
+                    for (size_t i = 0; i < end - begin; ++i) {
+                        for (auto& entry: new_in[i]) {
+                            in_labels[entry.first].push_back(entry.second);
+                        }
+                        for (auto& entry: new_out[i]) {
+                            out_labels[entry.first].push_back(entry.second);
+                        }
+                    }
+                }
+                barrier.wait();
+                begin = end;
+            }
+            if (search.too_long()) {
+                too_long = true;
+            }
+        });
+        if (too_long) {
+            throw std::length_error("Acquaintance chains are too long for the distance index.");
+        }
+        flatten(in_labels, in_);
+        flatten(out_labels, out_);
+    }
+
+    /**
+     * Загрузить индекс из файла, записанного save.
+     */
+    explicit DistanceIndex(const std::string& path) {
+        std::ifstream input(path, std::ios::binary | std::ios::ate);
+        uint64_t file_size = input ? static_cast<uint64_t>(input.tellg()) : 0;
+        input.seekg(0);
+        char magic[sizeof(file_magic_)] = {};
+        uint32_t header[2] = {};  // Версия и количество людей.
+        read_raw(input, magic, sizeof(magic));
+        read_raw(input, header, sizeof(header));
+        if (std::string(magic, sizeof(magic)) != std::string(file_magic_, sizeof(magic)) ||
+            header[0] != file_version_ || header[1] == no_distance) {
+            throw std::runtime_error("Not a distance index: " + path);
+        }
+        require_items(input, file_size, header[1], sizeof(Id));
+        order_.resize(header[1]);
+        read_raw(input, order_.data(), order_.size() * sizeof(Id));
+        std::vector<bool> is_hub(order_.size(), false);  // Порядок хабов должен быть перестановкой людей.
+        for (auto v: order_) {
+            if (v >= order_.size() || is_hub[v]) {
+                throw std::runtime_error("Corrupted distance index: " + path);
+            }
+            is_hub[v] = true;
+        }
+        load_labels(input, file_size, in_);
+        load_labels(input, file_size, out_);
+        if (input.peek() != std::ifstream::traits_type::eof()) {
+            throw std::runtime_error("Corrupted distance index: " + path);
+        }
+    }
+
+    DistanceIndex(const DistanceIndex&) = delete;
+    DistanceIndex& operator=(const DistanceIndex&) = delete;
+
+    /**
+     * Записать индекс в файл: заголовок, порядок хабов, затем входящие и исходящие метки - количество записей,
+     * смещения, номера хабов, расстояния и подсказки (числа в порядке байтов машины).
+     */
+    void save(const std::string& path) const {
+        std::ofstream output(path, std::ios::binary | std::ios::trunc);
+        uint32_t header[2] = {file_version_, static_cast<uint32_t>(vertex_count())};
+        output.write(file_magic_, sizeof(file_magic_));
+        write_raw(output, header, sizeof(header));
+        write_raw(output, order_.data(), order_.size() * sizeof(Id));
+        save_labels(output, in_);
+        save_labels(output, out_);
+        output.flush();
+        if (!output) {
+            throw std::runtime_error("Can't write distance index: " + path);
+        }
+    }
+
+    /**
+     * Количество людей.
+     */
+    size_t vertex_count() const {
+        return order_.size();
+    }
+
+    /**
+     * Общее количество записей во входящих и исходящих метках.
+     */
+    size_t label_entry_count() const {
+        return in_.hubs.size() + out_.hubs.size();
+    }
+
+    /**
+     * Память под индекс в байтах.
+     */
+    size_t memory_usage() const {
+        return order_.size() * sizeof(Id) + (in_.offsets.size() + out_.offsets.size()) * sizeof(uint64_t) +
+               label_entry_count() * (sizeof(uint32_t) + sizeof(uint8_t) + sizeof(Id));
+    }
+
+    /**
+     * Длина кратчайшей цепочки знакомых в рёбрах.
+     * @return Расстояние или no_distance, если цепочки нет или номер неизвестен.
+     */
+    uint32_t distance(Id first, Id second) const {
+        if (first >= vertex_count() || second >= vertex_count()) {
+            return no_distance;
+        }
+        return best_hub(first, second).first;
+    }
+
+    /**
+     * Поиск кратчайшей цепочки знакомых.
+     * @return Цепочка номеров или пустой вектор, если цепочки нет (как и у поиска в ширину, цепочки от человека
+     * к самому себе нет).
+     */
+    std::vector<Id> search_chain(Id first, Id second) const {
+        if (first >= vertex_count() || second >= vertex_count() || first == second) {
+            return {};
+        }
+        auto best = best_hub(first, second);
+        if (best.first == no_distance) {
+            return {};
+        }
+        Id hub = order_[best.second];
+        std::vector<Id> chain{first};
+        while (chain.back() != hub) {  // От начала к хабу по исходящим меткам.
+            chain.push_back(out_.hints[find_entry(out_, chain.back(), best.second)]);
+        }
+        std::vector<Id> tail{second};
+        while (tail.back() != hub) {  // От конца к хабу по входящим меткам.
+            tail.push_back(in_.hints[find_entry(in_, tail.back(), best.second)]);
+        }
+        chain.insert(chain.end(), tail.rbegin() + 1, tail.rend());
+        return chain;
+    }
+private:
+    /**
+     * Запись метки при построении.
+     */
+    struct LabelEntry {
+        uint32_t hub;  // Номер хаба в порядке обработки.
+        uint32_t distance;  // Расстояние до хаба (от хаба).
+        Id hint;  // Следующая вершина на пути к хабу (предыдущая на пути от хаба), у хаба - он сам.
+    };
+
+    /**
+     * Метки всех вершин одного направления подряд, каждая упорядочена по хабам.
+     */
+    struct Labels {
+        std::vector<uint64_t> offsets;  // Начала меток вершин, плюс общий конец.
+        std::vector<uint32_t> hubs;  // Номера хабов.
+        std::vector<uint8_t> distances;  // Расстояния до хабов (от хабов).
+        std::vector<Id> hints;  // Подсказки.
+    };
+
+    /**
+     * Поиск в ширину от хаба с отсечением по уже построенным меткам. Массивы размером с граф переиспользуются.
+     */
+    class PrunedSearch {
+    public:
+        /**
+         * @param graph Граф.
+         * @param hubs Номера хабов по вершинам.
+         */
+        PrunedSearch(const AcquaintanceGraph& graph, const std::vector<uint32_t>& hubs):
+                graph_(graph), hubs_(hubs), distances_(graph.vertex_count(), no_distance),
+                links_(graph.vertex_count()), root_label_(graph.vertex_count(), no_distance) {
+            queue_.reserve(graph.vertex_count());
+        }
+
+        /**
+         * @param root Вершина хаба.
+         * @param processed Количество хабов, чьи метки уже построены. Такие вершины не получают метку:
+         * расстояние до них всегда дают их собственные метки.
+         * @param backward false - поиск по знакомствам, строит входящие метки; true - по обратным, исходящие.
+         * @param root_labels Метки, которые дают расстояния от хаба (до хаба при обратном поиске).
+         * @param labels Метки, которые дополняет поиск. Не меняются во время поиска.
+         * @param new_entries Новые записи меток: (вершина, запись).
+         */
+        void run(Id root, size_t processed, bool backward, const std::vector<std::vector<LabelEntry>>& root_labels,
+                 const std::vector<std::vector<LabelEntry>>& labels,
+                 std::vector<std::pair<Id, LabelEntry>>& new_entries) {
+            for (auto& entry: root_labels[root]) {
+                root_label_[entry.hub] = entry.distance;
+            }
+            queue_.assign(1, root);
+            distances_[root] = 0;
+            links_[root] = root;
+            for (size_t head = 0; head < queue_.size(); ++head) {
+                Id v = queue_[head];
+                uint32_t distance = distances_[v];
+                if (hubs_[v] < processed || covered(labels[v], distance)) {
+                    continue;
+                }
+                new_entries.emplace_back(v, LabelEntry{hubs_[root], distance, links_[v]});
+                auto begin = backward ? graph_.reverse_neighbours_begin(v) : graph_.neighbours_begin(v);
+                auto end = backward ? graph_.reverse_neighbours_end(v) : graph_.neighbours_end(v);
+                for (auto it = begin; it != end; ++it) {
+                    if (distances_[*it] != no_distance) {
+                        continue;
+                    }
+                    if (distance == max_distance) {
+                        too_long_ = true;
+                        break;
+                    }
+                    distances_[*it] = distance + 1;
+                    links_[*it] = v;
+                    queue_.push_back(*it);
+                }
+            }
+            for (auto v: queue_) {
+                distances_[v] = no_distance;
+            }
+            for (auto& entry: root_labels[root]) {
+                root_label_[entry.hub] = no_distance;
+            }
+        }
+
+        /**
+         * Встретилась ли вершина дальше max_distance от корня.
+         */
+        bool too_long() const {
+            return too_long_;
+        }
+    private:
+        /**
+         * Дают ли метка вершины и метка корня расстояние не больше заданного.
+         */
+        bool covered(const std::vector<LabelEntry>& label, uint32_t distance) const {
+            for (auto& entry: label) {
+                if (root_label_[entry.hub] != no_distance && root_label_[entry.hub] + entry.distance <= distance) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        const AcquaintanceGraph& graph_;  // Граф.
+        const std::vector<uint32_t>& hubs_;  // Номера хабов по вершинам.
+        std::vector<uint32_t> distances_;  // Расстояния от корня, no_distance - вершина не посещена.
+        std::vector<Id> links_;  // Вершины, из которых посещены вершины.
+        std::vector<uint32_t> root_label_;  // Метка корня: расстояния по номерам хабов.
+        std::vector<Id> queue_;  // Очередь посещения вершин.
+        bool too_long_ = false;  // Встретилась вершина дальше max_distance от корня.
+    };
+
+    /**
+     * Хаб с наименьшей суммой расстояний: слияние исходящей метки first и входящей метки second.
+     * @return Расстояние (no_distance, если общих хабов нет) и номер хаба.
+     */
+    std::pair<uint32_t, uint32_t> best_hub(Id first, Id second) const {
+        std::pair<uint32_t, uint32_t> best{no_distance, 0};
+        uint64_t out = out_.offsets[first];
+        uint64_t out_end = out_.offsets[first + 1];
+        uint64_t in = in_.offsets[second];
+        uint64_t in_end = in_.offsets[second + 1];
+        while (out != out_end && in != in_end) {
+            uint32_t out_hub = out_.hubs[out];
+            uint32_t in_hub = in_.hubs[in];
+            if (out_hub == in_hub) {
+                uint32_t distance = uint32_t{out_.distances[out]} + in_.distances[in];
+                if (distance < best.first) {
+                    best = {distance, out_hub};
+                }
+            }
+            out += out_hub <= in_hub;
+            in += in_hub <= out_hub;
+        }
+        return best;
+    }
+
+    /**
+     * Позиция записи метки вершины для заданного хаба. Запись должна существовать.
+     */
+    static uint64_t find_entry(const Labels& labels, Id v, uint32_t hub) {
+        return std::lower_bound(labels.hubs.begin() + labels.offsets[v], labels.hubs.begin() + labels.offsets[v + 1],
+                                hub) - labels.hubs.begin();
+    }
+
+    /**
+     * Сложить метки всех вершин подряд, освобождая метки построения.
+     */
+    static void flatten(std::vector<std::vector<LabelEntry>>& labels, Labels& result) {
+        result.offsets.assign(1, 0);
+        result.offsets.reserve(labels.size() + 1);
+        for (auto& label: labels) {
+            result.offsets.push_back(result.offsets.back() + label.size());
+        }
+        result.hubs.reserve(result.offsets.back());
+        result.distances.reserve(result.offsets.back());
+        result.hints.reserve(result.offsets.back());
+        for (auto& label: labels) {
+            for (auto& entry: label) {
+                result.hubs.push_back(entry.hub);
+                result.distances.push_back(static_cast<uint8_t>(entry.distance));
+                result.hints.push_back(entry.hint);
+            }
+            std::vector<LabelEntry>().swap(label);
+        }
+    }
+
+    /**
+     * Записать метки одного направления.
+     */
+    static void save_labels(std::ofstream& output, const Labels& labels) {
+        uint64_t entry_count = labels.hubs.size();
+        write_raw(output, &entry_count, sizeof(entry_count));
+        write_raw(output, labels.offsets.data(), labels.offsets.size() * sizeof(uint64_t));
+        write_raw(output, labels.hubs.data(), entry_count * sizeof(uint32_t));
+        write_raw(output, labels.distances.data(), entry_count * sizeof(uint8_t));
+        write_raw(output, labels.hints.data(), entry_count * sizeof(Id));
+    }
+
+    /**
+     * Прочитать метки одного направления и проверить их согласованность.
+     * Кроме размеров проверяется, что хабы в метке каждой вершины возрастают, а подсказки ведут к хабу:
+     * запись с расстоянием 0 - у самого хаба, а у подсказки записи с расстоянием d есть тот же хаб
+     * с расстоянием d - 1. Поэтому восстановление цепочки по подсказкам не выходит за массивы и не зацикливается.
+     */
+    void load_labels(std::ifstream& input, uint64_t file_size, Labels& labels) const {
+        uint64_t entry_count = 0;
+        read_raw(input, &entry_count, sizeof(entry_count));
+        require_items(input, file_size, vertex_count() + 1, sizeof(uint64_t));
+        labels.offsets.resize(vertex_count() + 1);
+        read_raw(input, labels.offsets.data(), labels.offsets.size() * sizeof(uint64_t));
+        if (labels.offsets.front() != 0 || labels.offsets.back() != entry_count ||
+            !std::is_sorted(labels.offsets.begin(), labels.offsets.end())) {
+            throw std::runtime_error("Corrupted distance index.");
+        }
+        require_items(input, file_size, entry_count, sizeof(uint32_t) + sizeof(uint8_t) + sizeof(Id));
+        labels.hubs.resize(entry_count);
+        labels.distances.resize(entry_count);
+        labels.hints.resize(entry_count);
+        read_raw(input, labels.hubs.data(), entry_count * sizeof(uint32_t));
+        read_raw(input, labels.distances.data(), entry_count * sizeof(uint8_t));
+        read_raw(input, labels.hints.data(), entry_count * sizeof(Id));
+        for (size_t v = 0; v < vertex_count(); ++v) {
+            for (uint64_t i = labels.offsets[v]; i < labels.offsets[v + 1]; ++i) {
+                uint32_t hub = labels.hubs[i];
+                Id hint = labels.hints[i];
+                bool valid = hub < vertex_count() && hint < vertex_count() &&
+                             (i == labels.offsets[v] || labels.hubs[i - 1] < hub);
+                if (valid && labels.distances[i] == 0) {
+                    valid = order_[hub] == v && hint == v;
+                } else if (valid) {
+                    auto entry = find_entry(labels, hint, hub);
+                    valid = entry < labels.offsets[hint + 1] && labels.hubs[entry] == hub &&
+                            labels.distances[entry] + 1 == labels.distances[i];
+                }
+                if (!valid) {
+                    throw std::runtime_error("Corrupted distance index.");
+                }
+            }
+        }
+    }
+
+    /**
+     * Убедиться, что в файле после текущей позиции хватит байтов на count элементов, до выделения памяти под них.
+     */
+    static void require_items(std::ifstream& input, uint64_t file_size, uint64_t count, size_t item_size) {
+        auto position = input.tellg();
+        if (position < 0 || static_cast<uint64_t>(position) > file_size ||
+            count > (file_size - static_cast<uint64_t>(position)) / item_size) {
+            throw std::runtime_error("Truncated distance index.");
+        }
+    }
+
+    /**
+     * Записать в файл заданное количество байтов.
+     */
+    static void write_raw(std::ofstream& output, const void* data, size_t size) {
+        output.write(static_cast<const char*>(data), size);
+    }
+
+    /**
+     * Прочитать из файла заданное количество байтов.
+     */
+    static void read_raw(std::ifstream& input, void* data, size_t size) {
+        if (!input.read(static_cast<char*>(data), size)) {
+            throw std::runtime_error("Truncated distance index.");
+        }
+    }
+
+    static const size_t sequential_hubs_ = 64;  // Через сколько хабов пакет растёт на единицу.
+    static constexpr const char file_magic_[8] = {'A', 'C', 'Q', 'I', 'N', 'D', 'E', 'X'};  // Начало файла.
+    static const uint32_t file_version_ = 1;  // Версия формата файла.
+
+    std::vector<Id> order_;  // Вершины хабов по номерам хабов.
+    Labels in_;  // Входящие метки: от каких хабов можно дойти до вершины.
+    Labels out_;  // Исходящие метки: до каких хабов можно дойти от вершины.
+};
+
+const uint32_t DistanceIndex::no_distance;
+const uint32_t DistanceIndex::max_distance;
+constexpr const char DistanceIndex::file_magic_[8];
+
 void test1() {
     std::map<std::string, std::vector<std::string>> peoples {
             {"a", {"b"}},
@@ -106,9 +2554,945 @@ void test3() {
     assert(chain == true_chain);
 }
 
-int main(int, char *[]) {
+void test4() {
+    std::map<std::string, std::vector<std::string>> peoples {
+            {"a", {"b", "c"}},
+            {"b", {"c", "d"}},
+            {"c", {"d", "a"}},
+            {"d", {"e", "b"}},
+    };
+    AcquaintanceGraph graph(peoples);
+    assert(graph.vertex_count() == 5);
+    assert(graph.edge_count() == 8);
+    std::vector<std::string> true_chain{"a", "b", "d", "e"};
+    assert(graph.search_chain("a", "e") == true_chain);
+    AcquaintanceGraph::SearchWorkspace workspace;
+    assert(graph.search_chain_bidirectional("a", "e", workspace).size() == true_chain.size());
+    assert(graph.search_chain_bidirectional("e", "a", workspace).empty());
+    assert(graph.search_chain("e", "a").empty());  // У "e" нет знакомых.
+    assert(graph.search_chain("a", "z").empty());  // "z" нет в графе.
+    assert(graph.find("z") == AcquaintanceGraph::no_id);
+}
+
+void test5() {
+    std::mt19937 rd(19);
+    for (int graph_no = 0; graph_no < 20; ++graph_no) {
+        std::map<std::string, std::vector<std::string>> peoples;
+        size_t people_count = 2 + rd() % 200;
+        auto random_name = [&]() { return "person" + std::to_string(rd() % (people_count + 5)); };
+        for (size_t i = 0; i < people_count; ++i) {
+            auto& acquaintances = peoples[random_name()];
+            for (size_t degree = rd() % 4; degree > 0; --degree) {
+                acquaintances.push_back(random_name());
+            }
+        }
+        for (size_t i = 0; i < people_count + 5; ++i) {
+            peoples["person" + std::to_string(i)];  // searchAcquaintancesChain требует, чтобы все были ключами.
+        }
+        AcquaintanceGraph graph(peoples);
+        AcquaintanceGraph::SearchWorkspace workspace;
+        for (int query = 0; query < 200; ++query) {
+            auto first = std::next(peoples.begin(), rd() % peoples.size())->first;
+            auto second = rd() % 10 == 0 ? std::string("nobody") : random_name();
+            auto chain = searchAcquaintancesChain(peoples, first, second);
+            assert(graph.search_chain(first, second, workspace) == chain);
+            auto bidirectional_chain = graph.search_chain_bidirectional(first, second, workspace);
+            assert(bidirectional_chain.size() == chain.size());
+            for (size_t i = 0; i + 1 < bidirectional_chain.size(); ++i) {  // Каждое звено - знакомство.
+                auto& acquaintances = peoples.at(bidirectional_chain[i]);
+                assert(std::find(acquaintances.begin(), acquaintances.end(), bidirectional_chain[i + 1]) !=
+                       acquaintances.end());
+            }
+            assert(bidirectional_chain.empty() || (bidirectional_chain.front() == first &&
+                                                   bidirectional_chain.back() == second));
+        }
+    }
+}
+
+void test6() {
+    std::mt19937 rd(21);
+    for (int graph_no = 0; graph_no < 6; ++graph_no) {
+        AcquaintanceGraph::Id vertex_count = 500 + rd() % 3000;
+        size_t degree = graph_no % 2 == 0 ? 2 : 24;  // Плотные графы обрабатываются и снизу вверх.
+        std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> edges;
+        for (size_t i = 0; i < vertex_count * degree; ++i) {
+            edges.emplace_back(rd() % vertex_count, rd() % vertex_count);
+        }
+        AcquaintanceGraph graph(vertex_count, edges);
+        AcquaintanceGraph::SearchWorkspace workspace;
+        ParallelBfs parallel(graph, 4);
+        ParallelBfs top_down(graph, 3, false);
+        uint32_t bottom_up_levels = 0;
+        for (int query = 0; query < 50; ++query) {
+            AcquaintanceGraph::Id first = rd() % vertex_count;
+            AcquaintanceGraph::Id second = rd() % vertex_count;
+            auto chain = graph.search_chain(first, second, workspace);
+            for (auto bfs: {&parallel, &top_down}) {
+                auto parallel_chain = bfs->search_chain(first, second);
+                assert(parallel_chain.size() == chain.size());
+                for (size_t i = 0; i + 1 < parallel_chain.size(); ++i) {
+                    assert(std::find(graph.neighbours_begin(parallel_chain[i]), graph.neighbours_end(parallel_chain[i]),
+                                     parallel_chain[i + 1]) != graph.neighbours_end(parallel_chain[i]));
+                }
+            }
+            bottom_up_levels += parallel.last_stats().bottom_up_levels;
+            assert(top_down.last_stats().bottom_up_levels == 0);
+
+            std::vector<bool> seen(vertex_count);  // Достижимые вершины.
+            std::vector<AcquaintanceGraph::Id> queue{first};
+            seen[first] = true;
+            for (size_t head = 0; head < queue.size(); ++head) {
+                for (auto it = graph.neighbours_begin(queue[head]); it != graph.neighbours_end(queue[head]); ++it) {
+                    if (!seen[*it]) {
+                        seen[*it] = true;
+                        queue.push_back(*it);
+                    }
+                }
+            }
+            assert(parallel.traverse(first).reached_vertices == queue.size());
+        }
+        assert(degree == 2 || bottom_up_levels > 0);
+    }
+}
+
+void test7() {
+    std::mt19937 rd(22);
+    for (int graph_no = 0; graph_no < 6; ++graph_no) {
+        AcquaintanceGraph::Id vertex_count = 100 + rd() % 2000;
+        size_t degree = 1 + graph_no % 3 * 3;
+        std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> edges;
+        for (size_t i = 0; i < vertex_count * degree; ++i) {
+            edges.emplace_back(rd() % vertex_count, rd() % vertex_count);
+        }
+        AcquaintanceGraph graph(vertex_count, edges);
+        AcquaintanceGraph::SearchWorkspace workspace;
+        BatchBfs batch(graph);
+        std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> pairs;
+        for (size_t i = 0; i < 300; ++i) {  // Больше batch_sources разных начал, многие начала повторяются.
+            AcquaintanceGraph::Id first = rd() % 2 == 0 ? rd() % 20 : rd() % vertex_count;
+            AcquaintanceGraph::Id second = rd() % 30 == 0 ? first : rd() % (vertex_count + 3);
+            pairs.emplace_back(first, second);
+        }
+        auto chains = batch.search_chains(pairs);
+        BatchBfs short_batch(graph, 2);  // Большинство цепочек длиннее ограничения и ищутся по одной.
+        auto short_chains = short_batch.search_chains(pairs);
+        assert(chains.size() == pairs.size() && short_chains.size() == pairs.size());
+        assert(short_batch.max_levels() == 3 && short_batch.fallback_count() > 0);
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            auto chain = graph.search_chain(pairs[i].first, pairs[i].second, workspace);
+            for (const auto& found : {chains[i], short_chains[i]}) {
+                assert(found.size() == chain.size());  // Кратчайшая, хотя может отличаться от последовательной.
+                assert(found.empty() || (found.front() == pairs[i].first && found.back() == pairs[i].second));
+                for (size_t j = 0; j + 1 < found.size(); ++j) {
+                    assert(std::find(graph.neighbours_begin(found[j]), graph.neighbours_end(found[j]),
+                                     found[j + 1]) != graph.neighbours_end(found[j]));
+                }
+            }
+        }
+    }
+
+    std::map<std::string, std::vector<std::string>> peoples {
+            {"a", {"b", "c"}},
+            {"b", {"c", "d"}},
+            {"c", {"d", "a"}},
+            {"d", {"e", "b"}},
+    };
+    const AcquaintanceGraph::Id path_length = 3000;  // Цепочки длиннее ограничения уровней ищутся по одной.
+    std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> path_edges;
+    for (AcquaintanceGraph::Id v = 0; v + 1 < path_length; ++v) {
+        path_edges.emplace_back(v, v + 1);
+    }
+    AcquaintanceGraph path(path_length, path_edges);
+    AcquaintanceGraph::SearchWorkspace workspace;
+    BatchBfs path_batch(path);
+    std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> path_pairs{
+            {0, path_length - 1}, {0, 5}, {0, BatchBfs::default_level_limit}, {0, BatchBfs::default_level_limit + 1},
+            {100, 2000}, {path_length - 1, 0}};
+    auto path_chains = path_batch.search_chains(path_pairs);
+    assert(path_batch.max_levels() == BatchBfs::default_level_limit + 1);
+    assert(path_batch.fallback_count() == 4);
+    for (size_t i = 0; i < path_pairs.size(); ++i) {
+        auto chain = path.search_chain(path_pairs[i].first, path_pairs[i].second, workspace);
+        assert(path_chains[i] == chain);
+    }
+
+    AcquaintanceGraph graph(peoples);
+    BatchBfs batch(graph);
+    auto chains = batch.search_chains(std::vector<std::pair<std::string, std::string>>{
+            {"a", "e"}, {"e", "a"}, {"c", "b"}, {"a", "z"}, {"a", "a"}});
+    assert(chains[0] == (std::vector<std::string>{"a", "b", "d", "e"}));
+    assert(chains[1].empty());
+    assert(chains[2] == (std::vector<std::string>{"c", "a", "b"}));
+    assert(chains[3].empty());
+    assert(chains[4].empty());
+}
+
+void test8() {
+    const std::string path = "medium2_test_index.bin";
+    std::mt19937 rd(23);
+    for (int graph_no = 0; graph_no < 8; ++graph_no) {
+        AcquaintanceGraph::Id vertex_count = 50 + rd() % 400;
+        size_t degree = 1 + graph_no % 4;
+        std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> edges;
+        for (size_t i = 0; i < vertex_count * degree; ++i) {
+            edges.emplace_back(rd() % vertex_count, rd() % vertex_count);
+        }
+        AcquaintanceGraph graph(vertex_count, edges);
+        AcquaintanceGraph::SearchWorkspace workspace;
+        DistanceIndex index(graph, 1 + graph_no % 4);  // Метки, построенные пакетами, тоже верны.
+        index.save(path);
+        DistanceIndex loaded(path);
+        assert(loaded.label_entry_count() == index.label_entry_count());
+        for (AcquaintanceGraph::Id first = 0; first < vertex_count; ++first) {
+            for (AcquaintanceGraph::Id second = 0; second < vertex_count; second += 1 + rd() % 3) {
+                auto chain = graph.search_chain(first, second, workspace);
+                auto distance = index.distance(first, second);
+                if (first == second) {
+                    assert(distance == 0);
+                } else {
+                    assert(distance == (chain.empty() ? DistanceIndex::no_distance : chain.size() - 1));
+                }
+                auto index_chain = loaded.search_chain(first, second);
+                assert(index_chain.size() == chain.size());
+                assert(index_chain.empty() || (index_chain.front() == first && index_chain.back() == second));
+                for (size_t i = 0; i + 1 < index_chain.size(); ++i) {
+                    assert(std::find(graph.neighbours_begin(index_chain[i]), graph.neighbours_end(index_chain[i]),
+                                     index_chain[i + 1]) != graph.neighbours_end(index_chain[i]));
+                }
+            }
+        }
+        assert(index.distance(0, vertex_count) == DistanceIndex::no_distance);
+        assert(index.search_chain(vertex_count, 0).empty());
+    }
+
+    std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> path_edges;
+    for (AcquaintanceGraph::Id v = 0; v < DistanceIndex::max_distance; ++v) {
+        path_edges.emplace_back(v, v + 1);
+    }
+    path_edges.emplace_back(0, 0);  // Петли делают начало пути первым хабом.
+    path_edges.emplace_back(0, 0);
+    AcquaintanceGraph longest_path(DistanceIndex::max_distance + 1, path_edges);
+    assert(DistanceIndex(longest_path, 2).distance(0, DistanceIndex::max_distance) == DistanceIndex::max_distance);
+    path_edges.emplace_back(DistanceIndex::max_distance, DistanceIndex::max_distance + 1);
+    AcquaintanceGraph too_long_path(DistanceIndex::max_distance + 2, path_edges);
+    bool thrown = false;
+    try {
+        DistanceIndex too_long_index(too_long_path);
+    } catch (const std::length_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "ACQINDEX";
+    thrown = false;
+    try {
+        DistanceIndex truncated(path);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    DistanceIndex(longest_path, 2).save(path);  // Испорченные файлы: размеры, номера хабов и подсказки.
+    std::string bytes;
+    {
+        std::ifstream input(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+    auto read_word = [&bytes](size_t position) {
+        uint32_t value = 0;
+        std::memcpy(&value, bytes.data() + position, sizeof(value));
+        return value;
+    };
+    uint32_t vertex_count = read_word(12);
+    size_t in_labels = 16 + vertex_count * sizeof(uint32_t);  // Входящие метки идут после порядка хабов.
+    uint64_t entry_count = 0;
+    std::memcpy(&entry_count, bytes.data() + in_labels, sizeof(entry_count));
+    size_t hubs = in_labels + 8 + (vertex_count + 1) * sizeof(uint64_t);
+    size_t distances = hubs + entry_count * sizeof(uint32_t);
+    size_t hints = distances + entry_count;
+    size_t far_entry = 0;  // Запись с ненулевым расстоянием и вершина, к метке которой она относится.
+    while (bytes[distances + far_entry] == 0) {
+        ++far_entry;
+    }
+    uint32_t far_vertex = 0;
+    uint64_t offset = 0;
+    for (; far_vertex < vertex_count; ++far_vertex) {
+        std::memcpy(&offset, bytes.data() + in_labels + 8 + (far_vertex + 1) * sizeof(uint64_t), sizeof(offset));
+        if (offset > far_entry) {
+            break;
+        }
+    }
+    std::vector<std::pair<size_t, uint32_t>> corruptions{
+            {12, UINT32_MAX - 1},  // Количество людей больше файла.
+            {16, read_word(20)},  // Порядок хабов - не перестановка.
+            {hubs, vertex_count},  // Номер хаба вне индекса.
+            {hints, vertex_count},  // Подсказка вне индекса.
+            {hints + far_entry * sizeof(uint32_t), far_vertex},  // Подсказка на саму вершину: цикл.
+    };
+    for (auto& corruption: corruptions) {
+        std::string corrupted = bytes;
+        std::memcpy(&corrupted[corruption.first], &corruption.second, sizeof(corruption.second));
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << corrupted;
+        thrown = false;
+        try {
+            DistanceIndex corrupted_index(path);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    std::remove(path.c_str());
+}
+
+void test9() {
+    const std::string edge_list_path = "medium2_test_edges.txt";
+    const std::string cache_path = "medium2_test_graph.bin";
+    std::mt19937 rd(24);
+    for (int graph_no = 0; graph_no < 6; ++graph_no) {
+        std::map<std::string, std::vector<std::string>> peoples;
+        size_t people_count = 1 + rd() % 300;
+        auto random_name = [&]() { return "Иванов Иван " + std::to_string(rd() % people_count); };
+        std::vector<std::pair<std::string, std::string>> lines;  // Знакомства в порядке файла.
+        for (size_t i = 0; i < people_count * 3; ++i) {
+            auto person = random_name();
+            auto acquaintance = rd() % 5 == 0 ? std::string() : random_name();
+            auto& acquaintances = peoples[person];
+            if (!acquaintance.empty()) {
+                acquaintances.push_back(acquaintance);
+            }
+            lines.emplace_back(person, acquaintance);
+        }
+        for (size_t i = 0; i < people_count; ++i) {
+            peoples["Иванов Иван " + std::to_string(i)];
+        }
+        {
+            std::ofstream output(edge_list_path, std::ios::binary | std::ios::trunc);
+            for (auto& line: lines) {  // Разные разделители строк, пустые поля и строки.
+                output << line.first << (rd() % 2 || !line.second.empty() ? "\t" : "") << line.second << (rd() % 2 ? "\t\r\n" : "\n");
+                if (rd() % 10 == 0) {
+                    output << (rd() % 2 ? "\n" : "\t\r\n");
+                }
+            }
+            for (size_t i = 0; i < people_count; ++i) {
+                output << "Иванов Иван " << i << "\n";
+            }
+        }
+        for (size_t thread_count: {1, 3, 8}) {
+            auto graph = AcquaintanceGraph::load_edge_list(edge_list_path, thread_count);
+            assert(graph.vertex_count() == peoples.size());
+            assert(graph.edge_count() == lines.size() - std::count_if(lines.begin(), lines.end(), [](
+                    const std::pair<std::string, std::string>& line) { return line.second.empty(); }));
+            graph.save(cache_path);
+            auto cached = AcquaintanceGraph::load(cache_path);
+            assert(cached.image_size() == graph.image_size());
+            assert(cached.find("Иванов Иван " + std::to_string(people_count)) == AcquaintanceGraph::no_id);
+            AcquaintanceGraph::SearchWorkspace workspace;
+            for (int query = 0; query < 100; ++query) {
+                auto first = random_name();
+                auto second = random_name();
+                auto chain = searchAcquaintancesChain(peoples, first, second);
+                assert(graph.search_chain(first, second, workspace) == chain);  // Знакомые в порядке файла.
+                assert(cached.search_chain(first, second, workspace) == chain);
+                assert(cached.name(cached.find(first)) == first);
+            }
+        }
+    }
+
+    std::ofstream(edge_list_path, std::ios::binary | std::ios::trunc);  // Пустой файл - пустой граф.
+    assert(AcquaintanceGraph::load_edge_list(edge_list_path, 4).vertex_count() == 0);
+    std::remove(edge_list_path.c_str());
+
+    AcquaintanceGraph unnamed(3, {{0, 1}, {1, 2}});
+    unnamed.save(cache_path);
+    auto cached = AcquaintanceGraph::load(cache_path);
+    AcquaintanceGraph::SearchWorkspace workspace;
+    assert(cached.search_chain_bidirectional(0, 2, workspace).size() == 3);
+    bool thrown = false;
+    try {
+        cached.name(0);
+    } catch (const std::out_of_range&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::ofstream(cache_path, std::ios::binary | std::ios::app) << "tail";
+    thrown = false;
+    try {
+        AcquaintanceGraph::load(cache_path);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    auto patch_cache = [&cache_path](long position, const void* value, size_t size) {
+        std::fstream file(cache_path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(position).write(static_cast<const char*>(value), size);
+        assert(file.good());
+    };
+    auto is_rejected = [&cache_path]() {
+        try {
+            AcquaintanceGraph::load(cache_path);
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    const long name_bytes_position = 24;  // magic, версия, количество людей, количество знакомств.
+    const long named_position = 40;
+    const long offsets_position = 48;  // Заголовок образа: 48 байтов.
+    const long neighbours_position = offsets_position + 16;  // Начала списков: 4 числа по 4 байта.
+    unnamed.save(cache_path);
+    uint32_t outside = 7;
+    patch_cache(neighbours_position, &outside, sizeof(outside));  // Знакомый за пределами графа.
+    assert(is_rejected());
+    unnamed.save(cache_path);
+    uint32_t decreasing = 0;
+    patch_cache(offsets_position + 8, &decreasing, sizeof(decreasing));  // Начала списков: 0, 1, 0, 2.
+    assert(is_rejected());
+    unnamed.save(cache_path);
+    uint64_t named = 1;
+    uint64_t name_bytes = UINT64_MAX;  // Размер образа не помещается в 64 бита.
+    patch_cache(named_position, &named, sizeof(named));
+    patch_cache(name_bytes_position, &name_bytes, sizeof(name_bytes));
+    assert(is_rejected());
+
+    std::ofstream(edge_list_path, std::ios::binary | std::ios::trunc) << "a\tb\nb\tc\n";
+    auto rebuilt = AcquaintanceGraph::load_or_build(cache_path, edge_list_path, 2);  // Кэш повреждён.
+    assert(rebuilt.search_chain("a", "c", workspace) == (std::vector<std::string>{"a", "b", "c"}));
+    auto reloaded = AcquaintanceGraph::load(cache_path);  // Кэш перезаписан.
+    assert(reloaded.search_chain("a", "c", workspace) == (std::vector<std::string>{"a", "b", "c"}));
+    std::remove(cache_path.c_str());
+    auto built = AcquaintanceGraph::load_or_build(cache_path, edge_list_path, 2);  // Кэша нет.
+    assert(built.vertex_count() == 3 && AcquaintanceGraph::load(cache_path).vertex_count() == 3);
+    std::remove(edge_list_path.c_str());
+    std::remove(cache_path.c_str());
+}
+
+void test10() {
+    std::mt19937 rd(25);
+    for (int graph_no = 0; graph_no < 8; ++graph_no) {
+        AcquaintanceGraph::Id vertex_count = graph_no == 0 ? 0 : graph_no == 1 ? 5000000 :  // Разности в 4 байта.
+                                             1 + rd() % (graph_no % 2 == 0 ? 300 : 100000);
+        std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> edges;
+        for (size_t i = 0; vertex_count > 0 && i < 5000; ++i) {  // Есть повторяющиеся знакомства.
+            edges.emplace_back(rd() % vertex_count, rd() % std::min<AcquaintanceGraph::Id>(vertex_count, 1000));
+            edges.emplace_back(rd() % std::min<AcquaintanceGraph::Id>(vertex_count, 1000), rd() % vertex_count);
+        }
+        AcquaintanceGraph graph(vertex_count, edges, 3);
+        CompressedAdjacency compressed(graph, false, 1 + graph_no % 4);
+        CompressedAdjacency reverse(graph, true, 2);
+        assert(compressed.vertex_count() == vertex_count && compressed.edge_count() == edges.size());
+        std::vector<AcquaintanceGraph::Id> decoded;
+        for (AcquaintanceGraph::Id v = 0; v < vertex_count; v += 1 + rd() % 50) {
+            std::vector<AcquaintanceGraph::Id> list(graph.neighbours_begin(v), graph.neighbours_end(v));
+            std::sort(list.begin(), list.end());
+            decoded.clear();
+            compressed.for_each_neighbour(v, [&decoded](AcquaintanceGraph::Id to) { decoded.push_back(to); });
+            assert(decoded == list);
+            list.assign(graph.reverse_neighbours_begin(v), graph.reverse_neighbours_end(v));
+            std::sort(list.begin(), list.end());
+            decoded.clear();
+            reverse.for_each_neighbour(v, [&decoded](AcquaintanceGraph::Id to) { decoded.push_back(to); });
+            assert(decoded == list);
+        }
+        AcquaintanceGraph::SearchWorkspace workspace;
+        AcquaintanceGraph::SearchWorkspace compressed_workspace;
+        for (int query = 0; vertex_count > 0 && query < 50; ++query) {
+            AcquaintanceGraph::Id first = rd() % std::min<AcquaintanceGraph::Id>(vertex_count, 1000);
+            AcquaintanceGraph::Id second = rd() % std::min<AcquaintanceGraph::Id>(vertex_count, 1000);
+            auto chain = graph.search_chain(first, second, workspace);
+            for (bool bidirectional: {false, true}) {
+                auto compressed_chain = bidirectional ?
+                        CompressedAdjacency::search_chain_bidirectional(compressed, reverse, first, second,
+                                                                        compressed_workspace) :
+                        compressed.search_chain(first, second, compressed_workspace);
+                assert(compressed_chain.size() == chain.size());
+                assert(compressed_chain.empty() ||
+                       (compressed_chain.front() == first && compressed_chain.back() == second));
+                for (size_t i = 0; i + 1 < compressed_chain.size(); ++i) {
+                    assert(std::find(graph.neighbours_begin(compressed_chain[i]),
+                                     graph.neighbours_end(compressed_chain[i]),
+                                     compressed_chain[i + 1]) != graph.neighbours_end(compressed_chain[i]));
+                }
+            }
+        }
+        bool thrown = false;  // Поиск по обратным спискам шёл бы по перевёрнутому графу.
+        try {
+            reverse.search_chain(0, 0, compressed_workspace);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+        thrown = false;
+        try {
+            CompressedAdjacency::search_chain_bidirectional(compressed, compressed, 0, 0, compressed_workspace);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void run_all_tests() {
     test1();
     test2();
     test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+}
+
+
+// Бенчмарки.
+
+/**
+ * Параметры бенчмарков.
+ */
+struct BenchmarkOptions {
+    uint32_t scale = 20;  // Людей 2^scale.
+    uint32_t edge_factor = 16;  // Знакомств на человека в среднем.
+    std::vector<size_t> threads;  // Количества потоков (по умолчанию 1, 2, 4, ... до числа ядер).
+    size_t sources = 8;  // Количество обходов для каждого замера.
+    size_t queries = 256;  // Количество запросов цепочек для сравнения пакетного поиска с поочерёдным.
+    uint32_t index_scale = 16;  // Людей 2^index_scale в графе для индекса расстояний (0 - не строить индекс).
+    uint32_t load_scale = 18;  // Людей 2^load_scale в текстовом списке знакомств для загрузки (0 - не загружать).
+    uint64_t seed = 2021;  // Зерно генератора.
+};
+
+/**
+ * Сгенерировать граф R-MAT (как в Graph500): рёбра попадают в квадранты матрицы смежности с вероятностями
+ * 0.57, 0.19, 0.19, 0.05, поэтому степени распределены по степенному закону, а диаметр мал, как у социальных графов.
+ * Номера вершин перемешиваются, чтобы вершины большой степени не шли подряд.
+ */
+std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> generate_rmat_edges(uint32_t scale,
+                                                                                          uint64_t edge_count,
+                                                                                          uint64_t seed) {
+    std::mt19937_64 rd(seed);
+    std::uniform_real_distribution<double> probability(0, 1);
+    std::vector<AcquaintanceGraph::Id> permutation(size_t{1} << scale);
+    for (size_t i = 0; i < permutation.size(); ++i) {
+        permutation[i] = static_cast<AcquaintanceGraph::Id>(i);
+    }
+    std::shuffle(permutation.begin(), permutation.end(), rd);
+    std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> edges;
+    edges.reserve(edge_count);
+    for (uint64_t i = 0; i < edge_count; ++i) {
+        uint32_t from = 0;
+        uint32_t to = 0;
+        for (uint32_t bit = 0; bit < scale; ++bit) {
+            double p = probability(rd);
+            uint32_t from_bit = p >= 0.57 + 0.19 ? 1 : 0;  // Нижние квадранты: c и d.
+            uint32_t to_bit = (p >= 0.57 && p < 0.57 + 0.19) || p >= 0.57 + 0.19 + 0.19 ? 1 : 0;  // Правые: b и d.
+            from |= from_bit << bit;
+            to |= to_bit << bit;
+        }
+        edges.emplace_back(permutation[from], permutation[to]);
+    }
+    return edges;
+}
+
+/**
+ * Замерить обходы графа и вывести пройденные рёбра в секунду (TEPS) для разных количеств потоков.
+ */
+void benchmark_parallel_bfs(const AcquaintanceGraph& graph, const BenchmarkOptions& options) {
+    std::printf("%8s %10s %8s %12s %14s %14s\n", "threads", "mode", "levels", "seconds", "MTEPS", "examined/edge");
+    std::mt19937_64 rd(options.seed);
+    std::vector<AcquaintanceGraph::Id> sources;
+    while (sources.size() < options.sources) {
+        auto source = static_cast<AcquaintanceGraph::Id>(rd() % graph.vertex_count());
+        if (graph.neighbours_begin(source) != graph.neighbours_end(source)) {  // Изолированные вершины неинтересны.
+            sources.push_back(source);
+        }
+    }
+    for (auto threads: options.threads) {
+        for (bool direction_optimizing: {false, true}) {
+            ParallelBfs bfs(graph, threads, direction_optimizing);
+            ParallelBfs::Stats total;
+            for (auto source: sources) {
+                auto& stats = bfs.traverse(source);
+                total.traversed_edges += stats.traversed_edges;
+                total.examined_edges += stats.examined_edges;
+                total.levels += stats.levels;
+                total.seconds += stats.seconds;
+            }
+            std::printf("%8zu %10s %8.1f %12.4f %14.1f %14.3f\n", threads,
+                        direction_optimizing ? "optimizing" : "top-down", double(total.levels) / sources.size(),
+                        total.seconds / sources.size(), total.teps() / 1e6,
+                        double(total.examined_edges) / std::max<uint64_t>(total.traversed_edges, 1));
+            std::fflush(stdout);
+        }
+    }
+    std::printf("%8s %18s %18s\n", "threads", "chain ms/query", "levels/query");
+    for (auto threads: options.threads) {  // Цепочки между соседними началами: поиск обрывается на конце цепочки.
+        ParallelBfs bfs(graph, threads);
+        uint64_t levels = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i + 1 < sources.size(); ++i) {
+            bfs.search_chain(sources[i], sources[i + 1]);
+            levels += bfs.last_stats().levels;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t queries = std::max<size_t>(sources.size(), 2) - 1;
+        std::printf("%8zu %18.4f %18.1f\n", threads, seconds * 1e3 / queries, double(levels) / queries);
+        std::fflush(stdout);
+    }
+}
+
+/**
+ * Сравнить поочерёдный поиск цепочек для случайных пар с пакетным.
+ */
+void benchmark_batch_search(const AcquaintanceGraph& graph, const BenchmarkOptions& options) {
+    std::mt19937_64 rd(options.seed + 1);
+    std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> pairs;
+    while (pairs.size() < options.queries) {
+        auto first = static_cast<AcquaintanceGraph::Id>(rd() % graph.vertex_count());
+        auto second = static_cast<AcquaintanceGraph::Id>(rd() % graph.vertex_count());
+        if (graph.neighbours_begin(first) != graph.neighbours_end(first) &&
+            graph.reverse_neighbours_begin(second) != graph.reverse_neighbours_end(second)) {
+            pairs.emplace_back(first, second);
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    AcquaintanceGraph::SearchWorkspace workspace;
+    size_t found = 0;
+    for (auto& pair: pairs) {
+        found += !graph.search_chain(pair.first, pair.second, workspace).empty();
+    }
+    double sequential_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    BatchBfs batch(graph);
+    auto chains = batch.search_chains(pairs);
+    double batch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t batch_found = 0;
+    for (auto& chain: chains) {
+        batch_found += !chain.empty();
+    }
+    std::printf("%zu chain queries (%zu found): one by one %.3f s (%.0f queries/s), "
+                "batched by %zu %.3f s (%.0f queries/s, %zu levels)\n",
+                pairs.size(), found, sequential_seconds, pairs.size() / sequential_seconds, BatchBfs::batch_sources,
+                batch_seconds, pairs.size() / batch_seconds, batch.max_levels());
+    if (batch_found != found) {
+        std::printf("Batched search found %zu chains!\n", batch_found);
+    }
+}
+
+/**
+ * Построить индекс расстояний для отдельного графа R-MAT: время построения для разных количеств потоков,
+ * размер меток и время запросов по сравнению с двусторонним поиском в ширину.
+ */
+void benchmark_distance_index(const BenchmarkOptions& options) {
+    const std::string path = "medium2_bench_index.bin";
+    uint64_t edge_count = uint64_t{options.edge_factor} << options.index_scale;
+    AcquaintanceGraph graph(static_cast<AcquaintanceGraph::Id>(uint64_t{1} << options.index_scale),
+                            generate_rmat_edges(options.index_scale, edge_count, options.seed));
+    std::printf("Distance index for R-MAT graph: %zu people, %zu acquaintances\n", graph.vertex_count(),
+                graph.edge_count());
+    std::printf("%8s %12s %16s %14s\n", "threads", "build s", "entries/person", "index MB");
+    std::unique_ptr<DistanceIndex> index;
+    for (auto threads: options.threads) {
+        auto start = std::chrono::steady_clock::now();
+        index.reset(new DistanceIndex(graph, threads));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%8zu %12.2f %16.1f %14.1f\n", threads, seconds,
+                    double(index->label_entry_count()) / graph.vertex_count(), index->memory_usage() / 1e6);
+        std::fflush(stdout);
+    }
+    auto start = std::chrono::steady_clock::now();
+    index->save(path);
+    double save_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    DistanceIndex loaded(path);
+    double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::remove(path.c_str());
+    std::printf("Saved in %.2f s, loaded in %.2f s\n", save_seconds, load_seconds);
+
+    std::mt19937_64 rd(options.seed + 2);
+    std::vector<std::pair<AcquaintanceGraph::Id, AcquaintanceGraph::Id>> pairs;
+    while (pairs.size() < std::max<size_t>(options.queries, 1000)) {
+        auto first = static_cast<AcquaintanceGraph::Id>(rd() % graph.vertex_count());
+        auto second = static_cast<AcquaintanceGraph::Id>(rd() % graph.vertex_count());
+        if (graph.neighbours_begin(first) != graph.neighbours_end(first) &&
+            graph.reverse_neighbours_begin(second) != graph.reverse_neighbours_end(second)) {
+            pairs.emplace_back(first, second);
+        }
+    }
+    start = std::chrono::steady_clock::now();
+    uint64_t distance_sum = 0;
+    for (auto& pair: pairs) {
+        auto distance = loaded.distance(pair.first, pair.second);
+        distance_sum += distance == DistanceIndex::no_distance ? 0 : distance;
+    }
+    double distance_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    uint64_t chain_sum = 0;
+    for (auto& pair: pairs) {
+        auto chain = loaded.search_chain(pair.first, pair.second);
+        chain_sum += chain.empty() ? 0 : chain.size() - 1;
+    }
+    double chain_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    AcquaintanceGraph::SearchWorkspace workspace;
+    uint64_t bfs_sum = 0;
+    for (auto& pair: pairs) {
+        auto chain = graph.search_chain_bidirectional(pair.first, pair.second, workspace);
+        bfs_sum += chain.empty() ? 0 : chain.size() - 1;
+    }
+    double bfs_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%zu queries: distance %.3f us, chain %.3f us, bidirectional BFS %.3f us per query\n", pairs.size(),
+                distance_seconds / pairs.size() * 1e6, chain_seconds / pairs.size() * 1e6,
+                bfs_seconds / pairs.size() * 1e6);
+    if (distance_sum != bfs_sum || chain_sum != bfs_sum) {
+        std::printf("Index answers differ from BFS!\n");
+    }
+}
+
+/**
+ * Записать граф R-MAT в текстовый список знакомств и сравнить загрузку построчным разбором в std::map
+ * с загрузкой отображением файла, а также загрузку кэша графа. Для сравнения с пропускной способностью
+ * диска замеряется простое чтение файла (после записи он, скорее всего, в кэше страниц).
+ */
+void benchmark_loading(const BenchmarkOptions& options) {
+    const std::string edge_list_path = "medium2_bench_edges.txt";
+    const std::string cache_path = "medium2_bench_graph.bin";
+    std::string first_person;  // Концы цепочки для первого запроса к кэшу.
+    std::string second_person;
+    {
+        auto edges = generate_rmat_edges(options.load_scale, uint64_t{options.edge_factor} << options.load_scale,
+                                         options.seed);
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> output(std::fopen(edge_list_path.c_str(), "w"), std::fclose);
+        if (!output) {
+            std::fprintf(stderr, "Can't write %s\n", edge_list_path.c_str());
+            return;
+        }
+        for (auto& edge: edges) {
+            std::fprintf(output.get(), "Person %u\tPerson %u\n", edge.first, edge.second);
+        }
+        first_person = "Person " + std::to_string(edges.front().first);
+        second_person = "Person " + std::to_string(edges.back().second);
+    }
+    double megabytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::ifstream input(edge_list_path, std::ios::binary);
+        std::vector<char> buffer(1 << 20);
+        while (input.read(buffer.data(), buffer.size()) || input.gcount() > 0) {
+            megabytes += input.gcount() / 1e6;
+        }
+    }
+    auto seconds_since = [](std::chrono::steady_clock::time_point point) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - point).count();
+    };
+    double read_seconds = seconds_since(start);
+    std::printf("Edge list: %.1f MB, plain read %.2f s (%.0f MB/s)\n", megabytes, read_seconds,
+                megabytes / read_seconds);
+
+    start = std::chrono::steady_clock::now();
+    size_t map_people = 0;
+    {
+        std::map<std::string, std::vector<std::string>> peoples;
+        std::ifstream input(edge_list_path);
+        std::string line;
+        while (std::getline(input, line)) {
+            auto tab = line.find('\t');
+            peoples[line.substr(0, tab)].push_back(line.substr(tab + 1));
+        }
+        double map_seconds = seconds_since(start);
+        AcquaintanceGraph graph(peoples);
+        map_people = graph.vertex_count();
+        std::printf("std::map line by line: %.2f s (%.0f MB/s), then AcquaintanceGraph %.2f s\n", map_seconds,
+                    megabytes / map_seconds, seconds_since(start) - map_seconds);
+    }
+    std::printf("%8s %12s %12s\n", "threads", "load s", "MB/s");
+    for (auto threads: options.threads) {
+        start = std::chrono::steady_clock::now();
+        auto graph = AcquaintanceGraph::load_edge_list(edge_list_path, threads);
+        double seconds = seconds_since(start);
+        std::printf("%8zu %12.2f %12.0f\n", threads, seconds, megabytes / seconds);
+        std::fflush(stdout);
+        if (graph.vertex_count() != map_people) {
+            std::printf("Loaded %zu people instead of %zu!\n", graph.vertex_count(), map_people);
+        }
+        if (threads == options.threads.back()) {
+            start = std::chrono::steady_clock::now();
+            graph.save(cache_path);
+            std::printf("Cache: %.1f MB, saved in %.2f s\n", graph.image_size() / 1e6, seconds_since(start));
+        }
+    }
+    start = std::chrono::steady_clock::now();
+    auto cached = AcquaintanceGraph::load(cache_path);
+    double load_seconds = seconds_since(start);
+    AcquaintanceGraph::SearchWorkspace workspace;
+    auto chain = cached.search_chain_bidirectional(first_person, second_person, workspace);
+    std::printf("Cache loaded in %.6f s, first chain query (%zu people) answered %.4f s after start of loading\n",
+                load_seconds, chain.size(), seconds_since(start));
+    std::remove(edge_list_path.c_str());
+    std::remove(cache_path.c_str());
+}
+
+/**
+ * Полный обход в ширину от source по спискам графа (AcquaintanceGraph или CompressedAdjacency).
+ * @return Количество просмотренных знакомств.
+ */
+template<typename Graph>
+uint64_t traverse_graph(const Graph& graph, AcquaintanceGraph::Id source, std::vector<bool>& visited,
+                        std::vector<AcquaintanceGraph::Id>& queue) {
+    std::fill(visited.begin(), visited.end(), false);
+    queue.assign(1, source);
+    visited[source] = true;
+    uint64_t edges = 0;
+    for (size_t head = 0; head < queue.size(); ++head) {
+        graph.for_each_neighbour(queue[head], [&](AcquaintanceGraph::Id to) {
+            ++edges;
+            if (!visited[to]) {
+                visited[to] = true;
+                queue.push_back(to);
+            }
+        });
+    }
+    return edges;
+}
+
+/**
+ * Сравнить сжатые списки знакомых с несжатыми: байты на знакомство и скорость обхода в ширину.
+ */
+void benchmark_compressed_adjacency(const AcquaintanceGraph& graph, const BenchmarkOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    CompressedAdjacency compressed(graph, false, options.threads.back());
+    double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double edges = std::max<double>(graph.edge_count(), 1);
+    std::printf("%14s %14s %18s %12s\n", "layout", "bytes/edge", "with offsets", "MTEPS");
+    std::mt19937_64 rd(options.seed + 3);
+    std::vector<AcquaintanceGraph::Id> sources;
+    while (sources.size() < options.sources) {
+        auto source = static_cast<AcquaintanceGraph::Id>(rd() % graph.vertex_count());
+        if (graph.neighbours_begin(source) != graph.neighbours_end(source)) {
+            sources.push_back(source);
+        }
+    }
+    std::vector<bool> visited(graph.vertex_count());
+    std::vector<AcquaintanceGraph::Id> queue;
+    queue.reserve(graph.vertex_count());
+    for (bool is_compressed: {false, true}) {
+        uint64_t traversed = 0;
+        start = std::chrono::steady_clock::now();
+        for (auto source: sources) {
+            traversed += is_compressed ? traverse_graph(compressed, source, visited, queue) :
+                         traverse_graph(graph, source, visited, queue);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double list_bytes = is_compressed ? compressed.list_bytes() : graph.edge_count() * sizeof(AcquaintanceGraph::Id);
+        double total_bytes = is_compressed ? compressed.memory_usage() :
+                             list_bytes + (graph.vertex_count() + 1) * sizeof(uint32_t);
+        std::printf("%14s %14.2f %18.2f %12.1f\n", is_compressed ? "delta+varint" : "uint32", list_bytes / edges,
+                    total_bytes / edges, traversed / seconds / 1e6);
+    }
+    std::printf("Compressed in %.2f s\n", build_seconds);
+    CompressedAdjacency reverse(graph, true, options.threads.back());
+    AcquaintanceGraph::SearchWorkspace workspace;
+    workspace.prepare(graph.vertex_count());  // Массивы поиска выделяются до замера.
+    for (bool is_compressed: {false, true}) {  // Двусторонний поиск цепочек между соседними началами.
+        start = std::chrono::steady_clock::now();
+        size_t found = 0;
+        for (size_t i = 0; i + 1 < sources.size(); ++i) {
+            found += !(is_compressed ?
+                    CompressedAdjacency::search_chain_bidirectional(compressed, reverse, sources[i], sources[i + 1],
+                                                                    workspace) :
+                    graph.search_chain_bidirectional(sources[i], sources[i + 1], workspace)).empty();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t queries = std::max<size_t>(sources.size(), 2) - 1;
+        std::printf("%14s bidirectional chain search: %.1f us/query (%zu of %zu found)\n",
+                    is_compressed ? "delta+varint" : "uint32", seconds * 1e6 / queries, found, queries);
+    }
+}
+
+/**
+ * Разобрать параметры командной строки.
+ * @return true, если параметры корректны.
+ */
+bool parse_benchmark_options(int argc, char* argv[], BenchmarkOptions& options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        char* end = nullptr;
+        auto number = std::strtoull(argv[i + 1], &end, 10);
+        bool is_number = *argv[i + 1] != '\0' && (*end == '\0' || (option == "--threads" && *end == ','));
+        if (!is_number) {
+            return false;
+        }
+        if (option == "--scale" && number >= 10 && number <= 31) {
+            options.scale = static_cast<uint32_t>(number);
+        } else if (option == "--edge-factor" && number >= 1) {
+            options.edge_factor = static_cast<uint32_t>(number);
+        } else if (option == "--sources" && number >= 1) {
+            options.sources = number;
+        } else if (option == "--queries" && number >= 1) {
+            options.queries = number;
+        } else if (option == "--index-scale" && (number == 0 || (number >= 10 && number <= 31))) {
+            options.index_scale = static_cast<uint32_t>(number);
+        } else if (option == "--load-scale" && (number == 0 || (number >= 10 && number <= 31))) {
+            options.load_scale = static_cast<uint32_t>(number);
+        } else if (option == "--seed") {
+            options.seed = number;
+        } else if (option == "--threads") {
+            for (const char* position = argv[i + 1]; *position != '\0';) {
+                number = std::strtoull(position, &end, 10);
+                if (end == position || number == 0 || (*end != ',' && *end != '\0')) {
+                    return false;
+                }
+                options.threads.push_back(number);
+                position = *end == ',' ? end + 1 : end;
+            }
+        } else {
+            return false;
+        }
+    }
+    return argc % 2 == 1;
+}
+
+int run_all_benchmarks(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        std::fprintf(stderr, "Usage: %s [--scale N] [--edge-factor N] [--threads 1,2,4] [--sources N] [--queries N]"
+                     " [--index-scale N] [--load-scale N] [--seed N]\n",
+                     argv[0]);
+        return 2;
+    }
+    if (options.threads.empty()) {
+        for (size_t threads = 1; threads < std::thread::hardware_concurrency(); threads *= 2) {
+            options.threads.push_back(threads);
+        }
+        options.threads.push_back(std::max<size_t>(std::thread::hardware_concurrency(), 1));
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t edge_count = uint64_t{options.edge_factor} << options.scale;
+    AcquaintanceGraph graph(static_cast<AcquaintanceGraph::Id>(uint64_t{1} << options.scale),
+                            generate_rmat_edges(options.scale, edge_count, options.seed));
+    std::printf("R-MAT graph: %zu people, %zu acquaintances, built in %.1f s\n", graph.vertex_count(),
+                graph.edge_count(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    benchmark_parallel_bfs(graph, options);
+    benchmark_batch_search(graph, options);
+    benchmark_compressed_adjacency(graph, options);
+    if (options.index_scale != 0) {
+        benchmark_distance_index(options);
+    }
+    if (options.load_scale != 0) {
+        benchmark_loading(options);
+    }
+    return 0;
+}
+
+
+
+int main(int argc, char *argv[]) {
+#ifdef MEDIUM2_BENCH
+    return run_all_benchmarks(argc, argv);
+#else
+    static_cast<void>(argc);
+    static_cast<void>(argv);
+    run_all_tests();
     return 0;
+#endif
 }
\ No newline at end of file
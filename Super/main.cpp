@@ -64,6 +64,18 @@
  * Операция взятия MEX работает за O(log N) для каждой вершины.
  * Xor для бора сводится к изменению маски в корне, а значит выполняется за O(1).
  * Реальная перестановка узлов для операции xor происходит отложенно и не ухудшает асимптотику.
+ *
+ * Для 64-битных чисел каждое добавление может создать до 64 узлов, поэтому способ хранения узлов вынесен в политику.
+ * HeapNodeStorage выделяет каждый узел в куче, ArenaNodeStorage складывает узлы в один непрерывный буфер
+ * и ссылается на них 32-битными индексами: узел становится меньше, а удаление бора - освобождением буфера.
+ * Буфер растёт перевыделением, поэтому адреса узлов арены при создании новых узлов меняются: постоянны только
+ * дескрипторы (в отличие от HeapNodeStorage, где адрес узла не меняется до его удаления).
+ *
+ * Удаление числа снимает отметки полноты вверх по пути и возвращает хранилищу узлы опустевших поддеревьев.
+ * Разреженная арена переносится в новый буфер, поэтому память следует за количеством хранимых чисел.
+ *
+ * Для 8 и 16-битных чисел весь диапазон помещается в 32 байта или 8 КиБ, поэтому BitTrie для них по умолчанию
+ * специализирован плоским битовым множеством: MEX - векторный поиск первого неполного слова под ключом xor.
  */
 
 
@@ -73,445 +85,7008 @@
 #include <cassert>
 #include <random>
 #include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <iterator>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <set>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <climits>
+#include <csignal>
 
 /**
- * @brief Битовый бор для чисел.
- * @tparam NumberType Тип данных хранимых чисел. Должен быть беззнаковым.
+ * @brief Хранилище узлов бора в куче: каждый узел создаётся отдельно через new и удаляется через delete.
+ * @tparam Node Тип узла. Должен содержать массив дескрипторов потомков children.
  */
-template<typename NumberType = uint8_t>
-class BitTrie {
+template<typename Node>
+class HeapNodeStorage {
 public:
+    using Handle = Node*;  // Дескриптор узла - обычный указатель.
+
     /**
-     * @brief Удаление бора.
-     * @details Сводится к удалению корня дерева. Потомки рекурсивно удалятся в деструкторах узла.
+     * @brief Дескриптор, не указывающий ни на какой узел.
      */
-    ~BitTrie() {
-        delete root_;
+    static constexpr Handle null_handle() {
+        return nullptr;
     }
 
     /**
-     * @brief Добавить в бор минимально возможное число (минимальное положительное целое, не хранящееся в боре).
-     * @return Число, которое было добавлено в бор.
+     * @brief Создать новый узел.
+     * @return Дескриптор созданного узла.
      */
-    NumberType add_number() {
-        auto id = mex();  // Ищем минимальное положительное целое, не хранящееся в боре.
-        add_number(id);  // Добавляем его в бор.
-        return id;
+    Handle create() {
+        auto node = new Node{};
+        ++node_count_;
+        return node;
     }
 
     /**
-     * @brief Добавить в бор число.
-     * @param value Число, которое нужно добавить в бор.
+     * @brief Удалить один узел (без потомков).
+     * @param node Дескриптор удаляемого узла.
      */
-    void add_number(NumberType value) {
-        /**
-         * Нужно спуститься по дереву от корня к листьям, при необходимости создавая узлы.
-         * Спуск производится следующим образом:
-         *  * Начинаем со старшего бита добавляемого числа (старший бит - корень бора).
-         *  * Если очередной бит равен 0, идём в левого потомка, иначе - в правого.
-         */
-        Node* current = root_;
-        for(int bit_no = max_depth_trie_ - 1; bit_no >= 0; --bit_no) {  // Перебираем биты числа.
-            auto bit_value = (value >> bit_no) & 1;  // Получаем значение бита.
-            current = current->get_or_create_child(bit_value);  // Спускаемся в нужного потомка.
-        }
-        if (current->get_fullness()) {  // Если лист уже соответствовал какому-то числу, то возвращаем ошибку.
-            throw std::range_error("The ID is already taken.");
+    void destroy(Handle node) {
+        delete node;
+        --node_count_;
+    }
+
+    /**
+     * @brief Получить узел по дескриптору.
+     */
+    Node& operator[](Handle node) const {
+        return *node;
+    }
+
+    /**
+     * @brief Удалить все узлы дерева.
+     * @details Узлы выделялись по одному, поэтому их приходится обходить рекурсивно.
+     * @param root Корень удаляемого дерева.
+     */
+    void release_all(Handle root) {
+        if (root == nullptr) {
+            return;
         }
-        current->set_fullness(true);  // Ставим отметку о полноте поддерева. Она распространится вверх по дереву.
+        release_all(root->children[0]);
+        release_all(root->children[1]);
+        destroy(root);
     }
 
     /**
-     * @brief Все хранимые числа сложить по модулю 2 с заданным числом.
-     * @param value Второе слагаемое для операции xor.
+     * @brief Нужно ли владельцу перенести узлы в новое хранилище, чтобы вернуть память.
+     * @details Удалённые узлы сразу возвращаются распределителю памяти, поэтому перенос не нужен.
      */
-    void xor_all_values(NumberType value) {
-        root_->xor_values(value);  // Ставим отметку для отложенной операции в корне дерева.
+    bool is_sparse() const {
+        return false;
+    }
+
+    /**
+     * @brief Объём памяти, занятой узлами, в байтах (без накладных расходов распределителя памяти).
+     */
+    size_t memory_usage() const {
+        return node_count_ * sizeof(Node);
+    }
+
+    /**
+     * @brief Количество созданных и ещё не удалённых узлов.
+     */
+    size_t node_count() const {
+        return node_count_;
     }
 private:
+    size_t node_count_{0};  // Количество созданных и ещё не удалённых узлов.
+};
+
+/**
+ * @brief Хранилище узлов бора в арене: узлы лежат в одном непрерывном буфере и адресуются 32-битными индексами.
+ * @details Буфер растёт удвоением через realloc: узлы тривиально копируемы, а большие буферы ядро
+ * перемещает перестановкой страниц, без копирования данных. Из-за перемещения ссылки на узлы
+ * действительны только до следующего создания узла, постоянны лишь индексы.
+ * Удалённые узлы попадают в список свободных и переиспользуются. Удаление всего дерева - освобождение буфера.
+ * @tparam Node Тип узла. Должен быть тривиально копируемым и содержать массив дескрипторов потомков children.
+ */
+template<typename Node>
+class ArenaNodeStorage {
+public:
+    using Handle = uint32_t;  // Дескриптор узла - индекс в арене. Индекс 0 зарезервирован под пустой дескриптор.
+
     /**
-     * @brief Поиск минимального положительного целого числа, не хранящегося в боре.
-     * @return Значение минимального положительного целого числа, не хранящегося в боре.
+     * @brief Дескриптор, не указывающий ни на какой узел.
      */
-    NumberType mex() {
-        /**
-         * Спускаемся по дереву, заполняя биты результирующего числа:
-         *  * Корень соответствует старшему биту результата.
-         *  * Если левое поддерево неполное, то идём в него.
-         *  * Если идём в левого потомка, то соответствующий бит равен 0, иначе - 1.
-         *  * Если поддерево пустое (потомок отсутствует), то оставшиеся биты числа равны 0.
-         */
-        if (root_->get_fullness()) {  // Если бор полный, то сообщаем об ошибке.
-            throw std::out_of_range("Trie is full.");
-        }
-        NumberType result = 0;  // Установим все биты в 0.
-        Node* current = root_;  // Начнём со старшего бита.
-        for(int bit_no = max_depth_trie_ - 1; bit_no >= 0; --bit_no) {  // Перебираем все биты числа.
-                auto bit_value = 0;
-                if (current->get_child(0) == nullptr) {  // Если левое поддерево пустое, то можно выходить.
-                    return result;
-                } else if (current->get_child(0)->get_fullness()){
-                    // Если левое поддерево полное, то идём в правое, а бит устанавливаем в 1.
-                    bit_value = 1;
-                }
-                result |= bit_value << bit_no;  // Устанавливаем значение текущего бита.
-                if (current->get_child(bit_value) == nullptr) {  // Если правое поддерево пустое, то можно выходить.
-                    return result;
-                }
-                current = current->get_child(bit_value);  // Перемещаемся в левого или правого потомка.
-            }
-        return result;
+    static constexpr Handle null_handle() {
+        return 0;
     }
 
+    ArenaNodeStorage() = default;
+    ArenaNodeStorage(const ArenaNodeStorage&) = delete;
+    ArenaNodeStorage& operator=(const ArenaNodeStorage&) = delete;
+
     /**
-     * @brief Класс, описывающий узел битового бора.
+     * @brief Перемещение хранилища: буферы меняются местами, прежний буфер освобождает перемещённый объект.
      */
-    class Node {
-    public:
-        /**
-         * @brief Создание узла.
-         * @param parent Указываем родителя узла. Если это корень, то родитель = nullptr.
-         */
-        explicit Node(Node* parent){
-            parent_ = parent;
-        }
+    ArenaNodeStorage(ArenaNodeStorage&& other) noexcept {
+        swap(other);
+    }
 
-        /**
-         * @brief Уничтожаем узел.
-         * @details Уничтожаем потомков, у родителя снимаем отметку о полноте.
-         */
-        ~Node() {
-            if (parent_ != nullptr) {
-                parent_->is_full_ = false;
-            }
-            delete children_[0];
-            delete children_[1];
+    ArenaNodeStorage& operator=(ArenaNodeStorage&& other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~ArenaNodeStorage() {
+        release_all(null_handle());
+    }
+
+    /**
+     * @brief Создать новый узел.
+     * @details Сначала переиспользуются удалённые узлы, затем занимается следующий индекс в арене.
+     * @return Дескриптор созданного узла.
+     */
+    Handle create() {
+        if (free_list_ != null_handle()) {
+            auto node = free_list_;
+            free_list_ = nodes_[node].children[0];  // Список свободных узлов хранится в самих узлах.
+            --free_count_;
+            nodes_[node] = Node{};
+            return node;
+        }
+        if (size_ >= capacity_) {
+            grow();
         }
+        new (nodes_ + size_) Node{};
+        return size_++;
+    }
 
-        /**
-         * @brief Получить указатель на потомка.
-         * @param index 0, если нужен левый потомок, 1 - правый.
-         * @return Указатель на потомка (может быть равен nullptr).
-         */
-        Node* get_child(uint8_t index) const {
-            if (index > 1) {
-                throw std::range_error("Invalid index");
-            }
-            if (children_[index] != nullptr) {
-                children_[index]->push_inconsistency();  // При посещении узла нужно произвести отложенный xor.
-            }
-            return children_[index];
-        };
+    /**
+     * @brief Удалить один узел (без потомков).
+     * @details Узел помещается в список свободных узлов.
+     * @param node Дескриптор удаляемого узла.
+     */
+    void destroy(Handle node) {
+        nodes_[node].children[0] = free_list_;
+        free_list_ = node;
+        ++free_count_;
+    }
 
-        /**
-         * @brief Получить указатель на потомка. Если потомок отсутствует, то создать его.
-         * @param index 0, если нужен левый потомок, 1 - правый.
-         * @return Указатель на потомка (не может быть равен nullptr).
-         */
-        Node* get_or_create_child(uint8_t index) {
-            if (index > 1) {
-                throw std::range_error("Invalid index");
-            }
-            if (children_[index] == nullptr) {
-                children_[index] = new Node{this};
-            } else {
-                children_[index]->push_inconsistency();  // При посещении узла нужно произвести отложенный xor.
-            }
-            return children_[index];
+    /**
+     * @brief Получить узел по дескриптору.
+     */
+    Node& operator[](Handle node) const {
+        return nodes_[node];
+    }
+
+    /**
+     * @brief Удалить все узлы.
+     * @details Узлы тривиально разрушаемы, поэтому достаточно освободить буфер, не обходя дерево.
+     */
+    void release_all(Handle) {
+        if (mapped_bytes_ != 0) {
+            munmap(nodes_, mapped_bytes_);
+        } else {
+            std::free(nodes_);
         }
+        nodes_ = nullptr;
+        mapped_bytes_ = 0;
+        size_ = 1;
+        capacity_ = 0;
+        free_list_ = null_handle();
+        free_count_ = 0;
+    }
 
-        /**
-         * @brief Установить отметку о полноте поддерева.
-         * @param value Значение полноты.
-         */
-        void set_fullness(bool value) {
-            is_full_ = value;
-            if (parent_ != nullptr) {
-                bool new_parent_fullness = parent_->children_[0] != nullptr &&
-                                           parent_->children_[1] != nullptr &&
-                                           parent_->children_[0]->is_full_ &&
-                                           parent_->children_[1]->is_full_;
-                if (parent_->is_full_ != new_parent_fullness) {
-                    parent_->set_fullness(new_parent_fullness);  // Распространить полноту вверх по дереву к корню.
-                }
-            }
+    /**
+     * @brief Указывает ли дескриптор на занятый индекс арены.
+     * @details Нужно владельцу, чтобы проверить дескрипторы, прочитанные из файла.
+     */
+    bool contains(Handle node) const {
+        return node != null_handle() && node < size_;
+    }
+
+    /**
+     * @brief Нужно ли владельцу перенести узлы в новое хранилище, чтобы вернуть память.
+     * @details Удалённые узлы переиспользуются, но буфер не уменьшается. Если живых узлов стало меньше четверти
+     * буфера, владельцу стоит скопировать дерево в новое хранилище: копирование окупается количеством удалений,
+     * которые к нему привели.
+     */
+    bool is_sparse() const {
+        return capacity_ > min_capacity_ && (uint64_t{size_} - 1 - free_count_) * 4 < capacity_;
+    }
+
+    /**
+     * @brief Объём памяти, занятой буфером, в байтах (вместе со свободными узлами и резервом).
+     */
+    size_t memory_usage() const {
+        return uint64_t{capacity_} * sizeof(Node);
+    }
+
+    /**
+     * @brief Количество созданных и ещё не удалённых узлов.
+     */
+    size_t node_count() const {
+        return uint64_t{size_} - 1 - free_count_;
+    }
+
+    /**
+     * @brief Сохранить все узлы в файл.
+     * @details Узлы записываются как есть: они не содержат указателей, только индексы.
+     * Формат файла: заголовок хранилища и заголовок владельца, дополненные до snapshot_data_offset_ байтов,
+     * затем массив узлов.
+     * Формат зависит от платформы (порядок байтов, выравнивание).
+     * @param path Путь к файлу.
+     * @param owner_header Заголовок владельца хранилища (например, корень дерева).
+     * @param owner_header_size Размер заголовка владельца.
+     */
+    void save(const std::string& path, const void* owner_header, size_t owner_header_size) const {
+        if (sizeof(SnapshotHeader) + owner_header_size > snapshot_data_offset_) {
+            throw std::length_error("Snapshot header is too long.");
+        }
+        std::vector<char> page(snapshot_data_offset_, 0);
+        SnapshotHeader header{snapshot_magic_, snapshot_version_, sizeof(Node), size_, free_list_, free_count_,
+                              static_cast<uint32_t>(owner_header_size)};
+        std::memcpy(page.data(), &header, sizeof(header));
+        std::memcpy(page.data() + sizeof(header), owner_header, owner_header_size);
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "wb"), std::fclose);
+        if (file == nullptr) {
+            throw std::runtime_error("Cannot open snapshot file for writing.");
         }
+        Node null_node{};  // Индекс 0 не используется, записываем на его место пустой узел.
+        bool written = std::fwrite(page.data(), page.size(), 1, file.get()) == 1 &&
+                       std::fwrite(&null_node, sizeof(Node), 1, file.get()) == 1 &&
+                       (size_ == 1 || std::fwrite(nodes_ + 1, sizeof(Node), size_ - 1, file.get()) == size_ - 1);
+        if (!written || std::fflush(file.get()) != 0 || fsync(fileno(file.get())) != 0) {
+            throw std::runtime_error("Cannot write snapshot file.");
+        }
+    }
 
-        /**
-         * @brief Получить значение полноты поддерева.
-         * @return True, если поддерево полное, иначе - false.
-         */
-        bool get_fullness() const {
-            return is_full_;
+    /**
+     * @brief Заменить все узлы узлами из файла.
+     * @details Файл отображается в память с копированием при записи: узлы читаются с диска по мере обращения
+     * к страницам, изменения остаются в памяти процесса и не попадают в файл. За отображением файла резервируется
+     * столько же места под новые узлы; если его не хватит, узлы один раз копируются в обычный буфер.
+     * @param path Путь к файлу.
+     * @param owner_header Буфер для заголовка владельца хранилища.
+     * @param owner_header_size Размер заголовка владельца. Должен совпадать с сохранённым.
+     */
+    void load(const std::string& path, void* owner_header, size_t owner_header_size) {
+        int file = open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            throw std::runtime_error("Cannot open snapshot file for reading.");
+        }
+        std::unique_ptr<int, void(*)(int*)> file_guard(&file, [](int* descriptor) { close(*descriptor); });
+        if (page_size() > snapshot_data_offset_) {
+            throw std::runtime_error("Snapshot data offset is not page aligned.");
+        }
+        std::vector<char> page(snapshot_data_offset_);
+        struct stat file_stat{};
+        if (pread(file, page.data(), page.size(), 0) != static_cast<ssize_t>(page.size()) ||
+            fstat(file, &file_stat) != 0) {
+            throw std::runtime_error("Snapshot file is corrupted.");
+        }
+        SnapshotHeader header{};
+        std::memcpy(&header, page.data(), sizeof(header));
+        uint64_t nodes_bytes = uint64_t{header.size} * sizeof(Node);
+        if (header.magic != snapshot_magic_ || header.version != snapshot_version_ ||
+            header.node_size != sizeof(Node) || header.owner_header_size != owner_header_size || header.size == 0 ||
+            header.free_count >= header.size || header.free_list >= header.size ||
+            static_cast<uint64_t>(file_stat.st_size) < snapshot_data_offset_ + nodes_bytes) {
+            throw std::runtime_error("Snapshot file is corrupted.");
+        }
+        uint64_t capacity = std::min<uint64_t>(std::max<uint64_t>(min_capacity_, uint64_t{header.size} * 2), max_size_);
+        size_t mapped_bytes = round_to_pages(capacity * sizeof(Node));
+        void* reserved = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        if (mmap(reserved, round_to_pages(nodes_bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 file, snapshot_data_offset_) == MAP_FAILED) {
+            munmap(reserved, mapped_bytes);
+            throw std::runtime_error("Cannot map snapshot file.");
+        }
+        if (!are_children_valid(static_cast<const Node*>(reserved), header) ||
+            !is_free_list_valid(static_cast<const Node*>(reserved), header)) {
+            munmap(reserved, mapped_bytes);
+            throw std::runtime_error("Snapshot file is corrupted.");
         }
+        release_all(null_handle());
+        std::memcpy(owner_header, page.data() + sizeof(header), owner_header_size);
+        nodes_ = static_cast<Node*>(reserved);
+        mapped_bytes_ = mapped_bytes;
+        size_ = header.size;
+        capacity_ = static_cast<Handle>(capacity);
+        free_list_ = header.free_list;
+        free_count_ = header.free_count;
+    }
+private:
+    /**
+     * @brief Заголовок файла с узлами.
+     */
+    struct SnapshotHeader {
+        uint64_t magic;  // Сигнатура формата.
+        uint32_t version;  // Версия формата.
+        uint32_t node_size;  // Размер узла: защищает от чтения файла с узлами другого типа.
+        Handle size;  // Количество занятых индексов.
+        Handle free_list;  // Начало списка удалённых узлов.
+        Handle free_count;  // Длина списка удалённых узлов.
+        uint32_t owner_header_size;  // Размер заголовка владельца, следующего сразу за этим заголовком.
+    };
 
-        /**
-         * @brief Произвести операцию xor для всех чисел дереве.
-         * @param value Второе слагаемое для операции xor.
-         */
-        void xor_values(NumberType value){
-            xor_mask_ ^= value;
-            push_inconsistency();  // Не оставляем в корне несогласованность, чтобы облегчить обращения к корню.
+    /**
+     * @brief Увеличить буфер вдвое.
+     */
+    void grow() {
+        static_assert(std::is_trivially_copyable<Node>::value, "Arena nodes are moved by realloc.");
+        if (capacity_ == max_size_) {
+            throw std::length_error("Node arena is exhausted.");
         }
-    private:
-        /**
-         * @brief Произвести отложенный xor для текущего узла и протолкнуть отложенную операцию потомкам.
-         */
-        void push_inconsistency() {
-            if (xor_mask_ == 0) {
-                return;
-            }
-            if (((xor_mask_ >> (max_depth_trie_ - 1)) & 1) == 1) {  // Если соответствующий бит равен 1.
-                swap_children();  // Меняем детей местами
+        auto capacity = std::min<uint64_t>(std::max<uint64_t>(min_capacity_, uint64_t{capacity_} * 2), max_size_);
+        Node* nodes = nullptr;
+        if (mapped_bytes_ != 0) {  // Отображение файла не растёт: переносим узлы в обычный буфер.
+            nodes = static_cast<Node*>(std::malloc(capacity * sizeof(Node)));
+            if (nodes != nullptr) {
+                std::memcpy(nodes, nodes_, uint64_t{size_} * sizeof(Node));
+                munmap(nodes_, mapped_bytes_);
+                mapped_bytes_ = 0;
             }
-            for (auto & node : children_) {
-                if (node != nullptr) {
-                    node->xor_mask_ ^= xor_mask_ << 1;  // Проталкиваем несогласованность потомкам.
+        } else {
+            nodes = static_cast<Node*>(std::realloc(nodes_, capacity * sizeof(Node)));
+        }
+        if (nodes == nullptr) {
+            throw std::bad_alloc();
+        }
+        nodes_ = nodes;
+        capacity_ = static_cast<Handle>(capacity);
+    }
+
+    /**
+     * @brief Обменяться буферами с другим хранилищем.
+     */
+    void swap(ArenaNodeStorage& other) noexcept {
+        std::swap(nodes_, other.nodes_);
+        std::swap(mapped_bytes_, other.mapped_bytes_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(free_list_, other.free_list_);
+        std::swap(free_count_, other.free_count_);
+    }
+
+    /**
+     * @brief Проверить, что все дескрипторы потомков из файла указывают внутрь арены.
+     * @details Проверяются и удалённые узлы: после переиспользования их потомки снова становятся живыми ссылками.
+     * Файл при этом прочитывается целиком один раз.
+     * @param nodes Отображённые узлы.
+     * @param header Заголовок файла.
+     */
+    static bool are_children_valid(const Node* nodes, const SnapshotHeader& header) {
+        for (Handle node = 0; node < header.size; ++node) {
+            for (auto child : nodes[node].children) {
+                if (child >= header.size) {
+                    return false;
                 }
             }
-            xor_mask_ = 0;
         }
+        return true;
+    }
 
-        /**
-         * @brief Поменять потомков местами.
-         */
-        void swap_children() {
-            std::swap(children_[0], children_[1]);
+    /**
+     * @brief Проверить список удалённых узлов из файла: все его узлы в пределах арены, длина совпадает с заголовком.
+     * @param nodes Отображённые узлы.
+     * @param header Заголовок файла.
+     */
+    static bool is_free_list_valid(const Node* nodes, const SnapshotHeader& header) {
+        Handle node = header.free_list;
+        for (Handle count = 0; count < header.free_count; ++count) {
+            if (node == null_handle() || node >= header.size) {
+                return false;
+            }
+            node = nodes[node].children[0];
         }
+        return node == null_handle();
+    }
 
-        Node* children_[2]{nullptr, nullptr};  // Потомки.
-        Node* parent_{nullptr}; // Родитель.
-        bool is_full_{false};  // Полное ли поддерево?
-        NumberType xor_mask_{0};  // Пометки о необходимости отложенной операции xor.
-    };
+    /**
+     * @brief Размер страницы памяти.
+     */
+    static size_t page_size() {
+        static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
 
-    Node* root_{new Node{nullptr}};  // Корень дерева.
-    static const uint8_t max_depth_trie_{sizeof(NumberType) * 8};  // Максимальная глубина дерева.
+    /**
+     * @brief Округлить размер вверх до целого числа страниц.
+     */
+    static size_t round_to_pages(uint64_t bytes) {
+        return (bytes + page_size() - 1) / page_size() * page_size();
+    }
+
+    static const Handle min_capacity_{64};  // Начальный размер буфера.
+    static const Handle max_size_{UINT32_MAX};  // Предельное количество индексов (с учётом зарезервированного нуля).
+    static const uint64_t snapshot_magic_{0x31504E5345495254};  // "TRIESNP1" в little-endian.
+    static const uint32_t snapshot_version_{3};  // Версия формата файла.
+    static const size_t snapshot_data_offset_{65536};  // Начало узлов в файле: кратно любой странице до 64 КБ.
+
+    Node* nodes_{nullptr};  // Буфер с узлами.
+    size_t mapped_bytes_{0};  // Размер отображения файла вместе с резервом (0, если буфер выделен в куче).
+    Handle size_{1};  // Количество занятых индексов. Индекс 0 не используется.
+    Handle capacity_{0};  // Размер буфера в узлах.
+    Handle free_list_{null_handle()};  // Начало списка удалённых узлов.
+    Handle free_count_{0};  // Длина списка удалённых узлов.
 };
 
 /**
- * @brief Обёртка для работы с битовым бором в терминах задачи.
+ * @brief Общий пул узлов для многих боров: арена с отложенным освобождением удалённых деревьев.
+ * @details Удаление дерева - O(1): корень попадает в список мусора. Мусор разбирается понемногу при создании
+ * узлов (не больше reclaim_steps_ узлов за раз), освобождённые узлы сразу переиспользуются, так что каждый узел
+ * мусора освобождается один раз, а работа распределяется по созданиям узлов.
+ * @tparam Node Тип узла. Требования такие же, как у ArenaNodeStorage.
  */
-class DataBase {
+template<typename Node>
+class NodePool {
 public:
+    using Handle = typename ArenaNodeStorage<Node>::Handle;  // Дескриптор узла - индекс в арене.
+
+    NodePool() = default;
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
     /**
-     * @brief Зарегистрировать пользователя.
-     * @return Id нового пользователя.
+     * @brief Создать новый узел, попутно освободив несколько узлов мусора.
      */
-    uint64_t register_new_user() {
-        return trie.add_number();
+    Handle create() {
+        collect(reclaim_steps_);
+        return arena_.create();
     }
+
     /**
-     * @brief Зашифровать данные.
-     * @param key Ключ.
+     * @brief Удалить один узел (без потомков).
      */
-    void encrypt(uint64_t key) {
-        trie.xor_all_values(key);
+    void destroy(Handle node) {
+        arena_.destroy(node);
+    }
+
+    /**
+     * @brief Получить узел по дескриптору.
+     */
+    Node& operator[](Handle node) const {
+        return arena_[node];
     }
-private:
-    BitTrie<uint64_t> trie;  // Битовый бор для хранения id-шников.
-};
 
+    /**
+     * @brief Удалить дерево за O(1): узлы освобождаются позже, при создании новых.
+     * @param root Корень удаляемого дерева.
+     * @param node_count Количество узлов дерева.
+     */
+    void release(Handle root, size_t node_count) {
+        if (root != ArenaNodeStorage<Node>::null_handle()) {
+            garbage_.push_back(root);
+            garbage_node_count_ += node_count;
+        }
+    }
 
-// Тесты и примеры использования.
+    /**
+     * @brief Сразу освободить все узлы удалённых деревьев.
+     */
+    void collect_garbage() {
+        collect(SIZE_MAX);
+        garbage_.shrink_to_fit();
+    }
 
-void test_8bit_from_task() {
-    BitTrie<uint8_t> trie;
-    trie.add_number(1);
-    trie.add_number(3);
-    trie.xor_all_values(1);
-    auto id = trie.add_number();
-    assert(id == 1);
-    trie.xor_all_values(1);
-    id = trie.add_number();
-    assert(id == 2);
-}
+    /**
+     * @brief Объём памяти, занятой буфером арены, в байтах (вместе со свободными узлами и мусором).
+     */
+    size_t memory_usage() const {
+        return arena_.memory_usage();
+    }
 
-void test_8bit_sequential_registrations() {
-    BitTrie<uint8_t> trie;
-    auto id = trie.add_number();
-    assert(id == 0);
-    id = trie.add_number();
-    assert(id == 1);
-    id = trie.add_number();
-    assert(id == 2);
-    id = trie.add_number();
-    assert(id == 3);
-    id = trie.add_number();
-    assert(id == 4);
-}
+    /**
+     * @brief Количество узлов живых деревьев.
+     */
+    size_t node_count() const {
+        return arena_.node_count() - garbage_node_count_;
+    }
 
-void test_8bit_full_trie() {
-    BitTrie<uint8_t> trie;
-    for (auto i = 0; i < 256; ++i) {
-        auto id = trie.add_number();
-        assert(id == i);
+    /**
+     * @brief Количество узлов удалённых деревьев, ещё не возвращённых в арену.
+     */
+    size_t garbage_node_count() const {
+        return garbage_node_count_;
     }
-    try {
-        auto id = trie.add_number();
-        assert(false);
-    } catch(std::out_of_range& e) {
-        assert(true);
+private:
+    /**
+     * @brief Освободить не больше steps узлов мусора.
+     * @details Список мусора - стек обхода в глубину: вместо освобождённого узла в него попадают его потомки.
+     */
+    void collect(size_t steps) {
+        for (; steps > 0 && !garbage_.empty(); --steps) {
+            Handle node = garbage_.back();
+            garbage_.pop_back();
+            for (auto child : arena_[node].children) {
+                if (child != ArenaNodeStorage<Node>::null_handle()) {
+                    garbage_.push_back(child);
+                }
+            }
+            arena_.destroy(node);
+            --garbage_node_count_;
+        }
     }
-}
 
-void test_8bit_mex_all_values() {
-    std::random_device rd;
+    static const size_t reclaim_steps_{2};  // Сколько узлов мусора освобождается при создании одного узла.
 
-    for (auto mex = 0; mex < 256; ++mex) {
-        BitTrie<uint8_t> trie;
+    ArenaNodeStorage<Node> arena_;  // Узлы всех деревьев.
+    std::vector<Handle> garbage_;  // Корни ещё не освобождённых поддеревьев удалённых деревьев.
+    size_t garbage_node_count_{0};  // Количество узлов в этих поддеревьях.
+};
+
+/**
+ * @brief Хранилище узлов одного бора в общем пуле NodePool.
+ * @details Хранилище - лёгкая ссылка на пул со счётчиком своих узлов, поэтому многие маленькие боры не держат
+ * каждый свой буфер. Удаление дерева отдаётся пулу и выполняется за O(1).
+ * Пул должен жить дольше всех хранилищ на нём.
+ * @tparam Node Тип узла.
+ */
+template<typename Node>
+class PooledNodeStorage {
+public:
+    using Pool = NodePool<Node>;  // Тип общего пула.
+    using Handle = typename Pool::Handle;  // Дескриптор узла - индекс в арене пула.
+
+    /**
+     * @brief Дескриптор, не указывающий ни на какой узел.
+     */
+    static constexpr Handle null_handle() {
+        return ArenaNodeStorage<Node>::null_handle();
+    }
+
+    /**
+     * @brief Создать хранилище на пуле.
+     */
+    explicit PooledNodeStorage(Pool& pool): pool_(&pool) {
+    }
+
+    PooledNodeStorage(PooledNodeStorage&&) = default;
+    PooledNodeStorage& operator=(PooledNodeStorage&&) = default;
+
+    /**
+     * @brief Создать новый узел.
+     */
+    Handle create() {
+        auto node = pool_->create();
+        ++node_count_;
+        return node;
+    }
+
+    /**
+     * @brief Удалить один узел (без потомков).
+     */
+    void destroy(Handle node) {
+        pool_->destroy(node);
+        --node_count_;
+    }
+
+    /**
+     * @brief Получить узел по дескриптору.
+     */
+    Node& operator[](Handle node) const {
+        return (*pool_)[node];
+    }
+
+    /**
+     * @brief Удалить все узлы дерева за O(1): пул освободит их позже.
+     * @param root Корень удаляемого дерева.
+     */
+    void release_all(Handle root) {
+        pool_->release(root, node_count_);
+        node_count_ = 0;
+    }
+
+    /**
+     * @brief Перенос дерева не нужен: свободные узлы переиспользуют все боры пула.
+     */
+    bool is_sparse() const {
+        return false;
+    }
+
+    /**
+     * @brief Объём памяти, занятой узлами этого дерева, в байтах.
+     */
+    size_t memory_usage() const {
+        return node_count_ * sizeof(Node);
+    }
+
+    /**
+     * @brief Количество созданных и ещё не удалённых узлов.
+     */
+    size_t node_count() const {
+        return node_count_;
+    }
+private:
+    Pool* pool_;  // Общий пул узлов.
+    size_t node_count_{0};  // Количество узлов этого дерева.
+};
+
+/**
+ * @brief Переставить биты слова так, чтобы бит с индексом i оказался на месте i xor key_bits.
+ * @details Каждый единичный бит ключа меняет местами соседние блоки соответствующего размера.
+ * @param word Слово.
+ * @param key_bits Младшие 6 битов ключа xor.
+ */
+inline uint64_t xor_permute_word(uint64_t word, uint8_t key_bits) {
+    static const uint64_t masks[6]{
+        0x5555555555555555, 0x3333333333333333, 0x0F0F0F0F0F0F0F0F,
+        0x00FF00FF00FF00FF, 0x0000FFFF0000FFFF, 0x00000000FFFFFFFF,
+    };
+    for (uint8_t bit_no = 0; bit_no < 6; ++bit_no) {
+        if (((key_bits >> bit_no) & 1) == 1) {
+            auto shift = 1u << bit_no;
+            word = ((word & masks[bit_no]) << shift) | ((word >> shift) & masks[bit_no]);
+        }
+    }
+    return word;
+}
+
+/**
+ * @brief Снимок статистики бора.
+ */
+struct TrieStats {
+    uint64_t live_nodes{0};  // Узлов в хранилище.
+    uint64_t live_bytes{0};  // Памяти, занятой узлами, в байтах.
+    uint64_t push_calls{0};  // Проталкиваний отложенного xor (узлов с непустой маской).
+    uint64_t push_swaps{0};  // Из них обменов потомков местами.
+    uint64_t fullness_propagations{0};  // Распространений полноты вверх после добавления числа.
+    uint64_t fullness_propagation_levels{0};  // Суммарная глубина распространений полноты.
+    uint64_t mex_descents{0};  // Спусков за MEX.
+    uint64_t mex_descent_levels{0};  // Суммарная длина спусков за MEX по уже существовавшим узлам (словам).
+    uint64_t xor_epochs{0};  // Операций xor всех чисел.
+
+    /**
+     * @brief Средняя глубина распространения полноты.
+     */
+    double average_fullness_depth() const {
+        return fullness_propagations == 0 ? 0.0 : static_cast<double>(fullness_propagation_levels) /
+                                                   fullness_propagations;
+    }
+
+    /**
+     * @brief Средняя длина спуска за MEX.
+     */
+    double average_mex_descent() const {
+        return mex_descents == 0 ? 0.0 : static_cast<double>(mex_descent_levels) / mex_descents;
+    }
+};
+
+/**
+ * @brief Политика статистики бора, не ведущая статистику: все методы пусты и исчезают при компиляции.
+ */
+struct NoTrieStats {
+    void on_push(bool) {
+    }
+
+    void on_fullness_propagation(uint64_t) {
+    }
+
+    void on_mex_descent(uint64_t) {
+    }
+
+    void on_xor() {
+    }
+
+    void on_storage_changed(uint64_t, uint64_t) {
+    }
+
+    TrieStats snapshot() const {
+        return {};
+    }
+};
+
+/**
+ * @brief Политика статистики бора на атомарных счётчиках.
+ * @details Бор изменяет один поток (или комбайнер ConcurrentDataBase), поэтому счётчики увеличиваются обычными
+ * чтением и записью с memory_order_relaxed, без атомарных read-modify-write инструкций: это те же инструкции mov,
+ * что и для обычных переменных. Снимок можно читать из любого потока в любой момент; отдельные счётчики
+ * в нём могут относиться к соседним операциям.
+ */
+class AtomicTrieStats {
+public:
+    void on_push(bool swapped) {
+        increase(push_calls_, 1);
+        if (swapped) {
+            increase(push_swaps_, 1);
+        }
+    }
+
+    void on_fullness_propagation(uint64_t levels) {
+        increase(fullness_propagations_, 1);
+        increase(fullness_propagation_levels_, levels);
+    }
+
+    void on_mex_descent(uint64_t levels) {
+        increase(mex_descents_, 1);
+        increase(mex_descent_levels_, levels);
+    }
+
+    void on_xor() {
+        increase(xor_epochs_, 1);
+    }
+
+    void on_storage_changed(uint64_t nodes, uint64_t bytes) {
+        live_nodes_.store(nodes, std::memory_order_relaxed);
+        live_bytes_.store(bytes, std::memory_order_relaxed);
+    }
+
+    TrieStats snapshot() const {
+        TrieStats result;
+        result.live_nodes = live_nodes_.load(std::memory_order_relaxed);
+        result.live_bytes = live_bytes_.load(std::memory_order_relaxed);
+        result.push_calls = push_calls_.load(std::memory_order_relaxed);
+        result.push_swaps = push_swaps_.load(std::memory_order_relaxed);
+        result.fullness_propagations = fullness_propagations_.load(std::memory_order_relaxed);
+        result.fullness_propagation_levels = fullness_propagation_levels_.load(std::memory_order_relaxed);
+        result.mex_descents = mex_descents_.load(std::memory_order_relaxed);
+        result.mex_descent_levels = mex_descent_levels_.load(std::memory_order_relaxed);
+        result.xor_epochs = xor_epochs_.load(std::memory_order_relaxed);
+        return result;
+    }
+private:
+    /**
+     * @brief Увеличить счётчик. Только для потока, изменяющего бор.
+     */
+    static void increase(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> live_nodes_{0};
+    std::atomic<uint64_t> live_bytes_{0};
+    std::atomic<uint64_t> push_calls_{0};
+    std::atomic<uint64_t> push_swaps_{0};
+    std::atomic<uint64_t> fullness_propagations_{0};
+    std::atomic<uint64_t> fullness_propagation_levels_{0};
+    std::atomic<uint64_t> mex_descents_{0};
+    std::atomic<uint64_t> mex_descent_levels_{0};
+    std::atomic<uint64_t> xor_epochs_{0};
+};
+
+/**
+ * @brief Битовый бор для чисел.
+ * @details Полнота поддерева хранится не в самом узле, а в его родителе: у каждого узла есть два бита полноты
+ * потомков. Поэтому при спуске читается только текущий узел, а листья (узлы последнего уровня) не создаются вовсе:
+ * числа последнего уровня - это биты полноты в узлах предпоследнего уровня.
+ * Каждый узел хранит количество чисел в своём поддереве. Отложенный xor переставляет поддеревья, но не меняет
+ * их размеров, поэтому размеры пересчитываются только вдоль пути изменения. По размерам за один спуск отвечаем
+ * на порядковые запросы: k-е свободное число, количество чисел в отрезке, число с минимальным xor.
+ * @tparam NumberType Тип данных хранимых чисел. Должен быть беззнаковым.
+ * @tparam NodeStorage Политика хранения узлов: HeapNodeStorage (узлы в куче), ArenaNodeStorage (узлы в арене)
+ * или PooledNodeStorage (узлы в общем для многих боров пуле).
+ * @tparam FlatBitset Хранить ли числа плоским битовым множеством вместо узлов. По умолчанию выбирается
+ * для 8 и 16-битных чисел (специализация ниже); явное false оставляет для них узловой бор.
+ * @tparam Stats Политика статистики: NoTrieStats (без статистики) или AtomicTrieStats.
+ */
+template<typename NumberType = uint8_t, template<typename> class NodeStorage = HeapNodeStorage,
+         bool FlatBitset = (sizeof(NumberType) <= 2), typename Stats = NoTrieStats>
+class BitTrie {
+    struct Node;
+public:
+    // Тип количества чисел: вмещает 2^разрядность для всех разрядностей, кроме 64 бит.
+    using Count = typename std::conditional<sizeof(NumberType) < sizeof(uint32_t), uint32_t, uint64_t>::type;
+    using Storage = NodeStorage<Node>;  // Хранилище узлов.
+
+    BitTrie() {
+        on_storage_changed();
+    }
+
+    /**
+     * @brief Создание бора в заданном хранилище, например, PooledNodeStorage на общем пуле.
+     */
+    explicit BitTrie(Storage storage): storage_(std::move(storage)) {
+        on_storage_changed();
+    }
+
+    BitTrie(const BitTrie&) = delete;
+    BitTrie& operator=(const BitTrie&) = delete;
+
+    /**
+     * @brief Удаление бора.
+     * @details Сводится к освобождению всех узлов хранилищем: поштучно для кучи, целиком для арены.
+     */
+    ~BitTrie() {
+        storage_.release_all(root_);
+    }
+
+    /**
+     * @brief Добавить в бор минимально возможное число (минимальное положительное целое, не хранящееся в боре).
+     * @details Поиск MEX и вставка выполняются за один спуск по дереву.
+     * @return Число, которое было добавлено в бор.
+     */
+    NumberType add_number() {
+        /**
+         * Спускаемся по дереву, заполняя биты результирующего числа:
+         *  * Корень соответствует старшему биту результата.
+         *  * Если левое поддерево неполное, то идём в него, бит равен 0.
+         *  * Иначе идём в правое поддерево, бит равен 1.
+         *  * Отсутствующие узлы сразу создаём: дальше спуск идёт по новым узлам, и оставшиеся биты равны 0.
+         * Пройденный путь запоминаем на стеке, чтобы затем пересчитать полноту снизу вверх.
+         */
+        if (storage_[root_].full_children == both_children_full_) {  // Если бор полный, то сообщаем об ошибке.
+            throw std::out_of_range("Trie is full.");
+        }
+        Handle path[max_depth_trie_];
+        NumberType result = 0;  // Установим все биты в 0.
+        Handle current = root_;  // Начнём со старшего бита.
+        auto initial_node_count = storage_.node_count();
+        for(int bit_no = max_depth_trie_ - 1; bit_no > 0; --bit_no) {  // Перебираем биты числа, кроме младшего.
+            path[bit_no] = current;
+            uint8_t bit_value = storage_[current].full_children & 1;  // Если левое поддерево полное, то идём вправо.
+            result |= static_cast<NumberType>(NumberType{bit_value} << bit_no);  // Устанавливаем значение бита.
+            current = get_or_create_child(current, bit_value);  // Перемещаемся в левого или правого потомка.
+        }
+        path[0] = current;
+        result |= storage_[current].full_children & 1;  // Младший бит определяется битами полноты узла.
+        propagate_fullness(path, result);
+        update_sizes(path, 1);
+        auto created_nodes = storage_.node_count() - initial_node_count;
+        stats_.on_mex_descent(max_depth_trie_ - 1 - created_nodes);  // Уровни, пройденные по существовавшим узлам.
+        on_storage_changed();
+        return result;
+    }
+
+    /**
+     * @brief Добавить в бор число.
+     * @param value Число, которое нужно добавить в бор.
+     */
+    void add_number(NumberType value) {
+        /**
+         * Нужно спуститься по дереву от корня к листьям, при необходимости создавая узлы.
+         * Спуск производится следующим образом:
+         *  * Начинаем со старшего бита добавляемого числа (старший бит - корень бора).
+         *  * Если очередной бит равен 0, идём в левого потомка, иначе - в правого.
+         */
+        Handle path[max_depth_trie_];
+        Handle current = root_;
+        for(int bit_no = max_depth_trie_ - 1; bit_no > 0; --bit_no) {  // Перебираем биты числа, кроме младшего.
+            path[bit_no] = current;
+            uint8_t bit_value = (value >> bit_no) & 1;  // Получаем значение бита.
+            current = get_or_create_child(current, bit_value);  // Спускаемся в нужного потомка.
+        }
+        path[0] = current;
+        if (((storage_[current].full_children >> (value & 1)) & 1) == 1) {
+            throw std::range_error("The ID is already taken.");  // Если число уже есть в боре, то возвращаем ошибку.
+        }
+        propagate_fullness(path, value);  // Ставим отметку о полноте и распространяем её вверх по пути.
+        update_sizes(path, 1);
+        on_storage_changed();
+    }
+
+    /**
+     * @brief Добавить в бор минимальное число из отрезка [lo, hi], не хранящееся в боре.
+     * @details Поиск - один спуск по битам lo, отсекающий полные поддеревья, и спуск к минимуму поддерева справа
+     * от пути, если само lo занято.
+     * @param lo Левая граница отрезка.
+     * @param hi Правая граница отрезка. По умолчанию - максимальное число, то есть ищется число не меньше lo.
+     * @return Число, которое было добавлено в бор.
+     */
+    NumberType add_number_in_range(NumberType lo, NumberType hi = static_cast<NumberType>(~NumberType{0})) {
+        if (hi < lo) {
+            throw std::out_of_range("The range is empty.");
+        }
+        auto result = find_free_not_less(lo);
+        if (result > hi) {
+            throw std::out_of_range("There are no free numbers in the range.");
+        }
+        add_number(result);
+        return result;
+    }
+
+    /**
+     * @brief Добавить в бор count минимальных чисел, не хранящихся в боре.
+     * @details Эквивалентно count вызовам add_number(), но выполняется за один обход неполных поддеревьев
+     * слева направо, а полнота каждого затронутого узла пересчитывается один раз.
+     * Если свободных чисел не хватает, то бор заполняется целиком и бросается исключение.
+     * @param count Количество добавляемых чисел.
+     * @param out Итератор вывода, в который записываются добавленные числа в порядке возрастания.
+     * @return Итератор вывода после последнего записанного числа.
+     */
+    template<typename OutputIterator>
+    OutputIterator add_numbers(size_t count, OutputIterator out) {
+        if (count == 0) {
+            return out;
+        }
+        if (storage_[root_].full_children == both_children_full_) {
+            throw std::out_of_range("Trie is full.");
+        }
+        fill_free(root_, max_depth_trie_, 0, count, out);
+        on_storage_changed();
+        if (count > 0) {
+            throw std::out_of_range("Trie is full.");
+        }
+        return out;
+    }
+
+    /**
+     * @brief Удалить число из бора.
+     * @details Спуск производит отложенные xor, подъём снимает отметки полноты. Узлы, поддеревья которых опустели,
+     * возвращаются в хранилище. Если хранилище стало разреженным, дерево переносится в плотное хранилище,
+     * так что память следует за количеством хранимых чисел, а не за их историческим максимумом.
+     * @param value Число, которое нужно удалить.
+     */
+    void remove_number(NumberType value) {
+        Handle path[max_depth_trie_];
+        Handle current = root_;
+        for(int bit_no = max_depth_trie_ - 1; bit_no > 0; --bit_no) {  // Перебираем биты числа, кроме младшего.
+            path[bit_no] = current;
+            Handle child = storage_[current].children[(value >> bit_no) & 1];
+            if (child == Storage::null_handle()) {  // Поддерево пустое, значит, числа в боре нет.
+                throw std::range_error("The ID is not taken.");
+            }
+            push_inconsistency(child);  // При посещении узла нужно произвести отложенный xor.
+            current = child;
+        }
+        path[0] = current;
+        if (((storage_[current].full_children >> (value & 1)) & 1) == 0) {
+            throw std::range_error("The ID is not taken.");
+        }
+        clear_fullness(path, value);
+        update_sizes(path, -1);
+        prune_empty_nodes(path, value);
+        if (storage_.is_sparse()) {
+            shrink_to_fit();
+        }
+        on_storage_changed();
+    }
+
+    /**
+     * @brief Все хранимые числа сложить по модулю 2 с заданным числом.
+     * @param value Второе слагаемое для операции xor.
+     */
+    void xor_all_values(NumberType value) {
+        storage_[root_].xor_mask ^= value;  // Ставим отметку для отложенной операции в корне дерева.
+        push_inconsistency(root_);  // Не оставляем в корне несогласованность, чтобы облегчить обращения к корню.
+        stats_.on_xor();
+    }
+
+    /**
+     * @brief Перенести дерево в новое хранилище, занимающее минимум памяти.
+     * @details Узлы копируются обходом в глубину, поэтому заодно оказываются в памяти в порядке спуска.
+     * Отложенные маски xor копируются как есть. Вызывается автоматически при удалении чисел.
+     * Дерево в общем пуле не переносится: его свободные узлы и так переиспользуются другими борами.
+     */
+    void shrink_to_fit() {
+        shrink_storage(std::is_default_constructible<Storage>());
+    }
+
+    /**
+     * @brief Объём памяти, занятой узлами бора, в байтах.
+     */
+    size_t memory_usage() const {
+        return storage_.memory_usage();
+    }
+
+    /**
+     * @brief Количество узлов бора.
+     */
+    size_t node_count() const {
+        return storage_.node_count();
+    }
+
+    /**
+     * @brief Снимок статистики. Счётчики ведутся, только если политика статистики - AtomicTrieStats.
+     * @details С AtomicTrieStats снимок можно читать из любого потока одновременно с изменениями бора.
+     */
+    TrieStats stats() const {
+        return stats_.snapshot();
+    }
+
+    /**
+     * @brief Количество хранимых чисел.
+     * @details Если хранятся все 2^64 чисел 64-битного бора, то результат переполняется и равен 0.
+     */
+    Count size() const {
+        return storage_[root_].size;
+    }
+
+    /**
+     * @brief Найти k-е по возрастанию число, не хранящееся в боре (нумерация с нуля, 0-е - это MEX).
+     * @details Спуск выбирает поддерево по количеству свободных чисел в левом потомке.
+     * @param k Номер свободного числа.
+     * @return Свободное число.
+     */
+    NumberType kth_free(NumberType k) {
+        if (size() != 0 && k >= static_cast<NumberType>(0 - size())) {  // Свободных чисел 2^разрядность - size().
+            throw std::out_of_range("There are not enough free numbers.");
+        }
+        NumberType result = 0;
+        Handle current = root_;
+        for (int bit_no = max_depth_trie_ - 1; bit_no >= 0; --bit_no) {
+            auto left_size = child_size(current, 0, bit_no);
+            auto left_free = static_cast<NumberType>((NumberType{1} << bit_no) - left_size);
+            uint8_t bit_value = k < left_free ? 0 : 1;
+            if (bit_value == 1) {
+                k -= left_free;
+            }
+            result |= static_cast<NumberType>(NumberType{bit_value} << bit_no);
+            if (bit_no == 0) {
+                break;
+            }
+            Handle child = storage_[current].children[bit_value];
+            if (child == Storage::null_handle()) {  // Поддерево пустое: k-е свободное число в нём - само k.
+                return result | k;
+            }
+            push_inconsistency(child);
+            current = child;
+        }
+        return result;
+    }
+
+    /**
+     * @brief Количество хранимых чисел в отрезке [lo, hi].
+     * @param lo Левая граница отрезка.
+     * @param hi Правая граница отрезка. Если hi < lo, то отрезок пуст.
+     */
+    Count count_in_range(NumberType lo, NumberType hi) {
+        if (hi < lo) {
+            return 0;
+        }
+        return count_not_greater(hi) - (lo == 0 ? 0 : count_not_greater(lo - 1));
+    }
+
+    /**
+     * @brief Найти хранимое число, дающее минимальный xor с заданным.
+     * @param value Число, с которым складываются хранимые числа.
+     * @return Хранимое число (а не результат xor).
+     */
+    NumberType min_xor(NumberType value) {
+        return extreme_xor(value);
+    }
+
+    /**
+     * @brief Найти хранимое число, дающее максимальный xor с заданным.
+     * @param value Число, с которым складываются хранимые числа.
+     * @return Хранимое число (а не результат xor).
+     */
+    NumberType max_xor(NumberType value) {
+        return extreme_xor(static_cast<NumberType>(~value));  // Максимум xor с value - минимум xor с ~value.
+    }
+
+    /**
+     * @brief Сохранить бор в файл.
+     * @details Узлы сохраняются вместе с отметками полноты и отложенными масками xor.
+     * Доступно для хранилищ, поддерживающих снимки (ArenaNodeStorage).
+     * @param path Путь к файлу.
+     */
+    void save(const std::string& path) const {
+        SnapshotHeader header{max_depth_trie_, root_};
+        storage_.save(path, &header, sizeof(header));
+    }
+
+    /**
+     * @brief Заменить содержимое бора сохранённым в файле.
+     * @details Узлы не восстанавливаются по одному: хранилище отображает файл в память. Затем дерево один раз
+     * обходится от корня, чтобы повреждённый файл не нарушил инварианты бора.
+     * @param path Путь к файлу.
+     */
+    void load(const std::string& path) {
+        SnapshotHeader header{};
+        storage_.load(path, &header, sizeof(header));
+        if (header.number_bits != max_depth_trie_) {
+            storage_.release_all(root_);
+            root_ = storage_.create();
+            throw std::runtime_error("Snapshot file stores numbers of another width.");
+        }
+        size_t budget = storage_.node_count();  // Каждый живой узел обходится один раз.
+        if (!storage_.contains(header.root) || !is_subtree_valid(header.root, max_depth_trie_ - 1, budget) ||
+            budget != 0) {
+            storage_.release_all(root_);
+            root_ = storage_.create();
+            throw std::runtime_error("Snapshot file is corrupted.");
+        }
+        root_ = header.root;
+        on_storage_changed();
+    }
+private:
+    using Handle = typename Storage::Handle;
+
+    /**
+     * @brief Заголовок снимка бора.
+     */
+    struct SnapshotHeader {
+        uint8_t number_bits;  // Разрядность чисел.
+        Handle root;  // Корень дерева.
+    };
+
+    /**
+     * @brief Проверить поддерево, прочитанное из файла.
+     * @details Размер узла должен совпадать с суммой размеров потомков, а отметки полноты - с размерами.
+     * У узлов последнего уровня потомков нет: их числа - это отметки полноты. Глубина рекурсии ограничена
+     * разрядностью чисел, а количество посещений - количеством живых узлов, поэтому общие поддеревья и циклы
+     * в повреждённом файле не зацикливают проверку.
+     * @param node Корень поддерева.
+     * @param bit_no Бит числа, который выбирается в узле.
+     * @param budget Сколько узлов ещё можно посетить. Уменьшается по мере обхода.
+     * @return true, если поддерево согласовано.
+     */
+    bool is_subtree_valid(Handle node, int bit_no, size_t& budget) const {
+        if (budget == 0) {
+            return false;
+        }
+        --budget;
+        const Node& current = storage_[node];
+        if (bit_no == 0) {
+            return current.children[0] == Storage::null_handle() && current.children[1] == Storage::null_handle() &&
+                   current.size == Count{(current.full_children & 1u) + (current.full_children >> 1)} &&
+                   current.full_children <= both_children_full_;
+        }
+        Count size = 0;
+        for (uint8_t index = 0; index < 2; ++index) {
+            Handle child = current.children[index];
+            Count child_size = 0;
+            if (child != Storage::null_handle()) {
+                if (!is_subtree_valid(child, bit_no - 1, budget)) {
+                    return false;
+                }
+                child_size = storage_[child].size;
+            }
+            bool full = child_size == Count{1} << bit_no;  // Потомок определяет bit_no младших битов.
+            if (full != (((current.full_children >> index) & 1) == 1)) {
+                return false;
+            }
+            size += child_size;
+        }
+        return current.size == size && current.full_children <= both_children_full_;
+    }
+
+    /**
+     * @brief Количество чисел в поддереве потомка.
+     * @details Размер не зависит от отложенного xor в потомке, поэтому потомка не нужно обновлять.
+     * @param node Узел (отложенный xor в нём уже произведён).
+     * @param index 0 - левый потомок, 1 - правый.
+     * @param bit_no Бит числа, который выбирается в узле. Потомки узла с bit_no = 0 - сами числа.
+     */
+    Count child_size(Handle node, uint8_t index, int bit_no) const {
+        const Node& current = storage_[node];
+        if (bit_no == 0) {
+            return (current.full_children >> index) & 1;
+        }
+        Handle child = current.children[index];
+        return child == Storage::null_handle() ? 0 : storage_[child].size;
+    }
+
+    /**
+     * @brief Найти минимальное число, не меньшее заданного и не хранящееся в боре.
+     * @details Спускаемся по битам lo, запоминая самый глубокий узел, где lo идёт влево, а правое поддерево неполное.
+     * Если путь lo упирается в полное поддерево, то ответ - минимум правого поддерева запомненного узла.
+     */
+    NumberType find_free_not_less(NumberType lo) {
+        Handle current = root_;
+        Handle candidate = Storage::null_handle();  // Узел, в котором можно повернуть вправо.
+        int candidate_bit_no = -1;
+        for (int bit_no = max_depth_trie_ - 1; bit_no >= 0; --bit_no) {
+            uint8_t bit_value = (lo >> bit_no) & 1;
+            const Node& node = storage_[current];
+            if (bit_value == 0 && ((node.full_children >> 1) & 1) == 0) {
+                candidate = current;
+                candidate_bit_no = bit_no;
+            }
+            if (((node.full_children >> bit_value) & 1) == 1) {  // Все числа с префиксом lo заняты.
+                break;
+            }
+            if (bit_no == 0) {
+                return lo;
+            }
+            Handle child = node.children[bit_value];
+            if (child == Storage::null_handle()) {  // Поддерево пустое, значит, lo свободно.
+                return lo;
+            }
+            push_inconsistency(child);
+            current = child;
+        }
+        if (candidate_bit_no < 0) {
+            throw std::out_of_range("There are no free numbers in the range.");
+        }
+        auto result = static_cast<NumberType>(((lo >> candidate_bit_no) | 1) << candidate_bit_no);
+        if (candidate_bit_no == 0) {
+            return result;
+        }
+        current = storage_[candidate].children[1];
+        for (int bit_no = candidate_bit_no - 1; current != Storage::null_handle(); --bit_no) {  // Спуск как в MEX.
+            push_inconsistency(current);
+            uint8_t bit_value = storage_[current].full_children & 1;
+            result |= static_cast<NumberType>(NumberType{bit_value} << bit_no);
+            if (bit_no == 0) {
+                break;
+            }
+            current = storage_[current].children[bit_value];
+        }
+        return result;
+    }
+
+    /**
+     * @brief Количество хранимых чисел, не больших заданного.
+     * @details Спускаемся по битам числа; поворачивая вправо, прибавляем размер левого поддерева.
+     */
+    Count count_not_greater(NumberType value) {
+        Count result = 0;
+        Handle current = root_;
+        for (int bit_no = max_depth_trie_ - 1; bit_no >= 0; --bit_no) {
+            uint8_t bit_value = (value >> bit_no) & 1;
+            if (bit_value == 1) {
+                result += child_size(current, 0, bit_no);
+            }
+            if (bit_no == 0) {
+                return result + ((storage_[current].full_children >> bit_value) & 1);
+            }
+            Handle child = storage_[current].children[bit_value];
+            if (child == Storage::null_handle()) {
+                return result;
+            }
+            push_inconsistency(child);
+            current = child;
+        }
+        return result;
+    }
+
+    /**
+     * @brief Найти хранимое число, ближайшее к заданному в метрике xor.
+     * @details Спускаемся, по возможности повторяя биты заданного числа.
+     */
+    NumberType extreme_xor(NumberType value) {
+        if (size() == 0 && storage_[root_].full_children == 0) {
+            throw std::out_of_range("Trie is empty.");
+        }
+        NumberType result = 0;
+        Handle current = root_;
+        for (int bit_no = max_depth_trie_ - 1; bit_no >= 0; --bit_no) {
+            uint8_t bit_value = (value >> bit_no) & 1;
+            if (child_size(current, bit_value, bit_no) == 0) {
+                bit_value ^= 1;  // Нужное поддерево пустое - идём в другое.
+            }
+            result |= static_cast<NumberType>(NumberType{bit_value} << bit_no);
+            if (bit_no > 0) {
+                current = storage_[current].children[bit_value];
+                push_inconsistency(current);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Изменить размеры поддеревьев вдоль пути.
+     * @param path Пройденный путь: path[level] - узел, в котором выбирается бит level числа.
+     * @param delta 1 при добавлении числа, -1 при удалении.
+     */
+    void update_sizes(const Handle* path, int delta) {
+        for (uint8_t level = 0; level < max_depth_trie_; ++level) {
+            storage_[path[level]].size += delta;
+        }
+    }
+
+    /**
+     * @brief Занять минимальные свободные числа в неполном поддереве.
+     * @param node Корень поддерева (отложенный xor в нём уже произведён).
+     * @param level Количество битов числа, определяемых поддеревом.
+     * @param prefix Биты числа, определённые выше поддерева.
+     * @param count Сколько чисел ещё нужно занять. Уменьшается по мере заполнения.
+     * @param out Итератор вывода для занятых чисел.
+     */
+    template<typename OutputIterator>
+    void fill_free(Handle node, uint8_t level, NumberType prefix, size_t& count, OutputIterator& out) {
+        auto initial_count = count;
+        for (uint8_t index = 0; index < 2 && count > 0; ++index) {  // Сначала левое поддерево, затем правое.
+            if (((storage_[node].full_children >> index) & 1) == 1) {
+                continue;
+            }
+            auto child_prefix = prefix | static_cast<NumberType>(NumberType{index} << (level - 1));
+            if (level > 1) {
+                Handle child = get_or_create_child(node, index);
+                fill_free(child, level - 1, child_prefix, count, out);
+                if (storage_[child].full_children != both_children_full_) {
+                    continue;
+                }
+            } else {  // Потомок последнего уровня - это само число.
+                *out++ = child_prefix;
+                --count;
+            }
+            storage_[node].full_children |= 1 << index;
+        }
+        storage_[node].size += initial_count - count;
+    }
+
+    /**
+     * @brief Получить дескриптор потомка. Если потомок отсутствует, то создать его.
+     * @details Индекс не проверяется: метод вызывается только из внутренних спусков по дереву.
+     * @param node Узел, потомок которого нужен.
+     * @param index 0, если нужен левый потомок, 1 - правый.
+     * @return Дескриптор потомка (не может быть пустым).
+     */
+    Handle get_or_create_child(Handle node, uint8_t index) {
+        assert(index <= 1);
+        Handle child = storage_[node].children[index];
+        if (child == Storage::null_handle()) {
+            child = storage_.create();  // Создание узла может переместить узлы арены, поэтому ссылки не храним.
+            storage_[node].children[index] = child;
+        } else {
+            push_inconsistency(child);  // При посещении узла нужно произвести отложенный xor.
+        }
+        return child;
+    }
+
+    /**
+     * @brief Отметить число занятым и распространить полноту вверх по пути.
+     * @details Полнота узла может только появиться, поэтому подъём останавливается на первом неполном узле.
+     * @param path Пройденный путь: path[level] - узел, в котором выбирается бит level числа.
+     * @param value Занимаемое число. Его биты указывают, через какого потомка проходит путь.
+     */
+    void propagate_fullness(const Handle* path, NumberType value) {
+        uint8_t level = 0;
+        for (; level < max_depth_trie_; ++level) {
+            Node& node = storage_[path[level]];
+            node.full_children |= 1 << ((value >> level) & 1);
+            if (node.full_children != both_children_full_) {
+                break;
+            }
+        }
+        stats_.on_fullness_propagation(level);
+    }
+
+    /**
+     * @brief Сообщить статистике размер хранилища.
+     */
+    void on_storage_changed() {
+        stats_.on_storage_changed(storage_.node_count(), storage_.memory_usage());
+    }
+
+    /**
+     * @brief Снять с числа отметку занятости и убрать полноту вверх по пути.
+     * @details Полноту теряют только узлы, которые были полными, поэтому подъём останавливается на первом неполном.
+     * @param path Пройденный путь: path[level] - узел, в котором выбирается бит level числа.
+     * @param value Освобождаемое число.
+     */
+    void clear_fullness(const Handle* path, NumberType value) {
+        for (uint8_t level = 0; level < max_depth_trie_; ++level) {
+            Node& node = storage_[path[level]];
+            bool was_full = node.full_children == both_children_full_;
+            node.full_children &= ~(1 << ((value >> level) & 1));
+            if (!was_full) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Вернуть в хранилище узлы пути, поддеревья которых опустели.
+     * @details Узел пуст, если у него нет потомков и отметок полноты. Корень не удаляется никогда.
+     * @param path Пройденный путь: path[level] - узел, в котором выбирается бит level числа.
+     * @param value Освобождённое число. Его биты указывают, через какого потомка проходит путь.
+     */
+    void prune_empty_nodes(const Handle* path, NumberType value) {
+        for (uint8_t level = 0; level + 1 < max_depth_trie_; ++level) {
+            if (storage_[path[level]].size != 0) {
+                return;
+            }
+            storage_.destroy(path[level]);
+            storage_[path[level + 1]].children[(value >> (level + 1)) & 1] = Storage::null_handle();
+        }
+    }
+
+    /**
+     * @brief Перенести дерево в новое хранилище.
+     */
+    void shrink_storage(std::true_type) {
+        Storage compacted;
+        Handle root = copy_subtree(compacted, root_);
+        storage_.release_all(root_);
+        storage_ = std::move(compacted);
+        root_ = root;
+        on_storage_changed();
+    }
+
+    /**
+     * @brief Хранилище без собственного буфера (на общем пуле) переносить некуда.
+     */
+    void shrink_storage(std::false_type) {
+    }
+
+    /**
+     * @brief Скопировать поддерево в другое хранилище.
+     * @param target Хранилище, в которое копируются узлы.
+     * @param node Корень копируемого поддерева.
+     * @return Дескриптор копии корня в новом хранилище.
+     */
+    Handle copy_subtree(Storage& target, Handle node) const {
+        Handle copy = target.create();  // Родитель перед потомками: узлы лягут в порядке спуска.
+        Handle children[2];
+        for (uint8_t index = 0; index < 2; ++index) {
+            Handle child = storage_[node].children[index];
+            children[index] = child == Storage::null_handle() ? child : copy_subtree(target, child);
+        }
+        Node& copied = target[copy];  // Создание узлов перемещает узлы арены, поэтому ссылку берём в конце.
+        copied = storage_[node];
+        copied.children[0] = children[0];
+        copied.children[1] = children[1];
+        return copy;
+    }
+
+    /**
+     * @brief Произвести отложенный xor для узла и протолкнуть отложенную операцию потомкам.
+     * @param node Узел, в котором нужно произвести отложенную операцию.
+     */
+    void push_inconsistency(Handle node) {
+        Node& current = storage_[node];
+        if (current.xor_mask == 0) {
+            return;
+        }
+        bool swapped = ((current.xor_mask >> (max_depth_trie_ - 1)) & 1) == 1;  // Если соответствующий бит равен 1.
+        stats_.on_push(swapped);
+        if (swapped) {
+            std::swap(current.children[0], current.children[1]);  // Меняем детей местами вместе с их полнотой.
+            current.full_children = ((current.full_children & 1) << 1) | (current.full_children >> 1);
+        }
+        for (auto child : current.children) {
+            if (child != Storage::null_handle()) {
+                storage_[child].xor_mask ^= current.xor_mask << 1;  // Проталкиваем несогласованность потомкам.
+            }
+        }
+        current.xor_mask = 0;
+    }
+
+    /**
+     * @brief Узел битового бора.
+     * @details Узел не владеет потомками: временем жизни всех узлов управляет хранилище.
+     * Ссылки на родителя нет: путь от корня при необходимости запоминается во время спуска.
+     */
+    struct Node {
+        Handle children[2]{Storage::null_handle(), Storage::null_handle()};  // Потомки.
+        NumberType xor_mask{0};  // Пометки о необходимости отложенной операции xor.
+        uint8_t full_children{0};  // Биты полноты поддеревьев потомков: 1 - левого, 2 - правого.
+        Count size{0};  // Количество чисел в поддереве. Последним, чтобы не было выравнивания между полями.
+    };
+
+    static const uint8_t both_children_full_{3};  // Оба поддерева потомков полные, а значит, и поддерево узла.
+
+    Storage storage_;  // Хранилище узлов.
+    Handle root_{storage_.create()};  // Корень дерева.
+    Stats stats_;  // Статистика.
+    static const uint8_t max_depth_trie_{sizeof(NumberType) * 8};  // Максимальная глубина дерева.
+};
+
+/**
+ * @brief Битовый бор для узких чисел (8 и 16 бит), хранящийся как плоское битовое множество.
+ * @details Весь диапазон помещается в 32 байта или 8 КиБ, поэтому узлы не нужны: бит с номером value xor ключ
+ * означает, что число value занято. Xor всех чисел меняет только ключ. Логическое число value - это слово
+ * (value >> 6) xor (ключ >> 6) и бит внутри слова (value & 63) xor (ключ & 63): старшие биты ключа переставляют
+ * слова, младшие - биты внутри слова.
+ * MEX ищется сканированием слов в логическом порядке: группа слов размером с кэш-линию проверяется на полноту
+ * векторными сравнениями (AVX2 или SSE2, в зависимости от флагов компиляции), а внутри найденного слова первый
+ * свободный бит находится подсчётом младших нулей после перестановки битов. Слова левее последнего найденного
+ * MEX заведомо полные, поэтому повторный поиск начинается с него.
+ * Порядковые запросы сканируют слова, а не спускаются по дереву: O(2^разрядность / 64) вместо O(разрядность).
+ * Интерфейс совпадает с узловым BitTrie.
+ * @tparam NumberType Тип данных хранимых чисел: uint8_t или uint16_t.
+ * @tparam NodeStorage Не используется: узлов нет. Параметр оставлен, чтобы специализация выбиралась по FlatBitset.
+ */
+template<typename NumberType, template<typename> class NodeStorage, typename Stats>
+class BitTrie<NumberType, NodeStorage, true, Stats> {
+public:
+    static_assert(sizeof(NumberType) <= 2, "Flat bitsets are meant for 8 and 16-bit numbers.");
+
+    // Тип количества чисел: вмещает 2^разрядность.
+    using Count = uint32_t;
+
+    BitTrie() {
+        stats_.on_storage_changed(0, sizeof(words_));
+    }
+
+    BitTrie(const BitTrie&) = delete;
+    BitTrie& operator=(const BitTrie&) = delete;
+
+    /**
+     * @brief Выделить память под множество с выравниванием на кэш-линию.
+     * @details В C++14 обычный new не учитывает alignas, а группы слов должны совпадать с кэш-линиями.
+     */
+    static void* operator new(size_t size) {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, alignof(BitTrie), size) != 0) {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    static void operator delete(void* memory) {
+        std::free(memory);
+    }
+
+    /**
+     * @brief Добавить минимально возможное число (минимальное положительное целое, не хранящееся в множестве).
+     * @return Число, которое было добавлено.
+     */
+    NumberType add_number() {
+        auto word = find_word(first_free_word_, key_ >> word_shift_, ~uint64_t{0});
+        if (word == words_count_) {
+            throw std::out_of_range("Trie is full.");
+        }
+        stats_.on_mex_descent(word - first_free_word_ + 1);  // Длина спуска - количество просмотренных слов.
+        first_free_word_ = word;
+        auto key_bits = static_cast<uint8_t>(key_ & (word_bits_ - 1));
+        auto bit = __builtin_ctzll(~xor_permute_word(words_[word ^ (key_ >> word_shift_)], key_bits));
+        auto result = static_cast<NumberType>(word * word_bits_ + bit);
+        set_bit(result ^ key_);
+        return result;
+    }
+
+    /**
+     * @brief Добавить число.
+     * @param value Число, которое нужно добавить.
+     */
+    void add_number(NumberType value) {
+        if (test_bit(value ^ key_)) {
+            throw std::range_error("The ID is already taken.");
+        }
+        set_bit(value ^ key_);
+    }
+
+    /**
+     * @brief Добавить минимальное число из отрезка [lo, hi], не хранящееся в множестве.
+     * @param lo Левая граница отрезка.
+     * @param hi Правая граница отрезка. По умолчанию - максимальное число, то есть ищется число не меньше lo.
+     * @return Число, которое было добавлено.
+     */
+    NumberType add_number_in_range(NumberType lo, NumberType hi = static_cast<NumberType>(~NumberType{0})) {
+        if (hi < lo) {
+            throw std::out_of_range("The range is empty.");
+        }
+        auto key_words = key_ >> word_shift_;
+        auto key_bits = static_cast<uint8_t>(key_ & (word_bits_ - 1));
+        size_t word = lo / word_bits_;
+        auto free_bits = ~xor_permute_word(words_[word ^ key_words], key_bits) & (~uint64_t{0} << (lo % word_bits_));
+        if (free_bits == 0) {
+            word = find_word(std::max<size_t>(word + 1, first_free_word_), key_words, ~uint64_t{0});
+            if (word == words_count_) {
+                throw std::out_of_range("There are no free numbers in the range.");
+            }
+            free_bits = ~xor_permute_word(words_[word ^ key_words], key_bits);
+        }
+        auto result = word * word_bits_ + __builtin_ctzll(free_bits);
+        if (result > hi) {
+            throw std::out_of_range("There are no free numbers in the range.");
+        }
+        set_bit(static_cast<NumberType>(result) ^ key_);
+        return static_cast<NumberType>(result);
+    }
+
+    /**
+     * @brief Добавить count минимальных чисел, не хранящихся в множестве.
+     * @details Если свободных чисел не хватает, то множество заполняется целиком и бросается исключение.
+     * @param count Количество добавляемых чисел.
+     * @param out Итератор вывода, в который записываются добавленные числа в порядке возрастания.
+     * @return Итератор вывода после последнего записанного числа.
+     */
+    template<typename OutputIterator>
+    OutputIterator add_numbers(size_t count, OutputIterator out) {
+        for (; count > 0; --count) {  // Поиск продолжается с предыдущего MEX, поэтому слова просматриваются один раз.
+            *out++ = add_number();
+        }
+        return out;
+    }
+
+    /**
+     * @brief Удалить число.
+     * @param value Число, которое нужно удалить.
+     */
+    void remove_number(NumberType value) {
+        NumberType position = value ^ key_;
+        if (!test_bit(position)) {
+            throw std::range_error("The ID is not taken.");
+        }
+        words_[position / word_bits_] &= ~(uint64_t{1} << (position % word_bits_));
+        --size_;
+        first_free_word_ = std::min<size_t>(first_free_word_, value / word_bits_);
+    }
+
+    /**
+     * @brief Все хранимые числа сложить по модулю 2 с заданным числом.
+     * @param value Второе слагаемое для операции xor.
+     */
+    void xor_all_values(NumberType value) {
+        key_ ^= value;
+        first_free_word_ = 0;  // Порядок слов изменился: полнота левых слов больше не известна.
+        stats_.on_xor();
+    }
+
+    /**
+     * @brief Ничего не делает: память множества не зависит от количества хранимых чисел.
+     */
+    void shrink_to_fit() {
+    }
+
+    /**
+     * @brief Объём памяти, занятой множеством, в байтах. Не зависит от количества хранимых чисел.
+     */
+    size_t memory_usage() const {
+        return sizeof(words_);
+    }
+
+    /**
+     * @brief Количество узлов: у плоского множества их нет.
+     */
+    size_t node_count() const {
+        return 0;
+    }
+
+    /**
+     * @brief Снимок статистики. Счётчики ведутся, только если политика статистики - AtomicTrieStats.
+     * @details Узлов и проталкиваний xor у плоского множества нет, длина спуска за MEX - просмотренные слова.
+     */
+    TrieStats stats() const {
+        return stats_.snapshot();
+    }
+
+    /**
+     * @brief Количество хранимых чисел.
+     */
+    Count size() const {
+        return size_;
+    }
+
+    /**
+     * @brief Найти k-е по возрастанию число, не хранящееся в множестве (нумерация с нуля, 0-е - это MEX).
+     * @param k Номер свободного числа.
+     * @return Свободное число.
+     */
+    NumberType kth_free(NumberType k) {
+        if (k >= words_count_ * word_bits_ - size_) {
+            throw std::out_of_range("There are not enough free numbers.");
+        }
+        auto key_words = key_ >> word_shift_;
+        auto key_bits = static_cast<uint8_t>(key_ & (word_bits_ - 1));
+        size_t word = 0;
+        Count skipped = 0;
+        for (;; ++word) {  // Количество свободных битов слова не зависит от перестановки.
+            auto free_count = word_bits_ - __builtin_popcountll(words_[word ^ key_words]);
+            if (skipped + free_count > k) {
+                break;
+            }
+            skipped += free_count;
+        }
+        auto free_bits = ~xor_permute_word(words_[word ^ key_words], key_bits);
+        for (; skipped < k; ++skipped) {
+            free_bits &= free_bits - 1;  // Пропускаем младший свободный бит.
+        }
+        return static_cast<NumberType>(word * word_bits_ + __builtin_ctzll(free_bits));
+    }
+
+    /**
+     * @brief Количество хранимых чисел в отрезке [lo, hi].
+     * @param lo Левая граница отрезка.
+     * @param hi Правая граница отрезка. Если hi < lo, то отрезок пуст.
+     */
+    Count count_in_range(NumberType lo, NumberType hi) {
+        if (hi < lo) {
+            return 0;
+        }
+        auto key_words = key_ >> word_shift_;
+        auto key_bits = static_cast<uint8_t>(key_ & (word_bits_ - 1));
+        Count result = 0;
+        for (size_t word = lo / word_bits_; word <= hi / word_bits_; ++word) {
+            auto bits = words_[word ^ key_words];
+            if (word == lo / word_bits_ || word == hi / word_bits_) {  // Крайние слова - по маске логических битов.
+                bits = xor_permute_word(bits, key_bits);
+                if (word == lo / word_bits_) {
+                    bits &= ~uint64_t{0} << (lo % word_bits_);
+                }
+                if (word == hi / word_bits_) {
+                    bits &= ~uint64_t{0} >> (word_bits_ - 1 - hi % word_bits_);
+                }
+            }
+            result += __builtin_popcountll(bits);
+        }
+        return result;
+    }
+
+    /**
+     * @brief Найти хранимое число, дающее минимальный xor с заданным.
+     * @details Число x лежит на позиции x xor ключ, и x xor value = позиция xor (ключ xor value). Поэтому искомое
+     * число - первое занятое в логическом порядке под ключом (ключ xor value): ищем его тем же сканированием, что и MEX.
+     * @param value Число, с которым складываются хранимые числа.
+     * @return Хранимое число (а не результат xor).
+     */
+    NumberType min_xor(NumberType value) {
+        auto key = static_cast<NumberType>(key_ ^ value);
+        auto word = find_word(0, key >> word_shift_, 0);
+        if (word == words_count_) {
+            throw std::out_of_range("Trie is empty.");
+        }
+        auto key_bits = static_cast<uint8_t>(key & (word_bits_ - 1));
+        auto bit = __builtin_ctzll(xor_permute_word(words_[word ^ (key >> word_shift_)], key_bits));
+        return static_cast<NumberType>((word * word_bits_ + bit) ^ value);
+    }
+
+    /**
+     * @brief Найти хранимое число, дающее максимальный xor с заданным.
+     * @param value Число, с которым складываются хранимые числа.
+     * @return Хранимое число (а не результат xor).
+     */
+    NumberType max_xor(NumberType value) {
+        return min_xor(static_cast<NumberType>(~value));  // Максимум xor с value - минимум xor с ~value.
+    }
+
+    /**
+     * @brief Сохранить множество в файл.
+     * @details Формат: заголовок, затем слова множества. Формат зависит от платформы (порядок байтов).
+     * @param path Путь к файлу.
+     */
+    void save(const std::string& path) const {
+        SnapshotHeader header{snapshot_magic_, sizeof(NumberType) * 8, key_, size_};
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "wb"), std::fclose);
+        if (file == nullptr) {
+            throw std::runtime_error("Cannot open snapshot file for writing.");
+        }
+        bool written = std::fwrite(&header, sizeof(header), 1, file.get()) == 1 &&
+                       std::fwrite(words_, sizeof(words_), 1, file.get()) == 1;
+        if (!written || std::fflush(file.get()) != 0 || fsync(fileno(file.get())) != 0) {
+            throw std::runtime_error("Cannot write snapshot file.");
+        }
+    }
+
+    /**
+     * @brief Заменить содержимое множества сохранённым в файле.
+     * @details Размер из заголовка сверяется с количеством единичных битов. При ошибке содержимое не меняется.
+     * @param path Путь к файлу.
+     */
+    void load(const std::string& path) {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+        if (file == nullptr) {
+            throw std::runtime_error("Cannot open snapshot file for reading.");
+        }
+        SnapshotHeader header{};
+        if (std::fread(&header, sizeof(header), 1, file.get()) != 1 || header.magic != snapshot_magic_) {
+            throw std::runtime_error("Snapshot file is corrupted.");
+        }
+        if (header.number_bits != sizeof(NumberType) * 8) {
+            throw std::runtime_error("Snapshot file stores numbers of another width.");
+        }
+        uint64_t words[words_count_];
+        if (std::fread(words, sizeof(words), 1, file.get()) != 1) {
+            throw std::runtime_error("Snapshot file is corrupted.");
+        }
+        Count size = 0;
+        for (auto word : words) {
+            size += __builtin_popcountll(word);
+        }
+        if (size != header.size) {
+            throw std::runtime_error("Snapshot file is corrupted.");
+        }
+        std::memcpy(words_, words, sizeof(words_));
+        key_ = header.key;
+        size_ = header.size;
+        first_free_word_ = 0;
+    }
+private:
+    /**
+     * @brief Заголовок снимка множества.
+     */
+    struct SnapshotHeader {
+        uint64_t magic;  // Сигнатура формата.
+        uint8_t number_bits;  // Разрядность чисел.
+        NumberType key;  // Накопленный ключ xor.
+        Count size;  // Количество хранимых чисел.
+    };
+
+    /**
+     * @brief Занят ли бит.
+     * @param position Позиция бита (зашифрованное число).
+     */
+    bool test_bit(NumberType position) const {
+        return ((words_[position / word_bits_] >> (position % word_bits_)) & 1) == 1;
+    }
+
+    /**
+     * @brief Занять свободный бит.
+     * @param position Позиция бита (зашифрованное число).
+     */
+    void set_bit(NumberType position) {
+        words_[position / word_bits_] |= uint64_t{1} << (position % word_bits_);
+        ++size_;
+    }
+
+    /**
+     * @brief Найти первое в логическом порядке слово, отличное от заданного.
+     * @details Группа слов с номерами [i, i + group_words_) при перестановке слов переходит в группу
+     * с номерами [i xor старшие биты ключа, ...) целиком, поэтому группы проверяются векторно, без перестановки.
+     * @param from Логический номер слова, с которого начинается поиск.
+     * @param key_words Биты ключа, переставляющие слова.
+     * @param filler Пропускаемое значение слова: ~0 при поиске свободного числа, 0 - при поиске занятого.
+     * @return Логический номер найденного слова или words_count_, если все слова равны filler.
+     */
+    size_t find_word(size_t from, size_t key_words, uint64_t filler) const {
+        for (; from < words_count_ && from % group_words_ != 0; ++from) {  // Неполная первая группа.
+            if (words_[from ^ key_words] != filler) {
+                return from;
+            }
+        }
+        for (size_t group = from; group < words_count_; group += group_words_) {
+            if (!group_equals(words_ + (group ^ (key_words & ~(group_words_ - 1))), filler)) {
+                for (auto word = group;; ++word) {
+                    if (words_[word ^ key_words] != filler) {
+                        return word;
+                    }
+                }
+            }
+        }
+        return words_count_;
+    }
+
+    /**
+     * @brief Все ли слова группы равны заданному значению.
+     * @details Загрузки невыровненные: объект может лежать в памяти без учёта alignas (std::allocator в C++14).
+     * @param words Начало группы.
+     * @param filler Значение слова: 0 или ~0 (поэтому сравнивать можно и 32-битными частями).
+     */
+    static bool group_equals(const uint64_t* words, uint64_t filler) {
+#if defined(__AVX2__)
+        auto expected = _mm256_set1_epi32(static_cast<int>(filler));
+        auto equal = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(words)), expected);
+        for (size_t offset = 4; offset < group_words_; offset += 4) {
+            auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + offset));
+            equal = _mm256_and_si256(equal, _mm256_cmpeq_epi32(block, expected));
+        }
+        return _mm256_movemask_epi8(equal) == -1;
+#elif defined(__SSE2__)
+        auto expected = _mm_set1_epi32(static_cast<int>(filler));
+        auto equal = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words)), expected);
+        for (size_t offset = 2; offset < group_words_; offset += 2) {
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + offset));
+            equal = _mm_and_si128(equal, _mm_cmpeq_epi32(block, expected));
+        }
+        return _mm_movemask_epi8(equal) == 0xFFFF;
+#else
+        uint64_t difference = 0;
+        for (size_t offset = 0; offset < group_words_; ++offset) {
+            difference |= words[offset] ^ filler;
+        }
+        return difference == 0;
+#endif
+    }
+
+    static const uint8_t word_shift_{6};  // Младшие 6 битов числа - номер бита в слове.
+    static const size_t word_bits_{64};  // Битов в слове.
+    static const size_t words_count_{(size_t{1} << (sizeof(NumberType) * 8)) / word_bits_};  // Слов в множестве.
+    static const size_t group_words_{words_count_ < 8 ? words_count_ : 8};  // Слов в группе - кэш-линия.
+    static const uint64_t snapshot_magic_{0x31544553544C4146};  // "FLATSET1" в little-endian.
+
+    alignas(64) uint64_t words_[words_count_]{};  // Биты множества. Бит value xor key_ - отметка о числе value.
+    NumberType key_{0};  // Накопленный ключ xor.
+    Count size_{0};  // Количество хранимых чисел.
+    size_t first_free_word_{0};  // Логический номер слова, левее которого все слова полные.
+    Stats stats_;  // Статистика.
+};
+
+/**
+ * @brief Битовый бор со сжатием путей (radix-бор).
+ * @details Цепочки узлов с единственным потомком схлопываются в один узел, хранящий метку - пропущенные биты.
+ * Внутренние узлы всегда имеют двух потомков, поэтому спуск занимает O(количество ветвлений) вместо O(разрядность).
+ * Отложенный xor устроен так же, как в BitTrie: маска в узле выровнена так, что её старший бит соответствует
+ * первому биту метки узла. При проталкивании маска применяется к метке, бит ветвления меняет потомков местами,
+ * а остаток маски сдвигается к потомкам.
+ * Поддерево полное, если метка пустая и оба потомка полные (или узел - лист на последнем уровне).
+ * @tparam NumberType Тип данных хранимых чисел. Должен быть беззнаковым.
+ * @tparam NodeStorage Политика хранения узлов: HeapNodeStorage или ArenaNodeStorage.
+ */
+template<typename NumberType = uint8_t, template<typename> class NodeStorage = HeapNodeStorage>
+class CompressedBitTrie {
+    struct Node;
+public:
+    CompressedBitTrie() = default;
+    CompressedBitTrie(const CompressedBitTrie&) = delete;
+    CompressedBitTrie& operator=(const CompressedBitTrie&) = delete;
+
+    ~CompressedBitTrie() {
+        storage_.release_all(root_);
+    }
+
+    /**
+     * @brief Добавить в бор минимально возможное число (минимальное положительное целое, не хранящееся в боре).
+     * @return Число, которое было добавлено в бор.
+     */
+    NumberType add_number() {
+        auto id = mex();
+        add_number(id);
+        return id;
+    }
+
+    /**
+     * @brief Добавить в бор число.
+     * @param value Число, которое нужно добавить в бор.
+     */
+    void add_number(NumberType value) {
+        if (root_ == Storage::null_handle()) {  // Пустой бор: корень сразу становится листом с полной меткой.
+            root_ = create_leaf(value, 0);
+            return;
+        }
+        /**
+         * Спускаемся от корня, сравнивая метки узлов с битами числа.
+         * Если метка совпала не полностью, то узел разделяется на общую часть и две ветки.
+         * Если метка совпала, то переходим к потомку по следующему биту.
+         * Пройденный путь запоминаем, чтобы затем пересчитать полноту снизу вверх.
+         */
+        Handle path[max_depth_trie_ + 1];
+        uint8_t path_length = 0;
+        Handle current = root_;
+        uint8_t depth = 0;  // Количество битов числа, определённых выше текущего узла.
+        while (true) {
+            push_inconsistency(current);
+            path[path_length++] = current;
+            Node& node = storage_[current];
+            auto common = common_prefix(node.label, get_bits(value, depth, node.label_length), node.label_length);
+            if (common < node.label_length) {
+                split(current, depth, common, value);
+                break;
+            }
+            depth += node.label_length;
+            if (depth == max_depth_trie_) {  // Дошли до листа с этим числом.
+                throw std::range_error("The ID is already taken.");
+            }
+            current = node.children[get_bits(value, depth, 1)];
+            depth += 1;
+        }
+        while (path_length > 0) {  // Пересчитываем полноту вверх по пройденному пути.
+            Node& node = storage_[path[--path_length]];
+            bool fullness = compute_fullness(node);
+            if (node.is_full == fullness) {
+                break;
+            }
+            node.is_full = fullness;
+        }
+    }
+
+    /**
+     * @brief Все хранимые числа сложить по модулю 2 с заданным числом.
+     * @param value Второе слагаемое для операции xor.
+     */
+    void xor_all_values(NumberType value) {
+        if (root_ == Storage::null_handle()) {
+            return;
+        }
+        storage_[root_].xor_mask ^= value;
+        push_inconsistency(root_);
+    }
+
+    /**
+     * @brief Количество узлов бора.
+     */
+    size_t node_count() const {
+        return node_count_;
+    }
+private:
+    using Storage = NodeStorage<Node>;
+    using Handle = typename Storage::Handle;
+
+    /**
+     * @brief Поиск минимального положительного целого числа, не хранящегося в боре.
+     * @return Значение минимального положительного целого числа, не хранящегося в боре.
+     */
+    NumberType mex() {
+        /**
+         * Спускаемся по неполным поддеревьям:
+         *  * Если метка узла ненулевая, то число с нулевыми битами на месте метки отсутствует - это и есть MEX.
+         *  * Если метка нулевая и все числа с такой меткой заняты, то MEX - первое число со следующей меткой.
+         *  * Иначе идём в левого потомка, если он неполный, или в правого, устанавливая бит в 1.
+         */
+        if (root_ == Storage::null_handle()) {
+            return 0;
+        }
+        if (storage_[root_].is_full) {
+            throw std::out_of_range("Trie is full.");
+        }
+        NumberType result = 0;
+        Handle current = root_;
+        uint8_t depth = 0;
+        while (true) {
+            push_inconsistency(current);
+            const Node& node = storage_[current];
+            if (node.label != 0) {
+                return result;
+            }
+            depth += node.label_length;
+            if (is_slice_full(node)) {
+                // Все числа с нулевой меткой заняты, а узел неполный, значит, метка непустая.
+                // MEX - наименьшее число со следующим значением метки.
+                return result | static_cast<NumberType>(NumberType{1} << (max_depth_trie_ - depth));
+            }
+            Handle left = node.children[0];
+            if (storage_[left].is_full) {
+                result |= NumberType{1} << (max_depth_trie_ - 1 - depth);
+                current = node.children[1];
+            } else {
+                current = left;
+            }
+            depth += 1;
+        }
+    }
+
+    /**
+     * @brief Разделить узел, метка которого совпала с битами числа не полностью.
+     * @details Узел сохраняет общую часть метки и получает двух потомков:
+     * хвост прежнего узла (с его потомками) и новый лист для добавляемого числа.
+     * @param node Разделяемый узел (отложенный xor в нём уже произведён).
+     * @param depth Количество битов, определённых выше узла.
+     * @param common Длина совпавшей части метки.
+     * @param value Добавляемое число.
+     */
+    void split(Handle node, uint8_t depth, uint8_t common, NumberType value) {
+        Handle tail = storage_.create();  // Сначала создаём узлы: создание может переместить узлы арены.
+        ++node_count_;
+        Handle leaf = create_leaf(value, depth + common + 1);
+        Node& split_node = storage_[node];
+        Node& tail_node = storage_[tail];
+        uint8_t tail_length = split_node.label_length - common - 1;
+        tail_node.label = split_node.label & low_mask(tail_length);
+        tail_node.label_length = tail_length;
+        tail_node.children[0] = split_node.children[0];
+        tail_node.children[1] = split_node.children[1];
+        tail_node.is_full = compute_fullness(tail_node);  // Хвост мог стать полным, потеряв часть метки.
+        auto tail_bit = (split_node.label >> tail_length) & 1;
+        split_node.label = shift_right(split_node.label, tail_length + 1);
+        split_node.label_length = common;
+        split_node.children[tail_bit] = tail;
+        split_node.children[tail_bit ^ 1] = leaf;
+    }
+
+    /**
+     * @brief Создать лист для числа.
+     * @param value Число.
+     * @param depth Количество битов числа, определённых выше листа. Остальные биты попадают в метку.
+     * @return Дескриптор листа.
+     */
+    Handle create_leaf(NumberType value, uint8_t depth) {
+        Handle leaf = storage_.create();
+        ++node_count_;
+        Node& node = storage_[leaf];
+        node.label_length = max_depth_trie_ - depth;
+        node.label = get_bits(value, depth, node.label_length);
+        node.is_full = node.label_length == 0;
+        return leaf;
+    }
+
+    /**
+     * @brief Заняты ли все числа поддерева, у которых биты на месте метки совпадают с меткой.
+     */
+    bool is_slice_full(const Node& node) const {
+        if (node.children[0] == Storage::null_handle()) {  // Лист соответствует одному числу.
+            return true;
+        }
+        return storage_[node.children[0]].is_full && storage_[node.children[1]].is_full;
+    }
+
+    /**
+     * @brief Вычислить полноту поддерева узла по его метке и потомкам.
+     */
+    bool compute_fullness(const Node& node) const {
+        return node.label_length == 0 && is_slice_full(node);
+    }
+
+    /**
+     * @brief Произвести отложенный xor для узла и протолкнуть отложенную операцию потомкам.
+     * @param handle Узел, в котором нужно произвести отложенную операцию.
+     */
+    void push_inconsistency(Handle handle) {
+        Node& node = storage_[handle];
+        if (node.xor_mask == 0) {
+            return;
+        }
+        node.label ^= shift_right(node.xor_mask, max_depth_trie_ - node.label_length);  // Меняем биты метки.
+        if (node.children[0] != Storage::null_handle()) {
+            if ((shift_right(node.xor_mask, max_depth_trie_ - 1 - node.label_length) & 1) == 1) {
+                std::swap(node.children[0], node.children[1]);  // Бит ветвления меняет потомков местами.
+            }
+            auto child_mask = shift_left(node.xor_mask, node.label_length + 1);
+            storage_[node.children[0]].xor_mask ^= child_mask;
+            storage_[node.children[1]].xor_mask ^= child_mask;
+        }
+        node.xor_mask = 0;
+    }
+
+    /**
+     * @brief Получить биты числа.
+     * @param value Число.
+     * @param from Номер первого бита, считая от старшего (старший бит имеет номер 0).
+     * @param length Количество битов.
+     * @return Биты, выровненные к младшему разряду.
+     */
+    static NumberType get_bits(NumberType value, uint8_t from, uint8_t length) {
+        return shift_right(value, max_depth_trie_ - from - length) & low_mask(length);
+    }
+
+    /**
+     * @brief Длина общего префикса двух последовательностей битов одинаковой длины.
+     */
+    static uint8_t common_prefix(NumberType first, NumberType second, uint8_t length) {
+        uint64_t difference = first ^ second;
+        if (difference == 0) {
+            return length;
+        }
+        return length - 1 - (63 - __builtin_clzll(difference));
+    }
+
+    /**
+     * @brief Маска из length младших единичных битов.
+     */
+    static NumberType low_mask(uint8_t length) {
+        return length >= max_depth_trie_ ? static_cast<NumberType>(~NumberType{0})
+                                         : static_cast<NumberType>((NumberType{1} << length) - 1);
+    }
+
+    /**
+     * @brief Сдвиг вправо, допускающий сдвиг на всю разрядность числа.
+     */
+    static NumberType shift_right(NumberType value, uint8_t shift) {
+        return shift >= max_depth_trie_ ? 0 : static_cast<NumberType>(value >> shift);
+    }
+
+    /**
+     * @brief Сдвиг влево, допускающий сдвиг на всю разрядность числа.
+     */
+    static NumberType shift_left(NumberType value, uint8_t shift) {
+        return shift >= max_depth_trie_ ? 0 : static_cast<NumberType>(value << shift);
+    }
+
+    /**
+     * @brief Узел бора со сжатием путей.
+     */
+    struct Node {
+        Handle children[2]{Storage::null_handle(), Storage::null_handle()};  // Потомки (оба или ни одного).
+        NumberType label{0};  // Пропущенные биты, выровненные к младшему разряду.
+        NumberType xor_mask{0};  // Пометки о необходимости отложенной операции xor.
+        uint8_t label_length{0};  // Количество пропущенных битов.
+        bool is_full{false};  // Полное ли поддерево?
+    };
+
+    Storage storage_;  // Хранилище узлов.
+    Handle root_{Storage::null_handle()};  // Корень дерева (пустой, пока в боре нет чисел).
+    size_t node_count_{0};  // Количество узлов.
+    static const uint8_t max_depth_trie_{sizeof(NumberType) * 8};  // Разрядность чисел.
+};
+
+/**
+ * @brief Иерархическая битовая карта для поиска MEX в ограниченном диапазоне чисел.
+ * @details Нижний уровень хранит по биту на каждое число, каждый следующий уровень - по биту на слово
+ * предыдущего уровня ("слово полностью занято"). Верхний уровень состоит из одного слова.
+ * Xor всех чисел не переставляет данные: хранится общий ключ, числа лежат в карте в зашифрованном виде.
+ * При спуске слово очередного уровня переставляется в порядок логических индексов (индекс xor часть ключа),
+ * после чего первый свободный индекс находится одной инструкцией подсчёта младших нулей.
+ * Диапазон чисел округляется вверх до степени двойки: только такие диапазоны замкнуты относительно xor.
+ * @tparam NumberType Тип данных хранимых чисел. Должен быть беззнаковым и не шире 32 бит.
+ */
+template<typename NumberType = uint32_t>
+class HierarchicalBitmap {
+public:
+    static_assert(sizeof(NumberType) <= 4, "The bitmap is meant for IDs that fit in 32 bits.");
+
+    /**
+     * @brief Создание пустой карты.
+     * @param max_value Максимальное число, которое нужно уметь хранить.
+     */
+    explicit HierarchicalBitmap(NumberType max_value) {
+        domain_bits_ = 0;
+        while (domain_bits_ < sizeof(NumberType) * 8 && (uint64_t{max_value} >> domain_bits_) != 0) {
+            ++domain_bits_;
+        }
+        uint64_t bits_count = uint64_t{1} << domain_bits_;
+        do {  // Уровни снизу вверх, пока уровень не поместится в одно слово.
+            uint64_t words_count = (bits_count + word_bits_ - 1) / word_bits_;
+            levels_.emplace_back(words_count, 0);
+            if (bits_count % word_bits_ != 0) {
+                levels_.back().back() = ~uint64_t{0} << bits_count;  // Несуществующие индексы считаем занятыми.
+            }
+            bits_count = words_count;
+        } while (bits_count > 1);
+    }
+
+    /**
+     * @brief Добавить минимально возможное число (минимальное положительное целое, не хранящееся в карте).
+     * @return Число, которое было добавлено.
+     */
+    NumberType add_number() {
+        auto position = find_free_position();
+        set_position(position);
+        return static_cast<NumberType>(position ^ key_);
+    }
+
+    /**
+     * @brief Добавить число.
+     * @param value Число, которое нужно добавить.
+     */
+    void add_number(NumberType value) {
+        if ((uint64_t{value} >> domain_bits_) != 0) {
+            throw std::out_of_range("The ID is out of the bitmap domain.");
+        }
+        uint64_t position = value ^ key_;
+        if (((levels_[0][position / word_bits_] >> (position % word_bits_)) & 1) == 1) {
+            throw std::range_error("The ID is already taken.");
+        }
+        set_position(position);
+    }
+
+    /**
+     * @brief Удалить число.
+     * @param value Число, которое нужно удалить.
+     */
+    void remove_number(NumberType value) {
+        uint64_t position = value ^ key_;
+        if ((uint64_t{value} >> domain_bits_) != 0 ||
+            ((levels_[0][position / word_bits_] >> (position % word_bits_)) & 1) == 0) {
+            throw std::range_error("The ID is not taken.");
+        }
+        for (auto& level : levels_) {  // Слово выше теряет бит, только если слово было полным.
+            auto& word = level[position / word_bits_];
+            bool was_full = word == ~uint64_t{0};
+            word &= ~(uint64_t{1} << (position % word_bits_));
+            if (!was_full) {
+                return;
+            }
+            position /= word_bits_;
+        }
+    }
+
+    /**
+     * @brief Добавить count минимальных чисел, не хранящихся в карте.
+     * @details Если свободных чисел не хватает, то карта заполняется целиком и бросается исключение.
+     * @param count Количество добавляемых чисел.
+     * @param out Итератор вывода, в который записываются добавленные числа в порядке возрастания.
+     * @return Итератор вывода после последнего записанного числа.
+     */
+    template<typename OutputIterator>
+    OutputIterator add_numbers(size_t count, OutputIterator out) {
+        for (; count > 0; --count) {  // Каждый поиск - несколько слов без переходов по указателям.
+            *out++ = add_number();
+        }
+        return out;
+    }
+
+    /**
+     * @brief Все хранимые числа сложить по модулю 2 с заданным числом.
+     * @param value Второе слагаемое для операции xor. Не должно выводить числа за пределы диапазона.
+     */
+    void xor_all_values(NumberType value) {
+        if ((uint64_t{value} >> domain_bits_) != 0) {
+            throw std::out_of_range("The key is out of the bitmap domain.");
+        }
+        key_ ^= value;
+    }
+
+    /**
+     * @brief Объём памяти, занятой картой, в байтах. Не зависит от количества хранимых чисел.
+     */
+    size_t memory_usage() const {
+        size_t result = 0;
+        for (auto& level : levels_) {
+            result += level.size() * sizeof(uint64_t);
+        }
+        return result;
+    }
+private:
+    /**
+     * @brief Найти позицию в карте, соответствующую минимальному свободному числу.
+     * @return Позиция в нижнем уровне карты (зашифрованное число).
+     */
+    uint64_t find_free_position() const {
+        /**
+         * Спускаемся с верхнего уровня. На уровне level индекс бита внутри слова соответствует
+         * битам числа [6 * level, 6 * level + 6), поэтому соответствующие биты ключа переставляют биты слова.
+         * Позиция бита на уровне level - это номер слова на уровне level - 1.
+         */
+        if (levels_.back()[0] == ~uint64_t{0}) {
+            throw std::out_of_range("Bitmap is full.");
+        }
+        uint64_t position = 0;
+        for (auto level = levels_.size(); level-- > 0;) {
+            auto key_bits = static_cast<uint8_t>((key_ >> (word_shift_ * level)) & (word_bits_ - 1));
+            auto word = xor_permute_word(levels_[level][position], key_bits);
+            auto logical_bit = __builtin_ctzll(~word);  // Первый незанятый индекс в логическом порядке.
+            position = position * word_bits_ + (logical_bit ^ key_bits);
+        }
+        return position;
+    }
+
+    /**
+     * @brief Занять позицию и распространить полноту слов вверх по уровням.
+     * @param position Позиция в нижнем уровне карты.
+     */
+    void set_position(uint64_t position) {
+        for (auto& level : levels_) {
+            auto& word = level[position / word_bits_];
+            word |= uint64_t{1} << (position % word_bits_);
+            if (word != ~uint64_t{0}) {
+                return;
+            }
+            position /= word_bits_;
+        }
+    }
+
+    static const uint8_t word_shift_{6};  // Каждый уровень отвечает за 6 битов числа.
+    static const uint64_t word_bits_{64};  // Битов в слове.
+
+    std::vector<std::vector<uint64_t>> levels_;  // Уровни карты, начиная с нижнего.
+    uint8_t domain_bits_{0};  // Разрядность диапазона чисел.
+    NumberType key_{0};  // Накопленный ключ xor.
+};
+
+/**
+ * @brief Персистентный битовый бор: каждое изменение создаёт новую версию, не трогая прежние.
+ * @details Изменение копирует только путь от корня до числа (копирование пути), остальные узлы новая версия
+ * разделяет с предыдущей. Узлы неизменяемы и освобождаются, когда на них не остаётся ссылок.
+ * Xor всех чисел не копирует узлов: ключ хранится в версии рядом с корнем, число value лежит в дереве
+ * на месте value xor ключ. При спуске бит ключа указывает, какой физический потомок соответствует логическому нулю.
+ * Изменения выполняет один поток. Читатели в любых потоках берут снимок текущей версии без блокировок
+ * и выполняют запросы к нему, не мешая изменениям; от снимка можно перейти к версии любой прошлой эпохи шифрования.
+ * @tparam NumberType Тип данных хранимых чисел. Должен быть беззнаковым.
+ */
+template<typename NumberType = uint8_t>
+class PersistentBitTrie {
+    struct Node;
+public:
+    /**
+     * @brief Неизменяемая версия бора.
+     * @details Копирование версии - копирование двух умных указателей, запросы к версии не берут блокировок.
+     */
+    class Version {
+    public:
+        Version(const Version&) = default;
+        Version(Version&&) noexcept = default;
+        Version& operator=(const Version&) = default;
+        Version& operator=(Version&&) noexcept = default;
+
+        /**
+         * @brief Удаление версии.
+         * @details Цепочка прошлых эпох может быть длинной, поэтому её хвост, которым больше никто не владеет,
+         * освобождается в цикле, а не рекурсией деструкторов.
+         */
+        ~Version() {
+            while (previous_epoch_ != nullptr && previous_epoch_.use_count() == 1) {
+                auto previous = std::move(previous_epoch_->previous_epoch_);
+                previous_epoch_ = std::move(previous);
+            }
+        }
+
+        /**
+         * @brief Поиск минимального положительного целого числа, не хранящегося в версии.
+         */
+        NumberType mex() const {
+            if (root_ != nullptr && root_->full_children == both_children_full_) {
+                throw std::out_of_range("Trie is full.");
+            }
+            NumberType result = 0;
+            const Node* node = root_.get();
+            for (int bit_no = max_depth_trie_ - 1; bit_no >= 0 && node != nullptr; --bit_no) {
+                uint8_t zero_child = (key_ >> bit_no) & 1;  // Физический потомок, в котором логический бит равен 0.
+                uint8_t bit_value = (node->full_children >> zero_child) & 1;  // Если он полный, то бит равен 1.
+                result |= static_cast<NumberType>(NumberType{bit_value} << bit_no);
+                node = bit_no > 0 ? node->children[zero_child ^ bit_value].get() : nullptr;
+            }
+            return result;  // Биты ниже отсутствующего узла равны 0.
+        }
+
+        /**
+         * @brief Хранится ли число в версии.
+         * @param value Искомое число.
+         */
+        bool contains(NumberType value) const {
+            NumberType position = value ^ key_;
+            const Node* node = root_.get();
+            for (int bit_no = max_depth_trie_ - 1; bit_no > 0 && node != nullptr; --bit_no) {
+                node = node->children[(position >> bit_no) & 1].get();
+            }
+            return node != nullptr && ((node->full_children >> (position & 1)) & 1) == 1;
+        }
+
+        /**
+         * @brief Перебрать хранимые числа в порядке возрастания.
+         * @param visitor Функция, принимающая число.
+         */
+        template<typename Visitor>
+        void for_each(Visitor&& visitor) const {
+            if (root_ != nullptr) {
+                visit(root_.get(), max_depth_trie_ - 1, 0, visitor);
+            }
+        }
+
+        /**
+         * @brief Номер эпохи шифрования: сколько раз числа шифровались до этой версии.
+         */
+        size_t epoch() const {
+            return epoch_;
+        }
+
+        /**
+         * @brief Последняя версия заданной эпохи шифрования (не позже этой версии).
+         * @details Прошлые эпохи связаны в цепочку, переход занимает O(epoch() - epoch).
+         * @param epoch Номер эпохи, не больше epoch().
+         */
+        Version at_epoch(size_t epoch) const {
+            if (epoch > epoch_) {
+                throw std::out_of_range("The epoch has not started yet.");
+            }
+            const Version* version = this;
+            while (version->epoch_ > epoch) {
+                version = version->previous_epoch_.get();
+            }
+            return *version;
+        }
+    private:
+        friend class PersistentBitTrie;
+
+        Version() = default;
+
+        /**
+         * @brief Обойти поддерево в порядке возрастания логических чисел.
+         * @param node Корень поддерева.
+         * @param bit_no Бит числа, который выбирается в узле.
+         * @param prefix Логические биты числа, определённые выше узла.
+         * @param visitor Функция, принимающая число.
+         */
+        template<typename Visitor>
+        void visit(const Node* node, int bit_no, NumberType prefix, Visitor& visitor) const {
+            for (uint8_t bit_value = 0; bit_value < 2; ++bit_value) {
+                uint8_t index = bit_value ^ ((key_ >> bit_no) & 1);
+                auto value = static_cast<NumberType>(prefix | NumberType{bit_value} << bit_no);
+                if (bit_no == 0) {
+                    if (((node->full_children >> index) & 1) == 1) {
+                        visitor(value);
+                    }
+                } else if (node->children[index] != nullptr) {
+                    visit(node->children[index].get(), bit_no - 1, value, visitor);
+                }
+            }
+        }
+
+        std::shared_ptr<const Node> root_;  // Корень дерева (пустой указатель, если чисел нет).
+        NumberType key_{0};  // Накопленный ключ xor.
+        size_t epoch_{0};  // Номер эпохи шифрования.
+        std::shared_ptr<Version> previous_epoch_;  // Последняя версия предыдущей эпохи.
+    };
+
+    PersistentBitTrie(): current_(std::shared_ptr<Version>(new Version())) {
+    }
+
+    PersistentBitTrie(const PersistentBitTrie&) = delete;
+    PersistentBitTrie& operator=(const PersistentBitTrie&) = delete;
+
+    /**
+     * @brief Снимок текущей версии. Может вызываться из любого потока одновременно с изменениями.
+     */
+    Version snapshot() const {
+        return *std::atomic_load(&current_);
+    }
+
+    /**
+     * @brief Добавить в бор минимально возможное число (минимальное положительное целое, не хранящееся в боре).
+     * @return Число, которое было добавлено в бор.
+     */
+    NumberType add_number() {
+        auto result = current_->mex();
+        add_number(result);
+        return result;
+    }
+
+    /**
+     * @brief Добавить в бор число.
+     * @param value Число, которое нужно добавить в бор.
+     */
+    void add_number(NumberType value) {
+        const Node* path[max_depth_trie_];
+        NumberType position = find_path(value, path);
+        if (path[0] != nullptr && ((path[0]->full_children >> (position & 1)) & 1) == 1) {
+            throw std::range_error("The ID is already taken.");
+        }
+        std::shared_ptr<Node> child;
+        for (uint8_t level = 0; level < max_depth_trie_; ++level) {  // Копируем путь снизу вверх.
+            auto node = path[level] == nullptr ? std::make_shared<Node>() : std::make_shared<Node>(*path[level]);
+            uint8_t index = (position >> level) & 1;
+            if (level == 0 || child->full_children == both_children_full_) {
+                node->full_children |= 1 << index;
+            }
+            if (level > 0) {
+                node->children[index] = std::move(child);
+            }
+            child = std::move(node);
+        }
+        publish(std::move(child), current_->key_, current_->epoch_, current_->previous_epoch_);
+    }
+
+    /**
+     * @brief Добавить в бор count минимальных чисел, не хранящихся в боре.
+     * @param count Количество добавляемых чисел.
+     * @param out Итератор вывода, в который записываются добавленные числа в порядке возрастания.
+     * @return Итератор вывода после последнего записанного числа.
+     */
+    template<typename OutputIterator>
+    OutputIterator add_numbers(size_t count, OutputIterator out) {
+        for (; count > 0; --count) {  // Каждое добавление - отдельная версия, доступная читателям.
+            *out++ = add_number();
+        }
+        return out;
+    }
+
+    /**
+     * @brief Удалить число из бора.
+     * @details Узлы, поддеревья которых опустели, в новую версию не попадают.
+     * @param value Число, которое нужно удалить.
+     */
+    void remove_number(NumberType value) {
+        const Node* path[max_depth_trie_];
+        NumberType position = find_path(value, path);
+        if (path[0] == nullptr || ((path[0]->full_children >> (position & 1)) & 1) == 0) {
+            throw std::range_error("The ID is not taken.");
+        }
+        std::shared_ptr<Node> child;
+        for (uint8_t level = 0; level < max_depth_trie_; ++level) {
+            auto node = std::make_shared<Node>(*path[level]);
+            uint8_t index = (position >> level) & 1;
+            node->full_children &= ~(1 << index);  // Поддерево без удалённого числа не может быть полным.
+            if (level > 0) {
+                node->children[index] = std::move(child);
+            }
+            if (node->full_children != 0 || node->children[0] != nullptr || node->children[1] != nullptr) {
+                child = std::move(node);
+            } else {
+                child = nullptr;
+            }
+        }
+        publish(std::move(child), current_->key_, current_->epoch_, current_->previous_epoch_);
+    }
+
+    /**
+     * @brief Все хранимые числа сложить по модулю 2 с заданным числом и начать новую эпоху шифрования.
+     * @details Новая версия разделяет с предыдущей корень и отличается только ключом.
+     * @param value Второе слагаемое для операции xor.
+     */
+    void xor_all_values(NumberType value) {
+        publish(current_->root_, current_->key_ ^ value, current_->epoch_ + 1, current_);
+    }
+private:
+    /**
+     * @brief Спуститься по пути к числу в текущей версии.
+     * @param value Число.
+     * @param path Массив для пути: path[level] - узел, в котором выбирается бит level (пустой, если узла нет).
+     * @return Положение числа в дереве (число xor ключ).
+     */
+    NumberType find_path(NumberType value, const Node** path) const {
+        NumberType position = value ^ current_->key_;
+        const Node* node = current_->root_.get();
+        for (int bit_no = max_depth_trie_ - 1; bit_no > 0; --bit_no) {
+            path[bit_no] = node;
+            node = node == nullptr ? nullptr : node->children[(position >> bit_no) & 1].get();
+        }
+        path[0] = node;
+        return position;
+    }
+
+    /**
+     * @brief Сделать текущей новую версию.
+     * @details Указатель на текущую версию заменяется атомарно, поэтому читатели видят либо старую, либо новую.
+     */
+    void publish(std::shared_ptr<const Node> root, NumberType key, size_t epoch,
+                 std::shared_ptr<Version> previous_epoch) {
+        std::shared_ptr<Version> version(new Version());
+        version->root_ = std::move(root);
+        version->key_ = key;
+        version->epoch_ = epoch;
+        version->previous_epoch_ = std::move(previous_epoch);
+        std::atomic_store(&current_, std::move(version));
+    }
+
+    /**
+     * @brief Неизменяемый узел персистентного бора.
+     * @details Как и в BitTrie, полнота потомков хранится в родителе, а узлы последнего уровня не создаются.
+     */
+    struct Node {
+        std::shared_ptr<const Node> children[2];  // Потомки, разделяемые между версиями.
+        uint8_t full_children{0};  // Биты полноты поддеревьев потомков: 1 - левого, 2 - правого.
+    };
+
+    static const uint8_t both_children_full_{3};  // Оба поддерева потомков полные, а значит, и поддерево узла.
+    static const uint8_t max_depth_trie_{sizeof(NumberType) * 8};  // Максимальная глубина дерева.
+
+    std::shared_ptr<Version> current_;  // Текущая версия. Заменяется только писателем, читается атомарно.
+};
+
+/**
+ * @brief Обёртка для работы с битовым бором в терминах задачи.
+ * @tparam Trie Структура для хранения id-шников: BitTrie, CompressedBitTrie, HierarchicalBitmap или PersistentBitTrie.
+ */
+template<typename Trie>
+class BasicDataBase {
+public:
+    /**
+     * @brief Создание базы.
+     * @param trie_args Параметры структуры для хранения id-шников (например, максимальный id для HierarchicalBitmap).
+     */
+    template<typename... TrieArgs>
+    explicit BasicDataBase(TrieArgs&&... trie_args): trie(std::forward<TrieArgs>(trie_args)...) {
+    }
+
+    /**
+     * @brief Зарегистрировать пользователя.
+     * @return Id нового пользователя.
+     */
+    uint64_t register_new_user() {
+        return trie.add_number();
+    }
+
+    /**
+     * @brief Зарегистрировать пользователя с id из отрезка [lo, hi].
+     * @details Пользователь получает минимальный свободный id отрезка. Если свободных id в отрезке нет,
+     * то бросается исключение.
+     * @param lo Левая граница отрезка.
+     * @param hi Правая граница отрезка. По умолчанию отрезок не ограничен справа.
+     * @return Id нового пользователя.
+     */
+    uint64_t register_new_user(uint64_t lo, uint64_t hi = UINT64_MAX) {
+        const uint64_t max_id = static_cast<Id>(~Id{0});
+        if (lo > max_id) {
+            throw std::out_of_range("There are no free numbers in the range.");
+        }
+        return trie.add_number_in_range(static_cast<Id>(lo), static_cast<Id>(std::min(hi, max_id)));
+    }
+
+    /**
+     * @brief Зарегистрировать нескольких пользователей.
+     * @details Пользователи получают те же id, что и при последовательных вызовах register_new_user().
+     * @param count Количество пользователей.
+     * @return Id новых пользователей в порядке возрастания.
+     */
+    std::vector<uint64_t> register_new_users(size_t count) {
+        std::vector<uint64_t> ids;
+        ids.reserve(count);
+        register_new_users(count, std::back_inserter(ids));
+        return ids;
+    }
+
+    /**
+     * @brief Зарегистрировать нескольких пользователей, записывая id-шники в итератор вывода.
+     * @details Если id-шники закончились, то уже выданные id-шники остаются записанными, а затем бросается исключение.
+     * @param count Количество пользователей.
+     * @param out Итератор вывода для id-шников новых пользователей в порядке возрастания.
+     * @return Итератор вывода после последнего записанного id.
+     */
+    template<typename OutputIterator>
+    OutputIterator register_new_users(size_t count, OutputIterator out) {
+        return trie.add_numbers(count, out);
+    }
+
+    /**
+     * @brief Удалить пользователя. Его id освобождается и может быть снова выдан при регистрации.
+     * @param id Id удаляемого пользователя.
+     */
+    void unregister_user(uint64_t id) {
+        if (static_cast<Id>(id) != id) {
+            throw std::range_error("The ID is not taken.");
+        }
+        trie.remove_number(static_cast<Id>(id));
+    }
+
+    /**
+     * @brief Найти k-й по возрастанию свободный id.
+     * @param k Номер свободного id с нуля: 0-й свободный id получит следующий пользователь.
+     */
+    uint64_t kth_free_id(uint64_t k) {
+        if (static_cast<Id>(k) != k) {
+            throw std::out_of_range("There are not enough free numbers.");
+        }
+        return trie.kth_free(static_cast<Id>(k));
+    }
+
+    /**
+     * @brief Количество пользователей с id-шниками в отрезке [lo, hi].
+     */
+    uint64_t count_users(uint64_t lo, uint64_t hi) {
+        const uint64_t max_id = static_cast<Id>(~Id{0});
+        if (lo > max_id) {
+            return 0;
+        }
+        return trie.count_in_range(static_cast<Id>(lo), static_cast<Id>(std::min(hi, max_id)));
+    }
+
+    /**
+     * @brief Найти id пользователя, дающий минимальный xor с заданным числом.
+     * @details Старшие биты числа, не помещающиеся в id, одинаково влияют на все id-шники и отбрасываются.
+     */
+    uint64_t min_xor_user(uint64_t value) {
+        return trie.min_xor(static_cast<Id>(value));
+    }
+
+    /**
+     * @brief Найти id пользователя, дающий максимальный xor с заданным числом.
+     */
+    uint64_t max_xor_user(uint64_t value) {
+        return trie.max_xor(static_cast<Id>(value));
+    }
+
+    /**
+     * @brief Зашифровать данные.
+     * @param key Ключ.
+     */
+    void encrypt(uint64_t key) {
+        if (static_cast<Id>(key) != key) {
+            throw std::out_of_range("The key does not fit the ID type.");
+        }
+        trie.xor_all_values(static_cast<Id>(key));
+    }
+
+    /**
+     * @brief Снимок статистики структуры для хранения id-шников. Доступно для BitTrie.
+     */
+    TrieStats stats() const {
+        return trie.stats();
+    }
+
+    /**
+     * @brief Объём памяти, занятой структурой для хранения id-шников, в байтах. Доступно для BitTrie.
+     */
+    size_t memory_usage() const {
+        return trie.memory_usage();
+    }
+
+    /**
+     * @brief Снимок базы, по которому можно читать id-шники без блокировок. Доступно для PersistentBitTrie.
+     * @details Снимок неизменяем; от него можно перейти к состоянию базы в любую прошлую эпоху шифрования.
+     */
+    auto snapshot() const {
+        return trie.snapshot();
+    }
+
+    /**
+     * @brief Сохранить базу в файл.
+     * @param path Путь к файлу.
+     */
+    void save(const std::string& path) const {
+        trie.save(path);
+    }
+
+    /**
+     * @brief Заменить содержимое базы сохранённым в файле.
+     * @details Файл отображается в память, поэтому регистрации можно выполнять сразу после загрузки.
+     * @param path Путь к файлу.
+     */
+    void load(const std::string& path) {
+        trie.load(path);
+    }
+private:
+    using Id = decltype(std::declval<Trie&>().add_number());  // Тип id-шников, которые хранит структура.
+
+    Trie trie;  // Битовый бор для хранения id-шников.
+};
+
+using DataBase = BasicDataBase<BitTrie<uint64_t, ArenaNodeStorage>>;  // Id-шники без ограничений, узлы лежат в арене.
+using BoundedDataBase = BasicDataBase<HierarchicalBitmap<uint32_t>>;  // Id-шники не больше заданного максимума.
+using VersionedDataBase = BasicDataBase<PersistentBitTrie<uint64_t>>;  // Снимки по эпохам шифрования для читателей.
+using InstrumentedDataBase = BasicDataBase<BitTrie<uint64_t, ArenaNodeStorage, false, AtomicTrieStats>>;  // Со статистикой.
+
+
+/**
+ * @brief Много баз (по одной на арендатора) на одном общем пуле узлов.
+ * @details Каждая база - бор со своим корнем и своей маской xor в корне, но все узлы лежат в одной арене NodePool
+ * и адресуются 32-битными индексами, так что маленькие базы не держат каждая свой буфер и не дробят кучу.
+ * Номера арендаторов выдаются как id-шники пользователей - минимальный свободный номер - битовым бором.
+ * Удаление арендатора - O(1) с амортизацией: дерево отдаётся пулу целиком и разбирается при создании новых узлов.
+ * @tparam NumberType Тип id-шников пользователей.
+ */
+template<typename NumberType = uint64_t>
+class BasicTenantManager {
+public:
+    using Trie = BitTrie<NumberType, PooledNodeStorage, false>;  // Бор арендатора.
+    using TenantDataBase = BasicDataBase<Trie>;  // База арендатора.
+    using TenantId = uint32_t;  // Номер арендатора.
+
+    /**
+     * @brief Создать базу нового арендатора.
+     * @return Номер арендатора: минимальный номер, не занятый живыми арендаторами.
+     */
+    TenantId create_tenant() {
+        TenantId id = tenant_ids_.add_number();
+        try {
+            if (id >= tenants_.size()) {
+                tenants_.resize(id + 1);
+            }
+            tenants_[id].reset(new TenantDataBase(typename Trie::Storage(pool_)));
+        } catch (...) {
+            tenant_ids_.remove_number(id);
+            throw;
+        }
+        return id;
+    }
+
+    /**
+     * @brief Удалить базу арендатора. Его номер может быть снова выдан.
+     */
+    void drop_tenant(TenantId id) {
+        tenant(id);  // Проверка, что арендатор есть.
+        tenants_[id].reset();
+        tenant_ids_.remove_number(id);
+    }
+
+    /**
+     * @brief База арендатора.
+     */
+    TenantDataBase& tenant(TenantId id) {
+        if (id >= tenants_.size() || tenants_[id] == nullptr) {
+            throw std::out_of_range("There is no such tenant.");
+        }
+        return *tenants_[id];
+    }
+
+    /**
+     * @brief Перебрать арендаторов в порядке возрастания номеров.
+     * @param visitor Функция, принимающая номер арендатора и его базу.
+     */
+    template<typename Visitor>
+    void for_each_tenant(Visitor visitor) {
+        for (TenantId id = 0; id < tenants_.size(); ++id) {
+            if (tenants_[id] != nullptr) {
+                visitor(id, *tenants_[id]);
+            }
+        }
+    }
+
+    /**
+     * @brief Количество арендаторов.
+     */
+    size_t tenant_count() const {
+        return tenant_ids_.size();
+    }
+
+    /**
+     * @brief Объём памяти, занятой узлами арендатора в пуле, в байтах.
+     */
+    size_t tenant_memory_usage(TenantId id) {
+        return tenant(id).memory_usage();
+    }
+
+    /**
+     * @brief Объём памяти пула в байтах (вместе со свободными узлами и ещё не разобранными деревьями).
+     */
+    size_t memory_usage() const {
+        return pool_.memory_usage();
+    }
+
+    /**
+     * @brief Количество узлов всех живых арендаторов.
+     */
+    size_t node_count() const {
+        return pool_.node_count();
+    }
+
+    /**
+     * @brief Количество узлов удалённых арендаторов, ещё не возвращённых в пул.
+     */
+    size_t garbage_node_count() const {
+        return pool_.garbage_node_count();
+    }
+
+    /**
+     * @brief Сразу вернуть в пул все узлы удалённых арендаторов.
+     */
+    void collect_garbage() {
+        pool_.collect_garbage();
+    }
+private:
+    typename Trie::Storage::Pool pool_;  // Общий пул узлов. Объявлен первым, чтобы пережить базы арендаторов.
+    BitTrie<TenantId, ArenaNodeStorage> tenant_ids_;  // Занятые номера арендаторов.
+    std::vector<std::unique_ptr<TenantDataBase>> tenants_;  // Базы арендаторов по номерам.
+};
+
+using TenantManager = BasicTenantManager<uint64_t>;
+
+
+/**
+ * @brief Журнал операций базы с групповой фиксацией.
+ * @details Журнал - файл, в который только дописываются записи. Запись - байт с типом операции и число в формате
+ * varint (по 7 битов в байте, старший бит - признак продолжения):
+ *  * регистрация - разность с предыдущим выданным id в zigzag-кодировке (обычно один байт);
+ *  * шифрование - ключ.
+ * Записи копятся в памяти и записываются на диск вместе с одним fdatasync, когда набирается group_size операций
+ * или с предыдущей фиксации прошло больше window. Операция считается надёжно сохранённой после фиксации.
+ * Фонового потока нет: окно проверяется при добавлении записей, для немедленной фиксации есть commit().
+ * При открытии журнал воспроизводится, а оборванная при сбое последняя запись отбрасывается.
+ */
+class OperationLog {
+public:
+    /**
+     * @brief Параметры групповой фиксации.
+     */
+    struct Options {
+        size_t group_size{512};  // Максимальное количество операций в одной фиксации.
+        std::chrono::microseconds window{std::chrono::milliseconds(10)};  // Максимальное время между фиксациями.
+    };
+
+    /**
+     * @brief Открыть журнал, воспроизвести сохранённые в нём операции и подготовиться к дописыванию.
+     * @param path Путь к файлу журнала. Если файла нет, то он создаётся.
+     * @param options Параметры групповой фиксации.
+     * @param on_registrations Обработчик серии подряд идущих регистраций: принимает вектор выданных id-шников.
+     * @param on_encryption Обработчик шифрования: принимает ключ.
+     */
+    template<typename RegistrationsHandler, typename EncryptionHandler>
+    OperationLog(const std::string& path, Options options,
+                 RegistrationsHandler&& on_registrations, EncryptionHandler&& on_encryption): options_(options) {
+        file_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (file_ < 0) {
+            throw std::runtime_error("Cannot open operation log.");
+        }
+        try {
+            auto valid_length = replay(on_registrations, on_encryption);
+            if (ftruncate(file_, valid_length) != 0 || lseek(file_, valid_length, SEEK_SET) < 0) {
+                throw std::runtime_error("Cannot truncate operation log.");
+            }
+        } catch (...) {
+            close(file_);
+            throw;
+        }
+        last_commit_ = std::chrono::steady_clock::now();
+    }
+
+    OperationLog(const OperationLog&) = delete;
+    OperationLog& operator=(const OperationLog&) = delete;
+
+    /**
+     * @brief Зафиксировать оставшиеся записи и закрыть журнал.
+     */
+    ~OperationLog() {
+        try {
+            commit();
+        } catch (...) {
+            // Из деструктора ошибку не сообщить: незафиксированные записи теряются, как при сбое.
+        }
+        close(file_);
+    }
+
+    /**
+     * @brief Записать регистрацию пользователя.
+     * @param id Выданный id.
+     */
+    void append_registration(uint64_t id) {
+        auto delta = id - last_id_;
+        buffer_.push_back(registration_tag_);
+        append_varint((delta << 1) ^ (0 - (delta >> 63)));  // Zigzag: небольшие разности любого знака - короткие.
+        last_id_ = id;
+        on_appended();
+    }
+
+    /**
+     * @brief Записать шифрование.
+     * @param key Ключ.
+     */
+    void append_encryption(uint64_t key) {
+        buffer_.push_back(encryption_tag_);
+        append_varint(key);
+        on_appended();
+    }
+
+    /**
+     * @brief Записать накопленные записи на диск и дождаться их сохранения.
+     * @details Если запись прервалась ошибкой, записанная часть убирается из буфера, а остаток и синхронизация
+     * повторяются при следующем вызове: записи не дублируются в журнале.
+     */
+    void commit() {
+        size_t written = 0;
+        while (written < buffer_.size()) {
+            auto result = write(file_, buffer_.data() + written, buffer_.size() - written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                buffer_.erase(buffer_.begin(), buffer_.begin() + written);
+                unsynced_ = unsynced_ || written > 0;
+                throw std::runtime_error("Cannot write operation log.");
+            }
+            written += result;
+        }
+        buffer_.clear();
+        unsynced_ = unsynced_ || written > 0;
+        if (unsynced_) {
+            if (fdatasync(file_) != 0) {
+                throw std::runtime_error("Cannot sync operation log.");
+            }
+            unsynced_ = false;
+            ++commits_count_;
+        }
+        pending_operations_ = 0;
+        last_commit_ = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * @brief Зафиксировать записи, если с последней фиксации прошло больше options.window.
+     * @details Фиксация по времени иначе проверяется только при добавлении записи, поэтому после паузы в потоке
+     * операций последние записи ждали бы следующей операции. Владелец журнала вызывает этот метод периодически,
+     * например, когда ему нечего обрабатывать.
+     */
+    void commit_if_due() {
+        if (pending_operations_ > 0 && std::chrono::steady_clock::now() - last_commit_ >= options_.window) {
+            commit();
+        }
+    }
+
+    /**
+     * @brief Количество фиксаций (вызовов fdatasync) с момента открытия журнала.
+     */
+    size_t commits_count() const {
+        return commits_count_;
+    }
+private:
+    /**
+     * @brief Воспроизвести записи журнала.
+     * @details Подряд идущие регистрации передаются обработчику одной серией.
+     * @return Длина корректной части журнала (без оборванной последней записи).
+     */
+    template<typename RegistrationsHandler, typename EncryptionHandler>
+    uint64_t replay(RegistrationsHandler& on_registrations, EncryptionHandler& on_encryption) {
+        struct stat file_stat{};
+        if (fstat(file_, &file_stat) != 0) {
+            throw std::runtime_error("Cannot read operation log.");
+        }
+        std::vector<uint8_t> content(file_stat.st_size);
+        if (!content.empty() && pread(file_, content.data(), content.size(), 0) != file_stat.st_size) {
+            throw std::runtime_error("Cannot read operation log.");
+        }
+        std::vector<uint64_t> ids;
+        size_t position = 0;
+        size_t valid_length = 0;
+        while (position < content.size()) {
+            auto tag = content[position++];
+            uint64_t value = 0;
+            if (!read_varint(content, position, value)) {
+                break;  // Оборванная запись в конце журнала.
+            }
+            if (tag == registration_tag_) {
+                last_id_ += (value >> 1) ^ (0 - (value & 1));
+                ids.push_back(last_id_);
+            } else if (tag == encryption_tag_) {
+                if (!ids.empty()) {
+                    on_registrations(ids);
+                    ids.clear();
+                }
+                on_encryption(value);
+            } else {
+                throw std::runtime_error("Operation log is corrupted.");
+            }
+            valid_length = position;
+        }
+        if (!ids.empty()) {
+            on_registrations(ids);
+        }
+        return valid_length;
+    }
+
+    /**
+     * @brief Учесть добавленную запись и при необходимости зафиксировать группу.
+     */
+    void on_appended() {
+        ++pending_operations_;
+        if (pending_operations_ >= options_.group_size ||
+            std::chrono::steady_clock::now() - last_commit_ >= options_.window) {
+            commit();
+        }
+    }
+
+    /**
+     * @brief Дописать число в буфер в формате varint.
+     */
+    void append_varint(uint64_t value) {
+        while (value >= 0x80) {
+            buffer_.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        buffer_.push_back(static_cast<uint8_t>(value));
+    }
+
+    /**
+     * @brief Прочитать число в формате varint.
+     * @return False, если данные закончились раньше числа.
+     */
+    static bool read_varint(const std::vector<uint8_t>& content, size_t& position, uint64_t& value) {
+        for (uint8_t shift = 0; position < content.size() && shift < 64; shift += 7) {
+            auto byte = content[position++];
+            value |= uint64_t{byte & 0x7Fu} << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static const uint8_t registration_tag_{1};  // Тип записи: регистрация.
+    static const uint8_t encryption_tag_{2};  // Тип записи: шифрование.
+
+    Options options_;  // Параметры групповой фиксации.
+    int file_{-1};  // Дескриптор файла журнала.
+    std::vector<uint8_t> buffer_;  // Записи, ожидающие фиксации.
+    size_t pending_operations_{0};  // Количество операций, ожидающих фиксации.
+    size_t commits_count_{0};  // Количество фиксаций.
+    bool unsynced_{false};  // Часть записей уже в файле, но fdatasync для них ещё не выполнен.
+    uint64_t last_id_{0};  // Последний записанный id (для разностного кодирования).
+    std::chrono::steady_clock::time_point last_commit_;  // Время последней фиксации.
+};
+
+const uint8_t OperationLog::registration_tag_;
+const uint8_t OperationLog::encryption_tag_;
+
+/**
+ * @brief База, сохраняющая операции в журнал и восстанавливающаяся после перезапуска.
+ * @details В каталоге базы лежат снимок snapshot.N и журнал log.N операций, выполненных после снимка.
+ * При открытии загружается последний снимок и воспроизводится его журнал: шифрования - изменения маски в корне,
+ * серии регистраций - один вызов register_new_users(). Выданные при воспроизведении id-шники сверяются с журналом.
+ * checkpoint() записывает снимок следующего поколения и начинает новый журнал. Снимок сначала пишется во временный
+ * файл и переименовывается, поэтому при сбое в любой момент остаётся согласованная пара снимка и журнала.
+ * @tparam Trie Структура для хранения id-шников. Должна поддерживать снимки.
+ */
+template<typename Trie>
+class BasicDurableDataBase {
+public:
+    /**
+     * @brief Открыть базу в каталоге, восстановив её состояние.
+     * @param directory Существующий каталог базы.
+     * @param options Параметры групповой фиксации журнала.
+     */
+    explicit BasicDurableDataBase(const std::string& directory, OperationLog::Options options = {}):
+            directory_(directory), options_(options) {
+        generation_ = find_last_generation();
+        if (generation_ > 0) {
+            database_.load(snapshot_path(generation_));
+        }
+        open_log();
+    }
+
+    /**
+     * @brief Зарегистрировать пользователя.
+     * @return Id нового пользователя.
+     */
+    uint64_t register_new_user() {
+        auto id = database_.register_new_user();
+        log_->append_registration(id);
+        return id;
+    }
+
+    /**
+     * @brief Зарегистрировать нескольких пользователей.
+     * @param count Количество пользователей.
+     * @return Id новых пользователей в порядке возрастания.
+     */
+    std::vector<uint64_t> register_new_users(size_t count) {
+        auto ids = database_.register_new_users(count);
+        for (auto id : ids) {
+            log_->append_registration(id);
+        }
+        return ids;
+    }
+
+    /**
+     * @brief Зашифровать данные.
+     * @param key Ключ.
+     */
+    void encrypt(uint64_t key) {
+        database_.encrypt(key);
+        log_->append_encryption(key);
+    }
+
+    /**
+     * @brief Немедленно зафиксировать все выполненные операции.
+     */
+    void sync() {
+        log_->commit();
+    }
+
+    /**
+     * @brief Зафиксировать операции, ожидающие фиксации дольше окна группировки.
+     * @details Вызывается периодически, чтобы окно соблюдалось и тогда, когда новых операций нет.
+     */
+    void commit_if_due() {
+        log_->commit_if_due();
+    }
+
+    /**
+     * @brief Количество фиксаций журнала с момента открытия базы или последнего снимка.
+     */
+    size_t commits_count() const {
+        return log_->commits_count();
+    }
+
+    /**
+     * @brief Сохранить снимок базы и начать новый журнал.
+     * @details После этого восстановление не воспроизводит уже выполненные операции.
+     */
+    void checkpoint() {
+        log_->commit();
+        auto next_generation = generation_ + 1;
+        auto temporary_path = snapshot_path(next_generation) + ".tmp";
+        database_.save(temporary_path);
+        if (std::rename(temporary_path.c_str(), snapshot_path(next_generation).c_str()) != 0) {
+            throw std::runtime_error("Cannot publish snapshot.");
+        }
+        sync_directory();
+        auto previous_generation = generation_;
+        generation_ = next_generation;
+        open_log();
+        std::remove(log_path(previous_generation).c_str());
+        std::remove(snapshot_path(previous_generation).c_str());
+    }
+private:
+    /**
+     * @brief Открыть журнал текущего поколения и воспроизвести его.
+     */
+    void open_log() {
+        log_.reset();
+        auto& database = database_;
+        log_.reset(new OperationLog(log_path(generation_), options_,
+            [&database](const std::vector<uint64_t>& ids) {
+                if (database.register_new_users(ids.size()) != ids) {
+                    throw std::runtime_error("Operation log does not match the snapshot.");
+                }
+            },
+            [&database](uint64_t key) {
+                database.encrypt(key);
+            }));
+    }
+
+    /**
+     * @brief Найти последнее поколение, для которого есть снимок (0, если снимков нет).
+     */
+    uint64_t find_last_generation() const {
+        std::unique_ptr<DIR, int(*)(DIR*)> directory(opendir(directory_.c_str()), closedir);
+        if (directory == nullptr) {
+            throw std::runtime_error("Cannot open database directory.");
+        }
+        uint64_t generation = 0;
+        const std::string prefix = "snapshot.";
+        while (auto entry = readdir(directory.get())) {
+            std::string name = entry->d_name;
+            if (name.compare(0, prefix.size(), prefix) != 0 ||
+                name.find_first_not_of("0123456789", prefix.size()) != std::string::npos) {
+                continue;  // Не снимок или недописанный временный файл.
+            }
+            if (name.size() == prefix.size() || name.size() - prefix.size() > max_generation_digits_) {
+                continue;  // Посторонний файл: номер поколения пуст или не помещается в uint64_t.
+            }
+            generation = std::max<uint64_t>(generation, std::stoull(name.substr(prefix.size())));
+        }
+        return generation;
+    }
+
+    /**
+     * @brief Дождаться сохранения на диск изменений в каталоге (переименований и созданий файлов).
+     */
+    void sync_directory() const {
+        int directory = open(directory_.c_str(), O_RDONLY | O_DIRECTORY);
+        if (directory < 0) {
+            throw std::runtime_error("Cannot open database directory.");
+        }
+        fsync(directory);
+        close(directory);
+    }
+
+    std::string snapshot_path(uint64_t generation) const {
+        return directory_ + "/snapshot." + std::to_string(generation);
+    }
+
+    std::string log_path(uint64_t generation) const {
+        return directory_ + "/log." + std::to_string(generation);
+    }
+
+    static const size_t max_generation_digits_{19};  // Любое 19-значное число помещается в uint64_t.
+
+    std::string directory_;  // Каталог базы.
+    OperationLog::Options options_;  // Параметры групповой фиксации.
+    uint64_t generation_{0};  // Поколение текущего снимка и журнала.
+    BasicDataBase<Trie> database_;  // База в памяти.
+    std::unique_ptr<OperationLog> log_;  // Журнал операций после снимка.
+};
+
+using DurableDataBase = BasicDurableDataBase<BitTrie<uint64_t, ArenaNodeStorage>>;
+
+
+/**
+ * @brief Потокобезопасная обёртка над базой, объединяющая запросы потоков (flat combining).
+ * @details Все регистрации претендуют на один и тот же MEX, поэтому блокировки поддеревьев не дают параллелизма:
+ * потоки всё равно выстраиваются на пути к минимальному свободному числу. Вместо этого поток публикует запрос
+ * в общем стеке без блокировок, а один из ожидающих потоков становится комбайнером: забирает все опубликованные
+ * запросы, выполняет их в порядке публикации и раздаёт ответы. Подряд идущие регистрации выполняются одним
+ * вызовом register_new_users(), шифрование - это изменение маски в корне, поэтому оно задерживает остальных
+ * не дольше этой операции. Каждый запрос выполняется между своим началом и окончанием, так что история
+ * линеаризуема: результаты совпадают с последовательным выполнением запросов в порядке их применения.
+ * @tparam Trie Структура для хранения id-шников.
+ */
+template<typename Trie>
+class BasicConcurrentDataBase {
+public:
+    /**
+     * @brief Создание базы.
+     * @param trie_args Параметры структуры для хранения id-шников.
+     */
+    template<typename... TrieArgs>
+    explicit BasicConcurrentDataBase(TrieArgs&&... trie_args): database_(std::forward<TrieArgs>(trie_args)...) {
+    }
+
+    /**
+     * @brief Зарегистрировать пользователя.
+     * @return Id нового пользователя.
+     */
+    uint64_t register_new_user() {
+        Request request;
+        request.type = RequestType::register_user;
+        execute(request);
+        return request.result;
+    }
+
+    /**
+     * @brief Зашифровать данные.
+     * @param key Ключ.
+     */
+    void encrypt(uint64_t key) {
+        Request request;
+        request.type = RequestType::encrypt;
+        request.key = key;
+        execute(request);
+    }
+
+    /**
+     * @brief Снимок статистики без блокировок. Безопасен, если бор ведёт статистику на атомарных счётчиках.
+     */
+    TrieStats stats() const {
+        return database_.stats();
+    }
+private:
+    enum class RequestType : uint8_t {
+        register_user,
+        encrypt,
+    };
+
+    /**
+     * @brief Запрос потока. Живёт на стеке потока, пока тот ждёт ответа.
+     */
+    struct Request {
+        RequestType type{RequestType::register_user};  // Тип запроса.
+        uint64_t key{0};  // Ключ шифрования.
+        uint64_t result{0};  // Id нового пользователя.
+        std::exception_ptr error;  // Исключение, возникшее при выполнении запроса.
+        Request* next{nullptr};  // Следующий запрос в стеке опубликованных запросов.
+        std::atomic<bool> done{false};  // Запрос выполнен, ответ можно читать.
+    };
+
+    /**
+     * @brief Опубликовать запрос и дождаться его выполнения, при необходимости выполнив его самостоятельно.
+     * @param request Запрос.
+     */
+    void execute(Request& request) {
+        request.next = pending_.load(std::memory_order_relaxed);
+        while (!pending_.compare_exchange_weak(request.next, &request,
+                                               std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        while (!request.done.load(std::memory_order_acquire)) {
+            std::unique_lock<std::mutex> lock(combiner_, std::try_to_lock);
+            if (lock.owns_lock()) {
+                combine();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        if (request.error) {
+            std::rethrow_exception(request.error);
+        }
+    }
+
+    /**
+     * @brief Выполнить опубликованные запросы. Вызывается только под блокировкой комбайнера.
+     */
+    void combine() {
+        for (uint8_t round = 0; round < max_combining_rounds_; ++round) {
+            Request* stack = pending_.exchange(nullptr, std::memory_order_acquire);
+            if (stack == nullptr) {
+                return;
+            }
+            Request* queue = nullptr;  // Стек хранит запросы в обратном порядке - разворачиваем его.
+            while (stack != nullptr) {
+                Request* next = stack->next;
+                stack->next = queue;
+                queue = stack;
+                stack = next;
+            }
+            apply(queue);
+        }
+    }
+
+    /**
+     * @brief Выполнить очередь запросов и раздать ответы.
+     * @details Ответ публикуется последним: после этого поток-владелец может уничтожить запрос.
+     * @param queue Первый запрос очереди.
+     */
+    void apply(Request* queue) {
+        while (queue != nullptr) {
+            if (queue->type == RequestType::encrypt) {
+                try {
+                    database_.encrypt(queue->key);
+                } catch (...) {
+                    queue->error = std::current_exception();
+                }
+                Request* next = queue->next;
+                queue->done.store(true, std::memory_order_release);
+                queue = next;
+                continue;
+            }
+            size_t count = 0;  // Серия подряд идущих регистраций выполняется одним обходом бора.
+            for (Request* request = queue; request != nullptr && request->type == RequestType::register_user;
+                 request = request->next) {
+                ++count;
+            }
+            ids_.clear();
+            std::exception_ptr error;
+            try {
+                database_.register_new_users(count, std::back_inserter(ids_));
+            } catch (...) {
+                error = std::current_exception();  // Id-шники закончились: часть запросов получит ошибку.
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (i < ids_.size()) {
+                    queue->result = ids_[i];
+                } else {
+                    queue->error = error;
+                }
+                Request* next = queue->next;
+                queue->done.store(true, std::memory_order_release);
+                queue = next;
+            }
+        }
+    }
+
+    static const uint8_t max_combining_rounds_{8};  // Комбайнер не обслуживает других бесконечно долго.
+
+    BasicDataBase<Trie> database_;  // База, доступ к которой есть только у комбайнера.
+    std::vector<uint64_t> ids_;  // Буфер для id-шников серии регистраций.
+    std::atomic<Request*> pending_{nullptr};  // Стек опубликованных запросов.
+    std::mutex combiner_;  // Блокировка комбайнера.
+};
+
+using ConcurrentDataBase = BasicConcurrentDataBase<BitTrie<uint64_t, ArenaNodeStorage>>;
+
+
+/**
+ * @brief Входной поток команд базы, читаемый большими блоками без iostreams.
+ * @details Обычный файл отображается в память целиком. Канал, терминал или сокет читаются через read()
+ * в буфер, начало которого - ещё не разобранный хвост предыдущего блока. Разборщик видит окно [begin(), end())
+ * и запрашивает продолжение через refill(), когда команда не поместилась в окно.
+ */
+class CommandInput {
+public:
+    /**
+     * @brief Читать команды из открытого дескриптора (например, стандартного ввода). Дескриптор не закрывается.
+     * @param file Дескриптор.
+     * @param buffer_size Начальный размер буфера для чтения из канала.
+     */
+    explicit CommandInput(int file, size_t buffer_size = 1 << 20): file_(file), buffer_(std::max<size_t>(buffer_size, 16)) {
+        map_regular_file();
+    }
+
+    /**
+     * @brief Читать команды из файла.
+     * @param path Путь к файлу.
+     */
+    explicit CommandInput(const std::string& path): buffer_(1 << 20) {
+        file_ = open(path.c_str(), O_RDONLY);
+        if (file_ < 0) {
+            throw std::runtime_error("Cannot open command stream.");
+        }
+        owns_file_ = true;
+        try {
+            map_regular_file();
+        } catch (...) {
+            close(file_);
+            throw;
+        }
+    }
+
+    /**
+     * @brief Читать команды из памяти. Память не копируется и должна жить дольше объекта.
+     */
+    CommandInput(const char* data, size_t size): begin_(data), end_(data + size), end_of_input_(true) {
+    }
+
+    CommandInput(const CommandInput&) = delete;
+    CommandInput& operator=(const CommandInput&) = delete;
+
+    ~CommandInput() {
+        if (mapping_ != nullptr) {
+            munmap(mapping_, mapping_size_);
+        }
+        if (owns_file_) {
+            close(file_);
+        }
+    }
+
+    /**
+     * @brief Начало ещё не разобранных данных.
+     */
+    const char* begin() const {
+        return begin_;
+    }
+
+    /**
+     * @brief Конец прочитанных данных.
+     */
+    const char* end() const {
+        return end_;
+    }
+
+    /**
+     * @brief Входные данные закончились: всё, что будет прочитано, уже лежит в [begin(), end()).
+     */
+    bool at_end() const {
+        return end_of_input_;
+    }
+
+    /**
+     * @brief Отметить данные до position разобранными.
+     */
+    void consume(const char* position) {
+        begin_ = position;
+    }
+
+    /**
+     * @brief Дочитать данные в окно. Неразобранный хвост сохраняется, а при необходимости буфер растёт.
+     * @return False, если данных больше нет.
+     */
+    bool refill() {
+        if (end_of_input_) {
+            return false;
+        }
+        size_t tail = end_ - begin_;
+        if (tail == buffer_.size()) {
+            std::vector<char> bigger(buffer_.size() * 2);  // Команда длиннее буфера.
+            std::memcpy(bigger.data(), begin_, tail);
+            buffer_.swap(bigger);
+        } else if (tail != 0 && begin_ != buffer_.data()) {
+            std::memmove(buffer_.data(), begin_, tail);
+        }
+        begin_ = buffer_.data();
+        end_ = begin_ + tail;
+        while (true) {
+            auto bytes = read(file_, buffer_.data() + tail, buffer_.size() - tail);
+            if (bytes > 0) {
+                end_ += bytes;
+                return true;
+            }
+            if (bytes == 0) {
+                end_of_input_ = true;
+                return false;
+            }
+            if (errno != EINTR) {
+                throw std::runtime_error("Cannot read command stream.");
+            }
+        }
+    }
+private:
+    /**
+     * @brief Если дескриптор - непустой обычный файл, то отобразить его в память.
+     */
+    void map_regular_file() {
+        begin_ = end_ = buffer_.data();
+        struct stat file_stat{};
+        if (fstat(file_, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+            return;
+        }
+        auto offset = lseek(file_, 0, SEEK_CUR);
+        if (offset < 0 || offset >= file_stat.st_size) {
+            return;
+        }
+        mapping_size_ = file_stat.st_size;
+        mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, file_, 0);
+        if (mapping_ == MAP_FAILED) {
+            mapping_ = nullptr;
+            return;
+        }
+        madvise(mapping_, mapping_size_, MADV_SEQUENTIAL);
+        begin_ = static_cast<const char*>(mapping_) + offset;
+        end_ = static_cast<const char*>(mapping_) + mapping_size_;
+        end_of_input_ = true;
+    }
+
+    int file_{-1};  // Дескриптор, из которого читаются команды.
+    bool owns_file_{false};  // Дескриптор открыт объектом и закрывается им.
+    std::vector<char> buffer_;  // Буфер для чтения через read().
+    void* mapping_{nullptr};  // Отображённый в память файл.
+    size_t mapping_size_{0};  // Размер отображения.
+    const char* begin_{nullptr};  // Начало неразобранных данных.
+    const char* end_{nullptr};  // Конец прочитанных данных.
+    bool end_of_input_{false};  // Данных больше не будет.
+};
+
+
+/**
+ * @brief Буферизованный вывод выданных id-шников в дескриптор.
+ * @details Id-шники записываются в буфер в десятичном виде по одному в строке или по 8 байтов little-endian,
+ * буфер сбрасывается через write(), когда заполнится. Для передачи в register_new_users() есть итератор вывода.
+ */
+class IdOutput {
+public:
+    /**
+     * @brief Формат вывода.
+     */
+    enum class Format {
+        text,  // Десятичное число и перевод строки.
+        binary,  // 8 байтов little-endian.
+    };
+
+    /**
+     * @brief Итератор вывода, записывающий id-шники в буфер.
+     */
+    class Iterator {
+    public:
+        using iterator_category = std::output_iterator_tag;
+        using value_type = void;
+        using difference_type = void;
+        using pointer = void;
+        using reference = void;
+
+        explicit Iterator(IdOutput& output): output_(&output) {
+        }
+
+        Iterator& operator=(uint64_t id) {
+            output_->write(id);
+            return *this;
+        }
+
+        Iterator& operator*() {
+            return *this;
+        }
+
+        Iterator& operator++() {
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            return *this;
+        }
+    private:
+        IdOutput* output_;  // Вывод, в который записываются id-шники.
+    };
+
+    /**
+     * @brief Выводить id-шники в открытый дескриптор. Дескриптор не закрывается.
+     * @param file Дескриптор.
+     * @param format Формат вывода.
+     * @param buffer_size Размер буфера.
+     */
+    explicit IdOutput(int file, Format format = Format::text, size_t buffer_size = 1 << 16):
+            file_(file), format_(format), buffer_(std::max<size_t>(buffer_size, 2 * max_record_size_)) {
+    }
+
+    IdOutput(const IdOutput&) = delete;
+    IdOutput& operator=(const IdOutput&) = delete;
+
+    /**
+     * @brief Сбросить буфер. Ошибки записи при разрушении игнорируются, для их обработки нужно вызвать flush().
+     */
+    ~IdOutput() {
+        try {
+            flush();
+        } catch (const std::exception&) {
+        }
+    }
+
+    /**
+     * @brief Записать id.
+     */
+    void write(uint64_t id) {
+        if (used_ + max_record_size_ > buffer_.size()) {
+            flush();
+        }
+        char* position = buffer_.data() + used_;
+        if (format_ == Format::binary) {
+            for (int byte_no = 0; byte_no < 8; ++byte_no) {
+                position[byte_no] = static_cast<char>(id >> (8 * byte_no));
+            }
+            used_ += 8;
+            return;
+        }
+        char digits[20];
+        char* first = digits + sizeof(digits);
+        while (id >= 100) {  // По две цифры за деление.
+            auto pair = static_cast<unsigned>(id % 100);
+            id /= 100;
+            *--first = static_cast<char>('0' + pair % 10);
+            *--first = static_cast<char>('0' + pair / 10);
+        }
+        if (id >= 10) {
+            *--first = static_cast<char>('0' + id % 10);
+            id /= 10;
+        }
+        *--first = static_cast<char>('0' + id);
+        auto length = digits + sizeof(digits) - first;
+        std::memcpy(position, first, length);
+        position[length] = '\n';
+        used_ += length + 1;
+    }
+
+    /**
+     * @brief Итератор вывода для register_new_users().
+     */
+    Iterator iterator() {
+        return Iterator(*this);
+    }
+
+    /**
+     * @brief Записать содержимое буфера в дескриптор.
+     */
+    void flush() {
+        size_t written = 0;
+        while (written < used_) {
+            auto bytes = ::write(file_, buffer_.data() + written, used_ - written);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                used_ = 0;
+                throw std::runtime_error("Cannot write IDs.");
+            }
+            written += bytes;
+        }
+        used_ = 0;
+    }
+private:
+    static const size_t max_record_size_{21};  // 20 десятичных цифр и перевод строки.
+
+    int file_;  // Дескриптор для вывода.
+    Format format_;  // Формат вывода.
+    std::vector<char> buffer_;  // Буфер вывода.
+    size_t used_{0};  // Заполненная часть буфера.
+};
+
+
+/**
+ * @brief Исполнитель потока команд базы.
+ * @details Поток в текстовом формате состоит из строк "register" и "encrypt <x>" (пустые строки и "\r" в конце
+ * строки допускаются). Поток в двоичном формате начинается с magic "SUPERCMD", за которым идут записи:
+ * байт с типом и, для некоторых типов, число в формате varint:
+ *  * 1 - регистрация;
+ *  * 2 - шифрование, число - ключ;
+ *  * 3 - серия регистраций, число - их количество.
+ * Формат определяется по первым байтам. Подряд идущие регистрации накапливаются и выполняются одним вызовом
+ * register_new_users(), который пишет id-шники прямо в буфер вывода, - так выдаются те же id-шники,
+ * что и при последовательных вызовах register_new_user().
+ * @tparam DataBaseType База, например, DataBase.
+ */
+template<typename DataBaseType>
+class CommandStreamExecutor {
+public:
+    /**
+     * @brief Счётчики выполненных команд.
+     */
+    struct Counters {
+        uint64_t commands{0};  // Количество команд (серия регистраций в двоичном формате - одна команда).
+        uint64_t registrations{0};  // Количество зарегистрированных пользователей.
+        uint64_t encryptions{0};  // Количество шифрований.
+        uint64_t batches{0};  // Количество вызовов register_new_users().
+    };
+
+    CommandStreamExecutor(DataBaseType& database, IdOutput& output): database_(database), output_(output) {
+    }
+
+    /**
+     * @brief Выполнить все команды потока.
+     * @details При ошибке в потоке бросается исключение; команды до ошибки выполнены, их id-шники в буфере вывода.
+     * @return Счётчики команд, выполненных этим и предыдущими вызовами.
+     */
+    Counters run(CommandInput& input) {
+        const size_t magic_length = sizeof(binary_magic_) - 1;
+        while (static_cast<size_t>(input.end() - input.begin()) < magic_length && input.refill()) {
+        }
+        bool binary = false;
+        if (static_cast<size_t>(input.end() - input.begin()) >= magic_length &&
+            std::memcmp(input.begin(), binary_magic_, magic_length) == 0) {
+            input.consume(input.begin() + magic_length);
+            binary = true;
+        }
+        try {
+            if (binary) {
+                run_binary(input);
+            } else {
+                run_text(input);
+            }
+        } catch (const std::runtime_error&) {
+            flush_registrations();  // Команды до ошибки в потоке выполняются.
+            throw;
+        }
+        flush_registrations();
+        return counters_;
+    }
+private:
+    /**
+     * @brief Выполнить команды в текстовом формате.
+     */
+    void run_text(CommandInput& input) {
+        static const char registration[] = "register";
+        static const char encryption[] = "encrypt";
+        while (input.begin() != input.end() || input.refill()) {
+            const char* line = input.begin();
+            auto line_end = static_cast<const char*>(std::memchr(line, '\n', input.end() - line));
+            if (line_end == nullptr) {
+                if (input.refill()) {
+                    continue;
+                }
+                line_end = input.end();  // Последняя строка без перевода строки.
+            }
+            input.consume(line_end == input.end() ? line_end : line_end + 1);
+            if (line_end != line && line_end[-1] == '\r') {
+                --line_end;
+            }
+            auto length = static_cast<size_t>(line_end - line);
+            if (length == 0) {
+                continue;
+            }
+            ++counters_.commands;
+            if (length == sizeof(registration) - 1 && std::memcmp(line, registration, length) == 0) {
+                ++pending_registrations_;
+                continue;
+            }
+            const char* position = line + sizeof(encryption) - 1;
+            if (length <= sizeof(encryption) || std::memcmp(line, encryption, sizeof(encryption) - 1) != 0 ||
+                *position != ' ') {
+                throw std::runtime_error("Unknown command: " + std::string(line, length) + ".");
+            }
+            while (position != line_end && *position == ' ') {
+                ++position;
+            }
+            uint64_t key = 0;
+            if (!parse_decimal(position, line_end, key)) {
+                throw std::runtime_error("Invalid key: " + std::string(line, length) + ".");
+            }
+            encrypt(key);
+        }
+    }
+
+    /**
+     * @brief Выполнить команды в двоичном формате.
+     */
+    void run_binary(CommandInput& input) {
+        const size_t max_record_size = 11;  // Тип и varint из 64 битов.
+        while (true) {
+            if (static_cast<size_t>(input.end() - input.begin()) < max_record_size && input.refill()) {
+                continue;  // Пока данные не кончились, в окне помещается хотя бы одна запись целиком.
+            }
+            const char* position = input.begin();
+            const char* end = input.end();
+            if (position == end) {
+                return;
+            }
+            while (position != end && *position == registration_tag_) {  // Одиночные регистрации без разбора.
+                ++position;
+            }
+            if (position != input.begin()) {
+                auto registrations = static_cast<uint64_t>(position - input.begin());
+                pending_registrations_ += registrations;
+                counters_.commands += registrations;
+                input.consume(position);
+                continue;
+            }
+            auto tag = *position++;
+            uint64_t value = 0;
+            if (tag != encryption_tag_ && tag != registrations_tag_) {
+                throw std::runtime_error("Unknown command tag in command stream.");
+            } else if (!read_varint(position, end, value)) {
+                throw std::runtime_error("Command stream is truncated.");
+            } else if (tag == encryption_tag_) {
+                encrypt(value);
+            } else {
+                pending_registrations_ += value;
+            }
+            ++counters_.commands;
+            input.consume(position);
+        }
+    }
+
+    /**
+     * @brief Зашифровать базу после выполнения накопленных регистраций.
+     */
+    void encrypt(uint64_t key) {
+        flush_registrations();
+        database_.encrypt(key);
+        ++counters_.encryptions;
+    }
+
+    /**
+     * @brief Выполнить накопленные регистрации одним вызовом.
+     */
+    void flush_registrations() {
+        if (pending_registrations_ == 0) {
+            return;
+        }
+        auto count = pending_registrations_;
+        pending_registrations_ = 0;
+        database_.register_new_users(count, output_.iterator());
+        counters_.registrations += count;
+        ++counters_.batches;
+    }
+
+    /**
+     * @brief Разобрать десятичное число, занимающее весь отрезок [first, last).
+     * @return False, если в отрезке не число или оно не помещается в 64 бита.
+     */
+    static bool parse_decimal(const char* first, const char* last, uint64_t& value) {
+        if (first == last) {
+            return false;
+        }
+        value = 0;
+        for (; first != last; ++first) {
+            auto digit = static_cast<unsigned>(*first - '0');
+            if (digit > 9 || value > (UINT64_MAX - digit) / 10) {
+                return false;
+            }
+            value = value * 10 + digit;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Прочитать число в формате varint (как в OperationLog).
+     * @return False, если данные закончились раньше числа.
+     */
+    static bool read_varint(const char*& position, const char* end, uint64_t& value) {
+        for (uint8_t shift = 0; position != end && shift < 64; shift += 7) {
+            auto byte = static_cast<uint8_t>(*position++);
+            value |= uint64_t{byte & 0x7Fu} << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static constexpr const char binary_magic_[9] = "SUPERCMD";  // Начало потока в двоичном формате.
+    static const char registration_tag_{1};  // Тип записи: регистрация.
+    static const char encryption_tag_{2};  // Тип записи: шифрование.
+    static const char registrations_tag_{3};  // Тип записи: серия регистраций.
+
+    DataBaseType& database_;  // База, над которой выполняются команды.
+    IdOutput& output_;  // Вывод выданных id-шников.
+    uint64_t pending_registrations_{0};  // Регистрации, ещё не выполненные в базе.
+    Counters counters_;  // Счётчики выполненных команд.
+};
+
+template<typename DataBaseType>
+constexpr const char CommandStreamExecutor<DataBaseType>::binary_magic_[9];
+
+
+/**
+ * @brief Протокол сервера выдачи id-шников.
+ * @details Запросы и ответы - записи из байта с типом и, для некоторых типов, числа в формате varint.
+ * Запросы: 1 - регистрация, 2 - шифрование (число - ключ). Ответы приходят в порядке запросов соединения:
+ * 1 - регистрация (число - id), 2 - шифрование выполнено, 0 - запрос не выполнен (например, id-шники закончились).
+ */
+struct IdProtocol {
+    static const char error_tag{0};  // Тип ответа: ошибка.
+    static const char registration_tag{1};  // Тип записи: регистрация.
+    static const char encryption_tag{2};  // Тип записи: шифрование.
+    static const size_t max_record_size{11};  // Тип и varint из 64 битов.
+
+    /**
+     * @brief Дописать в буфер запись без числа.
+     */
+    static void append(std::vector<char>& buffer, char tag) {
+        buffer.push_back(tag);
+    }
+
+    /**
+     * @brief Дописать в буфер запись с числом.
+     */
+    static void append(std::vector<char>& buffer, char tag, uint64_t value) {
+        buffer.push_back(tag);
+        while (value >= 0x80) {
+            buffer.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<char>(value));
+    }
+
+    /**
+     * @brief Прочитать запись из [position, end).
+     * @param has_value Есть ли у записи с этим типом число.
+     * @return False, если запись не помещается в [position, end); тогда position не изменяется.
+     */
+    static bool read(const char*& position, const char* end, bool (*has_value)(char), char& tag, uint64_t& value) {
+        if (position == end) {
+            return false;
+        }
+        const char* current = position;
+        tag = *current++;
+        value = 0;
+        if (has_value(tag)) {
+            uint8_t shift = 0;
+            for (;; shift += 7) {
+                if (current == end || shift >= 64) {
+                    return false;
+                }
+                auto byte = static_cast<uint8_t>(*current++);
+                value |= uint64_t{byte & 0x7Fu} << shift;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+        }
+        position = current;
+        return true;
+    }
+
+    /**
+     * @brief Есть ли число у запроса с этим типом.
+     */
+    static bool request_has_value(char tag) {
+        return tag == encryption_tag;
+    }
+
+    /**
+     * @brief Есть ли число у ответа с этим типом.
+     */
+    static bool response_has_value(char tag) {
+        return tag == registration_tag;
+    }
+
+    /**
+     * @brief Адрес Unix-сокета по пути к нему.
+     */
+    static sockaddr_un address(const std::string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long.");
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+};
+
+
+/**
+ * @brief Сервер выдачи id-шников для локальных процессов через Unix-сокет.
+ * @details Однопоточный цикл на epoll. За одну итерацию сервер читает запросы всех готовых соединений
+ * (клиенты могут отправлять запросы, не дожидаясь ответов на предыдущие), а затем выполняет их одной пачкой
+ * в порядке чтения: подряд идущие регистрации всех соединений - одним вызовом register_new_users().
+ * Ответы пачки кодируются в общий буфер, а в каждое соединение отправляются одной векторной записью sendmsg()
+ * (writev() без SIGPIPE) по его кускам этого буфера. Что не удалось отправить сразу, копируется в очередь
+ * соединения и досылается по готовности сокета на запись; пока очередь большая, запросы соединения не читаются.
+ * @tparam DataBaseType База, например, DataBase.
+ */
+template<typename DataBaseType>
+class IdServer {
+public:
+    /**
+     * @brief Счётчики сервера.
+     */
+    struct Counters {
+        uint64_t connections{0};  // Количество принятых соединений.
+        uint64_t requests{0};  // Количество выполненных запросов.
+        uint64_t batches{0};  // Количество пачек запросов.
+        uint64_t registration_calls{0};  // Количество вызовов register_new_users().
+    };
+
+    /**
+     * @brief Создать сокет и начать принимать соединения. Старый файл сокета по этому пути удаляется.
+     * @param database База. Пока работает сервер, к ней не должно быть других обращений.
+     * @param socket_path Путь к Unix-сокету.
+     */
+    IdServer(DataBaseType& database, const std::string& socket_path): database_(database), socket_path_(socket_path) {
+        auto address = IdProtocol::address(socket_path);
+        try {
+            epoll_ = epoll_create1(EPOLL_CLOEXEC);
+            wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (epoll_ < 0 || wakeup_ < 0 || listener_ < 0) {
+                throw std::runtime_error("Cannot create server.");
+            }
+            unlink(socket_path.c_str());
+            if (bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+                listen(listener_, SOMAXCONN) != 0) {
+                throw std::runtime_error("Cannot listen on " + socket_path + ".");
+            }
+            watch(listener_, EPOLLIN, EPOLL_CTL_ADD);
+            watch(wakeup_, EPOLLIN, EPOLL_CTL_ADD);
+        } catch (...) {
+            close_all();
+            throw;
+        }
+    }
+
+    IdServer(const IdServer&) = delete;
+    IdServer& operator=(const IdServer&) = delete;
+
+    ~IdServer() {
+        close_all();
+    }
+
+    /**
+     * @brief Обслуживать соединения, пока не будет вызван stop().
+     */
+    void run() {
+        epoll_event events[max_events_];
+        bool stopping = false;
+        while (!stopping) {
+            int ready = epoll_wait(epoll_, events, max_events_, -1);
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Cannot wait for connections.");
+            }
+            for (int i = 0; i < ready; ++i) {
+                int file = events[i].data.fd;
+                if (file == listener_) {
+                    accept_connections();
+                } else if (file == wakeup_) {
+                    stopping = true;
+                } else if (connections_[file] != nullptr) {
+                    auto& connection = *connections_[file];
+                    if (events[i].events & EPOLLOUT) {
+                        send(connection);
+                    }
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                        receive(connection);
+                    }
+                }
+            }
+            execute_batch();
+            for (auto file : touched_) {
+                send(*connections_[file]);
+            }
+            touched_.clear();
+            for (auto file : closing_) {
+                connections_[file].reset();
+                close(file);
+            }
+            closing_.clear();
+        }
+    }
+
+    /**
+     * @brief Остановить run(). Можно вызывать из другого потока и из обработчика сигнала.
+     */
+    void stop() {
+        uint64_t one = 1;
+        auto written = write(wakeup_, &one, sizeof(one));
+        static_cast<void>(written);
+    }
+
+    /**
+     * @brief Счётчики сервера. Читать после завершения run().
+     */
+    const Counters& counters() const {
+        return counters_;
+    }
+private:
+    /**
+     * @brief Соединение с клиентом.
+     */
+    struct Connection {
+        int file{-1};  // Дескриптор сокета.
+        std::vector<char> input;  // Прочитанные, но ещё не разобранные байты.
+        std::vector<std::pair<size_t, size_t>> segments;  // Куски общего буфера ответов для этого соединения.
+        std::vector<char> backlog;  // Ответы, которые не удалось отправить сразу.
+        uint32_t interest{EPOLLIN};  // События, на которые подписан сокет.
+        bool read_closed{false};  // Клиент больше не пришлёт запросов.
+        bool touched{false};  // Соединению нужно отправить ответы в конце итерации.
+        bool closing{false};  // Соединение закрывается в конце итерации.
+    };
+
+    /**
+     * @brief Запрос из пачки.
+     */
+    struct Request {
+        int connection;  // Дескриптор соединения, приславшего запрос.
+        bool encryption;  // Шифрование, иначе регистрация.
+        uint64_t key;  // Ключ шифрования.
+    };
+
+    /**
+     * @brief Подписаться на события дескриптора.
+     */
+    void watch(int file, uint32_t events, int operation) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = file;
+        if (epoll_ctl(epoll_, operation, file, &event) != 0) {
+            throw std::runtime_error("Cannot watch descriptor.");
+        }
+    }
+
+    /**
+     * @brief Принять все ожидающие соединения.
+     */
+    void accept_connections() {
+        while (true) {
+            int file = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (file < 0) {
+                return;  // EAGAIN или соединение сброшено, не дождавшись приёма.
+            }
+            if (static_cast<size_t>(file) >= connections_.size()) {
+                connections_.resize(file + 1);
+            }
+            connections_[file].reset(new Connection());
+            connections_[file]->file = file;
+            watch(file, EPOLLIN, EPOLL_CTL_ADD);
+            ++counters_.connections;
+        }
+    }
+
+    /**
+     * @brief Прочитать доступные запросы соединения в пачку.
+     */
+    void receive(Connection& connection) {
+        if (connection.closing || connection.read_closed) {
+            return;
+        }
+        auto used = connection.input.size();
+        connection.input.resize(used + read_size_);
+        auto bytes = read(connection.file, connection.input.data() + used, read_size_);
+        connection.input.resize(used + std::max<ssize_t>(bytes, 0));
+        if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+            connection.read_closed = true;  // Ответы на уже прочитанные запросы всё равно отправляются.
+            touch(connection);
+        }
+        const char* position = connection.input.data();
+        const char* end = position + connection.input.size();
+        char tag = 0;
+        uint64_t key = 0;
+        while (IdProtocol::read(position, end, IdProtocol::request_has_value, tag, key)) {
+            if (tag != IdProtocol::registration_tag && tag != IdProtocol::encryption_tag) {
+                close_later(connection);  // Клиент нарушил протокол.
+                return;
+            }
+            batch_.push_back({connection.file, tag == IdProtocol::encryption_tag, key});
+        }
+        if (end - position > static_cast<ptrdiff_t>(IdProtocol::max_record_size)) {
+            close_later(connection);  // Varint длиннее 64 битов.
+            return;
+        }
+        connection.input.erase(connection.input.begin(), connection.input.begin() + (position - connection.input.data()));
+    }
+
+    /**
+     * @brief Выполнить пачку запросов и закодировать ответы.
+     */
+    void execute_batch() {
+        if (batch_.empty()) {
+            return;
+        }
+        responses_.clear();
+        size_t first = 0;
+        while (first < batch_.size()) {
+            if (batch_[first].encryption) {
+                char tag = IdProtocol::encryption_tag;
+                try {
+                    database_.encrypt(batch_[first].key);
+                } catch (const std::exception&) {
+                    tag = IdProtocol::error_tag;
+                }
+                respond(batch_[first++].connection, tag, 0);
+                continue;
+            }
+            size_t last = first;
+            while (last < batch_.size() && !batch_[last].encryption) {
+                ++last;
+            }
+            ids_.clear();
+            try {
+                database_.register_new_users(last - first, std::back_inserter(ids_));
+            } catch (const std::out_of_range&) {  // Id-шники закончились: выданные остаются выданными.
+            }
+            ++counters_.registration_calls;
+            for (size_t i = first; i < last; ++i) {
+                if (i - first < ids_.size()) {
+                    respond(batch_[i].connection, IdProtocol::registration_tag, ids_[i - first]);
+                } else {
+                    respond(batch_[i].connection, IdProtocol::error_tag, 0);
+                }
+            }
+            first = last;
+        }
+        counters_.requests += batch_.size();
+        ++counters_.batches;
+        batch_.clear();
+    }
+
+    /**
+     * @brief Закодировать ответ соединению в общий буфер ответов.
+     */
+    void respond(int file, char tag, uint64_t value) {
+        auto& connection = *connections_[file];
+        if (connection.closing) {
+            return;
+        }
+        auto offset = responses_.size();
+        if (IdProtocol::response_has_value(tag)) {
+            IdProtocol::append(responses_, tag, value);
+        } else {
+            IdProtocol::append(responses_, tag);
+        }
+        auto length = responses_.size() - offset;
+        if (!connection.segments.empty() &&
+            connection.segments.back().first + connection.segments.back().second == offset) {
+            connection.segments.back().second += length;  // Соседние ответы одного соединения - один кусок.
+        } else {
+            connection.segments.emplace_back(offset, length);
+        }
+        touch(connection);
+    }
+
+    /**
+     * @brief Отметить соединение для отправки ответов в конце итерации.
+     */
+    void touch(Connection& connection) {
+        if (!connection.touched) {
+            connection.touched = true;
+            touched_.push_back(connection.file);
+        }
+    }
+
+    /**
+     * @brief Отправить очередь и новые ответы соединения одним sendmsg() и обновить подписку на события.
+     */
+    void send(Connection& connection) {
+        connection.touched = false;
+        if (connection.closing) {
+            connection.segments.clear();
+            return;
+        }
+        iovecs_.clear();
+        if (!connection.backlog.empty()) {
+            iovecs_.push_back({connection.backlog.data(), connection.backlog.size()});
+        }
+        for (const auto& segment : connection.segments) {
+            iovecs_.push_back({responses_.data() + segment.first, segment.second});
+        }
+        connection.segments.clear();
+        size_t first = 0;
+        while (first < iovecs_.size()) {
+            msghdr message{};
+            message.msg_iov = iovecs_.data() + first;
+            message.msg_iovlen = std::min<size_t>(iovecs_.size() - first, IOV_MAX);
+            auto written = sendmsg(connection.file, &message, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    close_later(connection);
+                    return;
+                }
+                break;
+            }
+            for (auto rest = static_cast<size_t>(written); rest > 0;) {
+                auto& iovec = iovecs_[first];
+                if (rest >= iovec.iov_len) {
+                    rest -= iovec.iov_len;
+                    ++first;
+                } else {
+                    iovec.iov_base = static_cast<char*>(iovec.iov_base) + rest;
+                    iovec.iov_len -= rest;
+                    rest = 0;
+                }
+            }
+        }
+        std::vector<char> backlog;
+        for (size_t i = first; i < iovecs_.size(); ++i) {
+            auto data = static_cast<const char*>(iovecs_[i].iov_base);
+            backlog.insert(backlog.end(), data, data + iovecs_[i].iov_len);
+        }
+        connection.backlog.swap(backlog);
+        if (connection.read_closed && connection.backlog.empty()) {
+            close_later(connection);
+            return;
+        }
+        uint32_t interest = 0;
+        if (!connection.read_closed && connection.backlog.size() <= max_backlog_) {
+            interest |= EPOLLIN;
+        }
+        if (!connection.backlog.empty()) {
+            interest |= EPOLLOUT;
+        }
+        if (interest != connection.interest) {
+            connection.interest = interest;
+            watch(connection.file, interest, EPOLL_CTL_MOD);
+        }
+    }
+
+    /**
+     * @brief Закрыть соединение в конце итерации; ответы на его запросы отбрасываются.
+     */
+    void close_later(Connection& connection) {
+        if (!connection.closing) {
+            connection.closing = true;
+            closing_.push_back(connection.file);
+        }
+    }
+
+    /**
+     * @brief Закрыть все дескрипторы.
+     */
+    void close_all() {
+        for (auto& connection : connections_) {
+            if (connection != nullptr) {
+                close(connection->file);
+            }
+        }
+        connections_.clear();
+        for (int file : {listener_, wakeup_, epoll_}) {
+            if (file >= 0) {
+                close(file);
+            }
+        }
+        if (listener_ >= 0) {
+            unlink(socket_path_.c_str());
+        }
+        listener_ = wakeup_ = epoll_ = -1;
+    }
+
+    static const int max_events_{256};  // Сколько событий забирается за один epoll_wait().
+    static const size_t read_size_{64 * 1024};  // Сколько байтов читается из соединения за раз.
+    static const size_t max_backlog_{1 << 20};  // Размер очереди ответов, при котором запросы перестают читаться.
+
+    DataBaseType& database_;  // База, в которой выполняются запросы.
+    std::string socket_path_;  // Путь к Unix-сокету.
+    int epoll_{-1};  // Дескриптор epoll.
+    int listener_{-1};  // Сокет, принимающий соединения.
+    int wakeup_{-1};  // eventfd для остановки сервера.
+    std::vector<std::unique_ptr<Connection>> connections_;  // Соединения по дескрипторам.
+    std::vector<Request> batch_;  // Пачка прочитанных запросов.
+    std::vector<uint64_t> ids_;  // Id-шники серии регистраций.
+    std::vector<char> responses_;  // Общий буфер ответов пачки.
+    std::vector<iovec> iovecs_;  // Куски ответов соединения для sendmsg().
+    std::vector<int> touched_;  // Соединения, которым нужно отправить ответы.
+    std::vector<int> closing_;  // Соединения, которые закрываются в конце итерации.
+    Counters counters_;  // Счётчики сервера.
+};
+
+
+/**
+ * @brief Клиент сервера выдачи id-шников с блокирующим сокетом.
+ * @details Запросы копятся в буфере и отправляются flush(), так что можно отправить несколько запросов,
+ * не дожидаясь ответов. Ответы приходят в порядке запросов.
+ */
+class IdClient {
+public:
+    /**
+     * @brief Подключиться к серверу.
+     * @param socket_path Путь к Unix-сокету.
+     */
+    explicit IdClient(const std::string& socket_path) {
+        auto address = IdProtocol::address(socket_path);
+        file_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (file_ < 0 || connect(file_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            if (file_ >= 0) {
+                close(file_);
+            }
+            throw std::runtime_error("Cannot connect to " + socket_path + ".");
+        }
+    }
+
+    IdClient(const IdClient&) = delete;
+    IdClient& operator=(const IdClient&) = delete;
+
+    ~IdClient() {
+        close(file_);
+    }
+
+    /**
+     * @brief Добавить в буфер запрос регистрации.
+     */
+    void send_registration() {
+        IdProtocol::append(output_, IdProtocol::registration_tag);
+    }
+
+    /**
+     * @brief Добавить в буфер запрос шифрования.
+     */
+    void send_encryption(uint64_t key) {
+        IdProtocol::append(output_, IdProtocol::encryption_tag, key);
+    }
+
+    /**
+     * @brief Добавить в буфер произвольный байт. Для проверки реакции сервера на нарушение протокола.
+     */
+    void send_raw(char byte) {
+        output_.push_back(byte);
+    }
+
+    /**
+     * @brief Отправить накопленные запросы.
+     */
+    void flush() {
+        size_t written = 0;
+        while (written < output_.size()) {
+            auto bytes = ::send(file_, output_.data() + written, output_.size() - written, MSG_NOSIGNAL);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0) {
+                throw std::runtime_error("Cannot send requests.");
+            }
+            written += bytes;
+        }
+        output_.clear();
+    }
+
+    /**
+     * @brief Дождаться ответа на следующий запрос.
+     * @details Если id-шники закончились, бросается исключение std::out_of_range.
+     * @return Id для регистрации, 0 для шифрования.
+     */
+    uint64_t receive() {
+        char tag = 0;
+        uint64_t value = 0;
+        while (true) {
+            const char* position = input_.data() + parsed_;
+            if (IdProtocol::read(position, input_.data() + input_.size(), IdProtocol::response_has_value, tag, value)) {
+                parsed_ = position - input_.data();
+                break;
+            }
+            input_.erase(input_.begin(), input_.begin() + parsed_);
+            parsed_ = 0;
+            auto used = input_.size();
+            input_.resize(used + 64 * 1024);
+            auto bytes = read(file_, input_.data() + used, input_.size() - used);
+            input_.resize(used + std::max<ssize_t>(bytes, 0));
+            if (bytes == 0 || (bytes < 0 && errno != EINTR)) {
+                throw std::runtime_error("Connection is closed.");
+            }
+        }
+        if (tag == IdProtocol::error_tag) {
+            throw std::out_of_range("Server cannot execute the request.");
+        }
+        return value;
+    }
+private:
+    int file_{-1};  // Дескриптор сокета.
+    std::vector<char> output_;  // Запросы, ожидающие отправки.
+    std::vector<char> input_;  // Прочитанные ответы.
+    size_t parsed_{0};  // Разобранная часть прочитанных ответов.
+};
+
+
+/**
+ * @brief Результат нагрузки на сервер.
+ */
+struct LoadResult {
+    size_t connections{0};  // Количество соединений.
+    size_t depth{0};  // Количество запросов, отправленных без ожидания ответа, в каждом соединении.
+    uint64_t requests{0};  // Количество выполненных запросов.
+    double seconds{0};  // Время нагрузки.
+    double p50_us{0};  // Медиана задержки запроса, мкс.
+    double p99_us{0};  // 99-й перцентиль задержки запроса, мкс.
+};
+
+/**
+ * @brief Нагрузить сервер: в каждом соединении держать depth запросов без ответа.
+ * @details Задержка запроса - время от отправки до получения ответа.
+ * @param socket_path Путь к Unix-сокету сервера.
+ * @param connections Количество соединений, каждое обслуживается своим потоком.
+ * @param depth Количество запросов, отправленных без ожидания ответа, в каждом соединении.
+ * @param requests Количество запросов в каждом соединении.
+ * @param encrypt_every Каждый encrypt_every-й запрос - шифрование (0 - только регистрации).
+ */
+LoadResult generate_load(const std::string& socket_path, size_t connections, size_t depth, uint64_t requests,
+                         uint64_t encrypt_every) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::vector<uint32_t>> latencies(connections);  // Задержки в наносекундах.
+    std::vector<std::exception_ptr> errors(connections);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (size_t thread_no = 0; thread_no < connections; ++thread_no) {
+        threads.emplace_back([&, thread_no]() {
+            try {
+                IdClient client(socket_path);
+                std::vector<Clock::time_point> sent_at(depth);
+                auto& thread_latencies = latencies[thread_no];
+                thread_latencies.reserve(requests);
+                std::mt19937_64 rd(thread_no);
+                uint64_t sent = 0;
+                while (thread_latencies.size() < requests) {
+                    auto now = Clock::now();
+                    for (; sent < requests && sent - thread_latencies.size() < depth; ++sent) {
+                        if (encrypt_every != 0 && sent % encrypt_every == encrypt_every - 1) {
+                            client.send_encryption(rd() & 0xFFFF);
+                        } else {
+                            client.send_registration();
+                        }
+                        sent_at[sent % depth] = now;
+                    }
+                    client.flush();
+                    client.receive();
+                    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            Clock::now() - sent_at[thread_latencies.size() % depth]).count();
+                    thread_latencies.push_back(static_cast<uint32_t>(std::min<int64_t>(nanoseconds, UINT32_MAX)));
+                }
+            } catch (...) {
+                errors[thread_no] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    std::vector<uint32_t> all;
+    for (auto& thread_latencies : latencies) {
+        all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+    LoadResult result;
+    result.connections = connections;
+    result.depth = depth;
+    result.requests = all.size();
+    result.seconds = elapsed.count();
+    if (!all.empty()) {
+        auto percentile = [&all](double fraction) {
+            auto index = std::min(all.size() - 1, static_cast<size_t>(fraction * all.size()));
+            std::nth_element(all.begin(), all.begin() + index, all.end());
+            return all[index] / 1000.0;
+        };
+        result.p50_us = percentile(0.5);
+        result.p99_us = percentile(0.99);
+    }
+    return result;
+}
+
+
+// Тесты и примеры использования.
+
+void test_8bit_from_task() {
+    BitTrie<uint8_t> trie;
+    trie.add_number(1);
+    trie.add_number(3);
+    trie.xor_all_values(1);
+    auto id = trie.add_number();
+    assert(id == 1);
+    trie.xor_all_values(1);
+    id = trie.add_number();
+    assert(id == 2);
+}
+
+void test_8bit_sequential_registrations() {
+    BitTrie<uint8_t> trie;
+    auto id = trie.add_number();
+    assert(id == 0);
+    id = trie.add_number();
+    assert(id == 1);
+    id = trie.add_number();
+    assert(id == 2);
+    id = trie.add_number();
+    assert(id == 3);
+    id = trie.add_number();
+    assert(id == 4);
+}
+
+void test_8bit_full_trie() {
+    BitTrie<uint8_t> trie;
+    for (auto i = 0; i < 256; ++i) {
+        auto id = trie.add_number();
+        assert(id == i);
+    }
+    try {
+        auto id = trie.add_number();
+        assert(false);
+    } catch(std::out_of_range& e) {
+        assert(true);
+    }
+}
+
+void test_8bit_mex_all_values() {
+    std::random_device rd;
+
+    for (auto mex = 0; mex < 256; ++mex) {
+        BitTrie<uint8_t> trie;
+        for (auto i = 0; i < 256; ++i) {
+            if ((i < mex) || ((i > mex) && (rd() % 2 == 0))) {
+                trie.add_number(i);
+            }
+        }
+        auto id = trie.add_number();
+        assert(id == mex);
+    }
+}
+
+void test_8bit_xor_all_values() {
+    std::random_device rd;
+
+    for (auto mex = 0; mex < 256; ++mex) {
+        BitTrie<uint8_t> trie;
+        std::vector<uint8_t> ids;
         for (auto i = 0; i < 256; ++i) {
             if ((i < mex) || ((i > mex) && (rd() % 2 == 0))) {
                 trie.add_number(i);
+                ids.push_back(i);
+            }
+        }
+
+        uint8_t key = rd();
+        for(auto& id: ids) {
+            id ^= key;
+        }
+        std::sort(ids.begin(), ids.end());
+        uint8_t new_mex = 0;
+        while(new_mex == ids[new_mex]) {
+            new_mex += 1;
+        }
+        trie.xor_all_values(key);
+
+        auto id = trie.add_number();
+        assert(id == new_mex);
+    }
+}
+
+
+void test_16bit_from_task() {
+    BitTrie<uint16_t> trie;
+    trie.add_number(1);
+    trie.add_number(3);
+    trie.xor_all_values(1);
+    auto id = trie.add_number();
+    assert(id == 1);
+    trie.xor_all_values(1);
+    id = trie.add_number();
+    assert(id == 2);
+}
+
+void test_16bit_sequential_registrations() {
+    BitTrie<uint16_t> trie;
+    for (auto i = 0; i < 10000; ++i) {
+        auto id = trie.add_number();
+        assert(id == i);
+    }
+    auto id = trie.add_number();
+    assert(id == 10000);
+}
+
+void test_16bit_full_trie() {
+    BitTrie<uint16_t> trie;
+    for (auto i = 0; i < 65536; ++i) {
+        auto id = trie.add_number();
+        assert(id == i);
+    }
+    try {
+        auto id = trie.add_number();
+        assert(false);
+    } catch(std::out_of_range& e) {
+        assert(true);
+    }
+}
+
+void test_16bit_mex_all_values() {
+    std::random_device rd;
+
+    for (auto mex = 0; mex < 65536; mex += rd() % 1000) {
+        BitTrie<uint16_t> trie;
+        for (auto i = 0; i < 65536; ++i) {
+            if ((i < mex) || ((i > mex) && (rd() % 10 == 0))) {
+                trie.add_number(i);
+            }
+        }
+        auto id = trie.add_number();
+        assert(id == mex);
+    }
+}
+
+void test_16bit_xor_all_values() {
+    std::random_device rd;
+
+    for (auto mex = 0; mex < 65536; mex += rd() % 1000) {
+        BitTrie<uint16_t> trie;
+        std::vector<uint16_t> ids;
+        for (auto i = 0; i < 65536; ++i) {
+            if ((i < mex) || ((i > mex) && (rd() % 10 == 0))) {
+                trie.add_number(i);
+                ids.push_back(i);
+            }
+        }
+
+        uint16_t key = rd();
+        for(auto& id: ids) {
+            id ^= key;
+        }
+        std::sort(ids.begin(), ids.end());
+        uint16_t new_mex = 0;
+        while(new_mex == ids[new_mex]) {
+            new_mex += 1;
+        }
+        trie.xor_all_values(key);
+
+        auto id = trie.add_number();
+        assert(id == new_mex);
+    }
+}
+
+void test_64bit_from_task() {
+    BitTrie<uint64_t> trie;
+    trie.add_number(1);
+    trie.add_number(3);
+    trie.xor_all_values(1);
+    auto id = trie.add_number();
+    assert(id == 1);
+    trie.xor_all_values(1);
+    id = trie.add_number();
+    assert(id == 2);
+}
+
+
+void test_arena_storage_reuses_nodes() {
+    struct TestNode {
+        uint32_t children[2]{0, 0};
+        uint32_t payload{0};
+    };
+    ArenaNodeStorage<TestNode> storage;
+    std::vector<uint32_t> handles;
+    size_t initial_memory = 0;
+    for (uint32_t i = 0; i < 10000; ++i) {
+        auto handle = storage.create();
+        assert(handle != ArenaNodeStorage<TestNode>::null_handle());
+        storage[handle].payload = i;
+        handles.push_back(handle);
+        if (i == 0) {
+            initial_memory = storage.memory_usage();
+        }
+    }
+    // Буфер перевыделялся, поэтому адреса узлов могли измениться; дескрипторы и содержимое узлов сохраняются.
+    assert(storage.memory_usage() > initial_memory);
+    for (uint32_t i = 0; i < handles.size(); ++i) {
+        assert(handles[i] == i + 1 && storage[handles[i]].payload == i);
+    }
+    storage.destroy(handles[10]);
+    storage.destroy(handles[20]);
+    auto reused = storage.create();
+    assert(reused == handles[20]);
+    assert(storage[reused].payload == 0);
+    reused = storage.create();
+    assert(reused == handles[10]);
+    assert(storage.create() == handles.back() + 1);
+}
+
+void test_arena_matches_heap() {
+    std::mt19937 rd(2021);
+
+    BitTrie<uint16_t, HeapNodeStorage, false> heap_trie;
+    BitTrie<uint16_t, ArenaNodeStorage, false> arena_trie;
+    for (auto i = 0; i < 40000; ++i) {
+        auto operation = rd() % 10;
+        if (operation == 0) {
+            uint16_t key = rd();
+            heap_trie.xor_all_values(key);
+            arena_trie.xor_all_values(key);
+        } else if (operation < 5) {
+            uint16_t value = rd();
+            bool heap_taken = false;
+            bool arena_taken = false;
+            try {
+                heap_trie.add_number(value);
+            } catch (std::range_error& e) {
+                heap_taken = true;
+            }
+            try {
+                arena_trie.add_number(value);
+            } catch (std::range_error& e) {
+                arena_taken = true;
+            }
+            assert(heap_taken == arena_taken);
+        } else {
+            assert(heap_trie.add_number() == arena_trie.add_number());
+        }
+    }
+}
+
+void test_arena_64bit_from_task() {
+    BitTrie<uint64_t, ArenaNodeStorage> trie;
+    trie.add_number(1);
+    trie.add_number(3);
+    trie.xor_all_values(1);
+    auto id = trie.add_number();
+    assert(id == 1);
+    trie.xor_all_values(1);
+    id = trie.add_number();
+    assert(id == 2);
+    trie.xor_all_values(uint64_t{1} << 63);
+    id = trie.add_number();
+    assert(id == 0);
+}
+
+void test_database_from_task() {
+    DataBase db;
+    assert(db.register_new_user() == 0);
+    assert(db.register_new_user() == 1);
+    db.encrypt(1);
+    assert(db.register_new_user() == 2);
+    db.encrypt(2);
+    assert(db.register_new_user() == 1);
+}
+
+
+void test_compressed_from_task() {
+    CompressedBitTrie<uint64_t> trie;
+    trie.add_number(1);
+    trie.add_number(3);
+    trie.xor_all_values(1);
+    auto id = trie.add_number();
+    assert(id == 1);
+    trie.xor_all_values(1);
+    id = trie.add_number();
+    assert(id == 2);
+}
+
+void test_compressed_8bit_full_trie() {
+    CompressedBitTrie<uint8_t, ArenaNodeStorage> trie;
+    for (auto i = 0; i < 256; ++i) {
+        auto id = trie.add_number();
+        assert(id == i);
+    }
+    try {
+        trie.add_number();
+        assert(false);
+    } catch(std::out_of_range& e) {
+        assert(true);
+    }
+}
+
+void test_compressed_matches_bit_trie() {
+    std::mt19937 rd(2013);
+
+    BitTrie<uint16_t> trie;
+    CompressedBitTrie<uint16_t> compressed_trie;
+    for (auto i = 0; i < 40000; ++i) {
+        auto operation = rd() % 10;
+        if (operation == 0) {
+            uint16_t key = rd();
+            trie.xor_all_values(key);
+            compressed_trie.xor_all_values(key);
+        } else if (operation < 5) {
+            uint16_t value = rd();
+            bool taken = false;
+            bool compressed_taken = false;
+            try {
+                trie.add_number(value);
+            } catch (std::range_error& e) {
+                taken = true;
+            }
+            try {
+                compressed_trie.add_number(value);
+            } catch (std::range_error& e) {
+                compressed_taken = true;
+            }
+            assert(taken == compressed_taken);
+        } else {
+            assert(trie.add_number() == compressed_trie.add_number());
+        }
+    }
+}
+
+void test_compressed_64bit_node_count() {
+    CompressedBitTrie<uint64_t, ArenaNodeStorage> trie;
+    for (uint64_t i = 0; i < 10000; ++i) {
+        assert(trie.add_number() == i);
+    }
+    assert(trie.node_count() < 2 * 10000);  // Без сжатия понадобилось бы больше 10000 * 14 + 50 узлов.
+    trie.xor_all_values(~uint64_t{0});
+    assert(trie.add_number() == 0);
+    trie.add_number(uint64_t{1} << 63);
+    trie.xor_all_values(uint64_t{1} << 63);
+    assert(trie.add_number() == 1);
+}
+
+
+void test_bitmap_matches_bit_trie() {
+    std::mt19937 rd(1234);
+
+    BitTrie<uint16_t> trie;
+    HierarchicalBitmap<uint32_t> bitmap(65535);
+    for (auto i = 0; i < 40000; ++i) {
+        auto operation = rd() % 10;
+        if (operation == 0) {
+            uint16_t key = rd();
+            trie.xor_all_values(key);
+            bitmap.xor_all_values(key);
+        } else if (operation < 5) {
+            uint16_t value = rd();
+            bool taken = false;
+            bool bitmap_taken = false;
+            try {
+                trie.add_number(value);
+            } catch (std::range_error& e) {
+                taken = true;
+            }
+            try {
+                bitmap.add_number(value);
+            } catch (std::range_error& e) {
+                bitmap_taken = true;
+            }
+            assert(taken == bitmap_taken);
+        } else {
+            assert(trie.add_number() == bitmap.add_number());
+        }
+    }
+}
+
+void test_bitmap_full_domain() {
+    for (uint32_t max_value : {0u, 1u, 63u, 200u, 5000u}) {
+        HierarchicalBitmap<uint32_t> bitmap(max_value);
+        uint32_t domain_size = 1;
+        while (domain_size <= max_value) {
+            domain_size *= 2;
+        }
+        bitmap.xor_all_values(domain_size - 1);
+        std::vector<uint32_t> ids;
+        for (uint32_t i = 0; i < domain_size; ++i) {
+            ids.push_back(bitmap.add_number());
+            assert(ids.back() == i);
+        }
+        try {
+            bitmap.add_number();
+            assert(false);
+        } catch(std::out_of_range& e) {
+            assert(true);
+        }
+        try {
+            bitmap.xor_all_values(domain_size);
+            assert(false);
+        } catch(std::out_of_range& e) {
+            assert(true);
+        }
+    }
+}
+
+void test_bounded_database_from_task() {
+    BoundedDataBase db(1000);
+    assert(db.register_new_user() == 0);
+    assert(db.register_new_user() == 1);
+    db.encrypt(1);
+    assert(db.register_new_user() == 2);
+    db.encrypt(2);
+    assert(db.register_new_user() == 1);
+    try {
+        db.encrypt(uint64_t{1} << 40);
+        assert(false);
+    } catch(std::out_of_range& e) {
+        assert(true);
+    }
+}
+
+
+void test_add_numbers_matches_sequential() {
+    std::mt19937 rd(4);
+
+    for (auto round = 0; round < 50; ++round) {
+        BitTrie<uint16_t, HeapNodeStorage, false> batch_trie;
+        BitTrie<uint16_t> trie;
+        for (auto i = 0; i < 3000; ++i) {
+            uint16_t value = rd();
+            try {
+                batch_trie.add_number(value);
+                trie.add_number(value);
+            } catch (std::range_error& e) {
+                assert(true);
+            }
+        }
+        uint16_t key = rd();
+        batch_trie.xor_all_values(key);
+        trie.xor_all_values(key);
+        std::vector<uint16_t> ids;
+        batch_trie.add_numbers(rd() % 5000, std::back_inserter(ids));
+        for (auto id : ids) {
+            assert(trie.add_number() == id);
+        }
+        assert(batch_trie.add_number() == trie.add_number());  // Полнота узлов пересчитана верно.
+    }
+}
+
+void test_add_numbers_until_full() {
+    BitTrie<uint8_t, ArenaNodeStorage, false> trie;
+    trie.add_number(7);
+    std::vector<uint8_t> ids;
+    trie.add_numbers(10, std::back_inserter(ids));
+    assert((ids == std::vector<uint8_t>{0, 1, 2, 3, 4, 5, 6, 8, 9, 10}));
+    ids.clear();
+    try {
+        trie.add_numbers(1000, std::back_inserter(ids));
+        assert(false);
+    } catch(std::out_of_range& e) {
+        assert(ids.size() == 256 - 11);
+        assert(ids.back() == 255);
+    }
+}
+
+void test_database_register_new_users() {
+    DataBase db;
+    db.register_new_user();
+    db.encrypt(5);
+    auto ids = db.register_new_users(6);
+    assert((ids == std::vector<uint64_t>{0, 1, 2, 3, 4, 6}));
+    assert(db.register_new_user() == 7);
+    BoundedDataBase bounded_db(15);
+    ids = bounded_db.register_new_users(3);
+    assert((ids == std::vector<uint64_t>{0, 1, 2}));
+}
+
+
+void test_database_snapshot() {
+    const std::string path = "super_test_snapshot.bin";
+    DataBase db;
+    db.register_new_users(100000);
+    db.encrypt(12345);  // Отложенные маски сохраняются в узлах.
+    db.register_new_users(1000);
+    db.save(path);
+
+    DataBase loaded_db;
+    loaded_db.register_new_user();
+    loaded_db.load(path);
+    DataBase another_loaded_db;
+    another_loaded_db.load(path);
+    for (auto i = 0; i < 300000; ++i) {  // Загруженная база растёт за пределы отображённого файла.
+        if (i % 1000 == 0) {
+            db.encrypt(i);
+            loaded_db.encrypt(i);
+        }
+        assert(db.register_new_user() == loaded_db.register_new_user());
+    }
+    DataBase original_db;
+    original_db.register_new_users(100000);
+    original_db.encrypt(12345);
+    original_db.register_new_users(1000);
+    for (auto i = 0; i < 1000; ++i) {  // Изменения загруженной базы не попадают в файл.
+        assert(original_db.register_new_user() == another_loaded_db.register_new_user());
+    }
+
+    BitTrie<uint32_t, ArenaNodeStorage> narrow_trie;
+    try {
+        narrow_trie.load(path);
+        assert(false);
+    } catch (std::runtime_error& e) {
+        assert(narrow_trie.add_number() == 0);
+    }
+    auto patch_snapshot = [&path](long offset, uint32_t value) {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "r+b"), std::fclose);
+        assert(file != nullptr && std::fseek(file.get(), offset, SEEK_SET) == 0);
+        assert(std::fwrite(&value, sizeof(value), 1, file.get()) == 1);
+    };
+    const long free_list_offset = 20;  // magic, version, node_size, size.
+    const long root_offset = 36;  // Заголовок хранилища (32 байта), разрядность чисел с выравниванием.
+    const long root_node_offset = 65536 + 32;  // Корень - первый узел арены; узел занимает 32 байта.
+    const long root_size_offset = root_node_offset + 24;  // Потомки, маска xor, отметки полноты с выравниванием.
+    for (auto corruption : std::vector<std::pair<long, uint32_t>>{{root_offset, UINT32_MAX - 1}, {root_offset, 0},
+                                                                   {free_list_offset, 1},
+                                                                   {root_node_offset, UINT32_MAX - 1},
+                                                                   {root_node_offset, 1},
+                                                                   {root_size_offset, 7}}) {
+        db.save(path);
+        patch_snapshot(corruption.first, corruption.second);
+        DataBase corrupted_db;
+        try {
+            corrupted_db.load(path);
+            assert(false);
+        } catch (std::runtime_error& e) {
+            assert(corrupted_db.register_new_user() == 0);
+        }
+    }
+    std::remove(path.c_str());
+    try {
+        loaded_db.load(path);
+        assert(false);
+    } catch (std::runtime_error& e) {
+        assert(true);
+    }
+}
+
+
+void test_durable_database_recovery() {
+    const std::string directory = "super_test_durable_db";
+    mkdir(directory.c_str(), 0755);
+    std::vector<uint64_t> ids;
+    {
+        DurableDataBase db(directory, {64, std::chrono::seconds(60)});
+        ids.push_back(db.register_new_user());
+        db.encrypt(3);
+        for (auto id : db.register_new_users(100)) {
+            ids.push_back(id);
+        }
+        db.checkpoint();
+        db.encrypt(77);
+        ids.push_back(db.register_new_user());
+    }
+    {
+        DurableDataBase db(directory);  // Снимок и журнал после него.
+        db.encrypt(5);
+        ids.push_back(db.register_new_user());
+        db.sync();
+    }
+    DataBase reference_db;
+    std::vector<uint64_t> reference_ids;
+    reference_ids.push_back(reference_db.register_new_user());
+    reference_db.encrypt(3);
+    for (auto id : reference_db.register_new_users(100)) {
+        reference_ids.push_back(id);
+    }
+    reference_db.encrypt(77);
+    reference_ids.push_back(reference_db.register_new_user());
+    reference_db.encrypt(5);
+    reference_ids.push_back(reference_db.register_new_user());
+    assert(ids == reference_ids);
+
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> log(std::fopen((directory + "/log.1").c_str(), "ab"),
+                                                          std::fclose);
+        std::fputc(2, log.get());  // Оборванная при сбое запись шифрования.
+        std::fputc(0x80, log.get());
+    }
+    for (auto name : {"/snapshot.", "/snapshot.123456789012345678901234567890"}) {  // Посторонние файлы.
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)>(std::fopen((directory + name).c_str(), "wb"), std::fclose);
+    }
+    {
+        DurableDataBase db(directory);
+        assert(db.register_new_user() == reference_db.register_new_user());
+    }
+    {
+        DurableDataBase db(directory, {SIZE_MAX, std::chrono::milliseconds(200)});
+        db.commit_if_due();  // Фиксировать нечего.
+        db.register_new_user();
+        db.commit_if_due();  // Окно ещё не прошло.
+        assert(db.commits_count() == 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        db.commit_if_due();  // Новых операций нет, но окно прошло.
+        db.commit_if_due();
+        assert(db.commits_count() == 1);
+    }
+    std::remove((directory + "/snapshot.").c_str());
+    std::remove((directory + "/snapshot.123456789012345678901234567890").c_str());
+    std::remove((directory + "/snapshot.1").c_str());
+    std::remove((directory + "/log.1").c_str());
+    rmdir(directory.c_str());
+}
+
+
+/**
+ * @brief Бор, записывающий историю применённых к нему операций. Нужен для проверки линеаризуемости.
+ */
+class HistoryTrie {
+public:
+    struct Operation {
+        bool is_encrypt;  // Шифрование или регистрация.
+        uint64_t value;  // Ключ шифрования или выданный id.
+    };
+
+    uint64_t add_number() {
+        auto id = trie_.add_number();
+        history_.push_back({false, id});
+        return id;
+    }
+
+    template<typename OutputIterator>
+    OutputIterator add_numbers(size_t count, OutputIterator out) {
+        for (size_t i = 0; i < count; ++i) {
+            *out++ = add_number();
+        }
+        return out;
+    }
+
+    void xor_all_values(uint64_t value) {
+        trie_.xor_all_values(value);
+        history_.push_back({true, value});
+    }
+
+    static std::vector<Operation> history_;
+private:
+    BitTrie<uint64_t, ArenaNodeStorage> trie_;
+};
+
+std::vector<HistoryTrie::Operation> HistoryTrie::history_;
+
+void test_concurrent_database_unique_ids() {
+    const size_t threads_count = 4;
+    const size_t registrations_count = 20000;
+    ConcurrentDataBase db;
+    std::vector<std::vector<uint64_t>> ids(threads_count);
+    std::vector<std::thread> threads;
+    for (size_t thread_no = 0; thread_no < threads_count; ++thread_no) {
+        threads.emplace_back([&db, &ids, thread_no, registrations_count]() {
+            for (size_t i = 0; i < registrations_count; ++i) {
+                ids[thread_no].push_back(db.register_new_user());
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::vector<uint64_t> all_ids;
+    for (auto& thread_ids : ids) {
+        assert(std::is_sorted(thread_ids.begin(), thread_ids.end()));  // Без шифрования MEX только растёт.
+        all_ids.insert(all_ids.end(), thread_ids.begin(), thread_ids.end());
+    }
+    std::sort(all_ids.begin(), all_ids.end());
+    for (size_t i = 0; i < all_ids.size(); ++i) {
+        assert(all_ids[i] == i);
+    }
+}
+
+/**
+ * @brief Есть ли у истории разбиение по потокам, сохраняющее порядок и результаты операций каждого потока.
+ * @details История - последовательное выполнение; если она перемежает программы потоков, то потоки получили
+ * ответы одного последовательного выполнения, согласованного с порядком их операций. Одинаковые операции
+ * в начале программ нескольких потоков (одинаковые ключи, одинаковые id после шифрования) перебираются поиском
+ * в глубину по состояниям "сколько операций каждого потока уже сопоставлено"; состояния запоминаются.
+ * @param history Применённые операции в порядке применения.
+ * @param programs Операции каждого потока в программном порядке с полученными результатами.
+ */
+bool is_interleaving(const std::vector<HistoryTrie::Operation>& history,
+                     const std::vector<std::vector<HistoryTrie::Operation>>& programs) {
+    size_t total = 0;
+    for (auto& program : programs) {
+        total += program.size();
+    }
+    if (total != history.size()) {
+        return false;
+    }
+    std::set<std::vector<size_t>> visited;
+    std::vector<std::vector<size_t>> stack{std::vector<size_t>(programs.size(), 0)};
+    while (!stack.empty()) {
+        auto positions = stack.back();
+        stack.pop_back();
+        size_t done = 0;
+        for (auto position : positions) {
+            done += position;
+        }
+        if (done == history.size()) {
+            return true;
+        }
+        auto& operation = history[done];
+        for (size_t thread_no = 0; thread_no < programs.size(); ++thread_no) {
+            if (positions[thread_no] == programs[thread_no].size()) {
+                continue;
+            }
+            auto& candidate = programs[thread_no][positions[thread_no]];
+            if (candidate.is_encrypt != operation.is_encrypt || candidate.value != operation.value) {
+                continue;
+            }
+            ++positions[thread_no];
+            if (visited.insert(positions).second) {
+                stack.push_back(positions);
+            }
+            --positions[thread_no];
+        }
+    }
+    return false;
+}
+
+void test_concurrent_database_linearizable() {
+    const size_t threads_count = 4;
+    const size_t operations_count = 20000;
+    HistoryTrie::history_.clear();
+    BasicConcurrentDataBase<HistoryTrie> db;
+    std::vector<std::vector<HistoryTrie::Operation>> programs(threads_count);  // Операции потоков с результатами.
+    std::vector<std::thread> threads;
+    for (size_t thread_no = 0; thread_no < threads_count; ++thread_no) {
+        threads.emplace_back([&db, &programs, thread_no, operations_count]() {
+            std::mt19937 rd(thread_no);
+            for (size_t i = 0; i < operations_count; ++i) {
+                if (rd() % 50 == 0) {
+                    uint64_t key = rd() % 1024;
+                    db.encrypt(key);
+                    programs[thread_no].push_back({true, key});
+                } else {
+                    programs[thread_no].push_back({false, db.register_new_user()});
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    // Применённая история - корректное последовательное выполнение.
+    BitTrie<uint64_t, ArenaNodeStorage> trie;
+    for (auto& operation : HistoryTrie::history_) {
+        if (operation.is_encrypt) {
+            trie.xor_all_values(operation.value);
+        } else {
+            assert(trie.add_number() == operation.value);
+        }
+    }
+    // Потоки получили ответы этого выполнения, и оно сохраняет порядок операций каждого потока.
+    assert(is_interleaving(HistoryTrie::history_, programs));
+
+    // Проверка ловит переставленные и потерянные операции и разбирает одинаковые операции разных потоков.
+    using Operation = HistoryTrie::Operation;
+    std::vector<std::vector<Operation>> small_programs{{{false, 0}, {true, 5}}, {{false, 0}, {false, 1}}};
+    assert(is_interleaving({{false, 0}, {true, 5}, {false, 0}, {false, 1}}, small_programs));
+    assert(is_interleaving({{false, 0}, {false, 0}, {true, 5}, {false, 1}}, small_programs));
+    assert(!is_interleaving({{true, 5}, {false, 0}, {false, 0}, {false, 1}}, small_programs));
+    assert(!is_interleaving({{false, 1}, {false, 0}, {false, 0}, {true, 5}}, small_programs));
+    assert(!is_interleaving({{false, 0}, {true, 5}, {false, 0}}, small_programs));
+}
+
+template<typename Trie>
+void test_remove_matches_model() {
+    std::mt19937 rd(2022);
+
+    Trie trie;
+    HierarchicalBitmap<uint16_t> bitmap(UINT16_MAX);
+    std::set<uint16_t> model;
+    for (auto i = 0; i < 30000; ++i) {
+        auto operation = rd() % 100;
+        if (operation == 0) {
+            uint16_t key = rd();
+            trie.xor_all_values(key);
+            bitmap.xor_all_values(key);
+            std::set<uint16_t> encrypted;
+            for (auto value : model) {
+                encrypted.insert(value ^ key);
+            }
+            model.swap(encrypted);
+        } else if (operation < 45) {
+            uint16_t mex = 0;
+            for (auto it = model.begin(); it != model.end() && *it == mex; ++it) {
+                ++mex;
+            }
+            assert(trie.add_number() == mex);
+            assert(bitmap.add_number() == mex);
+            model.insert(mex);
+        } else if (operation < 55) {
+            uint16_t value = rd();
+            if (model.count(value) != 0) {
+                try {
+                    trie.add_number(value);
+                    assert(false);
+                } catch (std::range_error& e) {
+                }
+            } else {
+                try {
+                    trie.remove_number(value);
+                    assert(false);
+                } catch (std::range_error& e) {
+                }
+                trie.add_number(value);
+                bitmap.add_number(value);
+                model.insert(value);
+            }
+        } else if (!model.empty()) {
+            auto it = model.lower_bound(static_cast<uint16_t>(rd()));
+            if (it == model.end()) {
+                it = model.begin();
+            }
+            trie.remove_number(*it);
+            bitmap.remove_number(*it);
+            model.erase(it);
+        }
+    }
+}
+
+void test_remove_releases_memory() {
+    BitTrie<uint32_t, ArenaNodeStorage> trie;
+    std::vector<uint32_t> ids;
+    trie.add_numbers(100000, std::back_inserter(ids));
+    trie.xor_all_values(0xABCDEF);
+    auto peak = trie.memory_usage();
+    for (auto id : ids) {
+        if (id >= 10) {
+            trie.remove_number(id ^ 0xABCDEF);
+        }
+    }
+    assert(trie.memory_usage() * 100 < peak);  // Память следует за количеством хранимых чисел.
+    trie.xor_all_values(0xABCDEF);
+    assert(trie.add_number() == 10);  // Оставшиеся числа пережили перенос узлов вместе с отложенными масками.
+    for (uint32_t id = 0; id <= 10; ++id) {
+        trie.remove_number(id);
+    }
+    assert(trie.add_number() == 0);
+
+    BitTrie<uint16_t, HeapNodeStorage, false> heap_trie;
+    auto empty = heap_trie.memory_usage();
+    for (auto i = 0; i < 1000; ++i) {
+        heap_trie.add_number();
+    }
+    for (uint16_t id = 0; id < 1000; ++id) {
+        heap_trie.remove_number(id);
+    }
+    assert(heap_trie.memory_usage() == empty);  // Опустевшие узлы удалены, остался только корень.
+}
+
+void test_database_unregister_user() {
+    DataBase db;
+    for (auto i = 0; i < 5; ++i) {
+        db.register_new_user();
+    }
+    db.unregister_user(2);
+    assert(db.register_new_user() == 2);
+    db.encrypt(1);  // Id-шники: 1, 0, 3, 2, 5.
+    db.unregister_user(0);
+    assert(db.register_new_user() == 0);
+    assert(db.register_new_user() == 4);
+    try {
+        db.unregister_user(7);
+        assert(false);
+    } catch (std::range_error& e) {
+    }
+
+    BoundedDataBase bounded_db(15);
+    bounded_db.register_new_users(16);
+    bounded_db.unregister_user(9);
+    assert(bounded_db.register_new_user() == 9);
+    try {
+        bounded_db.unregister_user(16);
+        assert(false);
+    } catch (std::range_error& e) {
+    }
+}
+
+void test_persistent_versions_per_epoch() {
+    auto collect = [](const PersistentBitTrie<uint64_t>::Version& version) {
+        std::vector<uint64_t> values;
+        version.for_each([&values](uint64_t value) { values.push_back(value); });
+        return values;
+    };
+
+    VersionedDataBase db;
+    db.register_new_users(5);
+    auto first_snapshot = db.snapshot();
+    db.unregister_user(2);
+    db.encrypt(1);  // Id-шники: 1, 0, 2, 5.
+    assert(db.register_new_user() == 3);
+    db.encrypt(4);  // Id-шники: 5, 4, 6, 1, 7.
+    auto current = db.snapshot();
+    assert(current.epoch() == 2);
+    assert(collect(current) == std::vector<uint64_t>({1, 4, 5, 6, 7}));
+    assert(current.mex() == 0);
+    assert(collect(current.at_epoch(1)) == std::vector<uint64_t>({0, 1, 2, 3, 5}));
+    assert(current.at_epoch(1).mex() == 4);
+    assert(collect(current.at_epoch(0)) == std::vector<uint64_t>({0, 1, 3, 4}));
+    assert(!current.at_epoch(0).contains(2) && current.at_epoch(0).contains(3));
+    assert(collect(first_snapshot) == std::vector<uint64_t>({0, 1, 2, 3, 4}));  // Снимки не меняются.
+    assert(first_snapshot.mex() == 5);
+}
+
+void test_persistent_matches_bit_trie() {
+    std::mt19937 rd(2023);
+
+    PersistentBitTrie<uint16_t> persistent_trie;
+    BitTrie<uint16_t> trie;
+    std::atomic<bool> done{false};
+    std::thread reader([&persistent_trie, &done]() {  // Читатель проверяет согласованность снимков.
+        while (!done.load()) {
+            auto version = persistent_trie.snapshot();
+            std::vector<uint16_t> values;
+            version.for_each([&values](uint16_t value) { values.push_back(value); });
+            assert(std::is_sorted(values.begin(), values.end()));
+            if (values.size() < 65536) {
+                auto mex = version.mex();
+                assert(!version.contains(mex));
+                assert(std::lower_bound(values.begin(), values.end(), mex) - values.begin() == mex);
+            }
+        }
+    });
+    for (auto i = 0; i < 20000; ++i) {
+        auto operation = rd() % 10;
+        if (operation == 0) {
+            uint16_t key = rd();
+            persistent_trie.xor_all_values(key);
+            trie.xor_all_values(key);
+        } else if (operation < 3) {
+            uint16_t value = rd();
+            bool persistent_removed = true;
+            bool removed = true;
+            try {
+                persistent_trie.remove_number(value);
+            } catch (std::range_error& e) {
+                persistent_removed = false;
+            }
+            try {
+                trie.remove_number(value);
+            } catch (std::range_error& e) {
+                removed = false;
+            }
+            assert(persistent_removed == removed);
+        } else {
+            assert(persistent_trie.add_number() == trie.add_number());
+        }
+    }
+    done.store(true);
+    reader.join();
+}
+
+template<typename Trie>
+void test_order_statistics_match_model() {
+    std::mt19937 rd(2024);
+
+    Trie trie;
+    std::set<uint16_t> model;
+    for (auto i = 0; i < 20000; ++i) {
+        auto operation = rd() % 100;
+        if (operation == 0) {
+            uint16_t key = rd();
+            trie.xor_all_values(key);
+            std::set<uint16_t> encrypted;
+            for (auto value : model) {
+                encrypted.insert(value ^ key);
+            }
+            model.swap(encrypted);
+        } else if (operation < 3) {
+            std::vector<uint16_t> ids;
+            trie.add_numbers(rd() % 20, std::back_inserter(ids));
+            model.insert(ids.begin(), ids.end());
+        } else if (operation < 25) {
+            model.insert(trie.add_number());
+        } else if (operation < 50 && !model.empty()) {
+            auto it = model.lower_bound(static_cast<uint16_t>(rd()));
+            if (it == model.end()) {
+                it = model.begin();
+            }
+            trie.remove_number(*it);
+            model.erase(it);
+        } else if (operation < 70) {
+            auto k = static_cast<uint16_t>(rd() % (model.size() + 50));
+            uint32_t expected = 0;
+            for (auto skipped = 0; skipped < k || model.count(expected) != 0; ++expected) {
+                if (model.count(expected) == 0) {
+                    ++skipped;
+                }
+            }
+            assert(trie.kth_free(k) == expected);
+        } else if (operation < 85) {
+            uint16_t lo = rd();
+            uint16_t hi = rd();
+            auto expected = lo > hi ? 0 : std::distance(model.lower_bound(lo), model.upper_bound(hi));
+            assert(trie.count_in_range(lo, hi) == static_cast<uint32_t>(expected));
+        } else if (!model.empty()) {
+            uint16_t value = rd();
+            auto min_it = std::min_element(model.begin(), model.end(), [value](uint16_t a, uint16_t b) {
+                return (a ^ value) < (b ^ value);
+            });
+            auto max_it = std::max_element(model.begin(), model.end(), [value](uint16_t a, uint16_t b) {
+                return (a ^ value) < (b ^ value);
+            });
+            assert(trie.min_xor(value) == *min_it);
+            assert(trie.max_xor(value) == *max_it);
+        }
+        assert(trie.size() == model.size());
+    }
+}
+
+void test_database_order_statistics() {
+    DataBase db;
+    db.register_new_users(10);
+    db.unregister_user(3);
+    db.unregister_user(5);
+    assert(db.kth_free_id(0) == 3);
+    assert(db.kth_free_id(1) == 5);
+    assert(db.kth_free_id(2) == 10);
+    assert(db.kth_free_id(1000) == 1008);
+    assert(db.count_users(2, 6) == 3);
+    assert(db.count_users(0, UINT64_MAX) == 8);
+    assert(db.min_xor_user(5) == 4);
+    assert(db.max_xor_user(0) == 9);
+    db.encrypt(uint64_t{1} << 40);
+    assert(db.count_users(0, UINT32_MAX) == 0);
+    assert(db.min_xor_user(0) == (uint64_t{1} << 40));
+    assert(db.kth_free_id(0) == 0);
+}
+
+template<typename Trie>
+void test_add_number_in_range_matches_model() {
+    std::mt19937 rd(2025);
+
+    Trie trie;
+    std::set<uint16_t> model;
+    for (auto i = 0; i < 20000; ++i) {
+        auto operation = rd() % 100;
+        if (operation == 0) {
+            uint16_t key = rd();
+            trie.xor_all_values(key);
+            std::set<uint16_t> encrypted;
+            for (auto value : model) {
+                encrypted.insert(value ^ key);
+            }
+            model.swap(encrypted);
+        } else if (operation < 20 && !model.empty()) {
+            auto it = model.lower_bound(static_cast<uint16_t>(rd()));
+            if (it == model.end()) {
+                it = model.begin();
+            }
+            trie.remove_number(*it);
+            model.erase(it);
+        } else {
+            uint16_t lo = rd() % 4 == 0 ? 0xFFF0 | (rd() & 0xF) : rd() % 2048;  // Часто - почти заполненные отрезки.
+            uint16_t hi = std::min<uint32_t>(UINT16_MAX, lo + rd() % 64);
+            uint32_t expected = lo;
+            while (expected <= hi && model.count(expected) != 0) {
+                ++expected;
+            }
+            try {
+                assert(trie.add_number_in_range(lo, hi) == expected);
+                model.insert(expected);
+            } catch (std::out_of_range& e) {
+                assert(expected > hi);
+            }
+        }
+    }
+}
+
+void test_database_register_in_range() {
+    DataBase db;
+    const uint64_t region_start = uint64_t{1} << 40;
+    assert(db.register_new_user(region_start, region_start + 1) == region_start);
+    assert(db.register_new_user(region_start, region_start + 1) == region_start + 1);
+    try {
+        db.register_new_user(region_start, region_start + 1);
+        assert(false);
+    } catch (std::out_of_range& e) {
+    }
+    assert(db.register_new_user(region_start) == region_start + 2);
+    assert(db.register_new_user() == 0);  // Регистрации в диапазонах не мешают глобальному MEX.
+    db.encrypt(1);  // Id-шники: 1, 1 + 2^40, 2^40, 3 + 2^40.
+    assert(db.register_new_user(region_start, UINT64_MAX) == region_start + 2);
+    assert(db.register_new_user(0, 10) == 0);
+    assert(db.register_new_user(1) == 2);
+}
+
+template<typename NumberType>
+void test_flat_bitset_matches_node_trie() {
+    std::mt19937 rd(2026);
+
+    std::unique_ptr<BitTrie<NumberType>> flat_trie_holder(new BitTrie<NumberType>());
+    assert(reinterpret_cast<uintptr_t>(flat_trie_holder.get()) % 64 == 0);
+    auto& flat_trie = *flat_trie_holder;
+    BitTrie<NumberType, ArenaNodeStorage, false> node_trie;
+    for (auto i = 0; i < 20000; ++i) {
+        auto operation = rd() % 100;
+        auto value = static_cast<NumberType>(rd());
+        if (operation < 2) {
+            flat_trie.xor_all_values(value);
+            node_trie.xor_all_values(value);
+        } else if (operation < 40) {
+            bool flat_full = false;
+            bool node_full = false;
+            NumberType flat_id = 0;
+            NumberType node_id = 0;
+            try {
+                flat_id = flat_trie.add_number();
+            } catch (std::out_of_range& e) {
+                flat_full = true;
+            }
+            try {
+                node_id = node_trie.add_number();
+            } catch (std::out_of_range& e) {
+                node_full = true;
+            }
+            assert(flat_full == node_full && flat_id == node_id);
+        } else if (operation < 60) {
+            bool flat_taken = false;
+            bool node_taken = false;
+            try {
+                flat_trie.remove_number(value);
+            } catch (std::range_error& e) {
+                flat_taken = true;
+            }
+            try {
+                node_trie.remove_number(value);
+            } catch (std::range_error& e) {
+                node_taken = true;
+            }
+            assert(flat_taken == node_taken);
+        } else if (operation < 70 && flat_trie.size() > 0) {
+            assert(flat_trie.min_xor(value) == node_trie.min_xor(value));
+            assert(flat_trie.max_xor(value) == node_trie.max_xor(value));
+        } else if (operation < 80) {
+            auto hi = static_cast<NumberType>(rd());
+            assert(flat_trie.count_in_range(value, hi) == node_trie.count_in_range(value, hi));
+        }
+        assert(flat_trie.size() == node_trie.size());
+    }
+
+    const std::string path = "super_test_flat_snapshot.bin";
+    flat_trie.save(path);
+    std::unique_ptr<BitTrie<NumberType>> loaded_trie(new BitTrie<NumberType>());
+    loaded_trie->load(path);
+    assert(loaded_trie->size() == flat_trie.size());
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "r+b"), std::fclose);
+        uint32_t size = flat_trie.size() + 1;  // Размер не совпадает с количеством занятых битов.
+        assert(file != nullptr && std::fseek(file.get(), 12, SEEK_SET) == 0);  // magic, разрядность, ключ.
+        assert(std::fwrite(&size, sizeof(size), 1, file.get()) == 1);
+    }
+    loaded_trie->xor_all_values(1);
+    auto expected_min = loaded_trie->size() > 0 ? loaded_trie->min_xor(0) : 0;
+    try {
+        loaded_trie->load(path);
+        assert(false);
+    } catch (std::runtime_error& e) {
+        assert(loaded_trie->size() == flat_trie.size());  // Содержимое и ключ не изменились.
+        assert(loaded_trie->size() == 0 || loaded_trie->min_xor(0) == expected_min);
+    }
+    std::remove(path.c_str());
+}
+
+void test_trie_stats() {
+    BitTrie<uint64_t, ArenaNodeStorage, false, AtomicTrieStats> trie;
+    assert(trie.stats().live_nodes == 1);
+    trie.add_number();  // Путь создаётся целиком: 63 новых узла.
+    trie.add_number();  // Путь уже есть, полнота поднимается на один уровень.
+    auto stats = trie.stats();
+    assert(stats.live_nodes == 64 && stats.live_nodes == trie.node_count());
+    assert(stats.live_bytes == trie.memory_usage());
+    assert(stats.mex_descents == 2 && stats.mex_descent_levels == 63);
+    assert(stats.average_mex_descent() == 31.5);
+    assert(stats.fullness_propagations == 2 && stats.fullness_propagation_levels == 1);
+    assert(stats.push_calls == 0 && stats.push_swaps == 0);  // Масок нет: проталкивать нечего.
+    trie.xor_all_values(uint64_t{1} << 63);  // Маска корня сдвигается за пределы числа и до потомков не доходит.
+    stats = trie.stats();
+    assert(stats.xor_epochs == 1 && stats.push_calls == 1 && stats.push_swaps == 1);
+    trie.xor_all_values(1);  // Числа 2^63 + 1 и 2^63: корень отдаёт маску 2 своему потомку.
+    assert(trie.max_xor(0) == (uint64_t{1} << 63) + 1);
+    stats = trie.stats();
+    // Спуск проталкивает маску во всех 63 узлах пути под корнем; в узле бита 0 она меняет потомков местами.
+    assert(stats.push_calls == 2 + 63 && stats.push_swaps == 2);
+
+    BitTrie<uint16_t, HeapNodeStorage, true, AtomicTrieStats> flat_trie;
+    std::vector<uint16_t> ids;
+    flat_trie.add_numbers(64 * 3, std::back_inserter(ids));
+    flat_trie.xor_all_values(1);
+    flat_trie.add_number();
+    stats = flat_trie.stats();
+    assert(stats.live_nodes == 0 && stats.live_bytes == flat_trie.memory_usage());
+    assert(stats.mex_descents == 64 * 3 + 1 && stats.xor_epochs == 1);
+
+    InstrumentedDataBase db;
+    db.register_new_users(10);
+    db.encrypt(5);
+    assert(db.stats().xor_epochs == 1);
+    DataBase plain_db;
+    plain_db.register_new_user();
+    assert(plain_db.stats().mex_descents == 0);  // Без политики статистики счётчики не ведутся.
+}
+
+/**
+ * @brief Создать пустой файл с уникальным именем во временном каталоге.
+ * @details Каталог берётся из TMPDIR, по умолчанию /tmp. Одновременно запущенные тесты не мешают друг другу.
+ * @param prefix Начало имени файла.
+ * @return Путь к файлу. Удалить файл должен вызывающий.
+ */
+std::string make_temporary_file(const std::string& prefix) {
+    const char* directory = std::getenv("TMPDIR");
+    std::string path = std::string(directory != nullptr ? directory : "/tmp") + "/" + prefix + "XXXXXX";
+    int file = mkstemp(&path[0]);
+    if (file < 0) {
+        throw std::runtime_error("Cannot create temporary file.");
+    }
+    close(file);
+    return path;
+}
+
+/**
+ * @brief Прочитать файл целиком.
+ */
+std::string read_whole_file(const std::string& path) {
+    std::string content;
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+    char chunk[4096];
+    size_t bytes = 0;
+    while (file != nullptr && (bytes = std::fread(chunk, 1, sizeof(chunk), file.get())) > 0) {
+        content.append(chunk, bytes);
+    }
+    return content;
+}
+
+void test_command_stream_text() {
+    std::mt19937 rd(16);
+    DataBase reference_db;
+    std::string commands;
+    std::string expected;
+    uint64_t encryptions = 1;
+    for (int i = 0; i < 20000; ++i) {
+        if (rd() % 8 == 0) {
+            ++encryptions;
+            auto key = rd() % 1000;
+            commands += "encrypt " + std::to_string(key) + (i % 3 == 0 ? "\r\n" : "\n");
+            reference_db.encrypt(key);
+        } else {
+            commands += i % 50 == 0 ? "\nregister\n" : "register\n";
+            expected += std::to_string(reference_db.register_new_user()) + "\n";
+        }
+    }
+    commands += "encrypt 18446744073709551615\nregister";  // Последняя строка без перевода строки.
+    reference_db.encrypt(UINT64_MAX);
+    expected += std::to_string(reference_db.register_new_user()) + "\n";
+
+    int pipe_ends[2];
+    if (pipe(pipe_ends) != 0) {
+        throw std::runtime_error("Cannot create pipe.");
+    }
+    std::thread writer([&commands, &pipe_ends]() {  // Ввод из канала, как со стандартного ввода.
+        size_t written = 0;
+        while (written < commands.size()) {
+            auto bytes = write(pipe_ends[1], commands.data() + written, std::min<size_t>(commands.size() - written, 777));
+            assert(bytes > 0);
+            written += bytes;
+        }
+        close(pipe_ends[1]);
+    });
+    const std::string output_path = make_temporary_file("super_test_stream_output.");
+    int output_file = open(output_path.c_str(), O_WRONLY | O_TRUNC);
+    assert(output_file >= 0);
+    {
+        CommandInput input(pipe_ends[0], 4);  // Маленький буфер: команды разрезаются границами блоков.
+        IdOutput output(output_file, IdOutput::Format::text, 64);
+        DataBase db;
+        CommandStreamExecutor<DataBase> executor(db, output);
+        auto counters = executor.run(input);
+        assert(counters.commands == 20002);
+        assert(counters.encryptions == encryptions);
+        assert(counters.registrations == counters.commands - encryptions);
+    }
+    writer.join();
+    close(pipe_ends[0]);
+    close(output_file);
+    assert(read_whole_file(output_path) == expected);
+
+    const std::string malformed = "register\nregister\nencrypt 12x\nregister\n";
+    CommandInput input(malformed.data(), malformed.size());
+    output_file = open(output_path.c_str(), O_WRONLY | O_TRUNC);
+    {
+        IdOutput output(output_file);
+        DataBase db;
+        CommandStreamExecutor<DataBase> executor(db, output);
+        bool thrown = false;
+        try {
+            executor.run(input);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    close(output_file);
+    assert(read_whole_file(output_path) == "0\n1\n");  // Регистрации до ошибки выполнены.
+    std::remove(output_path.c_str());
+}
+
+void test_command_stream_binary() {
+    std::mt19937 rd(61);
+    DataBase reference_db;
+    std::string commands = "SUPERCMD";
+    std::vector<uint64_t> expected;
+    uint64_t runs = 0;
+    bool previous_is_registration = false;
+    auto append_varint = [&commands](uint64_t value) {
+        while (value >= 0x80) {
+            commands.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        commands.push_back(static_cast<char>(value));
+    };
+    for (int i = 0; i < 5000; ++i) {
+        auto kind = rd() % 4;
+        if (kind == 0) {
+            uint64_t key = rd() % 2 == 0 ? rd() % 100 : (uint64_t{rd()} << 32) | rd();
+            commands.push_back(2);
+            append_varint(key);
+            reference_db.encrypt(key);
+            previous_is_registration = false;
+            continue;
+        }
+        size_t count = 1;
+        if (kind == 1) {
+            count = rd() % 300;
+            commands.push_back(3);
+            append_varint(count);
+        } else {
+            commands.push_back(1);
+        }
+        reference_db.register_new_users(count, std::back_inserter(expected));
+        runs += !previous_is_registration && count > 0;
+        previous_is_registration = previous_is_registration || count > 0;
+    }
+
+    const std::string input_path = make_temporary_file("super_test_stream_input.");
+    const std::string output_path = make_temporary_file("super_test_stream_output.");
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(input_path.c_str(), "wb"), std::fclose);
+        std::fwrite(commands.data(), 1, commands.size(), file.get());
+    }
+    int output_file = open(output_path.c_str(), O_WRONLY | O_TRUNC);
+    assert(output_file >= 0);
+    {
+        CommandInput input(input_path);  // Обычный файл отображается в память.
+        IdOutput output(output_file, IdOutput::Format::binary);
+        DataBase db;
+        CommandStreamExecutor<DataBase> executor(db, output);
+        auto counters = executor.run(input);
+        assert(counters.commands == 5000);
+        assert(counters.registrations == expected.size());
+        assert(counters.batches == runs);
+    }
+    close(output_file);
+    auto output = read_whole_file(output_path);
+    assert(output.size() == 8 * expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        uint64_t id = 0;
+        for (int byte_no = 7; byte_no >= 0; --byte_no) {
+            id = (id << 8) | static_cast<uint8_t>(output[8 * i + byte_no]);
+        }
+        assert(id == expected[i]);
+    }
+
+    commands += std::string("\x02\x80", 2);  // Оборванный varint в конце потока.
+    output_file = open(output_path.c_str(), O_WRONLY | O_TRUNC);
+    {
+        CommandInput input(commands.data(), commands.size());
+        IdOutput output(output_file, IdOutput::Format::binary);
+        DataBase db;
+        CommandStreamExecutor<DataBase> executor(db, output);
+        bool thrown = false;
+        try {
+            executor.run(input);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    close(output_file);
+    assert(read_whole_file(output_path).size() == 8 * expected.size());
+    std::remove(input_path.c_str());
+    std::remove(output_path.c_str());
+}
+
+void test_id_server() {
+    const std::string socket_path = "super_test_server.sock";
+    DataBase db;
+    IdServer<DataBase> server(db, socket_path);
+    std::thread server_thread([&server]() { server.run(); });
+
+    std::vector<std::vector<uint64_t>> ids(4);
+    std::vector<std::thread> clients;
+    for (size_t client_no = 0; client_no < ids.size(); ++client_no) {
+        clients.emplace_back([&socket_path, &ids, client_no]() {
+            IdClient client(socket_path);
+            for (int i = 0; i < 500; ++i) {  // Запросы отправляются, не дожидаясь ответов.
+                client.send_registration();
+            }
+            client.flush();
+            for (int i = 0; i < 500; ++i) {
+                ids[client_no].push_back(client.receive());
+            }
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    std::vector<uint64_t> all;
+    for (const auto& client_ids : ids) {
+        assert(std::is_sorted(client_ids.begin(), client_ids.end()));
+        all.insert(all.end(), client_ids.begin(), client_ids.end());
+    }
+    std::sort(all.begin(), all.end());
+    for (uint64_t i = 0; i < all.size(); ++i) {
+        assert(all[i] == i);
+    }
+
+    DataBase reference_db;
+    reference_db.register_new_users(2000);
+    {
+        IdClient client(socket_path);
+        client.send_registration();
+        client.send_encryption(3);
+        client.send_registration();
+        client.send_registration();
+        client.flush();
+        assert(client.receive() == reference_db.register_new_user());
+        assert(client.receive() == 0);
+        reference_db.encrypt(3);
+        assert(client.receive() == reference_db.register_new_user());
+        assert(client.receive() == reference_db.register_new_user());
+
+        IdClient violator(socket_path);
+        violator.send_raw(9);
+        violator.flush();
+        bool closed = false;
+        try {
+            violator.receive();
+        } catch (const std::runtime_error&) {
+            closed = true;
+        }
+        assert(closed);
+    }
+
+    auto result = generate_load(socket_path, 3, 8, 300, 10);
+    assert(result.requests == 900);
+    assert(result.p50_us <= result.p99_us);
+
+    server.stop();
+    server_thread.join();
+    const auto& counters = server.counters();
+    assert(counters.connections == 4 + 2 + 3);
+    assert(counters.requests == 2000 + 4 + 900);
+    assert(counters.batches <= counters.requests);
+}
+
+void test_tenant_manager_matches_databases() {
+    std::mt19937 rd(18);
+    TenantManager manager;
+    std::vector<std::unique_ptr<DataBase>> reference(40);
+    std::vector<std::vector<uint64_t>> registered(reference.size());
+    for (size_t i = 0; i < reference.size(); ++i) {
+        assert(manager.create_tenant() == i);
+        reference[i].reset(new DataBase());
+    }
+    for (int operation = 0; operation < 30000; ++operation) {
+        auto id = static_cast<TenantManager::TenantId>(rd() % reference.size());
+        auto kind = rd() % 100;
+        if (reference[id] == nullptr) {
+            auto free_id = std::find(reference.begin(), reference.end(), nullptr) - reference.begin();
+            assert(manager.create_tenant() == free_id);  // Минимальный свободный номер.
+            reference[free_id].reset(new DataBase());
+        } else if (kind == 0) {
+            manager.drop_tenant(id);
+            reference[id].reset();
+            registered[id].clear();
+        } else if (kind < 10) {
+            auto key = rd() % 64;
+            manager.tenant(id).encrypt(key);
+            reference[id]->encrypt(key);
+            for (auto& user : registered[id]) {
+                user ^= key;
             }
+        } else if (kind < 20 && !registered[id].empty()) {
+            auto index = rd() % registered[id].size();
+            manager.tenant(id).unregister_user(registered[id][index]);
+            reference[id]->unregister_user(registered[id][index]);
+            registered[id].erase(registered[id].begin() + index);
+        } else {
+            auto user = manager.tenant(id).register_new_user();
+            assert(user == reference[id]->register_new_user());
+            registered[id].push_back(user);
+        }
+    }
+    bool thrown = false;
+    try {
+        manager.tenant(static_cast<TenantManager::TenantId>(reference.size()));
+    } catch (const std::out_of_range&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    auto empty_tenant = manager.create_tenant();
+    auto node_size = manager.tenant_memory_usage(empty_tenant);  // Пустой бор - один корень.
+    size_t tenants = 0;
+    size_t tenants_memory = 0;
+    manager.for_each_tenant([&](TenantManager::TenantId id, TenantManager::TenantDataBase& db) {
+        assert(id == empty_tenant || reference[id] != nullptr);
+        assert(id == empty_tenant || db.count_users(0, UINT64_MAX) == registered[id].size());
+        tenants_memory += manager.tenant_memory_usage(id);
+        ++tenants;
+    });
+    assert(tenants == manager.tenant_count());
+    assert(tenants_memory == manager.node_count() * node_size);
+}
+
+void test_tenant_drop_reclaims_lazily() {
+    TenantManager manager;
+    auto big = manager.create_tenant();
+    manager.tenant(big).register_new_users(100000);
+    auto nodes = manager.node_count();
+    auto memory = manager.memory_usage();
+    manager.drop_tenant(big);
+    assert(manager.tenant_count() == 0);
+    assert(manager.node_count() == 0);
+    assert(manager.garbage_node_count() == nodes);  // Дерево ещё не разобрано.
+
+    std::vector<TenantManager::TenantId> small;
+    for (int i = 0; i < 1000; ++i) {
+        small.push_back(manager.create_tenant());
+        manager.tenant(small.back()).register_new_users(10);
+    }
+    assert(manager.garbage_node_count() < nodes);
+    assert(manager.memory_usage() <= memory);  // Маленькие арендаторы переиспользуют узлы удалённого.
+    manager.collect_garbage();
+    assert(manager.garbage_node_count() == 0);
+    for (auto id : small) {
+        assert(manager.tenant(id).register_new_user() == 10);
+    }
+}
+
+
+void run_all_tests() {
+    test_8bit_from_task();
+    test_8bit_sequential_registrations();
+    test_8bit_full_trie();
+    test_8bit_mex_all_values();
+    test_8bit_xor_all_values();
+
+    test_16bit_from_task();
+    test_16bit_sequential_registrations();
+    test_16bit_full_trie();
+    test_16bit_mex_all_values();
+    test_16bit_xor_all_values();
+
+    test_64bit_from_task();
+
+    test_arena_storage_reuses_nodes();
+    test_arena_matches_heap();
+    test_arena_64bit_from_task();
+    test_database_from_task();
+
+    test_compressed_from_task();
+    test_compressed_8bit_full_trie();
+    test_compressed_matches_bit_trie();
+    test_compressed_64bit_node_count();
+
+    test_bitmap_matches_bit_trie();
+    test_bitmap_full_domain();
+    test_bounded_database_from_task();
+
+    test_add_numbers_matches_sequential();
+    test_add_numbers_until_full();
+    test_database_register_new_users();
+    test_database_snapshot();
+    test_durable_database_recovery();
+
+    test_concurrent_database_unique_ids();
+    test_concurrent_database_linearizable();
+
+    test_remove_matches_model<BitTrie<uint16_t, ArenaNodeStorage, false>>();
+    test_remove_matches_model<BitTrie<uint16_t>>();
+    test_remove_releases_memory();
+    test_database_unregister_user();
+
+    test_persistent_versions_per_epoch();
+    test_persistent_matches_bit_trie();
+
+    test_order_statistics_match_model<BitTrie<uint16_t, ArenaNodeStorage, false>>();
+    test_order_statistics_match_model<BitTrie<uint16_t>>();
+    test_database_order_statistics();
+
+    test_add_number_in_range_matches_model<BitTrie<uint16_t, HeapNodeStorage, false>>();
+    test_add_number_in_range_matches_model<BitTrie<uint16_t>>();
+    test_database_register_in_range();
+
+    test_flat_bitset_matches_node_trie<uint8_t>();
+    test_flat_bitset_matches_node_trie<uint16_t>();
+
+    test_trie_stats();
+
+    test_command_stream_text();
+    test_command_stream_binary();
+
+    test_id_server();
+
+    test_tenant_manager_matches_databases();
+    test_tenant_drop_reclaims_lazily();
+}
+
+
+// Бенчмарки.
+
+/**
+ * @brief Пропускная способность журнала операций в зависимости от параметров групповой фиксации.
+ */
+void benchmark_operation_log() {
+    const std::string directory = "super_bench_durable_db";
+    const std::chrono::milliseconds time_limit(500);
+    struct Configuration {
+        size_t group_size;
+        std::chrono::microseconds window;
+    };
+    const Configuration configurations[] = {
+            {1, std::chrono::seconds(1)},
+            {16, std::chrono::seconds(1)},
+            {256, std::chrono::seconds(1)},
+            {4096, std::chrono::seconds(1)},
+            {SIZE_MAX, std::chrono::microseconds(100)},
+            {SIZE_MAX, std::chrono::milliseconds(1)},
+            {SIZE_MAX, std::chrono::milliseconds(10)},
+    };
+    mkdir(directory.c_str(), 0755);
+    std::printf("operation log: group commit\n");
+    for (auto& configuration : configurations) {
+        size_t operations = 0;
+        size_t commits = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{};
+        {
+            DurableDataBase db(directory, {configuration.group_size, configuration.window});
+            do {
+                for (auto i = 0; i < 64; ++i, ++operations) {
+                    if (operations % 100 == 99) {
+                        db.encrypt(operations);
+                    } else {
+                        db.register_new_user();
+                    }
+                }
+                elapsed = std::chrono::steady_clock::now() - start;
+            } while (elapsed < time_limit);
+            db.sync();
+            elapsed = std::chrono::steady_clock::now() - start;
+            commits = db.commits_count();
+        }
+        std::remove((directory + "/log.0").c_str());
+        auto group_size = configuration.group_size == SIZE_MAX ? std::string("unlimited")
+                                                               : std::to_string(configuration.group_size);
+        std::printf("  group_size=%s window_us=%lld ops=%zu commits=%zu ops_per_s=%.0f\n", group_size.c_str(),
+                    static_cast<long long>(configuration.window.count()), operations, commits,
+                    operations / elapsed.count());
+    }
+    rmdir(directory.c_str());
+}
+
+/**
+ * @brief Распределитель памяти, подсчитывающий выделенные байты. Нужен, чтобы измерить память std::set.
+ */
+template<typename T>
+class CountingAllocator {
+public:
+    using value_type = T;
+
+    explicit CountingAllocator(size_t* allocated_bytes): allocated_bytes_(allocated_bytes) {
+    }
+
+    template<typename U>
+    CountingAllocator(const CountingAllocator<U>& other): allocated_bytes_(other.allocated_bytes_) {
+    }
+
+    T* allocate(size_t count) {
+        *allocated_bytes_ += count * sizeof(T);
+        return std::allocator<T>().allocate(count);
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        *allocated_bytes_ -= count * sizeof(T);
+        std::allocator<T>().deallocate(pointer, count);
+    }
+
+    template<typename U>
+    bool operator==(const CountingAllocator<U>& other) const {
+        return allocated_bytes_ == other.allocated_bytes_;
+    }
+
+    template<typename U>
+    bool operator!=(const CountingAllocator<U>& other) const {
+        return allocated_bytes_ != other.allocated_bytes_;
+    }
+private:
+    template<typename U>
+    friend class CountingAllocator;
+
+    size_t* allocated_bytes_;  // Счётчик байтов, общий для всех копий распределителя.
+};
+
+/**
+ * @brief Базовая реализация для сравнения: MEX поверх std::set.
+ * @details Хранится множество чисел и граница, ниже которой все числа заняты. MEX ищется перебором занятых чисел
+ * от границы, удаление сдвигает границу вниз, а xor перестраивает множество целиком.
+ * Интерфейс совпадает с BitTrie в той части, которую используют бенчмарки.
+ * @tparam NumberType Тип данных хранимых чисел. Должен быть беззнаковым.
+ */
+template<typename NumberType>
+class SetMexBaseline {
+public:
+    SetMexBaseline(): values_(std::less<NumberType>(), Allocator(&allocated_bytes_)) {
+    }
+
+    SetMexBaseline(const SetMexBaseline&) = delete;
+    SetMexBaseline& operator=(const SetMexBaseline&) = delete;
+
+    NumberType add_number() {
+        auto it = values_.lower_bound(mex_);
+        while (it != values_.end() && *it == mex_) {
+            ++it;
+            ++mex_;
         }
-        auto id = trie.add_number();
-        assert(id == mex);
+        values_.insert(it, mex_);
+        return mex_++;
     }
-}
 
-void test_8bit_xor_all_values() {
-    std::random_device rd;
+    void add_number(NumberType value) {
+        if (!values_.insert(value).second) {
+            throw std::range_error("The ID is already taken.");
+        }
+    }
 
-    for (auto mex = 0; mex < 256; ++mex) {
-        BitTrie<uint8_t> trie;
-        std::vector<uint8_t> ids;
-        for (auto i = 0; i < 256; ++i) {
-            if ((i < mex) || ((i > mex) && (rd() % 2 == 0))) {
-                trie.add_number(i);
-                ids.push_back(i);
-            }
+    template<typename OutputIterator>
+    OutputIterator add_numbers(size_t count, OutputIterator out) {
+        for (; count > 0; --count) {
+            *out++ = add_number();
         }
+        return out;
+    }
 
-        uint8_t key = rd();
-        for(auto& id: ids) {
-            id ^= key;
+    void remove_number(NumberType value) {
+        if (values_.erase(value) == 0) {
+            throw std::range_error("The ID is not taken.");
         }
-        std::sort(ids.begin(), ids.end());
-        uint8_t new_mex = 0;
-        while(new_mex == ids[new_mex]) {
-            new_mex += 1;
+        mex_ = std::min(mex_, value);
+    }
+
+    void xor_all_values(NumberType value) {
+        Set encrypted{std::less<NumberType>(), Allocator(&allocated_bytes_)};
+        for (auto stored : values_) {
+            encrypted.insert(static_cast<NumberType>(stored ^ value));
         }
-        trie.xor_all_values(key);
+        values_.swap(encrypted);
+        mex_ = 0;
+    }
 
-        auto id = trie.add_number();
-        assert(id == new_mex);
+    size_t size() const {
+        return values_.size();
     }
-}
 
+    size_t memory_usage() const {
+        return allocated_bytes_;
+    }
 
-void test_16bit_from_task() {
-    BitTrie<uint16_t> trie;
-    trie.add_number(1);
-    trie.add_number(3);
-    trie.xor_all_values(1);
-    auto id = trie.add_number();
-    assert(id == 1);
-    trie.xor_all_values(1);
-    id = trie.add_number();
-    assert(id == 2);
-}
+    size_t node_count() const {
+        return values_.size();
+    }
+private:
+    using Allocator = CountingAllocator<NumberType>;
+    using Set = std::set<NumberType, std::less<NumberType>, Allocator>;
 
-void test_16bit_sequential_registrations() {
-    BitTrie<uint16_t> trie;
-    for (auto i = 0; i < 10000; ++i) {
-        auto id = trie.add_number();
-        assert(id == i);
+    size_t allocated_bytes_{0};  // Память узлов множества (без накладных расходов распределителя памяти).
+    Set values_;  // Хранимые числа.
+    NumberType mex_{0};  // Все числа меньше mex_ заняты.
+};
+
+/**
+ * @brief Параметры запуска бенчмарков.
+ */
+struct BenchmarkOptions {
+    uint64_t max_ids{10000000};  // Наибольшее количество id-шников в нагрузках (степени десяти от 10^6).
+    uint64_t seed{2021};  // Зерно генератора случайных чисел.
+    std::chrono::milliseconds time_limit{2000};  // Ограничение времени на серию запросов к одной структуре.
+    std::string json_path{"super_bench.json"};  // Файл для результатов в формате JSON.
+};
+
+/**
+ * @brief Результат одного измерения.
+ */
+struct BenchmarkResult {
+    std::string structure;  // Структура для хранения id-шников.
+    std::string workload;  // Нагрузка.
+    unsigned width;  // Разрядность id-шников.
+    uint64_t ids;  // Размер нагрузки.
+    uint64_t operations;  // Выполненных операций.
+    double ns_per_op;  // Время операции в наносекундах.
+    double bytes_per_id;  // Память структуры на один хранимый id после нагрузки.
+    uint64_t nodes;  // Узлов структуры после нагрузки.
+};
+
+/**
+ * @brief Отчёт бенчмарков: печатает результаты по мере получения и сохраняет их в JSON.
+ */
+class BenchmarkReport {
+public:
+    /**
+     * @brief Добавить результат измерения.
+     */
+    void add(const BenchmarkResult& result) {
+        results_.push_back(result);
+        std::printf("  %-12s %-18s width=%-2u ids=%-9llu ops=%-9llu ns_per_op=%-9.1f bytes_per_id=%-7.1f nodes=%llu\n",
+                    result.structure.c_str(), result.workload.c_str(), result.width,
+                    static_cast<unsigned long long>(result.ids), static_cast<unsigned long long>(result.operations),
+                    result.ns_per_op, result.bytes_per_id, static_cast<unsigned long long>(result.nodes));
+        std::fflush(stdout);
     }
-    auto id = trie.add_number();
-    assert(id == 10000);
-}
 
-void test_16bit_full_trie() {
-    BitTrie<uint16_t> trie;
-    for (auto i = 0; i < 65536; ++i) {
-        auto id = trie.add_number();
-        assert(id == i);
+    /**
+     * @brief Добавить результат измерения структуры после нагрузки.
+     */
+    template<typename Structure>
+    void add(const char* structure_name, const char* workload, uint64_t ids, const Structure& structure,
+             uint64_t operations, std::chrono::duration<double> elapsed) {
+        using Id = decltype(std::declval<Structure&>().add_number());
+        auto size = static_cast<uint64_t>(structure.size());
+        add({structure_name, workload, sizeof(Id) * 8, ids, operations,
+             operations == 0 ? 0.0 : elapsed.count() * 1e9 / operations,
+             size == 0 ? 0.0 : static_cast<double>(structure.memory_usage()) / size, structure.node_count()});
     }
-    try {
-        auto id = trie.add_number();
-        assert(false);
-    } catch(std::out_of_range& e) {
-        assert(true);
+
+    /**
+     * @brief Сохранить результаты в файл в формате JSON.
+     * @param path Путь к файлу.
+     * @param options Параметры запуска, сохраняемые вместе с результатами.
+     */
+    void write_json(const std::string& path, const BenchmarkOptions& options) const {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "w"), std::fclose);
+        if (file == nullptr) {
+            throw std::runtime_error("Cannot open benchmark report file.");
+        }
+        std::fprintf(file.get(), "{\n  \"seed\": %llu,\n  \"max_ids\": %llu,\n  \"time_limit_ms\": %lld,\n"
+                                 "  \"results\": [\n", static_cast<unsigned long long>(options.seed),
+                     static_cast<unsigned long long>(options.max_ids),
+                     static_cast<long long>(options.time_limit.count()));
+        for (size_t i = 0; i < results_.size(); ++i) {
+            auto& result = results_[i];
+            std::fprintf(file.get(), "    {\"structure\": \"%s\", \"workload\": \"%s\", \"width\": %u, \"ids\": %llu, "
+                                     "\"operations\": %llu, \"ns_per_op\": %.3f, \"bytes_per_id\": %.3f, "
+                                     "\"nodes\": %llu}%s\n",
+                         result.structure.c_str(), result.workload.c_str(), result.width,
+                         static_cast<unsigned long long>(result.ids),
+                         static_cast<unsigned long long>(result.operations), result.ns_per_op,
+                         result.bytes_per_id, static_cast<unsigned long long>(result.nodes),
+                         i + 1 < results_.size() ? "," : "");
+        }
+        std::fprintf(file.get(), "  ]\n}\n");
+        if (std::fflush(file.get()) != 0) {
+            throw std::runtime_error("Cannot write benchmark report file.");
+        }
     }
-}
+private:
+    std::vector<BenchmarkResult> results_;  // Результаты в порядке измерения.
+};
 
-void test_16bit_mex_all_values() {
-    std::random_device rd;
+/**
+ * @brief Итератор вывода, складывающий записываемые числа в контрольную сумму вместо их хранения.
+ */
+class ChecksumIterator {
+public:
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = void;
+    using pointer = void;
+    using reference = void;
 
-    for (auto mex = 0; mex < 65536; mex += rd() % 1000) {
-        BitTrie<uint16_t> trie;
-        for (auto i = 0; i < 65536; ++i) {
-            if ((i < mex) || ((i > mex) && (rd() % 10 == 0))) {
-                trie.add_number(i);
-            }
+    explicit ChecksumIterator(uint64_t& checksum): checksum_(&checksum) {
+    }
+
+    ChecksumIterator& operator=(uint64_t value) {
+        *checksum_ += value;
+        return *this;
+    }
+
+    ChecksumIterator& operator*() {
+        return *this;
+    }
+
+    ChecksumIterator& operator++() {
+        return *this;
+    }
+
+    ChecksumIterator operator++(int) {
+        return *this;
+    }
+private:
+    uint64_t* checksum_;
+};
+
+/**
+ * @brief Выполнять операции, пока не выполнены все или не истекло время.
+ * @details Время проверяется после пачек операций растущего размера: медленные операции (xor в std::set)
+ * не выходят за ограничение надолго, а быстрые не замедляются чтением часов.
+ * @param count Количество операций.
+ * @param time_limit Ограничение времени.
+ * @param elapsed Затраченное время.
+ * @param operation Операция; принимает номер операции.
+ * @return Количество выполненных операций.
+ */
+template<typename Operation>
+uint64_t run_timed(uint64_t count, std::chrono::nanoseconds time_limit, std::chrono::duration<double>& elapsed,
+                   Operation&& operation) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t done = 0;
+    uint64_t batch = 1;
+    while (done < count) {
+        for (auto batch_end = std::min(count, done + batch); done < batch_end; ++done) {
+            operation(done);
+        }
+        batch = std::min<uint64_t>(batch * 2, 4096);
+        if (std::chrono::steady_clock::now() - start > time_limit) {
+            break;
         }
-        auto id = trie.add_number();
-        assert(id == mex);
     }
+    elapsed = std::chrono::steady_clock::now() - start;
+    return done;
 }
 
-void test_16bit_xor_all_values() {
-    std::random_device rd;
+/**
+ * @brief Прогнать нагрузки на одной структуре.
+ * @details Нагрузки (каждая на новой структуре):
+ *  * sequential - ids регистраций подряд;
+ *  * random_preload - ids добавлений случайных чисел, затем mex_after_preload - регистрации в получившихся дырах;
+ *  * xor_interleaved - ids регистраций пачкой, затем чередование шифрований и регистраций;
+ *  * burst - одна пачечная регистрация ids пользователей.
+ * Случайные числа и ключи не выходят за пределы 2 * ids, округлённого до степени двойки, чтобы id-шники оставались
+ * плотными. Серии запросов ограничены по времени, построения - нет.
+ * @param structure_name Название структуры в отчёте.
+ * @param ids Размер нагрузки.
+ */
+template<typename Structure>
+void benchmark_workloads(BenchmarkReport& report, const BenchmarkOptions& options, const char* structure_name,
+                         uint64_t ids) {
+    using Id = decltype(std::declval<Structure&>().add_number());
+    const auto unlimited = std::chrono::nanoseconds::max();
+    const uint64_t query_count = std::min<uint64_t>(ids, 1000000);
+    uint64_t domain = 1;
+    while (domain < 2 * ids) {
+        domain <<= 1;
+    }
+    std::mt19937_64 rd(options.seed);
+    std::chrono::duration<double> elapsed{};
+    uint64_t checksum = 0;
+    {
+        std::unique_ptr<Structure> structure(new Structure());
+        auto operations = run_timed(ids, unlimited, elapsed, [&](uint64_t) {
+            checksum += structure->add_number();
+        });
+        report.add(structure_name, "sequential", ids, *structure, operations, elapsed);
+    }
+    {
+        std::unique_ptr<Structure> structure(new Structure());
+        auto operations = run_timed(ids, unlimited, elapsed, [&](uint64_t) {
+            try {
+                structure->add_number(static_cast<Id>(rd() % domain));
+            } catch (std::range_error& e) {
+            }
+        });
+        report.add(structure_name, "random_preload", ids, *structure, operations, elapsed);
+        operations = run_timed(query_count, options.time_limit, elapsed, [&](uint64_t) {
+            checksum += structure->add_number();
+        });
+        report.add(structure_name, "mex_after_preload", ids, *structure, operations, elapsed);
+    }
+    {
+        std::unique_ptr<Structure> structure(new Structure());
+        structure->add_numbers(ids, ChecksumIterator(checksum));
+        auto operations = run_timed(query_count, options.time_limit, elapsed, [&](uint64_t operation) {
+            if (operation % 2 == 0) {
+                structure->xor_all_values(static_cast<Id>(rd() % domain));
+            } else {
+                checksum += structure->add_number();
+            }
+        });
+        report.add(structure_name, "xor_interleaved", ids, *structure, operations, elapsed);
+    }
+    {
+        std::unique_ptr<Structure> structure(new Structure());
+        auto start = std::chrono::steady_clock::now();
+        structure->add_numbers(ids, ChecksumIterator(checksum));
+        elapsed = std::chrono::steady_clock::now() - start;
+        report.add(structure_name, "burst", ids, *structure, ids, elapsed);
+    }
+    if (checksum == 1) {  // Не даём компилятору выбросить вычисления.
+        std::printf("checksum\n");
+    }
+}
 
-    for (auto mex = 0; mex < 65536; mex += rd() % 1000) {
-        BitTrie<uint16_t> trie;
-        std::vector<uint16_t> ids;
-        for (auto i = 0; i < 65536; ++i) {
-            if ((i < mex) || ((i > mex) && (rd() % 10 == 0))) {
-                trie.add_number(i);
-                ids.push_back(i);
+/**
+ * @brief Нагрузки на бор и на std::set для id-шников заданной разрядности.
+ * @param sizes Размеры нагрузок.
+ */
+template<typename NumberType>
+void benchmark_width(BenchmarkReport& report, const BenchmarkOptions& options, const std::vector<uint64_t>& sizes) {
+    std::printf("workloads: uint%zu_t\n", sizeof(NumberType) * 8);
+    for (auto ids : sizes) {
+        benchmark_workloads<BitTrie<NumberType, ArenaNodeStorage>>(report, options, "bit_trie", ids);
+        benchmark_workloads<SetMexBaseline<NumberType>>(report, options, "std_set", ids);
+    }
+}
+
+/**
+ * @brief Время операции над 16-битным бором: плоское битовое множество против узловых боров.
+ * @details Нагрузка: регистрация почти всего диапазона подряд, затем смесь удалений, MEX и шифрований.
+ */
+template<typename Trie>
+void benchmark_narrow_trie(BenchmarkReport& report, const BenchmarkOptions& options, const char* name) {
+    const int rounds = 20;
+    const uint32_t sequential_count = 60000;
+    const uint32_t mixed_count = 200000;
+    std::mt19937 rd(options.seed);
+    std::chrono::duration<double> sequential_time{};
+    std::chrono::duration<double> mixed_time{};
+    uint64_t checksum = 0;
+    for (auto round = 0; round < rounds; ++round) {
+        std::unique_ptr<Trie> trie(new Trie());
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < sequential_count; ++i) {
+            checksum += trie->add_number();
+        }
+        auto middle = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < mixed_count; ++i) {
+            if (i % 100 == 0) {
+                trie->xor_all_values(static_cast<uint16_t>(rd()));
             }
+            try {
+                trie->remove_number(static_cast<uint16_t>(rd()));
+            } catch (std::range_error& e) {
+            }
+            checksum += trie->add_number();
+        }
+        auto finish = std::chrono::steady_clock::now();
+        sequential_time += middle - start;
+        mixed_time += finish - middle;
+        if (round + 1 == rounds) {
+            report.add(name, "narrow_sequential", sequential_count, *trie, rounds * sequential_count,
+                       sequential_time);
+            report.add(name, "narrow_mixed", sequential_count, *trie, rounds * mixed_count, mixed_time);
         }
+    }
+    if (checksum == 1) {
+        std::printf("checksum\n");
+    }
+}
 
-        uint16_t key = rd();
-        for(auto& id: ids) {
-            id ^= key;
+/**
+ * @brief Разобрать параметры командной строки.
+ * @return true, если параметры корректны.
+ */
+bool parse_benchmark_options(int argc, char* argv[], BenchmarkOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 == argc) {
+            return false;
         }
-        std::sort(ids.begin(), ids.end());
-        uint16_t new_mex = 0;
-        while(new_mex == ids[new_mex]) {
-            new_mex += 1;
+        std::string value = argv[++i];
+        char* end = nullptr;
+        auto number = std::strtoull(value.c_str(), &end, 10);
+        bool is_number = !value.empty() && *end == '\0';
+        if (option == "--json") {
+            options.json_path = value;
+        } else if (option == "--max-ids" && is_number && number >= 1000000) {
+            options.max_ids = number;
+        } else if (option == "--seed" && is_number) {
+            options.seed = number;
+        } else if (option == "--time-limit-ms" && is_number) {
+            options.time_limit = std::chrono::milliseconds(number);
+        } else {
+            return false;
         }
-        trie.xor_all_values(key);
+    }
+    return true;
+}
 
-        auto id = trie.add_number();
-        assert(id == new_mex);
+int run_all_benchmarks(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        std::fprintf(stderr, "Usage: %s [--max-ids N (>= 1000000)] [--seed N] [--time-limit-ms N] [--json PATH]\n",
+                     argv[0]);
+        return 2;
+    }
+    BenchmarkReport report;
+    std::vector<uint64_t> sizes;
+    for (uint64_t ids = 1000000; ids <= options.max_ids; ids *= 10) {
+        sizes.push_back(ids);
     }
+    benchmark_width<uint16_t>(report, options, {30000});  // Больше не помещается в 16 бит с запасом под xor.
+    benchmark_width<uint32_t>(report, options, sizes);
+    benchmark_width<uint64_t>(report, options, sizes);
+    std::printf("narrow tries: uint16_t\n");
+    benchmark_narrow_trie<BitTrie<uint16_t>>(report, options, "flat_bitset");
+    benchmark_narrow_trie<BitTrie<uint16_t, HeapNodeStorage, false>>(report, options, "heap_nodes");
+    benchmark_narrow_trie<BitTrie<uint16_t, ArenaNodeStorage, false>>(report, options, "arena_nodes");
+    report.write_json(options.json_path, options);
+    benchmark_operation_log();
+    return 0;
 }
 
-void test_64bit_from_task() {
-    BitTrie<uint64_t> trie;
-    trie.add_number(1);
-    trie.add_number(3);
-    trie.xor_all_values(1);
-    auto id = trie.add_number();
-    assert(id == 1);
-    trie.xor_all_values(1);
-    id = trie.add_number();
-    assert(id == 2);
+
+// Исполнение потока команд.
+
+/**
+ * @brief Выполнить поток команд из стандартного ввода или файла и вывести выданные id-шники.
+ * @details Параметры: --input PATH (по умолчанию стандартный ввод), --output PATH (по умолчанию стандартный вывод),
+ * --binary-output (id-шники по 8 байтов little-endian), --report (счётчики и скорость в стандартный поток ошибок).
+ * @return Код завершения процесса.
+ */
+int run_command_stream(int argc, char* argv[]) {
+    std::string input_path;
+    std::string output_path;
+    auto format = IdOutput::Format::text;
+    bool report = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--binary-output") {
+            format = IdOutput::Format::binary;
+        } else if (option == "--report") {
+            report = true;
+        } else if ((option == "--input" || option == "--output") && i + 1 < argc) {
+            (option == "--input" ? input_path : output_path) = argv[++i];
+        } else {
+            std::fprintf(stderr, "Usage: %s [--input PATH] [--output PATH] [--binary-output] [--report]\n", argv[0]);
+            return 2;
+        }
+    }
+    int output_file = STDOUT_FILENO;
+    if (!output_path.empty()) {
+        output_file = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_file < 0) {
+            std::fprintf(stderr, "Cannot open %s.\n", output_path.c_str());
+            return 1;
+        }
+    }
+    int exit_code = 0;
+    try {
+        std::unique_ptr<CommandInput> input(input_path.empty() ? new CommandInput(STDIN_FILENO)
+                                                               : new CommandInput(input_path));
+        IdOutput output(output_file, format);
+        DataBase db;
+        CommandStreamExecutor<DataBase> executor(db, output);
+        auto start = std::chrono::steady_clock::now();
+        auto counters = executor.run(*input);
+        output.flush();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (report) {
+            std::fprintf(stderr, "commands: %llu, registrations: %llu in %llu batches, encryptions: %llu, "
+                                 "%.3f s, %.0f commands/s\n",
+                         static_cast<unsigned long long>(counters.commands),
+                         static_cast<unsigned long long>(counters.registrations),
+                         static_cast<unsigned long long>(counters.batches),
+                         static_cast<unsigned long long>(counters.encryptions),
+                         elapsed.count(), counters.commands / std::max(elapsed.count(), 1e-9));
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        exit_code = 1;
+    }
+    if (output_file != STDOUT_FILENO) {
+        close(output_file);
+    }
+    return exit_code;
 }
 
 
-void run_all_tests() {
-    test_8bit_from_task();
-    test_8bit_sequential_registrations();
-    test_8bit_full_trie();
-    test_8bit_mex_all_values();
-    test_8bit_xor_all_values();
+// Сервер выдачи id-шников и нагрузка на него.
 
-    test_16bit_from_task();
-    test_16bit_sequential_registrations();
-    test_16bit_full_trie();
-    test_16bit_mex_all_values();
-    test_16bit_xor_all_values();
+IdServer<DataBase>* running_server = nullptr;  // Сервер, который останавливается по сигналу.
 
-    test_64bit_from_task();
+/**
+ * @brief Обработчик SIGINT и SIGTERM: остановить сервер.
+ */
+void stop_running_server(int) {
+    if (running_server != nullptr) {
+        running_server->stop();
+    }
+}
+
+/**
+ * @brief Обслуживать запросы к базе через Unix-сокет до SIGINT или SIGTERM.
+ * @details Параметры: --socket PATH (по умолчанию super_ids.sock).
+ * @return Код завершения процесса.
+ */
+int run_id_server(int argc, char* argv[]) {
+    std::string socket_path = "super_ids.sock";
+    if (argc == 3 && std::string(argv[1]) == "--socket") {
+        socket_path = argv[2];
+    } else if (argc != 1) {
+        std::fprintf(stderr, "Usage: %s [--socket PATH]\n", argv[0]);
+        return 2;
+    }
+    try {
+        DataBase db;
+        IdServer<DataBase> server(db, socket_path);
+        running_server = &server;
+        std::signal(SIGINT, stop_running_server);
+        std::signal(SIGTERM, stop_running_server);
+        std::fprintf(stderr, "listening on %s\n", socket_path.c_str());
+        server.run();
+        running_server = nullptr;
+        const auto& counters = server.counters();
+        std::fprintf(stderr, "connections: %llu, requests: %llu in %llu batches, register_new_users calls: %llu\n",
+                     static_cast<unsigned long long>(counters.connections),
+                     static_cast<unsigned long long>(counters.requests),
+                     static_cast<unsigned long long>(counters.batches),
+                     static_cast<unsigned long long>(counters.registration_calls));
+    } catch (const std::exception& e) {
+        running_server = nullptr;
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Разобрать список чисел через запятую.
+ * @return False, если в списке не только положительные числа.
+ */
+bool parse_number_list(const std::string& text, std::vector<size_t>& numbers) {
+    numbers.clear();
+    const char* position = text.c_str();
+    while (*position != '\0') {
+        char* end = nullptr;
+        auto number = std::strtoull(position, &end, 10);
+        if (end == position || number == 0 || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        numbers.push_back(number);
+        position = *end == ',' ? end + 1 : end;
+    }
+    return !numbers.empty();
+}
+
+/**
+ * @brief Нагрузить сервер при разных количествах соединений и глубинах конвейера и вывести таблицу.
+ * @details Параметры: --socket PATH, --connections 1,4,16, --depth 1,16,128, --requests N (на соединение),
+ * --encrypt-every N (каждый N-й запрос - шифрование, 0 - только регистрации).
+ * @return Код завершения процесса.
+ */
+int run_load_generator(int argc, char* argv[]) {
+    std::string socket_path = "super_ids.sock";
+    std::vector<size_t> connection_counts{1, 4, 16};
+    std::vector<size_t> depths{1, 16, 128};
+    uint64_t requests = 100000;
+    uint64_t encrypt_every = 100;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        bool valid = i + 1 < argc;
+        std::string value = valid ? argv[++i] : "";
+        char* end = nullptr;
+        auto number = std::strtoull(value.c_str(), &end, 10);
+        bool is_number = !value.empty() && *end == '\0';
+        if (option == "--socket") {
+            socket_path = value;
+        } else if (option == "--connections") {
+            valid = valid && parse_number_list(value, connection_counts);
+        } else if (option == "--depth") {
+            valid = valid && parse_number_list(value, depths);
+        } else if (option == "--requests") {
+            valid = valid && is_number && number > 0;
+            requests = number;
+        } else if (option == "--encrypt-every") {
+            valid = valid && is_number;
+            encrypt_every = number;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            std::fprintf(stderr, "Usage: %s [--socket PATH] [--connections 1,4,16] [--depth 1,16,128] "
+                                 "[--requests N] [--encrypt-every N]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::printf("%11s %6s %10s %14s %9s %9s\n", "connections", "depth", "requests", "requests/s", "p50, us", "p99, us");
+    try {
+        for (auto connections : connection_counts) {
+            for (auto depth : depths) {
+                auto result = generate_load(socket_path, connections, depth, requests, encrypt_every);
+                std::printf("%11zu %6zu %10llu %14.0f %9.1f %9.1f\n", result.connections, result.depth,
+                            static_cast<unsigned long long>(result.requests), result.requests / result.seconds,
+                            result.p50_us, result.p99_us);
+                std::fflush(stdout);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
 }
 
 
-int main(int, char *[]) {
+int main(int argc, char *argv[]) {
+#if defined(SUPER_BENCH)
+    return run_all_benchmarks(argc, argv);
+#elif defined(SUPER_STREAM)
+    return run_command_stream(argc, argv);
+#elif defined(SUPER_SERVER)
+    return run_id_server(argc, argv);
+#elif defined(SUPER_CLIENT)
+    return run_load_generator(argc, argv);
+#else
+    static_cast<void>(argc);
+    static_cast<void>(argv);
     run_all_tests();
     return 0;
+#endif
 }
 